@@ -0,0 +1,240 @@
+import argparse
+import json
+import multiprocessing
+import platform
+import resource
+import sys
+import time
+from typing import Any, Callable, Dict, List, Tuple
+
+import numpy as np
+import pandas as pd
+from scipy import sparse as sps
+
+import myfm
+from myfm import RelationBlock
+from myfm.utils.benchmark_data import SYNTHETIC_SCALES, SyntheticMovieLensDataManager
+
+ALGORITHMS = ["gibbs", "variational", "oprobit"]
+
+
+def peak_rss_mb() -> float:
+    usage = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+    # ru_maxrss is in kilobytes on Linux and in bytes on macOS.
+    if sys.platform == "darwin":
+        return usage / 1024 ** 2
+    return usage / 1024
+
+
+def myfm_version() -> str:
+    try:
+        import pkg_resources
+
+        return pkg_resources.get_distribution("myfm").version
+    except Exception:
+        return "unknown"
+
+
+def implicit_block(
+    ids: np.ndarray, partners: np.ndarray, n_ids: int, n_partners: int
+) -> sps.csr_matrix:
+    """One-hot id followed by the normalized set of partners it interacted with
+    (SVD++-like implicit feedback)."""
+    implicit = sps.csr_matrix(
+        (np.ones(ids.shape[0]), (ids, partners)), shape=(n_ids, n_partners)
+    )
+    implicit.data[:] = 1
+    count = np.asarray(implicit.sum(axis=1)).ravel()
+    normalizer = 1 / np.sqrt(np.maximum(count, 1))
+    implicit = sps.diags(normalizer).dot(implicit)
+    return sps.hstack([sps.identity(n_ids, format="csr"), implicit], format="csr")
+
+
+def build_relations(
+    df_train: pd.DataFrame, n_users: int, n_items: int
+) -> Tuple[sps.csr_matrix, sps.csr_matrix, List[int]]:
+    user_block = implicit_block(
+        df_train.user_id.values, df_train.movie_id.values, n_users, n_items
+    )
+    item_block = implicit_block(
+        df_train.movie_id.values, df_train.user_id.values, n_items, n_users
+    )
+    group_shapes = [n_users, n_items, n_items, n_users]
+    return user_block, item_block, group_shapes
+
+
+def run_algorithm(
+    algorithm: str,
+    df_train: pd.DataFrame,
+    df_test: pd.DataFrame,
+    user_block: sps.csr_matrix,
+    item_block: sps.csr_matrix,
+    group_shapes: List[int],
+    args: argparse.Namespace,
+) -> Dict[str, Any]:
+    def relations(df: pd.DataFrame) -> List[RelationBlock]:
+        return [
+            RelationBlock(df.user_id.values, user_block),
+            RelationBlock(df.movie_id.values, item_block),
+        ]
+
+    rel_train, rel_test = relations(df_train), relations(df_test)
+    y_train = df_train.rating.values
+    y_test = df_test.rating.values
+    # no main table: every feature lives in the relation blocks.
+    X_test = sps.csr_matrix((df_test.shape[0], 0), dtype=np.float64)
+
+    predict: Callable[[], np.ndarray]
+    start = time.perf_counter()
+    if algorithm == "gibbs":
+        fm = myfm.MyFMRegressor(rank=args.dimension, random_seed=args.seed)
+        fm.fit(
+            None,
+            y_train.astype(np.float64),
+            X_rel=rel_train,
+            n_iter=args.iteration,
+            group_shapes=group_shapes,
+        )
+        predict = lambda: fm.predict(X_test, rel_test)
+    elif algorithm == "variational":
+        vfm = myfm.VariationalFMRegressor(rank=args.dimension, random_seed=args.seed)
+        vfm.fit(
+            None,
+            y_train.astype(np.float64),
+            X_rel=rel_train,
+            n_iter=args.iteration,
+            group_shapes=group_shapes,
+        )
+        predict = lambda: vfm.predict(X_test, rel_test)
+    elif algorithm == "oprobit":
+        ofm = myfm.MyFMOrderedProbit(rank=args.dimension, random_seed=args.seed)
+        ofm.fit(
+            None,
+            y_train - 1,
+            X_rel=rel_train,
+            n_iter=args.iteration,
+            group_shapes=group_shapes,
+        )
+        predict = lambda: ofm.predict_proba(X_test, rel_test).dot(np.arange(1, 6))
+    else:
+        raise ValueError("unknown algorithm {}".format(algorithm))
+    fit_seconds = time.perf_counter() - start
+
+    start = time.perf_counter()
+    prediction = predict()
+    predict_seconds = time.perf_counter() - start
+
+    return dict(
+        algorithm=algorithm,
+        fit_seconds=fit_seconds,
+        predict_seconds=predict_seconds,
+        rmse=float(np.sqrt(((prediction - y_test) ** 2).mean())),
+        mae=float(np.abs(prediction - y_test).mean()),
+        peak_rss_mb=peak_rss_mb(),
+    )
+
+
+def run_in_child(queue: Any, *args: Any) -> None:
+    queue.put(run_algorithm(*args))
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(
+        description="""
+    End-to-end fit/predict benchmark on synthetic MovieLens-like data
+    (user/item relation blocks with implicit feedback and power-law popularity).
+    One JSON line per (scale, algorithm) is appended to the results file.
+    """,
+        formatter_class=argparse.ArgumentDefaultsHelpFormatter,
+    )
+    parser.add_argument(
+        "-s",
+        "--scale",
+        nargs="+",
+        choices=list(SYNTHETIC_SCALES.keys()),
+        default=["100k", "1m"],
+        help="dataset sizes to run.",
+    )
+    parser.add_argument(
+        "-a",
+        "--algorithm",
+        nargs="+",
+        choices=ALGORITHMS,
+        default=ALGORITHMS,
+        help="algorithms to run.",
+    )
+    parser.add_argument(
+        "-i", "--iteration", type=int, help="number of iterations", default=100
+    )
+    parser.add_argument(
+        "-d", "--dimension", type=int, help="fm embedding dimension", default=10
+    )
+    parser.add_argument("--seed", type=int, help="random seed", default=42)
+    parser.add_argument(
+        "-o",
+        "--output",
+        type=str,
+        help="results file (JSON lines)",
+        default="synthetic-benchmark.jsonl",
+    )
+    args = parser.parse_args()
+
+    # Each algorithm runs in a forked child, so that its peak RSS is not
+    # inflated by the previous ones.
+    use_fork = "fork" in multiprocessing.get_all_start_methods()
+
+    for scale in args.scale:
+        data_manager = SyntheticMovieLensDataManager(scale, random_state=args.seed)
+        start = time.perf_counter()
+        df_train, df_test = data_manager.load_rating_split(0.1)
+        user_block, item_block, group_shapes = build_relations(
+            df_train, data_manager.n_users, data_manager.n_items
+        )
+        generation_seconds = time.perf_counter() - start
+        print(
+            "scale = {}, train = {}, test = {}, generated in {:.1f}s".format(
+                scale, df_train.shape[0], df_test.shape[0], generation_seconds
+            )
+        )
+
+        for algorithm in args.algorithm:
+            run_args = (
+                algorithm,
+                df_train,
+                df_test,
+                user_block,
+                item_block,
+                group_shapes,
+                args,
+            )
+            if use_fork:
+                context = multiprocessing.get_context("fork")
+                queue = context.Queue()
+                process = context.Process(target=run_in_child, args=(queue,) + run_args)
+                process.start()
+                process.join()
+                if process.exitcode != 0:
+                    raise RuntimeError(
+                        "{} on {} exited with {}".format(
+                            algorithm, scale, process.exitcode
+                        )
+                    )
+                result = queue.get()
+            else:
+                result = run_algorithm(*run_args)
+
+            result.update(
+                scale=scale,
+                n_train=int(df_train.shape[0]),
+                n_test=int(df_test.shape[0]),
+                rank=args.dimension,
+                n_iter=args.iteration,
+                generation_seconds=generation_seconds,
+                myfm_version=myfm_version(),
+                python=platform.python_version(),
+                machine=platform.machine(),
+                date=time.strftime("%Y-%m-%dT%H:%M:%S"),
+            )
+            print(json.dumps(result))
+            with open(args.output, "a") as ofs:
+                ofs.write(json.dumps(result) + "\n")
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <algorithm>
 #include <sstream>
 #include <stdexcept>
 #include <string>
@@ -9,8 +10,11 @@
 #include "HyperParams.hpp"
 #include "OProbitSampler.hpp"
 #include "definitions.hpp"
+#include "memory.hpp"
 #include "predictor.hpp"
+#include "trace.hpp"
 #include "util.hpp"
+#include "window.hpp"
 
 namespace myFM {
 template <typename Real, class Derived, class FMType, class HyperType,
@@ -38,11 +42,18 @@ struct BaseFMTrainer {
   SparseMatrix X_t; // transposed
 
   const size_t dim_all;
-  const Vector y;
+  Vector y;
 
-  const int n_train;
+  int n_train;
   int n_class = 0; // Used by ordered probit
 
+  /*
+  Likelihood weight of each row (see FMLearningConfig::sample_weight); the
+  relation caches' cardinalities are the per-block sums of these.
+  */
+  Vector sample_weight;
+  Real sample_weight_sum;
+
   Vector e_train;
   Vector q_train;
   vector<RelationWiseCache> relation_caches;
@@ -58,12 +69,16 @@ struct BaseFMTrainer {
   inline BaseFMTrainer(const SparseMatrix &X,
                        const vector<RelationBlock> &relations, const Vector &y,
                        int random_seed, Config learning_config)
-      : X(X), relations(relations), X_t(X.transpose()),
+      : X(within_budget(X, relations, learning_config)),
+        relations(relational::flatten_relations(relations)),
+        X_t(X.transpose()),
         dim_all(check_row_consistency_return_column(X, relations)), y(y),
-        n_train(X.rows()), e_train(X.rows()), q_train(X.rows()),
+        n_train(X.rows()), sample_weight(Vector::Ones(X.rows())),
+        sample_weight_sum(X.rows()), e_train(X.rows()), q_train(X.rows()),
         relation_caches(), learning_config(learning_config),
         random_seed(random_seed), gen_(random_seed) {
-    for (auto it = relations.begin(); it != relations.end(); it++) {
+    for (auto it = this->relations.begin(); it != this->relations.end();
+         it++) {
       relation_caches.emplace_back(*it);
     }
     if (X.rows() != y.rows()) {
@@ -76,6 +91,24 @@ struct BaseFMTrainer {
     }
     this->X.makeCompressed();
     this->X_t.makeCompressed();
+    if (!learning_config.sample_weight().empty()) {
+      const auto &weights = learning_config.sample_weight();
+      if (weights.size() != static_cast<size_t>(X.rows())) {
+        throw std::invalid_argument(StringBuilder{}
+                                        .add("Shape mismatch: X has size")
+                                        .space_and_add(X.rows())
+                                        .space_and_add(
+                                            "and sample_weight has size")
+                                        .space_and_add(weights.size())
+                                        .build());
+      }
+      if (learning_config.task_type == Config::TASKTYPE::ORDERED) {
+        throw std::invalid_argument(
+            "sample weights are not supported for ordered probit.");
+      }
+      set_sample_weight(
+          Eigen::Map<const Vector>(weights.data(), weights.size()));
+    }
     if (learning_config.task_type == Config::TASKTYPE::ORDERED) {
 
       const size_t rows = this->X.rows();
@@ -104,6 +137,19 @@ struct BaseFMTrainer {
     }
   }
 
+  inline void set_sample_weight(const Vector &weights) {
+    sample_weight = weights;
+    update_sample_weight_sums();
+  }
+
+  /* To be called whenever sample_weight is modified in place. */
+  inline void update_sample_weight_sums() {
+    sample_weight_sum = sample_weight.sum();
+    for (auto &cache : relation_caches) {
+      cache.set_case_weights(sample_weight);
+    }
+  }
+
   inline FMType create_FM(int rank, Real init_std) {
     FMType fm(rank);
     fm.initialize_weight(dim_all, init_std, gen_);
@@ -119,6 +165,263 @@ struct BaseFMTrainer {
   learn_with_callback(FMType &fm, HyperType &hyper,
                       std::function<bool(int, FMType *, HyperType *, Predictor<Real> *, HistoryType *)> cb);
 
+  /* Bytes currently held by the training data and the work vectors. */
+  inline memory::MemoryReport memory_report() const {
+    memory::MemoryReport report;
+    report.add("X", memory::bytes_of(X));
+    report.add("X_t", memory::bytes_of(X_t));
+    report.add("y", memory::bytes_of(y));
+    report.add("sample_weight", memory::bytes_of(sample_weight));
+    report.add("residuals",
+               memory::bytes_of(e_train) + memory::bytes_of(q_train));
+    for (const auto &rel : relations) {
+      report.add("relations", memory::bytes_of(rel));
+    }
+    for (const auto &cache : relation_caches) {
+      report.add("relation_caches",
+                 memory::bytes_of(
+                     static_cast<const relational::RelationWiseCache<Real> &>(
+                         cache)));
+    }
+    static_cast<const Derived &>(*this).add_trainer_memory(report);
+    return report;
+  }
+
+  /* Overridden by trainers that keep additional work vectors. */
+  inline void add_trainer_memory(memory::MemoryReport &report) const {}
+
+  /*
+  learn_with_callback starting from `fm` and `hyper` as they are instead of
+  initialising them, e.g. to continue a chain (or the variational updates)
+  after slide_window.
+  */
+  template <typename Callback, typename D = Derived>
+  inline auto continue_with_callback(FMType &fm, HyperType &hyper,
+                                     Callback cb)
+      -> decltype(static_cast<D *>(nullptr)->learn_with_callback(fm, hyper,
+                                                                  cb)) {
+    continuing_ = true;
+    try {
+      auto result = static_cast<D &>(*this).learn_with_callback(fm, hyper, cb);
+      continuing_ = false;
+      return result;
+    } catch (...) {
+      continuing_ = false;
+      throw;
+    }
+  }
+
+  /*
+  Slides the training window: drops the `n_evict` oldest cases and appends
+  those of X_new. `relations_new` must consist of the trainer's blocks
+  (same rows, same nesting) with mappings for the new cases only. X, X_t,
+  the block mappings and cardinalities and the residuals are updated in
+  place; those of the new cases are computed with `fm`, which should be the
+  model the trainer last left, so that continue_with_callback resumes the
+  chain where it stopped.
+  */
+  inline void slide_window(const FMType &fm, size_t n_evict,
+                           const SparseMatrix &X_new,
+                           const vector<RelationBlock> &relations_new,
+                           const Vector &y_new) {
+    if (learning_config.task_type == TASKTYPE::ORDERED ||
+        !learning_config.sample_weight().empty()) {
+      throw std::invalid_argument("Sliding windows support neither ordered "
+                                  "probit nor sample weights.");
+    }
+    if (n_evict > static_cast<size_t>(n_train) || X_new.cols() != X.cols() ||
+        X_new.rows() != y_new.rows()) {
+      throw std::invalid_argument(StringBuilder{}
+                                      .add("Cannot evict")
+                                      .space_and_add(n_evict)
+                                      .space_and_add("of")
+                                      .space_and_add(n_train)
+                                      .space_and_add("cases and append")
+                                      .space_and_add(X_new.rows())
+                                      .space_and_add("x")
+                                      .space_and_add(X_new.cols())
+                                      .space_and_add("with")
+                                      .space_and_add(y_new.rows())
+                                      .space_and_add("targets.")
+                                      .build());
+    }
+    if (n_train - n_evict + X_new.rows() == 0) {
+      throw std::invalid_argument("The training window would be empty.");
+    }
+    const vector<RelationBlock> flat_new =
+        relational::flatten_relations(relations_new);
+    bool same_blocks = flat_new.size() == relations.size();
+    for (size_t i = 0; same_blocks && i < relations.size(); i++) {
+      same_blocks = flat_new[i].block_size == relations[i].block_size &&
+                    flat_new[i].feature_size == relations[i].feature_size &&
+                    flat_new[i].mapper_size ==
+                        static_cast<size_t>(X_new.rows());
+    }
+    if (!same_blocks) {
+      throw std::invalid_argument(
+          "Relation blocks of the new cases differ from the trainer's.");
+    }
+
+    Vector e_new(X_new.rows());
+    fm.predict_score_write_target(e_new, X_new, relations_new);
+    e_new -= y_new;
+
+    for (size_t i = 0; i < relations.size(); i++) {
+      RelationWiseCache &cache = relation_caches[i];
+      auto cursor = relations[i].original_to_block.cursor();
+      for (size_t case_index = 0; case_index < n_evict; case_index++) {
+        cache.cardinality(cursor[case_index]) -= sample_weight(case_index);
+      }
+      flat_new[i].original_to_block.for_each_run(
+          [&cache](size_t begin, size_t end, size_t block_index) {
+            cache.cardinality(block_index) += static_cast<Real>(end - begin);
+          });
+      relations[i].set_original_to_block(relations[i].original_to_block.slide(
+          n_evict, flat_new[i].original_to_block));
+    }
+
+    window::slide_rows(X, n_evict, X_new);
+    const SparseMatrix X_new_t = X_new.transpose();
+    window::slide_columns(X_t, n_evict, X_new_t);
+    window::slide_vector(y, n_evict, y_new);
+    window::slide_vector(sample_weight, n_evict,
+                         Vector(Vector::Ones(X_new.rows())));
+    window::slide_vector(e_train, n_evict, e_new);
+    n_train = X.rows();
+    q_train.resize(n_train);
+    sample_weight_sum = sample_weight.sum();
+    static_cast<Derived &>(*this).slide_trainer_state();
+  }
+
+  /* Overridden by trainers that keep additional per-case vectors. */
+  inline void slide_trainer_state() {}
+
+  /* Memory a run with `rank` factors is expected to need at its peak. */
+  inline memory::MemoryReport projected_memory_report(size_t rank) const {
+    return memory::projected_training_memory(X, relations, rank,
+                                             learning_config,
+                                             Derived::is_variational);
+  }
+
+  /*
+  Checks what a run needs whatever the rank (the data, its transpose, the
+  relation caches and residuals) against the budget before the constructor
+  copies or allocates any of it; the rank is checked when learning starts.
+  */
+  inline static const SparseMatrix &
+  within_budget(const SparseMatrix &X, const vector<RelationBlock> &relations,
+                const Config &learning_config) {
+    if (learning_config.memory_budget != 0) {
+      memory::check_memory_budget(
+          memory::projected_training_memory(X, relations, 0, learning_config,
+                                            Derived::is_variational),
+          learning_config);
+    }
+    return X;
+  }
+
+  inline void check_memory_budget(size_t rank) const {
+    if (learning_config.memory_budget == 0) {
+      return;
+    }
+    memory::check_memory_budget(projected_memory_report(rank),
+                                learning_config);
+  }
+
+  /*
+  Checks the per-group factor ranks (see FMLearningConfig::group_ranks)
+  against the model, zeroes V beyond them and records each feature's rank,
+  past which the updates of V skip it. The model keeps the ranks so that
+  prediction reads only the ranked part of V as well, and the samples kept
+  from it store only that part (see FM::compact).
+  */
+  inline void apply_group_ranks(FMType &fm) {
+    if (fm.is_compact()) {
+      // training goes on from a kept sample.
+      fm.V = fm.dense_V();
+      fm.ranked_V.resize(0);
+    }
+    feature_ranks_.assign(dim_all, fm.n_factors);
+    ranked_features_.clear();
+    fm.feature_ranks.reset();
+    const vector<size_t> &group_ranks = learning_config.group_ranks();
+    for (size_t rank : group_ranks) {
+      if (rank > static_cast<size_t>(fm.n_factors)) {
+        throw std::invalid_argument(StringBuilder{}
+                                        .add("A group rank of")
+                                        .space_and_add(rank)
+                                        .space_and_add("exceeds the")
+                                        .space_and_add(fm.n_factors)
+                                        .space_and_add("factors.")
+                                        .build());
+      }
+    }
+    if (group_ranks.empty()) {
+      return;
+    }
+    for (size_t feature = 0; feature < dim_all; feature++) {
+      const int rank = learning_config.group_rank(
+          learning_config.group_index(feature), fm.n_factors);
+      feature_ranks_[feature] = rank;
+      fm.V.row(feature).tail(fm.n_factors - rank).setZero();
+    }
+    if (std::all_of(feature_ranks_.begin(), feature_ranks_.end(),
+                    [&fm](int rank) { return rank == fm.n_factors; })) {
+      return;
+    }
+    fm.feature_ranks = std::make_shared<const FeatureRanks>(feature_ranks_);
+    ranked_features_.resize(
+        *std::max_element(feature_ranks_.begin(), feature_ranks_.end()));
+    for (int feature = 0; feature < X.cols(); feature++) {
+      for (int factor = 0; factor < feature_ranks_[feature]; factor++) {
+        ranked_features_[factor].push_back(feature);
+      }
+    }
+  }
+
+  /* The factors past this one are zero for every feature. */
+  inline int n_ranked_factors(const FMType &fm) const {
+    return ranked_features_.empty() ? fm.n_factors
+                                    : static_cast<int>(ranked_features_.size());
+  }
+
+  /*
+  Calls f(row, feature, x) for the nonzeros of X in the features that use a
+  factor: row by row without group ranks, and through X_t over the ranked
+  features only with them.
+  */
+  template <typename F>
+  inline void for_each_ranked_entry(int factor_index, F &&f) const {
+    using itertype = typename SparseMatrix::InnerIterator;
+    if (ranked_features_.empty()) {
+      for (int row = 0; row < X.rows(); row++) {
+        for (itertype it(X, row); it; ++it) {
+          f(row, it.col(), it.value());
+        }
+      }
+      return;
+    }
+    for (int feature : ranked_features_[factor_index]) {
+      for (itertype it(X_t, feature); it; ++it) {
+        f(it.col(), feature, it.value());
+      }
+    }
+  }
+
+  /* X times a column of V, over the features that use the factor. */
+  inline void ranked_product(const DenseMatrix &V, int factor_index,
+                             Vector &result) const {
+    if (ranked_features_.empty()) {
+      result = X * V.col(factor_index).head(X.cols());
+      return;
+    }
+    result.setZero();
+    for_each_ranked_entry(factor_index,
+                          [&](size_t row, size_t feature, Real x) {
+                            result(row) += x * V(feature, factor_index);
+                          });
+  }
+
   inline void initialize_hyper(FMType &fm, HyperType &hyper) {
     static_cast<Derived &>(*this).initialize_alpha();
     static_cast<Derived &>(*this).initialize_mu_w();
@@ -133,6 +436,7 @@ struct BaseFMTrainer {
   }
 
   inline void update_all(FMType &fm, HyperType &hyper) {
+    trace::TraceScope scope("sweep", "train");
     update_alpha_(fm, hyper);
 
     update_w0_(fm, hyper);
@@ -152,38 +456,47 @@ struct BaseFMTrainer {
   }
 
   inline void update_alpha_(FMType &fm, HyperType &hyper) {
+    trace::TraceScope scope("update_alpha", "train");
     static_cast<Derived &>(*this).update_alpha(fm, hyper);
   }
 
   inline void update_w0_(FMType &fm, HyperType &hyper) {
+    trace::TraceScope scope("update_w0", "train");
     static_cast<Derived &>(*this).update_w0(fm, hyper);
   }
 
   inline void update_lambda_w_(FMType &fm, HyperType &hyper) {
+    trace::TraceScope scope("update_lambda_w", "train");
     static_cast<Derived &>(*this).update_lambda_w(fm, hyper);
   }
 
   inline void update_mu_w_(FMType &fm, HyperType &hyper) {
+    trace::TraceScope scope("update_mu_w", "train");
     static_cast<Derived &>(*this).update_mu_w(fm, hyper);
   }
 
   inline void update_lambda_V_(FMType &fm, HyperType &hyper) {
+    trace::TraceScope scope("update_lambda_V", "train");
     static_cast<Derived &>(*this).update_lambda_V(fm, hyper);
   }
 
   inline void update_mu_V_(FMType &fm, HyperType &hyper) {
+    trace::TraceScope scope("update_mu_V", "train");
     static_cast<Derived &>(*this).update_mu_V(fm, hyper);
   }
 
   inline void update_w_(FMType &fm, HyperType &hyper) {
+    trace::TraceScope scope("update_w", "train");
     static_cast<Derived &>(*this).update_w(fm, hyper);
   }
 
   inline void update_e_(FMType &fm, HyperType &hyper) {
+    trace::TraceScope scope("update_e", "train");
     static_cast<Derived &>(*this).update_e(fm, hyper);
   }
 
   inline void update_V_(FMType &fm, HyperType &hyper) {
+    trace::TraceScope scope("update_V", "train");
     static_cast<Derived &>(*this).update_V(fm, hyper);
   }
 
@@ -191,6 +504,15 @@ struct BaseFMTrainer {
 
 protected:
   mt19937 gen_;
+  // set by continue_with_callback.
+  bool continuing_ = false;
+  // whether e_train matches the model the trainer last left.
+  bool residuals_current_ = false;
+  // the number of factors of each feature, see apply_group_ranks.
+  vector<int> feature_ranks_;
+  // the main-table features within the rank of each factor, empty when every
+  // feature uses all the factors.
+  vector<vector<int>> ranked_features_;
   // std::vector<OprobitSamplerType> cutpoint_sampler;
 
 }; // BaseFMTrainer
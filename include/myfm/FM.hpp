@@ -1,6 +1,10 @@
 #pragma once
+#include "autotune.hpp"
 #include "definitions.hpp"
+#include "feature_ranks.hpp"
+#include "interaction_mask.hpp"
 #include <cmath>
+#include <memory>
 
 namespace myFM {
 
@@ -13,6 +17,9 @@ template <typename Real> struct FM {
   typedef types::DenseMatrix<Real> DenseMatrix;
   typedef types::SparseMatrix<Real> SparseMatrix;
   typedef types::Vector<Real> Vector;
+  typedef Eigen::Map<const Eigen::Matrix<Real, 1, Eigen::Dynamic>, 0,
+                     Eigen::InnerStride<>>
+      FactorRow;
 
   inline FM(int n_factors, size_t n_groups)
       : n_factors(n_factors), initialized(false) {}
@@ -20,7 +27,9 @@ template <typename Real> struct FM {
 
   inline FM(const FM &other)
       : n_factors(other.n_factors), w0(other.w0), w(other.w), V(other.V),
-        cutpoints(other.cutpoints), initialized(other.initialized) {}
+        cutpoints(other.cutpoints), mask(other.mask),
+        feature_ranks(other.feature_ranks), ranked_V(other.ranked_V),
+        initialized(other.initialized) {}
 
   inline FM(Real w0, const Vector &w, const DenseMatrix &V)
       : n_factors(V.cols()), w0(w0), w(w), V(V), initialized(true) {}
@@ -53,6 +62,10 @@ template <typename Real> struct FM {
   inline void
   predict_score_write_target(Eigen::Ref<Vector> target, const SparseMatrix &X,
                              const vector<RelationBlock> &relations) const {
+    if (relational::has_nested_relation(relations)) {
+      return predict_score_write_target(
+          target, X, relational::flatten_relations(relations));
+    }
     // check input consistency
     size_t case_size = X.rows();
     size_t feature_size_all = X.cols();
@@ -70,14 +83,394 @@ template <typename Real> struct FM {
     if (!initialized) {
       throw std::runtime_error("get_score called before initialization");
     }
+    if (mask) {
+      if (mask->feature_size() != feature_size_all) {
+        throw std::invalid_argument(
+            "Interaction mask and feature size mismatch.");
+      }
+      return predict_score_masked(target, X, relations);
+    }
+    if (feature_ranks) {
+      return predict_score_ranked(target, X, relations);
+    }
+    autotune::Autotuner &tuner = autotune::Autotuner::instance();
+    if (!tuner.enabled()) {
+      return predict_score_with_kernel(target, X, relations,
+                                       default_kernel());
+    }
+    const string key = autotune::shape_key("score", X, relations, n_factors);
+    string kernel;
+    if (tuner.lookup(key, kernel)) {
+      return predict_score_with_kernel(target, X, relations, kernel);
+    }
+    const string fallback = default_kernel();
+    tuner.measure(key,
+                  {fallback, fallback == "fused" ? "per_factor" : "fused"},
+                  [this, &target, &X, &relations](const string &candidate) {
+                    predict_score_with_kernel(target, X, relations,
+                                              candidate);
+                  });
+  }
+
+  /*
+  The kernel used without autotuning: "fused" for the ranks that have a
+  fixed-size specialisation and "per_factor" for the others.
+  */
+  inline string default_kernel() const {
+    switch (n_factors) {
+    case 4:
+    case 8:
+    case 16:
+    case 32:
+    case 64:
+      return "fused";
+    default:
+      return "per_factor";
+    }
+  }
+
+  /*
+  Scores with a given kernel (see default_kernel), both being exact up to
+  rounding. Not for masked models; compact ones are always scored by
+  predict_score_ranked.
+  */
+  inline void
+  predict_score_with_kernel(Eigen::Ref<Vector> target, const SparseMatrix &X,
+                            const vector<RelationBlock> &relations,
+                            const string &kernel) const {
+    if (is_compact()) {
+      return predict_score_ranked(target, X, relations);
+    }
+    if (kernel == "per_factor") {
+      return predict_score_generic_rank(target, X, relations);
+    }
+    if (kernel != "fused") {
+      throw std::invalid_argument(
+          StringBuilder{}("Unknown scoring kernel ")(kernel).build());
+    }
+    switch (n_factors) {
+    case 4:
+      return predict_score_fixed_rank<4>(target, X, relations);
+    case 8:
+      return predict_score_fixed_rank<8>(target, X, relations);
+    case 16:
+      return predict_score_fixed_rank<16>(target, X, relations);
+    case 32:
+      return predict_score_fixed_rank<32>(target, X, relations);
+    case 64:
+      return predict_score_fixed_rank<64>(target, X, relations);
+    default:
+      return predict_score_fixed_rank<Eigen::Dynamic>(target, X, relations);
+    }
+  }
+
+  /*
+  Row-wise scoring with the factor dimension fixed at compile time.
+  Each row accumulates sum_i x_i v_i and sum_i x_i^2 v_i^2 in fixed-size
+  vectors, so X is traversed once instead of twice per factor and the loops
+  over factors are unrolled. Relation blocks are reduced to per-block-row
+  accumulators first and then gathered. With Rank = Eigen::Dynamic the
+  accumulators are sized at run time instead.
+  */
+  template <int Rank>
+  inline void
+  predict_score_fixed_rank(Eigen::Ref<Vector> target, const SparseMatrix &X,
+                           const vector<RelationBlock> &relations) const {
+    typedef Eigen::Matrix<Real, Rank, 1> FactorVector;
+    typedef Eigen::Matrix<Real, Eigen::Dynamic, Rank, Eigen::RowMajor>
+        BlockCache;
+    using itertype = typename SparseMatrix::InnerIterator;
+
+    vector<Vector> block_linear;
+    vector<BlockCache> block_q, block_q_S;
+    size_t offset = X.cols();
+    for (auto const &rel : relations) {
+      Vector linear = rel.multiply(w.segment(offset, rel.feature_size));
+      BlockCache q(rel.block_size, n_factors), q_S(rel.block_size, n_factors);
+      if (rel.is_dense) {
+        // matrix-matrix products over the whole block.
+        auto V_block = V.block(offset, 0, rel.feature_size, n_factors);
+        q.noalias() = rel.X_dense * V_block;
+        q_S.setZero();
+        for (size_t col = 0; col < rel.feature_size; col++) {
+          q_S.noalias() += rel.X_dense.col(col).cwiseAbs2() *
+                           V_block.row(col).cwiseAbs2();
+        }
+      } else {
+        FactorVector q_row(n_factors), q_S_row(n_factors);
+        for (int block_index = 0; block_index < rel.X.rows(); block_index++) {
+          q_row.setZero();
+          q_S_row.setZero();
+          for (itertype it(rel.X, block_index); it; ++it) {
+            const Real x = it.value();
+            auto v = V.template block<1, Rank>(offset + it.col(), 0, 1,
+                                               n_factors)
+                         .transpose();
+            q_row += x * v;
+            q_S_row.array() += x * x * v.array().square();
+          }
+          q.row(block_index) = q_row.transpose();
+          q_S.row(block_index) = q_S_row.transpose();
+        }
+      }
+      block_linear.emplace_back(std::move(linear));
+      block_q.emplace_back(std::move(q));
+      block_q_S.emplace_back(std::move(q_S));
+      offset += rel.feature_size;
+    }
+
+    vector<relational::BlockMapper::Cursor> cursors;
+    for (auto const &rel : relations) {
+      cursors.push_back(rel.original_to_block.cursor());
+    }
+    FactorVector q(n_factors), q_S(n_factors);
+    for (int row = 0; row < X.rows(); row++) {
+      Real score = w0;
+      q.setZero();
+      q_S.setZero();
+      for (itertype it(X, row); it; ++it) {
+        const Real x = it.value();
+        score += x * w(it.col());
+        auto v = V.template block<1, Rank>(it.col(), 0, 1, n_factors)
+                     .transpose();
+        q += x * v;
+        q_S.array() += x * x * v.array().square();
+      }
+      for (size_t relation_index = 0; relation_index < relations.size();
+           relation_index++) {
+        const size_t block_index = cursors[relation_index][row];
+        score += block_linear[relation_index](block_index);
+        q += block_q[relation_index].row(block_index).transpose();
+        q_S += block_q_S[relation_index].row(block_index).transpose();
+      }
+      target(row) = score + (q.squaredNorm() - q_S.sum()) / 2;
+    }
+  }
+
+  /*
+  Row-wise scoring of a model with feature_ranks, reading only the leading
+  feature_rank(i) factors of each feature (see V_row). Relation blocks are
+  reduced to
+  per-block-row accumulators first, as in predict_score_fixed_rank.
+  */
+  inline void
+  predict_score_ranked(Eigen::Ref<Vector> target, const SparseMatrix &X,
+                       const vector<RelationBlock> &relations) const {
+    using itertype = typename SparseMatrix::InnerIterator;
+    typedef Eigen::Matrix<Real, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>
+        BlockCache;
+    if (feature_ranks->size() != static_cast<size_t>(w.rows())) {
+      throw std::invalid_argument("Feature ranks and feature size mismatch.");
+    }
+    Vector q(n_factors), q_S(n_factors);
+    auto add = [this, &q, &q_S](size_t feature, Real x) {
+      const int rank = feature_rank(feature);
+      const FactorRow v = V_row(feature);
+      q.head(rank) += x * v.transpose();
+      q_S.head(rank).array() += x * x * v.transpose().array().square();
+      return x * w(feature);
+    };
+
+    vector<Vector> block_linear;
+    vector<BlockCache> block_q, block_q_S;
+    size_t offset = X.cols();
+    for (auto const &rel : relations) {
+      Vector linear(rel.block_size);
+      BlockCache q_block(rel.block_size, n_factors),
+          q_S_block(rel.block_size, n_factors);
+      for (size_t block_index = 0; block_index < rel.block_size;
+           block_index++) {
+        q.setZero();
+        q_S.setZero();
+        Real score = 0;
+        rel.for_each_in_row(block_index,
+                            [&add, &score, offset](size_t col, Real x) {
+                              score += add(offset + col, x);
+                            });
+        linear(block_index) = score;
+        q_block.row(block_index) = q.transpose();
+        q_S_block.row(block_index) = q_S.transpose();
+      }
+      block_linear.emplace_back(std::move(linear));
+      block_q.emplace_back(std::move(q_block));
+      block_q_S.emplace_back(std::move(q_S_block));
+      offset += rel.feature_size;
+    }
+
+    vector<relational::BlockMapper::Cursor> cursors;
+    for (auto const &rel : relations) {
+      cursors.push_back(rel.original_to_block.cursor());
+    }
+    for (int row = 0; row < X.rows(); row++) {
+      Real score = w0;
+      q.setZero();
+      q_S.setZero();
+      for (itertype it(X, row); it; ++it) {
+        score += add(it.col(), it.value());
+      }
+      for (size_t relation_index = 0; relation_index < relations.size();
+           relation_index++) {
+        const size_t block_index = cursors[relation_index][row];
+        score += block_linear[relation_index](block_index);
+        q += block_q[relation_index].row(block_index).transpose();
+        q_S += block_q_S[relation_index].row(block_index).transpose();
+      }
+      target(row) = score + (q.squaredNorm() - q_S.sum()) / 2;
+    }
+  }
+
+  /*
+  Row-wise scoring under an interaction mask, keeping the sums of each side
+  of the mask (see interaction_mask.hpp). Block rows are read once per case
+  that refers to them.
+  */
+  inline void
+  predict_score_masked(Eigen::Ref<Vector> target, const SparseMatrix &X,
+                       const vector<RelationBlock> &relations) const {
+    using itertype = typename SparseMatrix::InnerIterator;
+    SideSums sums(n_sides(), n_factors), squares(n_sides(), n_factors);
+    vector<relational::BlockMapper::Cursor> cursors;
+    for (auto const &rel : relations) {
+      cursors.push_back(rel.original_to_block.cursor());
+    }
+    for (int row = 0; row < X.rows(); row++) {
+      Real score = w0;
+      sums.setZero();
+      squares.setZero();
+      auto add = [this, &score, &sums, &squares](size_t feature, Real x) {
+        score += x * w(feature);
+        const int rank = feature_rank(feature);
+        const FactorRow v = V_row(feature);
+        for (const auto &membership : memberships(feature)) {
+          sums.row(membership.side).head(rank) += x * v;
+          if (membership.side == membership.partner) {
+            squares.row(membership.side).head(rank) += x * x * v.cwiseAbs2();
+          }
+        }
+      };
+      for (itertype it(X, row); it; ++it) {
+        add(it.col(), it.value());
+      }
+      size_t offset = X.cols();
+      for (size_t relation_index = 0; relation_index < relations.size();
+           relation_index++) {
+        relations[relation_index].for_each_in_row(
+            cursors[relation_index][row],
+            [&add, offset](size_t col, Real x) { add(offset + col, x); });
+        offset += relations[relation_index].feature_size;
+      }
+      target(row) = score + pair_term(sums, squares);
+    }
+  }
+
+  /*
+  Per-side sums of a row (see interaction_mask.hpp), a single side when all
+  the pairs interact.
+  */
+  typedef Eigen::Matrix<Real, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>
+      SideSums;
+
+  /* The number of leading factors a feature uses, see feature_ranks. */
+  inline int feature_rank(size_t feature) const {
+    return feature_ranks ? (*feature_ranks)[feature] : n_factors;
+  }
+
+  /*
+  Whether V is held as ranked_V, see compact. Only the scoring and the
+  accessors below read such a model; the trainers work on dense ones.
+  */
+  inline bool is_compact() const {
+    return feature_ranks && feature_ranks->size() > 0 && V.rows() == 0;
+  }
+
+  /*
+  Moves the leading feature_rank(i) factors of each row of V into ranked_V
+  and frees V, so that a kept sample costs the sum of the ranks instead of
+  feature_size * n_factors. Does nothing without feature_ranks.
+  */
+  inline void compact() {
+    if (!feature_ranks || is_compact()) {
+      return;
+    }
+    if (feature_ranks->size() != static_cast<size_t>(V.rows())) {
+      throw std::invalid_argument("Feature ranks and feature size mismatch.");
+    }
+    ranked_V.resize(feature_ranks->n_entries());
+    for (size_t feature = 0; feature < feature_ranks->size(); feature++) {
+      const int rank = (*feature_ranks)[feature];
+      ranked_V.segment(feature_ranks->offset(feature), rank) =
+          V.row(feature).head(rank).transpose();
+    }
+    V.resize(0, n_factors);
+  }
+
+  /* V as a (feature_size, n_factors) matrix, zero past the ranks. */
+  inline DenseMatrix dense_V() const {
+    if (!is_compact()) {
+      return V;
+    }
+    DenseMatrix result = DenseMatrix::Zero(feature_ranks->size(), n_factors);
+    for (size_t feature = 0; feature < feature_ranks->size(); feature++) {
+      result.row(feature).head(feature_rank(feature)) = V_row(feature);
+    }
+    return result;
+  }
+
+  /* The leading feature_rank(feature) factors of a feature. */
+  inline FactorRow V_row(size_t feature) const {
+    const int rank = feature_rank(feature);
+    if (is_compact()) {
+      return FactorRow(ranked_V.data() + feature_ranks->offset(feature), rank,
+                       Eigen::InnerStride<>(1));
+    }
+    return FactorRow(V.data() + feature, rank, Eigen::InnerStride<>(V.rows()));
+  }
+
+  /* One factor of a feature, zero past its rank. */
+  inline Real V_at(size_t feature, int factor) const {
+    if (factor >= feature_rank(feature)) {
+      return 0;
+    }
+    if (is_compact()) {
+      return ranked_V(feature_ranks->offset(feature) + factor);
+    }
+    return V(feature, factor);
+  }
+
+  inline size_t n_sides() const { return mask ? mask->n_sides() : 1; }
+
+  inline const vector<InteractionMask::Membership> &
+  memberships(size_t feature) const {
+    static const vector<InteractionMask::Membership> all_pairs{{0, 0}};
+    return mask ? mask->memberships(feature) : all_pairs;
+  }
+
+  /* The pairwise term from the per-side sums of x v and x^2 v^2. */
+  template <typename Matrix>
+  inline Real pair_term(const Matrix &sums, const Matrix &squares) const {
+    if (mask) {
+      return mask->pair_term(sums, squares);
+    }
+    return (sums.row(0).squaredNorm() - squares.row(0).sum()) / 2;
+  }
+
+  /*
+  Factor-by-factor scoring for ranks without a fixed-size specialisation.
+  */
+  inline void
+  predict_score_generic_rank(Eigen::Ref<Vector> target, const SparseMatrix &X,
+                             const vector<RelationBlock> &relations) const {
     target = w0 + (X * w.head(X.cols())).array();
     size_t offset = X.cols();
     for (auto iter = relations.begin(); iter != relations.end(); iter++) {
-      Vector w0_cache = (iter->X) * w.segment(offset, iter->feature_size);
-      size_t j = 0;
-      for (auto i : (iter->original_to_block)) {
-        target(j++) += w0_cache(i);
-      }
+      Vector w0_cache = iter->multiply(w.segment(offset, iter->feature_size));
+      iter->original_to_block.for_each_run(
+          [&target, &w0_cache](size_t begin, size_t end, size_t i) {
+            const Real value = w0_cache(i);
+            for (size_t j = begin; j < end; j++) {
+              target(j) += value;
+            }
+          });
       offset += iter->feature_size;
     }
 
@@ -97,13 +490,16 @@ template <typename Real> struct FM {
       for (auto iter = relations.begin(); iter != relations.end();
            iter++, relation_index++) {
         Eigen::Map<Vector> block_cache(buffer_cache.data(), iter->block_size);
-        block_cache =
-            iter->X * V.col(factor_index).segment(offset, iter->feature_size);
+        block_cache = iter->multiply(
+            V.col(factor_index).segment(offset, iter->feature_size));
         offset += iter->feature_size;
-        size_t train_case_index = 0;
-        for (auto i : iter->original_to_block) {
-          q_cache(train_case_index++) += block_cache(i);
-        }
+        iter->original_to_block.for_each_run(
+            [&q_cache, &block_cache](size_t begin, size_t end, size_t i) {
+              const Real value = block_cache(i);
+              for (size_t j = begin; j < end; j++) {
+                q_cache(j) += value;
+              }
+            });
       }
       target.array() += q_cache.array().square() * static_cast<Real>(0.5);
 
@@ -114,17 +510,20 @@ template <typename Real> struct FM {
       for (auto iter = relations.begin(); iter != relations.end();
            iter++, relation_index++) {
         Eigen::Map<Vector> block_cache(buffer_cache.data(), iter->block_size);
-        block_cache =
-            (iter->X.cwiseAbs2()) * (V.col(factor_index)
-                                         .segment(offset, iter->feature_size)
-                                         .array()
-                                         .square()
-                                         .matrix());
+        block_cache = iter->multiply_squared(
+            V.col(factor_index)
+                .segment(offset, iter->feature_size)
+                .array()
+                .square()
+                .matrix());
         offset += iter->feature_size;
-        size_t train_case_index = 0;
-        for (auto i : iter->original_to_block) {
-          q_cache(train_case_index++) += block_cache(i);
-        }
+        iter->original_to_block.for_each_run(
+            [&q_cache, &block_cache](size_t begin, size_t end, size_t i) {
+              const Real value = block_cache(i);
+              for (size_t j = begin; j < end; j++) {
+                q_cache(j) += value;
+              }
+            });
       }
       target -= q_cache * static_cast<Real>(0.5);
     }
@@ -133,8 +532,16 @@ template <typename Real> struct FM {
   const int n_factors;
   Real w0;
   Vector w;
-  DenseMatrix V;            // (n_feature, n_factor) - matrix
+  DenseMatrix V;            // (n_feature, n_factor) - matrix, or empty
+                            // when compact
   vector<Vector> cutpoints; // ordered probit
+  // the field pairs that interact; null for all of them.
+  std::shared_ptr<const InteractionMask> mask;
+  // the number of leading factors each feature uses, past which its row of
+  // V is zero (see FMLearningConfig::group_ranks); null for all of them.
+  std::shared_ptr<const FeatureRanks> feature_ranks;
+  // the rows of V cut to their ranks, feature by feature, when compact.
+  Vector ranked_V;
 
 protected:
   bool initialized;
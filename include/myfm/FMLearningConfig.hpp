@@ -2,8 +2,11 @@
 
 #include "OProbitSampler.hpp"
 #include "definitions.hpp"
+#include "interaction_mask.hpp"
 #include "util.hpp"
+#include <cmath>
 #include <cstddef>
+#include <memory>
 #include <set>
 #include <tuple>
 #include <vector>
@@ -19,12 +22,35 @@ public:
                           bool fit_w0, bool fit_linear,
                           const vector<size_t> &group_index, int n_iter,
                           int n_kept_samples, Real cutpoint_scale,
-                          const CutpointGroupType &cutpoint_groups)
+                          const CutpointGroupType &cutpoint_groups,
+                          size_t memory_budget = 0, bool auto_burn_in = false,
+                          Real target_ess = 0, Real rhat_threshold = 1.1,
+                          Real geweke_threshold = 2,
+                          int convergence_check_interval = 10,
+                          bool rao_blackwell = false,
+                          const vector<Real> &sample_weight = {},
+                          Real collapsed_sum_of_squares = 0,
+                          size_t implicit_user_block = 0,
+                          size_t implicit_item_block = 0,
+                          Real implicit_weight = 0,
+                          const InteractionMask::BlockType &interaction_blocks =
+                              {},
+                          const vector<size_t> &group_ranks = {})
       : alpha_0(alpha_0), beta_0(beta_0), gamma_0(gamma_0), mu_0(mu_0),
         reg_0(reg_0), task_type(task_type), nu_oprobit(nu_oprobit),
         fit_w0(fit_w0), fit_linear(fit_linear), n_iter(n_iter),
         n_kept_samples(n_kept_samples), cutpoint_scale(cutpoint_scale),
-        group_index_(group_index), cutpoint_groups_(cutpoint_groups) {
+        memory_budget(memory_budget), auto_burn_in(auto_burn_in),
+        target_ess(target_ess), rhat_threshold(rhat_threshold),
+        geweke_threshold(geweke_threshold),
+        convergence_check_interval(convergence_check_interval),
+        rao_blackwell(rao_blackwell),
+        collapsed_sum_of_squares(collapsed_sum_of_squares),
+        implicit_user_block(implicit_user_block),
+        implicit_item_block(implicit_item_block),
+        implicit_weight(implicit_weight),
+        group_index_(group_index), cutpoint_groups_(cutpoint_groups),
+        group_ranks_(group_ranks), sample_weight_(sample_weight) {
 
     /* check group_index consistency */
     set<size_t> all_index(group_index.begin(), group_index.end());
@@ -54,6 +80,44 @@ public:
     if (n_iter < n_kept_samples) {
       throw invalid_argument("n_kept_samples must not exceed n_iter.");
     }
+    if (target_ess > 0 && !auto_burn_in) {
+      throw invalid_argument("target_ess requires auto_burn_in.");
+    }
+    if (target_ess > n_kept_samples) {
+      throw invalid_argument("target_ess must not exceed n_kept_samples, "
+                             "the samples it is measured on.");
+    }
+    if (convergence_check_interval <= 0) {
+      throw invalid_argument("convergence_check_interval must be positive.");
+    }
+    if (!(implicit_weight >= 0)) {
+      throw invalid_argument("implicit_weight must be non-negative.");
+    }
+    if (implicit_weight > 0 && task_type != TASKTYPE::REGRESSION) {
+      throw invalid_argument("implicit feedback requires regression.");
+    }
+    if (!(collapsed_sum_of_squares >= 0)) {
+      throw invalid_argument("collapsed_sum_of_squares must be non-negative.");
+    }
+    for (Real weight : sample_weight) {
+      if (!(weight >= 0) || !std::isfinite(weight)) {
+        throw invalid_argument(
+            "sample weights must be finite and non-negative.");
+      }
+    }
+    if (!group_ranks.empty() && group_ranks.size() != n_groups_) {
+      throw invalid_argument(StringBuilder{}
+                                 .add("group_ranks has size")
+                                 .space_and_add(group_ranks.size())
+                                 .space_and_add("but there are")
+                                 .space_and_add(n_groups_)
+                                 .space_and_add("groups.")
+                                 .build());
+    }
+    if (!interaction_blocks.empty()) {
+      interaction_mask_ = std::make_shared<const InteractionMask>(
+          group_index, n_groups_, interaction_blocks);
+    }
   }
 
   FMLearningConfig(const FMLearningConfig &other) = default;
@@ -70,12 +134,101 @@ public:
 
   const Real cutpoint_scale;
 
+  // upper bound in bytes on the projected memory of a run; 0 means no limit.
+  const size_t memory_budget;
+
+  /*
+  If auto_burn_in is set, Gibbs sampling starts keeping samples once the
+  recent half of the chain passes the split-R-hat and Geweke tests, keeping
+  at most n_kept_samples of the most recent ones, and n_iter becomes an upper
+  bound. A positive target_ess further stops the chain once every monitored
+  trace has that many effective samples among the kept ones. If burn-in is
+  never detected, the n_kept_samples last draws are kept all the same, and
+  the history's n_burn_in stays negative.
+  */
+  const bool auto_burn_in;
+  const Real target_ess;
+  const Real rhat_threshold;
+  const Real geweke_threshold;
+  const int convergence_check_interval;
+
+  /*
+  If set, Gibbs sampling keeps, for every iteration that would otherwise be
+  kept as a sample, the model made of the full conditional means of w0, w
+  and V that the iteration drew from instead of the draw itself. The
+  predictor averages their predictions as it would those of the draws, with
+  less Monte Carlo noise in each.
+  */
+  const bool rao_blackwell;
+
+  /*
+  Squared residuals not represented by the training rows, i.e. the targets'
+  sum of squared deviations from the mean of their row when duplicate rows
+  were collapsed into weighted ones (see collapse.hpp). It enters the
+  update of the noise precision.
+  */
+  const Real collapsed_sum_of_squares;
+
+  /*
+  If implicit_weight is positive, Gibbs sampling also fits every pair of a
+  row of relation block implicit_user_block and a row of block
+  implicit_item_block (indices into the flattened relations) to 0 with that
+  likelihood weight, without materialising the pairs (see implicit.hpp).
+  */
+  const size_t implicit_user_block;
+  const size_t implicit_item_block;
+  const Real implicit_weight;
+
+  inline bool implicit_feedback() const { return implicit_weight > 0; }
+
+  /*
+  The field pairs the pairwise term keeps, fields being the groups (see
+  interaction_mask.hpp); null when all of them interact.
+  */
+  inline const std::shared_ptr<const InteractionMask> &
+  interaction_mask() const {
+    return interaction_mask_;
+  }
+
+  /*
+  The number of factors that features of `group` use, the rest of their row
+  of V being zero (see group_ranks); n_factors unless set.
+  */
+  inline int group_rank(size_t group, int n_factors) const {
+    return group_ranks_.empty() ? n_factors
+                                : static_cast<int>(group_ranks_[group]);
+  }
+
+  inline bool group_has_factor(size_t group, int factor_index) const {
+    return group_ranks_.empty() ||
+           static_cast<size_t>(factor_index) < group_ranks_[group];
+  }
+
+  const vector<size_t> &group_ranks() const { return group_ranks_; }
+
 private:
   const vector<size_t> group_index_;
   size_t n_groups_;
   vector<vector<size_t>> group_vs_feature_index_;
 
   const CutpointGroupType cutpoint_groups_;
+  std::shared_ptr<const InteractionMask> interaction_mask_;
+
+  /*
+  Per-group factor ranks: features of group g only use the first
+  group_ranks_[g] factors and dot products are taken as if the remaining ones
+  were zero. The model being trained keeps those zeros; the Gibbs samples
+  kept from it store only the ranked factors (see FM::compact). Empty for
+  n_factors everywhere.
+  */
+  const vector<size_t> group_ranks_;
+
+  /*
+  Per-row likelihood weights, i.e. row i counts as sample_weight[i] copies of
+  itself (e.g. 1 / keep rate after downsampling, see downsample.hpp). Empty
+  means unit weights.
+  */
+  const vector<Real> sample_weight_;
 
 public:
   inline size_t get_n_groups() const { return n_groups_; }
@@ -89,6 +242,8 @@ public:
     return group_vs_feature_index_;
   }
 
+  const vector<Real> &sample_weight() const { return sample_weight_; }
+
   struct Builder {
     Real alpha_0 = 1;
     Real beta_0 = 1;
@@ -104,6 +259,20 @@ public:
     vector<size_t> group_index;
     Real cutpoint_scale = 10;
     CutpointGroupType cutpoint_groups;
+    size_t memory_budget = 0;
+    bool auto_burn_in = false;
+    Real target_ess = 0;
+    Real rhat_threshold = 1.1;
+    Real geweke_threshold = 2;
+    int convergence_check_interval = 10;
+    bool rao_blackwell = false;
+    vector<Real> sample_weight;
+    Real collapsed_sum_of_squares = 0;
+    size_t implicit_user_block = 0;
+    size_t implicit_item_block = 0;
+    Real implicit_weight = 0;
+    InteractionMask::BlockType interaction_blocks;
+    vector<size_t> group_ranks;
 
     Builder() {}
 
@@ -186,11 +355,81 @@ public:
       return *this;
     }
 
+    inline Builder &set_memory_budget(size_t memory_budget) {
+      this->memory_budget = memory_budget;
+      return *this;
+    }
+
+    inline Builder &set_auto_burn_in(bool auto_burn_in) {
+      this->auto_burn_in = auto_burn_in;
+      return *this;
+    }
+
+    inline Builder &set_target_ess(Real target_ess) {
+      this->target_ess = target_ess;
+      return *this;
+    }
+
+    inline Builder &set_rhat_threshold(Real rhat_threshold) {
+      this->rhat_threshold = rhat_threshold;
+      return *this;
+    }
+
+    inline Builder &set_geweke_threshold(Real geweke_threshold) {
+      this->geweke_threshold = geweke_threshold;
+      return *this;
+    }
+
+    inline Builder &set_convergence_check_interval(int interval) {
+      this->convergence_check_interval = interval;
+      return *this;
+    }
+
+    inline Builder &set_rao_blackwell(bool rao_blackwell) {
+      this->rao_blackwell = rao_blackwell;
+      return *this;
+    }
+
+    inline Builder &set_sample_weight(const vector<Real> &sample_weight) {
+      this->sample_weight = sample_weight;
+      return *this;
+    }
+
+    inline Builder &set_collapsed_sum_of_squares(Real sum_of_squares) {
+      this->collapsed_sum_of_squares = sum_of_squares;
+      return *this;
+    }
+
+    inline Builder &set_implicit_feedback(size_t user_block,
+                                          size_t item_block, Real weight) {
+      this->implicit_user_block = user_block;
+      this->implicit_item_block = item_block;
+      this->implicit_weight = weight;
+      return *this;
+    }
+
+    inline Builder &
+    set_interaction_blocks(const InteractionMask::BlockType &blocks) {
+      this->interaction_blocks = blocks;
+      return *this;
+    }
+
+    inline Builder &set_group_ranks(const vector<size_t> &group_ranks) {
+      this->group_ranks = group_ranks;
+      return *this;
+    }
+
     FMLearningConfig build() {
       return FMLearningConfig(alpha_0, beta_0, gamma_0, mu_0, reg_0, task_type,
                               nu_oprobit, fit_w0, fit_linear, group_index,
                               n_iter, n_kept_samples, cutpoint_scale,
-                              this->cutpoint_groups);
+                              this->cutpoint_groups, memory_budget,
+                              auto_burn_in, target_ess, rhat_threshold,
+                              geweke_threshold, convergence_check_interval,
+                              rao_blackwell, sample_weight,
+                              collapsed_sum_of_squares, implicit_user_block,
+                              implicit_item_block, implicit_weight,
+                              interaction_blocks, group_ranks);
     }
 
     static FMLearningConfig get_default_config(size_t n_features) {
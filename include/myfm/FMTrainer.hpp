@@ -1,4 +1,6 @@
 #pragma once
+#include <deque>
+#include <memory>
 #include <sstream>
 #include <string>
 #include <tuple>
@@ -8,7 +10,9 @@
 #include "HyperParams.hpp"
 #include "LearningHistory.hpp"
 #include "OProbitSampler.hpp"
+#include "convergence.hpp"
 #include "definitions.hpp"
+#include "implicit.hpp"
 #include "predictor.hpp"
 #include "util.hpp"
 
@@ -50,6 +54,8 @@ struct GibbsFMTrainer
 public:
   using BaseType::BaseType;
 
+  static constexpr bool is_variational = false;
+
   /**
    *  Main routine for Gibbs sampling.
    */
@@ -61,25 +67,110 @@ public:
          this->learning_config.task_type},
         {},
     };
-    initialize_hyper(fm, hyper);
-    initialize_e(fm, hyper);
+    this->check_memory_budget(fm.n_factors);
+    fm.mask = this->learning_config.interaction_mask();
+    if (fm.mask && this->learning_config.implicit_feedback()) {
+      throw std::invalid_argument("Interaction masks are not supported with "
+                                  "implicit feedback.");
+    }
+    this->apply_group_ranks(fm);
+    if (this->learning_config.implicit_feedback()) {
+      implicit_.reset(new implicit::ImplicitFeedback<Real>(
+          this->relations, this->relation_caches,
+          this->learning_config.implicit_user_block,
+          this->learning_config.implicit_item_block, this->X.cols(),
+          fm.n_factors, this->learning_config.implicit_weight));
+    }
+    if (!this->continuing_) {
+      initialize_hyper(fm, hyper);
+    }
+    if (!this->continuing_ || !this->residuals_current_) {
+      initialize_e(fm, hyper);
+    }
+    this->residuals_current_ = true;
+
+    const Config &config = this->learning_config;
+    // the effective sample size describes the samples that are returned, the
+    // n_kept_samples most recent ones.
+    convergence::ConvergenceMonitor<Real> monitor(
+        config.rhat_threshold, config.geweke_threshold, config.target_ess,
+        config.n_kept_samples);
+    bool burnt_in = false;
+    // FM is not assignable, so the sliding window cannot live in a vector.
+    std::deque<FMType> recent_samples;
+    auto keep_recent = [&recent_samples](const FMType &sample,
+                                         size_t capacity) {
+      if (capacity == 0) {
+        return;
+      }
+      if (recent_samples.size() >= capacity) {
+        recent_samples.pop_front();
+      }
+      recent_samples.emplace_back(sample);
+      recent_samples.back().compact();
+    };
 
-    result.first.samples.reserve(this->learning_config.n_kept_samples);
-    for (int mcmc_iteration = 0; mcmc_iteration < this->learning_config.n_iter;
+    if (!config.auto_burn_in) {
+      result.first.samples.reserve(config.n_kept_samples);
+    }
+    for (int mcmc_iteration = 0; mcmc_iteration < config.n_iter;
          mcmc_iteration++) {
+      const bool keep =
+          config.auto_burn_in
+              ? burnt_in
+              : (config.n_iter <= (mcmc_iteration + config.n_kept_samples));
+      accumulate_means_ = config.rao_blackwell && keep;
+      if (accumulate_means_) {
+        start_conditional_means(fm);
+      }
       this->update_all(fm, hyper);
-      if (this->learning_config.n_iter <=
-          (mcmc_iteration + this->learning_config.n_kept_samples)) {
+
+      bool enough_samples = false;
+      if (config.auto_burn_in) {
+        monitor.record(hyper, this->e_train);
+        const bool check =
+            (mcmc_iteration + 1) % config.convergence_check_interval == 0;
+        if (burnt_in) {
+          if (accumulate_means_) {
+            keep_recent(conditional_means(fm), config.n_kept_samples);
+          } else {
+            keep_recent(fm, config.n_kept_samples);
+          }
+          enough_samples = check && monitor.enough_samples();
+        } else {
+          // the most recent draws stand in for the posterior in case burn-in
+          // is never detected.
+          keep_recent(fm, config.n_kept_samples);
+          if (check && monitor.check_burn_in()) {
+            burnt_in = true;
+            recent_samples.clear();
+          }
+        }
+      } else if (accumulate_means_) {
+        result.first.samples.emplace_back(conditional_means(fm));
+        result.first.samples.back().compact();
+      } else if (keep) {
         result.first.samples.emplace_back(fm);
+        result.first.samples.back().compact();
       }
       // for tracing
       result.second.hypers.emplace_back(hyper);
 
       bool should_stop = cb(mcmc_iteration, &fm, &hyper, &(result.second));
-      if (should_stop) {
+      if (should_stop || enough_samples) {
         break;
       }
     }
+    accumulate_means_ = false;
+    if (config.auto_burn_in) {
+      for (const auto &sample : recent_samples) {
+        result.first.samples.emplace_back(sample);
+      }
+      result.second.n_burn_in = monitor.burn_in;
+      result.second.min_effective_sample_size =
+          monitor.min_effective_sample_size();
+      result.second.max_split_rhat = monitor.max_split_rhat;
+    }
     for (OprobitSamplerType &cs : cutpoint_sampler) {
       result.second.n_mh_accept.emplace_back(cs.accept_count);
     }
@@ -124,6 +215,50 @@ public:
            normal_distribution<Real>(0, 1)(this->gen_) / std::sqrt(quad);
   }
 
+  // Same as above, also writing the conditional mean to `mean` while
+  // Rao-Blackwellised samples are being kept.
+  inline Real sample_normal(const Real &quad, const Real &first, Real &mean) {
+    if (accumulate_means_) {
+      mean = first / quad;
+    }
+    return sample_normal(quad, first);
+  }
+
+  // Where the conditional mean of a coordinate is written; the means are
+  // only allocated when Rao-Blackwellising.
+  inline Real &mean_slot(Real &mean) {
+    return accumulate_means_ ? mean : discarded_mean_;
+  }
+  inline Real &mean_slot(Vector &means, size_t i) {
+    return accumulate_means_ ? means(i) : discarded_mean_;
+  }
+  inline Real &mean_slot(DenseMatrix &means, size_t i, size_t j) {
+    return accumulate_means_ ? means(i, j) : discarded_mean_;
+  }
+
+  /*
+  Starts a sweep whose conditional means are kept, from the current values,
+  which stand for the coordinates that the sweep does not update.
+  */
+  inline void start_conditional_means(const FMType &fm) {
+    w0_mean_ = fm.w0;
+    w_mean_ = fm.w;
+    V_mean_ = fm.V;
+  }
+
+  /*
+  The model made of the full conditional means of w0, w and V taken during
+  the last sweep, with its sampled cutpoints. The predictor averages the
+  predictions of these models, the link applied to each, as it does those
+  of the draws.
+  */
+  inline FMType conditional_means(const FMType &fm) const {
+    FMType result(w0_mean_, w_mean_, V_mean_, fm.cutpoints);
+    result.mask = fm.mask;
+    result.feature_ranks = fm.feature_ranks;
+    return result;
+  }
+
   inline void update_alpha(FMType &fm, HyperType &hyper) {
     // If the task is classification, take alpha = 1.
     if ((this->learning_config.task_type == TASKTYPE::CLASSIFICATION)) {
@@ -135,9 +270,18 @@ public:
       return;
     }
 
-    Real e_all = this->e_train.array().square().sum();
+    Real e_all =
+        (this->sample_weight.array() * this->e_train.array().square()).sum() +
+        this->learning_config.collapsed_sum_of_squares;
+    Real n_cases = this->sample_weight_sum;
+    if (implicit_) {
+      // A sweep starts here; the updates below keep the pair sums current.
+      implicit_->reset(fm);
+      e_all += implicit_->sum_of_squares();
+      n_cases += implicit_->weight * implicit_->n_pairs();
+    }
 
-    Real exponent = (this->learning_config.alpha_0 + this->X.rows()) / 2;
+    Real exponent = (this->learning_config.alpha_0 + n_cases) / 2;
     Real variance = (this->learning_config.beta_0 + e_all) / 2;
     Real new_alpha =
         gamma_distribution<Real>(exponent, 1 / variance)(this->gen_);
@@ -146,13 +290,20 @@ public:
 
   /*
  The sampling method for both $\lambda _g ^{(w)}$ and $\lambda _{g,r} ^{(v)}$.
+ Groups whose rank leaves out factor `factor_index` keep their value.
  */
   inline void update_lambda_generic(const Vector &mu, Eigen::Ref<Vector> lambda,
-                                    const Vector &weight) {
+                                    const Vector &weight,
+                                    int factor_index = -1) {
     const vector<vector<size_t>> &group_vs_feature_index =
         this->learning_config.group_vs_feature_index();
     size_t group_index = 0;
     for (const auto &group_feature_indices : group_vs_feature_index) {
+      if (factor_index >= 0 &&
+          !this->learning_config.group_has_factor(group_index, factor_index)) {
+        group_index++;
+        continue;
+      }
       Real mean = mu(group_index);
       Real alpha = this->learning_config.alpha_0 + group_feature_indices.size();
       Real beta = this->learning_config.beta_0;
@@ -172,11 +323,16 @@ public:
  The sampling method for both $\mu _g ^{(w)}$ and $\mu _{g,r} ^{(v)}$.
  */
   inline void update_mu_generic(Eigen::Ref<Vector> mu, const Vector &lambda,
-                                const Vector &weight) {
+                                const Vector &weight, int factor_index = -1) {
     const vector<vector<size_t>> &group_vs_feature_index =
         this->learning_config.group_vs_feature_index();
     size_t group_index = 0;
     for (const auto &group_feature_indices : group_vs_feature_index) {
+      if (factor_index >= 0 &&
+          !this->learning_config.group_has_factor(group_index, factor_index)) {
+        group_index++;
+        continue;
+      }
       size_t n_feature_in_groups = group_feature_indices.size();
       Real square = lambda(group_index) *
                     (this->learning_config.gamma_0 + n_feature_in_groups);
@@ -203,7 +359,7 @@ public:
     for (int factor_index = 0; factor_index < fm.n_factors; factor_index++) {
       update_lambda_generic(hyper.mu_V.col(factor_index),
                             hyper.lambda_V.col(factor_index),
-                            fm.V.col(factor_index));
+                            fm.V.col(factor_index), factor_index);
     }
   }
 
@@ -211,7 +367,7 @@ public:
     for (int factor_index = 0; factor_index < fm.n_factors; factor_index++) {
       update_mu_generic(hyper.mu_V.col(factor_index),
                         hyper.lambda_V.col(factor_index),
-                        fm.V.col(factor_index));
+                        fm.V.col(factor_index), factor_index);
     }
   }
 
@@ -220,15 +376,28 @@ public:
       fm.w0 = 0;
       return;
     }
-    Real w0_lin_term = hyper.alpha * (fm.w0 - this->e_train.array()).sum();
+    Real w0_lin_term =
+        hyper.alpha *
+        (this->sample_weight.array() * (fm.w0 - this->e_train.array())).sum();
     Real w0_quad_term =
-        hyper.alpha * this->n_train + this->learning_config.reg_0;
-    Real w0_new = sample_normal(w0_quad_term, w0_lin_term);
+        hyper.alpha * this->sample_weight_sum + this->learning_config.reg_0;
+    if (implicit_) {
+      Real square = 0, linear = 0;
+      implicit_->add_w0_terms(fm.w0, square, linear);
+      w0_quad_term += hyper.alpha * square;
+      w0_lin_term += hyper.alpha * linear;
+    }
+    Real w0_new =
+        sample_normal(w0_quad_term, w0_lin_term, mean_slot(w0_mean_));
+    if (implicit_) {
+      implicit_->apply_w0(w0_new - fm.w0);
+    }
     this->e_train.array() += (w0_new - fm.w0);
     fm.w0 = w0_new;
   }
 
   inline void update_w(FMType &fm, HyperType &hyper) {
+    using itertype = typename SparseMatrix::InnerIterator;
     if (!this->learning_config.fit_linear) {
       fm.w.array() = 0;
       return;
@@ -242,13 +411,18 @@ public:
       this->e_train.array() -= this->X_t.row(feature_index) * w_old;
       Real lambda = hyper.lambda_w(group);
       Real mu = hyper.mu_w(group);
-      Real square_term =
-          lambda + hyper.alpha * this->X_t.row(feature_index).cwiseAbs2().sum();
-      Real linear_term =
-          -hyper.alpha * this->X_t.row(feature_index) * this->e_train +
-          lambda * mu;
+      Real x2_sum = 0;
+      Real xe_sum = 0;
+      for (itertype it(this->X_t, feature_index); it; ++it) {
+        const Real weighted_x = this->sample_weight(it.col()) * it.value();
+        x2_sum += weighted_x * it.value();
+        xe_sum += weighted_x * this->e_train(it.col());
+      }
+      Real square_term = lambda + hyper.alpha * x2_sum;
+      Real linear_term = -hyper.alpha * xe_sum + lambda * mu;
 
-      Real w_new = sample_normal(square_term, linear_term);
+      Real w_new = sample_normal(square_term, linear_term,
+                                 mean_slot(w_mean_, feature_index));
       this->e_train.array() += this->X_t.row(feature_index) * w_new;
       fm.w(feature_index) = w_new;
     }
@@ -257,22 +431,29 @@ public:
     size_t offset = this->X.cols();
     for (size_t relation_index = 0; relation_index < this->relations.size();
          relation_index++) {
+      trace::TraceScope block_scope("relation_block", "train",
+                                    relation_index);
       RelationBlock &relation_data = this->relations[relation_index];
       RelationWiseCache &relation_cache = this->relation_caches[relation_index];
+      const int implicit_side = implicit_side_of(relation_index);
       relation_cache.e.array() = 0;
       relation_cache.q.array() = 0;
 
-      relation_cache.q =
-          relation_data.X * fm.w.segment(offset, relation_data.feature_size);
-
-      {
-        size_t train_data_index = 0;
-        for (auto i : relation_data.original_to_block) {
-          relation_cache.e(i) += this->e_train(train_data_index);
-          this->e_train(train_data_index++) -=
-              relation_cache.q(i); // un-synchronize
-        }
-      }
+      relation_cache.q = relation_data.multiply(
+          fm.w.segment(offset, relation_data.feature_size));
+
+      relation_data.original_to_block.for_each_run(
+          [this, &relation_cache](size_t begin, size_t end, size_t i) {
+            const Real q = relation_cache.q(i);
+            Real e_sum = 0;
+            for (size_t train_data_index = begin; train_data_index < end;
+                 train_data_index++) {
+              e_sum += this->sample_weight(train_data_index) *
+                       this->e_train(train_data_index);
+              this->e_train(train_data_index) -= q; // un-synchronize
+            }
+            relation_cache.e(i) += e_sum;
+          });
       for (size_t inner_feature_index = 0;
            inner_feature_index < relation_data.feature_size;
            inner_feature_index++) {
@@ -282,42 +463,57 @@ public:
         Real lambda = hyper.lambda_w(group);
         Real mu = hyper.mu_w(group);
 
-        Real square_term =
-            relation_cache.X_t.row(inner_feature_index).cwiseAbs2() *
-            relation_cache.cardinality;
+        Real square_term = relation_cache.column_squared_dot(
+            inner_feature_index, relation_cache.cardinality);
         Real linear_term =
-            -relation_cache.X_t.row(inner_feature_index) * relation_cache.e;
+            -relation_cache.column_dot(inner_feature_index, relation_cache.e);
 
         linear_term += square_term * w_old;
+        if (implicit_side >= 0) {
+          implicit_->add_w_terms(implicit_side, inner_feature_index, w_old,
+                                 square_term, linear_term);
+        }
 
         square_term = lambda + hyper.alpha * square_term;
         linear_term = hyper.alpha * linear_term + lambda * mu;
 
-        Real w_new = sample_normal(square_term, linear_term);
+        Real w_new = sample_normal(
+            square_term, linear_term,
+            mean_slot(w_mean_, offset + inner_feature_index));
         fm.w(offset + inner_feature_index) = w_new;
-        relation_cache.e += relation_cache.X_t.row(inner_feature_index)
-                                .transpose()
-                                .cwiseProduct(relation_cache.cardinality) *
-                            (w_new - w_old);
-      }
-
-      relation_cache.q =
-          relation_data.X * fm.w.segment(offset, relation_data.feature_size);
-      {
-        size_t train_data_index = 0;
-        for (auto i : relation_data.original_to_block) {
-          this->e_train(train_data_index++) += relation_cache.q(i); // un-sync
+        if (implicit_side >= 0) {
+          implicit_->apply_w(implicit_side, inner_feature_index,
+                             w_new - w_old);
         }
+        relation_cache.add_scaled_column_product(
+            inner_feature_index, relation_cache.cardinality, w_new - w_old,
+            relation_cache.e);
       }
+
+      relation_cache.q = relation_data.multiply(
+          fm.w.segment(offset, relation_data.feature_size));
+      relation_data.original_to_block.for_each_run(
+          [this, &relation_cache](size_t begin, size_t end, size_t i) {
+            const Real q = relation_cache.q(i);
+            for (size_t train_data_index = begin; train_data_index < end;
+                 train_data_index++) {
+              this->e_train(train_data_index) += q; // re-sync
+            }
+          });
       offset += relation_data.feature_size;
     }
   }
 
   inline void update_V(FMType &fm, HyperType &hyper) {
     using itertype = typename SparseMatrix::InnerIterator;
+    if (fm.mask) {
+      return update_V_masked(fm, hyper);
+    }
 
-    for (int factor_index = 0; factor_index < fm.n_factors; factor_index++) {
-      this->q_train = this->X * fm.V.col(factor_index).head(this->X.cols());
+    // the factors past every rank are zero and leave e_train unchanged.
+    for (int factor_index = 0; factor_index < this->n_ranked_factors(fm);
+         factor_index++) {
+      this->ranked_product(fm.V, factor_index, this->q_train);
 
       // compute contribution of blocks
       {
@@ -325,16 +521,22 @@ public:
         size_t offset = this->X.cols();
         for (size_t relation_index = 0; relation_index < this->relations.size();
              relation_index++) {
+          trace::TraceScope block_scope("relation_block", "train",
+                                        relation_index);
           const RelationBlock &relation_data = this->relations[relation_index];
           RelationWiseCache &relation_cache =
               this->relation_caches[relation_index];
-          relation_cache.q = relation_data.X *
-                             (fm.V.col(factor_index)
-                                  .segment(offset, relation_data.feature_size));
-          size_t train_data_index = 0;
-          for (auto i : relation_data.original_to_block) {
-            this->q_train(train_data_index++) += relation_cache.q(i);
-          }
+          relation_cache.q = relation_data.multiply(
+              fm.V.col(factor_index)
+                  .segment(offset, relation_data.feature_size));
+          relation_data.original_to_block.for_each_run(
+              [this, &relation_cache](size_t begin, size_t end, size_t i) {
+                const Real q = relation_cache.q(i);
+                for (size_t train_data_index = begin; train_data_index < end;
+                     train_data_index++) {
+                  this->q_train(train_data_index) += q;
+                }
+              });
           offset += relation_data.feature_size;
         }
       }
@@ -342,6 +544,9 @@ public:
       // main table
       for (int feature_index = 0; feature_index < this->X_t.rows();
            feature_index++) {
+        if (factor_index >= this->feature_ranks_[feature_index]) {
+          continue;
+        }
         auto g = this->learning_config.group_index(feature_index);
         Real v_old = fm.V(feature_index, factor_index);
 
@@ -352,8 +557,9 @@ public:
           auto train_data_index = it.col();
           auto h = it.value() *
                    (this->q_train(train_data_index) - it.value() * v_old);
-          square_coeff += h * h;
-          linear_coeff += (-this->e_train(train_data_index)) * h;
+          const Real weighted_h = this->sample_weight(train_data_index) * h;
+          square_coeff += weighted_h * h;
+          linear_coeff += (-this->e_train(train_data_index)) * weighted_h;
         }
         linear_coeff += square_coeff * v_old;
 
@@ -364,7 +570,9 @@ public:
         linear_coeff +=
             hyper.lambda_V(g, factor_index) * hyper.mu_V(g, factor_index);
 
-        Real v_new = sample_normal(square_coeff, linear_coeff);
+        Real v_new =
+            sample_normal(square_coeff, linear_coeff,
+                          mean_slot(V_mean_, feature_index, factor_index));
         fm.V(feature_index, factor_index) = v_new;
         for (itertype it(this->X_t, feature_index); it; ++it) {
           auto train_data_index = it.col();
@@ -380,104 +588,132 @@ public:
       // initialize caches
       for (size_t relation_index = 0; relation_index < this->relations.size();
            relation_index++) {
+        trace::TraceScope block_scope("relation_block", "train",
+                                      relation_index);
         const RelationBlock &relation_data = this->relations[relation_index];
         RelationWiseCache &relation_cache =
             this->relation_caches[relation_index];
+        const int implicit_side = implicit_side_of(relation_index);
 
         // initialize block caches.
-        relation_cache.q_S = relation_data.X.cwiseAbs2() *
-                             (fm.V.col(factor_index)
-                                  .segment(offset, relation_data.feature_size)
-                                  .array()
-                                  .square()
-                                  .matrix());
-        size_t train_data_index = 0;
-
+        relation_cache.q_S = relation_data.multiply_squared(
+            fm.V.col(factor_index)
+                .segment(offset, relation_data.feature_size)
+                .array()
+                .square()
+                .matrix());
         relation_cache.c.array() = 0;
         relation_cache.c_S.array() = 0;
         relation_cache.e.array() = 0;
         relation_cache.e_q.array() = 0;
 
-        for (auto i : relation_data.original_to_block) {
-          Real temp = (this->q_train(train_data_index) - relation_cache.q(i));
-          relation_cache.c(i) += temp;
-          relation_cache.c_S(i) += temp * temp;
-          relation_cache.e(i) += this->e_train(train_data_index);
-          relation_cache.e_q(i) += this->e_train(train_data_index) * temp;
-          // un-synchronization of q and e
-          this->q_train(train_data_index) -= relation_cache.q(i);
-          // q_B
-          // 1/ 2 ( (q_B + q_other) **2 - (q_B_S + other) )
-          // q_B * q_other + 0.5 q_B **2 - 0.5 * q_B_S
-          this->e_train(train_data_index) -=
-              (this->q_train(train_data_index) * relation_cache.q(i) +
-               0.5 * relation_cache.q(i) * relation_cache.q(i) -
-               0.5 * relation_cache.q_S(i));
-          train_data_index++;
-        }
+        relation_data.original_to_block.for_each_run(
+            [this, &relation_cache](size_t begin, size_t end, size_t i) {
+              const Real q = relation_cache.q(i);
+              const Real q_S = relation_cache.q_S(i);
+              Real c = 0, c_S = 0, e = 0, e_q = 0;
+              for (size_t train_data_index = begin; train_data_index < end;
+                   train_data_index++) {
+                const Real weight = this->sample_weight(train_data_index);
+                Real temp = (this->q_train(train_data_index) - q);
+                c += weight * temp;
+                c_S += weight * temp * temp;
+                e += weight * this->e_train(train_data_index);
+                e_q += weight * this->e_train(train_data_index) * temp;
+                // un-synchronization of q and e
+                this->q_train(train_data_index) = temp;
+                // q_B
+                // 1/ 2 ( (q_B + q_other) **2 - (q_B_S + other) )
+                // q_B * q_other + 0.5 q_B **2 - 0.5 * q_B_S
+                this->e_train(train_data_index) -=
+                    (temp * q + 0.5 * q * q - 0.5 * q_S);
+              }
+              relation_cache.c(i) += c;
+              relation_cache.c_S(i) += c_S;
+              relation_cache.e(i) += e;
+              relation_cache.e_q(i) += e_q;
+            });
         // Initialized block-wise caches.
         for (size_t inner_feature_index = 0;
              inner_feature_index < relation_data.feature_size;
              inner_feature_index++) {
+          if (factor_index >=
+              this->feature_ranks_[offset + inner_feature_index]) {
+            continue;
+          }
           auto g =
               this->learning_config.group_index(offset + inner_feature_index);
           Real v_old = fm.V(offset + inner_feature_index, factor_index);
           Real square_coeff = 0;
           Real linear_coeff = 0;
 
-          Real x_il;
-          for (itertype it(relation_cache.X_t, inner_feature_index); it; ++it) {
-            auto block_data_index = it.col();
-            x_il = it.value();
-            auto h_B = (relation_cache.q(block_data_index) - x_il * v_old);
-            auto h_squared =
-                h_B * h_B * relation_cache.cardinality(block_data_index) +
-                2 * relation_cache.c(block_data_index) * h_B +
-                relation_cache.c_S(block_data_index);
-            h_squared = x_il * x_il * h_squared;
-            square_coeff += h_squared;
-            linear_coeff += (-relation_cache.e(block_data_index) * h_B -
-                             relation_cache.e_q(block_data_index)) *
-                            x_il;
-          }
+          relation_cache.for_each_in_column(
+              inner_feature_index,
+              [&](size_t block_data_index, Real x_il) {
+                auto h_B = (relation_cache.q(block_data_index) - x_il * v_old);
+                auto h_squared =
+                    h_B * h_B * relation_cache.cardinality(block_data_index) +
+                    2 * relation_cache.c(block_data_index) * h_B +
+                    relation_cache.c_S(block_data_index);
+                h_squared = x_il * x_il * h_squared;
+                square_coeff += h_squared;
+                linear_coeff += (-relation_cache.e(block_data_index) * h_B -
+                                 relation_cache.e_q(block_data_index)) *
+                                x_il;
+              });
           linear_coeff += square_coeff * v_old;
+          if (implicit_side >= 0) {
+            implicit_->add_V_terms(implicit_side, inner_feature_index,
+                                   factor_index, v_old, square_coeff,
+                                   linear_coeff);
+          }
           square_coeff *= hyper.alpha;
           linear_coeff *= hyper.alpha;
           square_coeff += hyper.lambda_V(g, factor_index);
           linear_coeff +=
               hyper.lambda_V(g, factor_index) * hyper.mu_V(g, factor_index);
 
-          Real v_new = sample_normal(square_coeff, linear_coeff);
+          Real v_new = sample_normal(
+              square_coeff, linear_coeff,
+              mean_slot(V_mean_, offset + inner_feature_index,
+                        factor_index));
           Real delta = v_new - v_old;
-          fm.V(offset + inner_feature_index, factor_index) = v_new;
-          for (itertype it(relation_cache.X_t, inner_feature_index); it; ++it) {
-            auto block_data_index = it.col();
-            const Real x_il = it.value();
-            auto h_B = relation_cache.q(block_data_index) - x_il * v_old;
-            relation_cache.q(block_data_index) += delta * x_il;
-            relation_cache.q_S(block_data_index) +=
-                delta * (v_new + v_old) * x_il * x_il;
-
-            relation_cache.e(block_data_index) +=
-                x_il * delta *
-                (h_B * relation_cache.cardinality(block_data_index) +
-                 relation_cache.c(block_data_index));
-            relation_cache.e_q(block_data_index) +=
-                x_il * delta *
-                (h_B * relation_cache.c(block_data_index) +
-                 relation_cache.c_S(block_data_index));
+          if (implicit_side >= 0) {
+            implicit_->apply_V(implicit_side, inner_feature_index,
+                               factor_index, v_old, delta);
           }
+          fm.V(offset + inner_feature_index, factor_index) = v_new;
+          relation_cache.for_each_in_column(
+              inner_feature_index,
+              [&](size_t block_data_index, Real x_il) {
+                auto h_B = relation_cache.q(block_data_index) - x_il * v_old;
+                relation_cache.q(block_data_index) += delta * x_il;
+                relation_cache.q_S(block_data_index) +=
+                    delta * (v_new + v_old) * x_il * x_il;
+
+                relation_cache.e(block_data_index) +=
+                    x_il * delta *
+                    (h_B * relation_cache.cardinality(block_data_index) +
+                     relation_cache.c(block_data_index));
+                relation_cache.e_q(block_data_index) +=
+                    x_il * delta *
+                    (h_B * relation_cache.c(block_data_index) +
+                     relation_cache.c_S(block_data_index));
+              });
         }
         // resync
-        train_data_index = 0;
-        for (auto i : relation_data.original_to_block) {
-          this->e_train(train_data_index) +=
-              (this->q_train(train_data_index) * relation_cache.q(i) +
-               0.5 * relation_cache.q(i) * relation_cache.q(i) -
-               0.5 * relation_cache.q_S(i));
-          this->q_train(train_data_index) += relation_cache.q(i);
-          train_data_index++;
-        }
+        relation_data.original_to_block.for_each_run(
+            [this, &relation_cache](size_t begin, size_t end, size_t i) {
+              const Real q = relation_cache.q(i);
+              const Real q_S = relation_cache.q_S(i);
+              for (size_t train_data_index = begin; train_data_index < end;
+                   train_data_index++) {
+                this->e_train(train_data_index) +=
+                    (this->q_train(train_data_index) * q + 0.5 * q * q -
+                     0.5 * q_S);
+                this->q_train(train_data_index) += q;
+              }
+            });
         offset += relation_data.feature_size;
       }
     }
@@ -485,6 +721,288 @@ public:
     // relations
   }
 
+  /*
+  update_V under an interaction mask (see interaction_mask.hpp). In place of
+  q_train, each row keeps the sum of x v over every side of the mask, and a
+  feature's h sums the sides its field interacts with. The sums include the
+  relation blocks' parts, which are kept per block row in side_q (see
+  update_V_masked_relation).
+  */
+  inline void update_V_masked(FMType &fm, HyperType &hyper) {
+    using itertype = typename SparseMatrix::InnerIterator;
+    const InteractionMask &mask = *fm.mask;
+    side_sums_.resize(this->X.rows(), mask.n_sides());
+
+    for (int factor_index = 0; factor_index < this->n_ranked_factors(fm);
+         factor_index++) {
+      side_sums_.setZero();
+      this->for_each_ranked_entry(
+          factor_index, [&](size_t row, size_t feature, Real x) {
+            for (const auto &membership : mask.memberships(feature)) {
+              side_sums_(row, membership.side) +=
+                  x * fm.V(feature, factor_index);
+            }
+          });
+      size_t offset = this->X.cols();
+      for (size_t relation_index = 0; relation_index < this->relations.size();
+           relation_index++) {
+        const RelationBlock &relation_data = this->relations[relation_index];
+        RelationWiseCache &relation_cache =
+            this->relation_caches[relation_index];
+        relation_cache.side_q.setZero(relation_data.block_size,
+                                      mask.n_sides());
+        for (size_t block_index = 0; block_index < relation_data.block_size;
+             block_index++) {
+          relation_data.for_each_in_row(
+              block_index, [&](size_t col, Real x) {
+                for (const auto &membership :
+                     mask.memberships(offset + col)) {
+                  relation_cache.side_q(block_index, membership.side) +=
+                      x * fm.V(offset + col, factor_index);
+                }
+              });
+        }
+        relation_data.original_to_block.for_each_run(
+            [this, &relation_cache](size_t begin, size_t end, size_t i) {
+              for (size_t train_data_index = begin; train_data_index < end;
+                   train_data_index++) {
+                side_sums_.row(train_data_index) +=
+                    relation_cache.side_q.row(i);
+              }
+            });
+        offset += relation_data.feature_size;
+      }
+
+      for (int feature_index = 0; feature_index < this->X_t.rows();
+           feature_index++) {
+        if (factor_index >= this->feature_ranks_[feature_index]) {
+          continue;
+        }
+        auto g = this->learning_config.group_index(feature_index);
+        const auto &memberships = mask.memberships(feature_index);
+        Real v_old = fm.V(feature_index, factor_index);
+        auto h_of = [this, &memberships, v_old](size_t train_data_index,
+                                                Real x) {
+          Real h = 0;
+          for (const auto &membership : memberships) {
+            h += side_sums_(train_data_index, membership.partner);
+            if (membership.side == membership.partner) {
+              h -= x * v_old;
+            }
+          }
+          return x * h;
+        };
+
+        Real square_coeff = 0;
+        Real linear_coeff = 0;
+        for (itertype it(this->X_t, feature_index); it; ++it) {
+          auto train_data_index = it.col();
+          auto h = h_of(train_data_index, it.value());
+          const Real weighted_h = this->sample_weight(train_data_index) * h;
+          square_coeff += weighted_h * h;
+          linear_coeff += (-this->e_train(train_data_index)) * weighted_h;
+        }
+        linear_coeff += square_coeff * v_old;
+
+        square_coeff *= hyper.alpha;
+        linear_coeff *= hyper.alpha;
+
+        square_coeff += hyper.lambda_V(g, factor_index);
+        linear_coeff +=
+            hyper.lambda_V(g, factor_index) * hyper.mu_V(g, factor_index);
+
+        Real v_new =
+            sample_normal(square_coeff, linear_coeff,
+                          mean_slot(V_mean_, feature_index, factor_index));
+        fm.V(feature_index, factor_index) = v_new;
+        for (itertype it(this->X_t, feature_index); it; ++it) {
+          auto train_data_index = it.col();
+          auto h = h_of(train_data_index, it.value());
+          for (const auto &membership : memberships) {
+            side_sums_(train_data_index, membership.side) +=
+                it.value() * (v_new - v_old);
+          }
+          this->e_train(train_data_index) += h * (v_new - v_old);
+        }
+      }
+
+      offset = this->X.cols();
+      for (size_t relation_index = 0; relation_index < this->relations.size();
+           relation_index++) {
+        trace::TraceScope block_scope("relation_block", "train",
+                                      relation_index);
+        update_V_masked_relation(fm, hyper, relation_index, offset,
+                                 factor_index);
+        offset += this->relations[relation_index].feature_size;
+      }
+    }
+  }
+
+  /*
+  The updates of a relation block's factors under an interaction mask. With
+  O_i the side sums of case i less the part P_b of the block row b it
+  refers to (side_q), a feature of the block with x = x_bl has
+      h_i = x (A_b + u . O_i),  A_b = u . P_b - n_within x v_old,
+  u counting the memberships of its field per partner side and n_within
+  those to within-blocks. The sums over the cases of each block row of w_i,
+  w_i O_i, w_i O_i O_i^T, w_i e_i and w_i e_i O_i (cardinality, side_c,
+  side_c_S, e and side_e_q) then give the coefficients of v without
+  visiting the cases, and are kept current as the block's factors change.
+  The cases' side sums and residuals are brought up to date at the end.
+  */
+  inline void update_V_masked_relation(FMType &fm, HyperType &hyper,
+                                       size_t relation_index, size_t offset,
+                                       int factor_index) {
+    typedef Eigen::Matrix<Real, 1, Eigen::Dynamic> SideVector;
+    const InteractionMask &mask = *fm.mask;
+    const size_t n_sides = mask.n_sides();
+    const RelationBlock &relation_data = this->relations[relation_index];
+    RelationWiseCache &relation_cache = this->relation_caches[relation_index];
+    const size_t block_size = relation_data.block_size;
+    relation_cache.side_c.setZero(block_size, n_sides);
+    relation_cache.side_c_S.setZero(block_size, n_sides * n_sides);
+    relation_cache.side_e_q.setZero(block_size, n_sides);
+    relation_cache.side_dq.setZero(block_size, n_sides);
+    relation_cache.side_dq_S.setZero(block_size, n_sides);
+    relation_cache.e.setZero();
+    auto c_S_of = [&relation_cache, n_sides](size_t block_index) {
+      return Eigen::Map<DenseMatrix>(
+          relation_cache.side_c_S.row(block_index).data(), n_sides, n_sides);
+    };
+
+    SideVector others(n_sides);
+    relation_data.original_to_block.for_each_run(
+        [&](size_t begin, size_t end, size_t i) {
+          for (size_t train_data_index = begin; train_data_index < end;
+               train_data_index++) {
+            const Real weight = this->sample_weight(train_data_index);
+            const Real e = this->e_train(train_data_index);
+            others = side_sums_.row(train_data_index) -
+                     relation_cache.side_q.row(i);
+            relation_cache.side_c.row(i) += weight * others;
+            c_S_of(i).noalias() += weight * others.transpose() * others;
+            relation_cache.e(i) += weight * e;
+            relation_cache.side_e_q.row(i) += weight * e * others;
+          }
+        });
+
+    SideVector u(n_sides);
+    for (size_t inner_feature_index = 0;
+         inner_feature_index < relation_data.feature_size;
+         inner_feature_index++) {
+      const size_t feature_index = offset + inner_feature_index;
+      if (factor_index >= this->feature_ranks_[feature_index]) {
+        continue;
+      }
+      const auto &memberships = mask.memberships(feature_index);
+      u.setZero();
+      Real n_within = 0;
+      for (const auto &membership : memberships) {
+        u(membership.partner) += 1;
+        if (membership.side == membership.partner) {
+          n_within += 1;
+        }
+      }
+      auto g = this->learning_config.group_index(feature_index);
+      const Real v_old = fm.V(feature_index, factor_index);
+      auto A_of = [&](size_t block_index, Real x) {
+        return relation_cache.side_q.row(block_index).dot(u) -
+               n_within * x * v_old;
+      };
+
+      Real square_coeff = 0;
+      Real linear_coeff = 0;
+      relation_cache.for_each_in_column(
+          inner_feature_index, [&](size_t block_index, Real x) {
+            const Real A = A_of(block_index, x);
+            square_coeff +=
+                x * x *
+                (A * A * relation_cache.cardinality(block_index) +
+                 2 * A * relation_cache.side_c.row(block_index).dot(u) +
+                 (u * c_S_of(block_index)).dot(u));
+            linear_coeff -=
+                x * (A * relation_cache.e(block_index) +
+                     relation_cache.side_e_q.row(block_index).dot(u));
+          });
+      linear_coeff += square_coeff * v_old;
+
+      square_coeff *= hyper.alpha;
+      linear_coeff *= hyper.alpha;
+      square_coeff += hyper.lambda_V(g, factor_index);
+      linear_coeff +=
+          hyper.lambda_V(g, factor_index) * hyper.mu_V(g, factor_index);
+
+      const Real v_new =
+          sample_normal(square_coeff, linear_coeff,
+                        mean_slot(V_mean_, feature_index, factor_index));
+      const Real delta = v_new - v_old;
+      fm.V(feature_index, factor_index) = v_new;
+      relation_cache.for_each_in_column(
+          inner_feature_index, [&](size_t block_index, Real x) {
+            const Real A = A_of(block_index, x);
+            relation_cache.e(block_index) +=
+                delta * x *
+                (A * relation_cache.cardinality(block_index) +
+                 relation_cache.side_c.row(block_index).dot(u));
+            relation_cache.side_e_q.row(block_index) +=
+                delta * x *
+                (A * relation_cache.side_c.row(block_index) +
+                 u * c_S_of(block_index));
+            for (const auto &membership : memberships) {
+              relation_cache.side_q(block_index, membership.side) +=
+                  x * delta;
+              relation_cache.side_dq(block_index, membership.side) +=
+                  x * delta;
+              if (membership.side == membership.partner) {
+                relation_cache.side_dq_S(block_index, membership.side) +=
+                    x * x * (v_new * v_new - v_old * v_old);
+              }
+            }
+          });
+    }
+
+    // the pair terms of the cases before and after the block's changes.
+    Vector before(n_sides), after(n_sides), squares(n_sides);
+    const Vector no_squares = Vector::Zero(n_sides);
+    relation_data.original_to_block.for_each_run(
+        [&](size_t begin, size_t end, size_t i) {
+          squares = relation_cache.side_dq_S.row(i).transpose();
+          for (size_t train_data_index = begin; train_data_index < end;
+               train_data_index++) {
+            before = side_sums_.row(train_data_index).transpose();
+            after = before + relation_cache.side_dq.row(i).transpose();
+            this->e_train(train_data_index) +=
+                mask.pair_term(after, squares) -
+                mask.pair_term(before, no_squares);
+            side_sums_.row(train_data_index) = after.transpose();
+          }
+        });
+  }
+
+  /*
+  The implicit-feedback side (see implicit.hpp) of a relation block, or -1.
+  Also brings the other side's sums up to date for the block's updates.
+  */
+  inline int implicit_side_of(size_t relation_index) {
+    if (!implicit_) {
+      return -1;
+    }
+    const int side = implicit_->side_of(relation_index);
+    if (side >= 0) {
+      implicit_->prepare(side);
+    }
+    return side;
+  }
+
+  inline void add_trainer_memory(memory::MemoryReport &report) const {
+    if (implicit_) {
+      report.add("implicit_feedback", implicit_->bytes());
+    }
+    if (side_sums_.size() > 0) {
+      report.add("interaction_side_sums", memory::bytes_of(side_sums_));
+    }
+  }
+
   inline void sample_cutpoint_z_marginalized(FMType &fm) {
     cutpoint_sampler->step();
     cutpoint_sampler->alpha_to_gamma(fm.cutpoint, cutpoint_sampler->alpha_now);
@@ -498,17 +1016,47 @@ public:
     } else if (this->learning_config.task_type == TASKTYPE::CLASSIFICATION) {
       Real zero = static_cast<Real>(0);
       Real std = static_cast<Real>(1); // 1/ sqrt(hyper.alpha);
+      /*
+      A row of weight s stands for s copies sharing the prediction: it gets
+      that many latent draws, and its residual is taken w.r.t. their mean.
+      Fractional weights are rounded stochastically, so the sweep's row
+      weights (and the weighted cardinalities) change with each draw.
+      */
+      const vector<Real> &nominal_weight =
+          this->learning_config.sample_weight();
+      bool weight_changed = false;
+      uniform_real_distribution<Real> rounding(0, 1);
       for (int train_data_index = 0; train_data_index < this->X.rows();
            train_data_index++) {
         Real gt = this->y(train_data_index);
         Real pred = this->e_train(train_data_index);
-        Real n;
-        if (gt > 0) {
-          n = sample_truncated_normal_left(this->gen_, pred, std, zero);
-        } else {
-          n = sample_truncated_normal_right(this->gen_, pred, std, zero);
+        int n_copies = 1;
+        if (!nominal_weight.empty()) {
+          const Real weight = nominal_weight[train_data_index];
+          n_copies = static_cast<int>(std::floor(weight));
+          if (weight > n_copies && rounding(this->gen_) < weight - n_copies) {
+            n_copies++;
+          }
+          weight_changed = weight_changed ||
+                           (this->sample_weight(train_data_index) != n_copies);
+          this->sample_weight(train_data_index) = n_copies;
+        }
+        if (n_copies == 0) {
+          this->e_train(train_data_index) = zero;
+          continue;
+        }
+        Real n = 0;
+        for (int copy = 0; copy < n_copies; copy++) {
+          if (gt > 0) {
+            n += sample_truncated_normal_left(this->gen_, pred, std, zero);
+          } else {
+            n += sample_truncated_normal_right(this->gen_, pred, std, zero);
+          }
         }
-        this->e_train(train_data_index) -= n;
+        this->e_train(train_data_index) -= n / n_copies;
+      }
+      if (weight_changed) {
+        this->update_sample_weight_sums();
       }
     } else if (this->learning_config.task_type == TASKTYPE::ORDERED) {
       int i = 0;
@@ -521,6 +1069,19 @@ public:
     }
   }
   std::vector<OprobitSamplerType> cutpoint_sampler;
+
+private:
+  std::unique_ptr<implicit::ImplicitFeedback<Real>> implicit_;
+
+  // per-row sums over the sides of an interaction mask, see update_V_masked.
+  typename FMType::SideSums side_sums_;
+
+  // full conditional means of the current sweep, see FMLearningConfig.
+  bool accumulate_means_ = false;
+  Real discarded_mean_ = 0;
+  Real w0_mean_ = 0;
+  Vector w_mean_;
+  DenseMatrix V_mean_;
 };
 
 } // namespace myFM
\ No newline at end of file
@@ -8,5 +8,10 @@ template <typename Real> struct GibbsLearningHistory {
   std::vector<size_t>
       n_mh_accept; // will be used for M-H step in ordered probit regression;
   std::vector<Real> train_log_losses;
+
+  // filled when FMLearningConfig::auto_burn_in is set.
+  int n_burn_in = -1;
+  Real min_effective_sample_size = 0;
+  Real max_split_rhat = 0;
 };
 } // namespace myFM
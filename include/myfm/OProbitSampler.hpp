@@ -1,6 +1,7 @@
 #pragma once
 
 #include "Faddeeva/Faddeeva.hh"
+#include "special.hpp"
 #include "util.hpp"
 #include <Eigen/Cholesky>
 #include <Eigen/Core>
@@ -17,6 +18,7 @@ template <typename Real> struct OprobitSampler {
   using DenseVector = types::Vector<Real>;
   using DenseMatrix = types::DenseMatrix<Real>;
   using IntVector = Eigen::Matrix<int, Eigen::Dynamic, 1>;
+  using Array = special::Array<Real>;
   static constexpr Real SQRT2 = 1.4142135623730951;
   static constexpr Real SQRTPI = 1.7724538509055159;
   static constexpr Real SQRT2PI = SQRT2 * SQRTPI;
@@ -26,7 +28,8 @@ template <typename Real> struct OprobitSampler {
                  const std::vector<size_t> &indices, std::mt19937 &rng,
                  Real reg, Real nu)
       : x_(x), y_(y), K(K), indices_(indices), reg(reg), nu(nu), rng(rng),
-        zmins(K), zmaxs(K), histogram(K), accept_count(0) {
+        zmins(K), zmaxs(K), histogram(K), indices_by_label_(K),
+        accept_count(0) {
     this->alpha_now = DenseVector::Zero(K - 1);
     this->gamma_now = DenseVector::Zero(K - 1);
     this->alpha_to_gamma(gamma_now, alpha_now);
@@ -45,6 +48,7 @@ template <typename Real> struct OprobitSampler {
         throw std::invalid_argument(ss.str());
       }
       histogram[y_label]++;
+      indices_by_label_[y_label].push_back(i);
     }
   }
 
@@ -406,6 +410,67 @@ template <typename Real> struct OprobitSampler {
     }
   }
 
+  /*
+  The log-likelihood of the cutpoints gamma, adding its gradient w.r.t. gamma
+  to dgamma and, if given, its Hessian to HessianTarget (which is zeroed
+  first). These are the terms of safe_lcdf, safe_lccdf and safe_ldiff summed
+  over the rows, evaluated a label at a time by the kernels of special.hpp.
+  */
+  inline Real add_likelihood_terms(const DenseVector &gamma,
+                                   DenseVector &dgamma,
+                                   DenseMatrix *HessianTarget) const {
+    Real ll = 0;
+    if (HessianTarget != nullptr) {
+      (*HessianTarget).array() = 0;
+    }
+    Array upper, lower, log_p, ratio_upper, ratio_lower;
+    for (int label = 0; label < K; label++) {
+      const std::vector<size_t> &indices = indices_by_label_[label];
+      if (indices.empty()) {
+        continue;
+      }
+      const size_t n = indices.size();
+      if (label == 0 || label == (K - 1)) {
+        // log Phi(upper), with upper = -(gamma(K - 2) - x) for the last one.
+        const int cut = (label == 0) ? 0 : K - 2;
+        const Real sign = (label == 0) ? 1 : -1;
+        upper.resize(n);
+        for (size_t k = 0; k < n; k++) {
+          upper(k) = sign * (gamma(cut) - x_(indices[k]));
+        }
+        special::log_normal_cdf(upper, log_p, ratio_upper);
+        ll += log_p.sum();
+        dgamma(cut) += sign * ratio_upper.sum();
+        if (HessianTarget != nullptr) {
+          (*HessianTarget)(cut, cut) -=
+              (upper * ratio_upper + ratio_upper.square()).sum();
+        }
+        continue;
+      }
+      upper.resize(n);
+      lower.resize(n);
+      for (size_t k = 0; k < n; k++) {
+        upper(k) = gamma(label) - x_(indices[k]);
+        lower(k) = gamma(label - 1) - x_(indices[k]);
+      }
+      special::log_normal_cdf_diff(upper, lower, log_p, ratio_upper,
+                                   ratio_lower);
+      ll += log_p.sum();
+      dgamma(label) += ratio_upper.sum();
+      dgamma(label - 1) -= ratio_lower.sum();
+      if (HessianTarget != nullptr) {
+        (*HessianTarget)(label, label) -=
+            (upper * ratio_upper + ratio_upper.square()).sum();
+        (*HessianTarget)(label - 1, label - 1) +=
+            (lower * ratio_lower - ratio_lower.square()).sum();
+        Real off_diag = (ratio_upper * ratio_lower).sum();
+        (*HessianTarget)(label, label - 1) += off_diag;
+        (*HessianTarget)(label - 1, label) += off_diag;
+      }
+    }
+    return ll;
+  }
+
   inline Real operator()(const DenseVector &alpha, DenseVector &dalpha,
                          DenseMatrix *HessianTarget = nullptr) {
     DenseVector gamma = DenseVector::Zero(alpha.rows());
@@ -414,23 +479,7 @@ template <typename Real> struct OprobitSampler {
 
     DenseMatrix dGammadAlpha = DenseMatrix(alpha.rows(), alpha.rows());
     jacobian_dgamma_dalpha(dGammadAlpha, alpha);
-    Real ll = 0;
-    if (HessianTarget != nullptr) {
-
-      (*HessianTarget).array() = 0;
-    }
-    for (auto i : indices_) {
-      int label = y_(i);
-      if (label == 0) {
-        safe_lcdf(gamma(0) - x_(i), ll, dalpha(0), HessianTarget, label);
-      } else if (label == (K - 1)) {
-        safe_lccdf(gamma(K - 2) - x_(i), ll, dalpha(K - 2), HessianTarget,
-                   label);
-      } else {
-        safe_ldiff(gamma(label) - x_(i), gamma(label - 1) - x_(i), ll,
-                   dalpha(label), dalpha(label - 1), HessianTarget, label);
-      }
-    }
+    Real ll = add_likelihood_terms(gamma, dalpha, HessianTarget);
 
     if (HessianTarget != nullptr) {
       DenseMatrix &H = (*HessianTarget);
@@ -524,6 +573,7 @@ template <typename Real> struct OprobitSampler {
   static constexpr bool fix_gamma0 = false;
   DenseVector zmins, zmaxs;
   std::vector<size_t> histogram;
+  std::vector<std::vector<size_t>> indices_by_label_;
   size_t accept_count;
 };
 
@@ -0,0 +1,202 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "predictor.hpp"
+#include "util.hpp"
+
+namespace myFM {
+using namespace std;
+
+/*
+The result of a batch submitted to an AsyncPredictor. Besides waiting on it,
+callers can register callbacks that run when it completes (on the worker
+that scored it, or at once if it already has), which is how an event loop
+is woken without blocking a thread on get().
+*/
+template <typename Vector> class PredictionFuture {
+public:
+  inline bool done() const {
+    std::lock_guard<std::mutex> lock{mtx_};
+    return done_;
+  }
+
+  /* Waits up to `seconds` (forever if negative); returns done(). */
+  inline bool wait(double seconds = -1) const {
+    std::unique_lock<std::mutex> lock{mtx_};
+    if (seconds < 0) {
+      cv_.wait(lock, [this] { return done_; });
+      return true;
+    }
+    return cv_.wait_for(lock, std::chrono::duration<double>(seconds),
+                        [this] { return done_; });
+  }
+
+  /* Waits, then returns the scores or rethrows what scoring threw. */
+  inline Vector get() const {
+    wait();
+    if (error_) {
+      std::rethrow_exception(error_);
+    }
+    return value_;
+  }
+
+  inline void add_done_callback(std::function<void()> callback) {
+    {
+      std::lock_guard<std::mutex> lock{mtx_};
+      if (!done_) {
+        callbacks_.push_back(std::move(callback));
+        return;
+      }
+    }
+    callback();
+  }
+
+  inline void set(Vector &&value, std::exception_ptr error) {
+    vector<std::function<void()>> callbacks;
+    {
+      std::lock_guard<std::mutex> lock{mtx_};
+      value_ = std::move(value);
+      error_ = error;
+      done_ = true;
+      callbacks.swap(callbacks_);
+    }
+    cv_.notify_all();
+    for (auto &callback : callbacks) {
+      callback();
+    }
+  }
+
+private:
+  mutable std::mutex mtx_;
+  mutable std::condition_variable cv_;
+  bool done_ = false;
+  Vector value_;
+  std::exception_ptr error_;
+  vector<std::function<void()>> callbacks_;
+};
+
+/*
+Scores batches on a fixed pool of workers, each batch by a single worker
+with Predictor::predict, so that several batches are in flight while the
+caller prepares the next ones. At most `max_pending` batches wait for a
+worker: submit blocks beyond that, which bounds the memory held by queued
+batches. The predictor must outlive the pool.
+*/
+template <typename Real, class FMType = FM<Real>> class AsyncPredictor {
+public:
+  typedef Predictor<Real, FMType> PredictorType;
+  typedef typename PredictorType::SparseMatrix SparseMatrix;
+  typedef typename PredictorType::Vector Vector;
+  typedef typename PredictorType::RelationBlock RelationBlock;
+  typedef PredictionFuture<Vector> Future;
+
+  inline AsyncPredictor(const PredictorType &predictor, size_t n_workers,
+                        size_t max_pending)
+      : predictor_(predictor), max_pending_(max_pending) {
+    if (n_workers == 0 || max_pending == 0) {
+      throw std::invalid_argument(
+          "n_workers and max_pending must be positive.");
+    }
+    for (size_t i = 0; i < n_workers; i++) {
+      workers_.emplace_back([this] { work(); });
+    }
+  }
+
+  AsyncPredictor(const AsyncPredictor &) = delete;
+  AsyncPredictor &operator=(const AsyncPredictor &) = delete;
+
+  /* Scores what has been submitted, then stops the workers. */
+  inline ~AsyncPredictor() {
+    {
+      std::lock_guard<std::mutex> lock{mtx_};
+      stopping_ = true;
+    }
+    queue_changed_.notify_all();
+    for (auto &worker : workers_) {
+      worker.join();
+    }
+  }
+
+  /*
+  Queues a batch, waiting while max_pending batches already do. Input
+  errors are raised here rather than through the future.
+  */
+  inline std::shared_ptr<Future> submit(SparseMatrix X,
+                                        vector<RelationBlock> relations) {
+    predictor_.check_input(X, relations);
+    std::shared_ptr<Future> future = std::make_shared<Future>();
+    {
+      std::unique_lock<std::mutex> lock{mtx_};
+      queue_changed_.wait(
+          lock, [this] { return queue_.size() < max_pending_ || stopping_; });
+      if (stopping_) {
+        throw std::runtime_error("Submitted to a stopped AsyncPredictor.");
+      }
+      queue_.emplace_back(new Task{std::move(X), std::move(relations), future});
+    }
+    queue_changed_.notify_all();
+    return future;
+  }
+
+  /* Batches waiting for a worker. */
+  inline size_t pending() const {
+    std::lock_guard<std::mutex> lock{mtx_};
+    return queue_.size();
+  }
+
+  inline size_t n_workers() const { return workers_.size(); }
+
+private:
+  struct Task {
+    SparseMatrix X;
+    vector<RelationBlock> relations;
+    std::shared_ptr<Future> future;
+  };
+
+  inline void work() {
+    while (true) {
+      std::unique_ptr<Task> task;
+      {
+        std::unique_lock<std::mutex> lock{mtx_};
+        queue_changed_.wait(lock,
+                            [this] { return !queue_.empty() || stopping_; });
+        if (queue_.empty()) {
+          return;
+        }
+        task = std::move(queue_.front());
+        queue_.pop_front();
+      }
+      // a slot is free for a blocked submit.
+      queue_changed_.notify_all();
+      Vector result;
+      std::exception_ptr error;
+      try {
+        result = predictor_.predict(task->X, task->relations);
+      } catch (...) {
+        error = std::current_exception();
+      }
+      task->future->set(std::move(result), error);
+    }
+  }
+
+  const PredictorType &predictor_;
+  const size_t max_pending_;
+  mutable std::mutex mtx_;
+  std::condition_variable queue_changed_;
+  std::deque<std::unique_ptr<Task>> queue_;
+  bool stopping_ = false;
+  vector<std::thread> workers_;
+};
+
+} // namespace myFM
@@ -0,0 +1,211 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <fstream>
+#include <ios>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "util.hpp"
+
+namespace myFM {
+
+/*
+Picks among kernels that compute the same thing by timing them. The first
+time a kernel is needed for a shape class (see shape_key), every candidate
+is warmed up and then timed a few times on the actual input, and the one
+with the fastest run is remembered for the class; later calls of that class
+use it without measuring. One thread measures at a time. Choices can be kept in
+a cache file, one "key choice" line each, so that they survive the process.
+
+Tuning is off by default: the candidates agree only up to rounding, and
+which one wins depends on the machine, so results would otherwise change
+with the timings.
+*/
+namespace autotune {
+
+/* floor(log2(x)), 0 for x < 2. */
+inline int log2_bucket(double x) {
+  return x < 2 ? 0 : static_cast<int>(std::floor(std::log2(x)));
+}
+
+/*
+What the relative speed of scoring kernels depends on: the precision, the
+rank, the number of rows and stored entries per row (in powers of two) and,
+per relation block, whether it is dense, its rows and its entries per row.
+*/
+template <typename SparseMatrix, typename RelationBlock>
+inline string shape_key(const char *what, const SparseMatrix &X,
+                        const vector<RelationBlock> &relations,
+                        size_t rank) {
+  std::ostringstream key;
+  key << what << "/f" << 8 * sizeof(typename SparseMatrix::Scalar) << "/rank"
+      << rank << "/rows" << log2_bucket(X.rows()) << "/nnz"
+      << log2_bucket(static_cast<double>(X.nonZeros()) /
+                     std::max<Eigen::Index>(X.rows(), 1));
+  for (const auto &relation : relations) {
+    const double per_row =
+        relation.is_dense
+            ? relation.feature_size
+            : static_cast<double>(relation.X.nonZeros()) /
+                  std::max<size_t>(relation.block_size, 1);
+    key << "/" << (relation.is_dense ? "dense" : "sparse")
+        << log2_bucket(relation.block_size) << "x" << log2_bucket(per_row);
+  }
+  return key.str();
+}
+
+class Autotuner {
+public:
+  inline static Autotuner &instance() {
+    static Autotuner tuner;
+    return tuner;
+  }
+
+  inline void set_enabled(bool enabled) {
+    enabled_.store(enabled, std::memory_order_release);
+  }
+
+  inline bool enabled() const {
+    return enabled_.load(std::memory_order_relaxed);
+  }
+
+  /*
+  Reads the choices kept in `path`, if it exists, and appends the ones made
+  from now on to it. An empty path stops persisting.
+  */
+  inline void set_cache_file(const string &path) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    cache_file_ = path;
+    if (path.empty()) {
+      return;
+    }
+    std::ifstream ifs(path);
+    string line;
+    while (std::getline(ifs, line)) {
+      std::istringstream fields(line);
+      string key, choice;
+      if (!(fields >> key >> choice)) {
+        continue;
+      }
+      choices_[key] = choice;
+    }
+  }
+
+  /* The choice made for `key`, if any. */
+  inline bool lookup(const string &key, string &choice) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto found = choices_.find(key);
+    if (found == choices_.end()) {
+      return false;
+    }
+    choice = found->second;
+    return true;
+  }
+
+  inline void record(const string &key, const string &choice) {
+    if (key.find_first_of(" \t\n") != string::npos ||
+        choice.find_first_of(" \t\n") != string::npos) {
+      throw std::invalid_argument("autotune keys and choices are single "
+                                  "words.");
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    choices_[key] = choice;
+    if (cache_file_.empty()) {
+      return;
+    }
+    std::ofstream ofs(cache_file_, std::ios::app);
+    if (!ofs) {
+      throw std::ios_base::failure(StringBuilder{}("Could not open ")(
+                                       cache_file_)(" for writing.")
+                                       .build());
+    }
+    ofs << key << " " << choice << "\n";
+  }
+
+  /*
+  Runs each candidate once to warm up, then times TIMED_RUNS rounds of
+  run(candidate) over the candidates in turn, records the candidate of the
+  fastest run for `key` and returns it. The last run is of that candidate,
+  so its output is the one that stands.
+
+  While another thread is measuring, nothing is timed: the first candidate,
+  which should be the default, runs once and is returned unrecorded. This
+  also covers candidates that score in threads of their own.
+  */
+  template <typename Run>
+  inline string measure(const string &key, const vector<string> &candidates,
+                        Run &&run) {
+    if (candidates.empty()) {
+      throw std::invalid_argument("No candidate to measure.");
+    }
+    std::unique_lock<std::mutex> tuning(tuning_mutex_, std::try_to_lock);
+    string best;
+    if (!tuning.owns_lock()) {
+      run(candidates.front());
+      return candidates.front();
+    }
+    if (lookup(key, best)) {
+      // measured by another thread meanwhile.
+      run(best);
+      return best;
+    }
+    for (const string &candidate : candidates) {
+      run(candidate);
+    }
+    double best_seconds = 0;
+    for (int round = 0; round < TIMED_RUNS; round++) {
+      for (const string &candidate : candidates) {
+        const auto begin = std::chrono::steady_clock::now();
+        run(candidate);
+        const double seconds = std::chrono::duration<double>(
+                                   std::chrono::steady_clock::now() - begin)
+                                   .count();
+        if (best.empty() || seconds < best_seconds) {
+          best = candidate;
+          best_seconds = seconds;
+        }
+      }
+    }
+    if (best != candidates.back()) {
+      run(best);
+    }
+    record(key, best);
+    return best;
+  }
+
+  // the timed runs of each candidate per measurement.
+  static constexpr int TIMED_RUNS = 3;
+
+  /* All the choices made or loaded so far. */
+  inline std::map<string, string> choices() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return choices_;
+  }
+
+  /* Forgets the choices, leaving the cache file as it is. */
+  inline void clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    choices_.clear();
+  }
+
+private:
+  Autotuner() = default;
+
+  std::atomic<bool> enabled_{false};
+  mutable std::mutex mutex_;
+  // held while measuring, apart from mutex_ so that lookups go on.
+  std::mutex tuning_mutex_;
+  std::map<string, string> choices_;
+  string cache_file_;
+};
+
+} // namespace autotune
+} // namespace myFM
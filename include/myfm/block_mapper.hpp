@@ -0,0 +1,299 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace myFM {
+namespace relational {
+
+using namespace std;
+
+/*
+Compact storage of the case -> block row mapping of a relation block.
+
+The mapping is kept either as one 32-bit (or, for blocks with more than
+2^32 rows, 64-bit) index per case, or as runs of consecutive cases sharing a
+block row. The latter is chosen automatically when it is smaller, which is
+the case when the training cases are grouped by block row, and lets the
+sweeps replace scatter/gather over cases by contiguous segment sums. The
+identity mapping (one block row per case, e.g. dense per-case features) is
+recognised and stored in constant space.
+
+Sequential access goes through for_each_run / for_each, which dispatch on
+the encoding once per pass rather than once per case.
+*/
+class BlockMapper {
+public:
+  enum class Encoding { INDEX32, INDEX64, RUN_LENGTH, IDENTITY };
+
+  inline BlockMapper() : BlockMapper(vector<size_t>{}) {}
+
+  template <typename Index>
+  inline BlockMapper(const vector<Index> &indices)
+      : BlockMapper(indices.data(), indices.size()) {}
+
+  template <typename Index>
+  inline BlockMapper(const Index *indices, size_t size)
+      : size_(size), block_size_(0), encoding_(Encoding::INDEX32) {
+    build([indices, size](const RunCallback &f) {
+      for (size_t i = 0; i < size; i++) {
+        f(i, i + 1, static_cast<size_t>(indices[i]));
+      }
+    });
+  }
+
+  inline static BlockMapper identity(size_t size) {
+    BlockMapper result;
+    result.size_ = size;
+    result.block_size_ = size;
+    result.encoding_ = Encoding::IDENTITY;
+    return result;
+  }
+
+  /* Number of training cases. */
+  inline size_t size() const { return size_; }
+
+  /* One past the largest block row referenced. */
+  inline size_t block_size() const { return block_size_; }
+
+  inline Encoding encoding() const { return encoding_; }
+
+  inline string encoding_name() const {
+    switch (encoding_) {
+    case Encoding::INDEX32:
+      return "index32";
+    case Encoding::INDEX64:
+      return "index64";
+    case Encoding::IDENTITY:
+      return "identity";
+    default:
+      return "run_length";
+    }
+  }
+
+  inline size_t n_runs() const {
+    return encoding_ == Encoding::RUN_LENGTH ? run_ends_.size() : size_;
+  }
+
+  /* Random access; logarithmic in the number of runs if run-length encoded. */
+  inline size_t operator[](size_t case_index) const {
+    switch (encoding_) {
+    case Encoding::INDEX32:
+      return index32_[case_index];
+    case Encoding::INDEX64:
+      return index64_[case_index];
+    case Encoding::IDENTITY:
+      return case_index;
+    default: {
+      auto run = std::upper_bound(run_ends_.begin(), run_ends_.end(),
+                                  case_index) -
+                 run_ends_.begin();
+      return run_blocks_[run];
+    }
+    }
+  }
+
+  /*
+  Random access for callers that visit the cases in increasing order but
+  cannot be written as a for_each_run pass (e.g. when walking several
+  mappers side by side); constant amortized time for every encoding.
+  */
+  class Cursor {
+  public:
+    inline explicit Cursor(const BlockMapper &mapper)
+        : mapper_(mapper), run_(0) {}
+
+    inline size_t operator[](size_t case_index) {
+      if (mapper_.encoding_ != Encoding::RUN_LENGTH) {
+        return mapper_[case_index];
+      }
+      while (mapper_.run_ends_[run_] <= case_index) {
+        run_++;
+      }
+      return mapper_.run_blocks_[run_];
+    }
+
+  private:
+    const BlockMapper &mapper_;
+    size_t run_;
+  };
+
+  inline Cursor cursor() const { return Cursor(*this); }
+
+  /* Calls f(begin, end, block_index) for consecutive cases [begin, end). */
+  template <typename F> inline void for_each_run(F &&f) const {
+    switch (encoding_) {
+    case Encoding::INDEX32:
+      for (size_t i = 0; i < size_; i++) {
+        f(i, i + 1, static_cast<size_t>(index32_[i]));
+      }
+      break;
+    case Encoding::INDEX64:
+      for (size_t i = 0; i < size_; i++) {
+        f(i, i + 1, index64_[i]);
+      }
+      break;
+    case Encoding::IDENTITY:
+      for (size_t i = 0; i < size_; i++) {
+        f(i, i + 1, i);
+      }
+      break;
+    default: {
+      size_t begin = 0;
+      for (size_t run = 0; run < run_ends_.size(); run++) {
+        f(begin, run_ends_[run], run_blocks_[run]);
+        begin = run_ends_[run];
+      }
+    }
+    }
+  }
+
+  /* Calls f(case_index, block_index) for every case in order. */
+  template <typename F> inline void for_each(F &&f) const {
+    for_each_run([&f](size_t begin, size_t end, size_t block_index) {
+      for (size_t i = begin; i < end; i++) {
+        f(i, block_index);
+      }
+    });
+  }
+
+  /*
+  Maps each case through `inner`, which maps this mapping's block rows to
+  rows of another block.
+  */
+  inline BlockMapper compose(const BlockMapper &inner) const {
+    if (block_size_ > inner.size()) {
+      throw runtime_error(
+          "inner mapping is shorter than the outer mapping's block size.");
+    }
+    BlockMapper result;
+    result.size_ = size_;
+    result.build([this, &inner](const RunCallback &f) {
+      for_each_run([&f, &inner](size_t begin, size_t end, size_t block) {
+        f(begin, end, inner[block]);
+      });
+    });
+    return result;
+  }
+
+  /*
+  The mapping once the first `n_evict` cases are dropped and the cases of
+  `appended` are added after the remaining ones.
+  */
+  inline BlockMapper slide(size_t n_evict, const BlockMapper &appended) const {
+    if (n_evict > size_) {
+      throw runtime_error("cannot evict more cases than the mapping has.");
+    }
+    BlockMapper result;
+    result.size_ = size_ - n_evict + appended.size_;
+    result.build([this, n_evict, &appended](const RunCallback &f) {
+      for_each_run([&f, n_evict](size_t begin, size_t end, size_t block) {
+        if (end > n_evict) {
+          f(std::max(begin, n_evict) - n_evict, end - n_evict, block);
+        }
+      });
+      const size_t offset = size_ - n_evict;
+      appended.for_each_run(
+          [&f, offset](size_t begin, size_t end, size_t block) {
+            f(begin + offset, end + offset, block);
+          });
+    });
+    return result;
+  }
+
+  inline vector<size_t> to_vector() const {
+    vector<size_t> result(size_);
+    for_each_run([&result](size_t begin, size_t end, size_t block) {
+      std::fill(result.begin() + begin, result.begin() + end, block);
+    });
+    return result;
+  }
+
+  inline size_t bytes() const {
+    return sizeof(uint32_t) * index32_.capacity() +
+           sizeof(size_t) * (index64_.capacity() + run_ends_.capacity() +
+                             run_blocks_.capacity());
+  }
+
+private:
+  typedef std::function<void(size_t, size_t, size_t)> RunCallback;
+
+  /*
+  `for_each_input` feeds (begin, end, block_index) runs covering [0, size_)
+  to its argument, possibly splitting runs of equal block rows. It is called
+  twice: once to pick the encoding and once to fill it.
+  */
+  template <typename ForEachInput>
+  inline void build(const ForEachInput &for_each_input) {
+    size_t n_runs = 0, last_block = 0;
+    bool is_identity = true;
+    block_size_ = 0;
+    for_each_input([&](size_t begin, size_t end, size_t block) {
+      if (begin == end) {
+        return;
+      }
+      is_identity = is_identity && (end == begin + 1) && (block == begin);
+      if (n_runs == 0 || block != last_block) {
+        n_runs++;
+      }
+      last_block = block;
+      block_size_ = std::max(block_size_, block + 1);
+    });
+    const size_t max_32 = std::numeric_limits<uint32_t>::max();
+    const bool fits_32 = block_size_ <= max_32;
+    const size_t index_bytes = size_ * (fits_32 ? 4 : 8);
+    index32_.clear();
+    index64_.clear();
+    run_ends_.clear();
+    run_blocks_.clear();
+    if (is_identity && size_ > 0) {
+      encoding_ = Encoding::IDENTITY;
+    } else if (n_runs * 2 * sizeof(size_t) < index_bytes) {
+      encoding_ = Encoding::RUN_LENGTH;
+      run_ends_.reserve(n_runs);
+      run_blocks_.reserve(n_runs);
+      for_each_input([this](size_t begin, size_t end, size_t block) {
+        if (begin == end) {
+          return;
+        }
+        if (run_blocks_.empty() || block != run_blocks_.back()) {
+          run_blocks_.push_back(block);
+          run_ends_.push_back(end);
+        } else {
+          run_ends_.back() = end;
+        }
+      });
+    } else if (fits_32) {
+      encoding_ = Encoding::INDEX32;
+      index32_.resize(size_);
+      for_each_input([this](size_t begin, size_t end, size_t block) {
+        std::fill(index32_.begin() + begin, index32_.begin() + end,
+                  static_cast<uint32_t>(block));
+      });
+    } else {
+      encoding_ = Encoding::INDEX64;
+      index64_.resize(size_);
+      for_each_input([this](size_t begin, size_t end, size_t block) {
+        std::fill(index64_.begin() + begin, index64_.begin() + end, block);
+      });
+    }
+  }
+
+  size_t size_;
+  size_t block_size_;
+  Encoding encoding_;
+  vector<uint32_t> index32_;
+  vector<size_t> index64_;
+  // run r covers cases [run_ends_[r - 1], run_ends_[r]).
+  vector<size_t> run_ends_;
+  vector<size_t> run_blocks_;
+};
+
+} // namespace relational
+} // namespace myFM
@@ -0,0 +1,123 @@
+/*
+ * C interface to the myFM scoring kernels.
+ *
+ * The functions declared here only use C types, so that services written in
+ * any language can load a trained predictor and score CSR batches without a
+ * python interpreter. Every function returning int reports one of the
+ * myfm_status codes; on failure, myfm_last_error() describes the cause.
+ * Handles are not thread-safe for concurrent modification, but concurrent
+ * calls to myfm_predictor_predict_csr on the same predictor are allowed.
+ */
+#ifndef MYFM_C_API_H
+#define MYFM_C_API_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32)
+#if defined(MYFM_BUILDING_LIBRARY)
+#define MYFM_API __declspec(dllexport)
+#elif defined(MYFM_STATIC)
+#define MYFM_API
+#else
+#define MYFM_API __declspec(dllimport)
+#endif
+#else
+#define MYFM_API __attribute__((visibility("default")))
+#endif
+
+#define MYFM_ABI_VERSION 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct myfm_predictor myfm_predictor;
+typedef struct myfm_relation_block myfm_relation_block;
+
+typedef enum myfm_status {
+  MYFM_OK = 0,
+  MYFM_ERROR_INVALID_ARGUMENT = 1,
+  MYFM_ERROR_RUNTIME = 2,
+  MYFM_ERROR_IO = 3,
+  MYFM_ERROR_UNKNOWN = 4
+} myfm_status;
+
+/*
+ * MYFM_TASK_ORDERED is reserved: myfm_predictor_create and
+ * myfm_predictor_load reject ordered probit predictors with
+ * MYFM_ERROR_INVALID_ARGUMENT, as myfm_predictor_predict_csr has no output
+ * for their per-class probabilities.
+ */
+typedef enum myfm_task_type {
+  MYFM_TASK_REGRESSION = 0,
+  MYFM_TASK_CLASSIFICATION = 1,
+  MYFM_TASK_ORDERED = 2
+} myfm_task_type;
+
+/* Returns MYFM_ABI_VERSION of the loaded library. */
+MYFM_API int myfm_abi_version(void);
+
+/* Message of the last failed call on this thread. Never NULL. */
+MYFM_API const char *myfm_last_error(void);
+
+/*
+ * Creates an empty predictor. Samples are added with
+ * myfm_predictor_add_sample.
+ */
+MYFM_API int myfm_predictor_create(size_t rank, size_t feature_size,
+                                   int task_type, myfm_predictor **out);
+
+/*
+ * Appends a posterior sample. `w` has `feature_size` entries and `V` has
+ * `feature_size * rank` entries in column-major order.
+ */
+MYFM_API int myfm_predictor_add_sample(myfm_predictor *predictor, double w0,
+                                       const double *w, const double *V);
+
+/* Loads a predictor written by myfm_predictor_save or Predictor.save. */
+MYFM_API int myfm_predictor_load(const char *path, myfm_predictor **out);
+
+MYFM_API int myfm_predictor_save(const myfm_predictor *predictor,
+                                 const char *path);
+
+MYFM_API int myfm_predictor_info(const myfm_predictor *predictor,
+                                 size_t *rank, size_t *feature_size,
+                                 size_t *n_samples, int *task_type);
+
+MYFM_API void myfm_predictor_free(myfm_predictor *predictor);
+
+/*
+ * Creates a relation block. `original_to_block` has `mapper_size` entries
+ * pointing to the rows of the (n_rows x n_cols) CSR matrix given by
+ * (indptr, indices, data).
+ */
+MYFM_API int myfm_relation_block_create(const uint64_t *original_to_block,
+                                        size_t mapper_size, size_t n_rows,
+                                        size_t n_cols, const int32_t *indptr,
+                                        const int32_t *indices,
+                                        const double *data,
+                                        myfm_relation_block **out);
+
+MYFM_API void myfm_relation_block_free(myfm_relation_block *block);
+
+/*
+ * Computes the posterior predictive mean for an (n_rows x n_cols) CSR batch
+ * together with `n_relations` relation blocks, writing n_rows values to
+ * `out`. For classification the output is the probability of the positive
+ * class. The rows are split among n_workers threads. X and the blocks are
+ * read in place, not copied; malformed CSR input (indptr not starting at 0
+ * or decreasing, column indices out of range) is rejected with
+ * MYFM_ERROR_INVALID_ARGUMENT.
+ */
+MYFM_API int myfm_predictor_predict_csr(
+    const myfm_predictor *predictor, size_t n_rows, size_t n_cols,
+    const int32_t *indptr, const int32_t *indices, const double *data,
+    const myfm_relation_block *const *relations, size_t n_relations,
+    size_t n_workers, double *out);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* MYFM_C_API_H */
@@ -0,0 +1,165 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+#include "definitions.hpp"
+#include "util.hpp"
+
+namespace myFM {
+using namespace std;
+
+template <typename Real> struct CollapsedRows {
+  typedef types::SparseMatrix<Real> SparseMatrix;
+  typedef types::Vector<Real> Vector;
+
+  SparseMatrix X;
+  vector<relational::RelationBlock<Real>> relations;
+  // (weighted) mean target of each collapsed row.
+  Vector y;
+  // (weighted) number of original rows in each collapsed row.
+  vector<Real> sample_weight;
+  // sum of the squared deviations of the targets from their row's mean.
+  Real within_sum_of_squares;
+  vector<size_t> original_to_collapsed;
+};
+
+/*
+Merges the training cases that have identical features, i.e. the same row of
+X and the same row of every relation block, into one row weighted by their
+number (or total sample_weight). The Gaussian likelihood of the duplicates
+only depends on the weight, the mean of their targets and
+within_sum_of_squares, so training on the collapsed rows with
+FMLearningConfig::sample_weight and ::collapsed_sum_of_squares set
+accordingly gives the same posterior.
+
+With split_by_label (binary classification) only cases of the same label are
+merged, and y keeps the label. The first occurrence of each row decides its
+position, so that cases grouped by relation block row stay grouped.
+*/
+template <typename Real>
+inline CollapsedRows<Real> collapse_duplicate_rows(
+    const types::SparseMatrix<Real> &X_original,
+    const vector<relational::RelationBlock<Real>> &relations,
+    const types::Vector<Real> &y, bool split_by_label,
+    const vector<Real> &sample_weight = {}) {
+  typedef types::SparseMatrix<Real> SparseMatrix;
+  typedef typename SparseMatrix::InnerIterator itertype;
+  check_row_consistency_return_column(X_original, relations);
+  const size_t n_rows = X_original.rows();
+  if (static_cast<size_t>(y.rows()) != n_rows) {
+    throw invalid_argument(StringBuilder{}
+                               .add("Shape mismatch: X has size")
+                               .space_and_add(n_rows)
+                               .space_and_add("and y has size")
+                               .space_and_add(y.rows())
+                               .build());
+  }
+  if (!sample_weight.empty() && sample_weight.size() != n_rows) {
+    throw invalid_argument("sample_weight must have one entry per row.");
+  }
+  SparseMatrix X(X_original);
+  X.makeCompressed();
+
+  vector<vector<size_t>> block_index;
+  for (const auto &rel : relations) {
+    block_index.emplace_back(rel.original_to_block.to_vector());
+  }
+  auto label_of = [&y, split_by_label](size_t row) {
+    return split_by_label && y(row) > 0;
+  };
+  auto row_hash = [&](size_t row) {
+    size_t h = std::hash<bool>()(label_of(row));
+    auto combine = [&h](size_t v) {
+      h ^= v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+    };
+    for (itertype it(X, row); it; ++it) {
+      combine(static_cast<size_t>(it.col()));
+      combine(std::hash<Real>()(it.value()));
+    }
+    for (const auto &indices : block_index) {
+      combine(indices[row]);
+    }
+    return h;
+  };
+  auto same_row = [&](size_t a, size_t b) {
+    if (label_of(a) != label_of(b)) {
+      return false;
+    }
+    for (const auto &indices : block_index) {
+      if (indices[a] != indices[b]) {
+        return false;
+      }
+    }
+    itertype it_a(X, a), it_b(X, b);
+    for (; it_a && it_b; ++it_a, ++it_b) {
+      if (it_a.col() != it_b.col() || it_a.value() != it_b.value()) {
+        return false;
+      }
+    }
+    return !it_a && !it_b;
+  };
+
+  CollapsedRows<Real> result;
+  result.original_to_collapsed.resize(n_rows);
+  result.within_sum_of_squares = 0;
+  vector<size_t> representative;
+  vector<Real> mean;
+  unordered_multimap<size_t, size_t> hash_to_collapsed;
+  for (size_t row = 0; row < n_rows; row++) {
+    const Real weight = sample_weight.empty() ? 1 : sample_weight[row];
+    const size_t h = row_hash(row);
+    size_t collapsed = representative.size();
+    auto range = hash_to_collapsed.equal_range(h);
+    for (auto it = range.first; it != range.second; ++it) {
+      if (same_row(representative[it->second], row)) {
+        collapsed = it->second;
+        break;
+      }
+    }
+    if (collapsed == representative.size()) {
+      hash_to_collapsed.emplace(h, collapsed);
+      representative.push_back(row);
+      mean.push_back(y(row));
+      result.sample_weight.push_back(weight);
+    } else if (weight > 0) {
+      // weighted incremental update of the mean and the sum of squares.
+      Real &total = result.sample_weight[collapsed];
+      total += weight;
+      const Real delta = y(row) - mean[collapsed];
+      mean[collapsed] += delta * weight / total;
+      result.within_sum_of_squares +=
+          weight * delta * (y(row) - mean[collapsed]);
+    }
+    result.original_to_collapsed[row] = collapsed;
+  }
+
+  const size_t n_collapsed = representative.size();
+  result.X = SparseMatrix(n_collapsed, X.cols());
+  result.y = types::Vector<Real>(n_collapsed);
+  vector<Eigen::Triplet<Real>> triplets;
+  for (size_t collapsed = 0; collapsed < n_collapsed; collapsed++) {
+    for (itertype it(X, representative[collapsed]); it; ++it) {
+      triplets.emplace_back(collapsed, it.col(), it.value());
+    }
+    result.y(collapsed) = mean[collapsed];
+  }
+  result.X.setFromTriplets(triplets.begin(), triplets.end());
+  result.X.makeCompressed();
+  for (size_t relation_index = 0; relation_index < relations.size();
+       relation_index++) {
+    vector<size_t> mapper(n_collapsed);
+    for (size_t collapsed = 0; collapsed < n_collapsed; collapsed++) {
+      mapper[collapsed] =
+          block_index[relation_index][representative[collapsed]];
+    }
+    result.relations.emplace_back(
+        relations[relation_index].with_original_to_block(mapper));
+  }
+  return result;
+}
+
+} // namespace myFM
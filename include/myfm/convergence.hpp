@@ -0,0 +1,224 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <vector>
+
+#include "HyperParams.hpp"
+#include "definitions.hpp"
+
+namespace myFM {
+namespace convergence {
+
+template <typename Real> inline Real mean_of(const Real *x, size_t n) {
+  Real result = 0;
+  for (size_t i = 0; i < n; i++) {
+    result += x[i];
+  }
+  return result / n;
+}
+
+template <typename Real> inline Real variance_of(const Real *x, size_t n) {
+  if (n < 2) {
+    return 0;
+  }
+  Real mean = mean_of(x, n);
+  Real result = 0;
+  for (size_t i = 0; i < n; i++) {
+    result += (x[i] - mean) * (x[i] - mean);
+  }
+  return result / (n - 1);
+}
+
+/*
+Integrated autocorrelation time, estimated with Geyer's initial positive
+sequence. Returns 1 for constant or very short chains.
+*/
+template <typename Real>
+inline Real autocorrelation_time(const Real *x, size_t n) {
+  if (n < 4) {
+    return 1;
+  }
+  Real mean = mean_of(x, n);
+  auto autocovariance = [x, n, mean](size_t lag) {
+    Real result = 0;
+    for (size_t i = 0; i + lag < n; i++) {
+      result += (x[i] - mean) * (x[i + lag] - mean);
+    }
+    return result / n;
+  };
+  Real c0 = autocovariance(0);
+  if (c0 <= 0) {
+    return 1;
+  }
+  Real tau = -1;
+  for (size_t lag = 0; lag + 1 < n; lag += 2) {
+    Real pair_sum = (autocovariance(lag) + autocovariance(lag + 1)) / c0;
+    if (pair_sum <= 0) {
+      break;
+    }
+    tau += 2 * pair_sum;
+  }
+  return std::max(tau, static_cast<Real>(1) / n);
+}
+
+template <typename Real>
+inline Real effective_sample_size(const Real *x, size_t n) {
+  return n / autocorrelation_time(x, n);
+}
+
+/*
+Geweke's z-score comparing the mean of the first `first` fraction of the
+chain with that of the last `last` fraction. The variances of the means are
+corrected for autocorrelation.
+*/
+template <typename Real>
+inline Real geweke_z(const Real *x, size_t n, Real first = 0.1,
+                     Real last = 0.5) {
+  size_t n_a = static_cast<size_t>(n * first);
+  size_t n_b = static_cast<size_t>(n * last);
+  if (n_a < 2 || n_b < 2) {
+    return std::numeric_limits<Real>::infinity();
+  }
+  const Real *b = x + (n - n_b);
+  Real var_a = variance_of(x, n_a) * autocorrelation_time(x, n_a) / n_a;
+  Real var_b = variance_of(b, n_b) * autocorrelation_time(b, n_b) / n_b;
+  Real diff = mean_of(x, n_a) - mean_of(b, n_b);
+  if (var_a + var_b <= 0) {
+    return (diff == 0) ? 0 : std::numeric_limits<Real>::infinity();
+  }
+  return diff / std::sqrt(var_a + var_b);
+}
+
+/*
+Potential scale reduction factor of a single chain split into two halves.
+Returns 1 for constant chains.
+*/
+template <typename Real> inline Real split_rhat(const Real *x, size_t n) {
+  size_t half = n / 2;
+  if (half < 2) {
+    return std::numeric_limits<Real>::infinity();
+  }
+  const Real *first = x + (n - 2 * half);
+  const Real *second = first + half;
+  Real mean_1 = mean_of(first, half), mean_2 = mean_of(second, half);
+  Real within = (variance_of(first, half) + variance_of(second, half)) / 2;
+  Real mean_all = (mean_1 + mean_2) / 2;
+  Real between = half * ((mean_1 - mean_all) * (mean_1 - mean_all) +
+                         (mean_2 - mean_all) * (mean_2 - mean_all));
+  if (within <= 0) {
+    return (between <= 0) ? 1 : std::numeric_limits<Real>::infinity();
+  }
+  Real pooled = (half - 1) * within / half + between / half;
+  return std::sqrt(pooled / within);
+}
+
+/*
+Records scalar summaries of the chain every iteration, and decides when the
+chain has burnt in and when enough effective samples have been collected
+after that.
+
+Burn-in is judged on alpha, the root mean square of the training residual
+(standing in for a prediction summary) and the per-group precisions
+lambda_w and lambda_V. The means mu_w and mu_V are left out as they are
+confounded with w0 and with the sign of V, and drift without affecting the
+predictions. Effective sample sizes are measured on alpha and the residual
+only, which is what the averaged prediction depends on, over the last
+`window` iterations after burn-in (all of them if `window` is 0), i.e. over
+the samples that are kept.
+*/
+template <typename Real> struct ConvergenceMonitor {
+  typedef typename FMHyperParameters<Real>::Vector Vector;
+
+  // alpha and the residual come first in `traces`.
+  static constexpr size_t N_PREDICTIVE_TRACES = 2;
+
+  inline ConvergenceMonitor(Real rhat_threshold, Real geweke_threshold,
+                            Real target_ess, size_t window = 0)
+      : rhat_threshold(rhat_threshold), geweke_threshold(geweke_threshold),
+        target_ess(target_ess), window(window), burn_in(-1), traces() {}
+
+  inline void record(const FMHyperParameters<Real> &hyper,
+                     const Vector &residual) {
+    const size_t n_groups = hyper.mu_w.rows();
+    if (traces.empty()) {
+      traces.resize(N_PREDICTIVE_TRACES + 2 * n_groups);
+    }
+    size_t index = 0;
+    traces[index++].push_back(hyper.alpha);
+    traces[index++].push_back(std::sqrt(
+        residual.squaredNorm() / std::max<size_t>(residual.rows(), 1)));
+    for (size_t g = 0; g < n_groups; g++) {
+      traces[index++].push_back(hyper.lambda_w(g));
+      traces[index++].push_back(hyper.lambda_V.row(g).mean());
+    }
+  }
+
+  inline size_t n_recorded() const {
+    return traces.empty() ? 0 : traces[0].size();
+  }
+
+  /*
+  The chain is considered burnt in once the most recent half of it passes
+  both the split-R-hat and the Geweke tests for every trace.
+  */
+  inline bool check_burn_in() {
+    const size_t n = n_recorded();
+    const size_t start = n / 2;
+    Real worst_rhat = 1;
+    for (const auto &trace : traces) {
+      const Real *x = trace.data() + start;
+      Real rhat = split_rhat(x, n - start);
+      Real z = geweke_z(x, n - start);
+      worst_rhat = std::max(worst_rhat, rhat);
+      if (!(rhat < rhat_threshold) || !(std::abs(z) < geweke_threshold)) {
+        max_split_rhat = worst_rhat;
+        return false;
+      }
+    }
+    max_split_rhat = worst_rhat;
+    burn_in = static_cast<int>(n);
+    return true;
+  }
+
+  /*
+  Smallest effective sample size of alpha and the residual over the kept
+  window after burn-in.
+  */
+  inline Real min_effective_sample_size() const {
+    if (burn_in < 0 || traces.empty()) {
+      return 0;
+    }
+    size_t n = n_recorded() - burn_in;
+    if (window > 0) {
+      n = std::min(n, window);
+    }
+    const size_t start = n_recorded() - n;
+    Real result = std::numeric_limits<Real>::infinity();
+    for (size_t i = 0; i < N_PREDICTIVE_TRACES; i++) {
+      result = std::min(result,
+                        effective_sample_size(traces[i].data() + start, n));
+    }
+    return result;
+  }
+
+  inline bool enough_samples() const {
+    return target_ess > 0 && min_effective_sample_size() >= target_ess;
+  }
+
+  const Real rhat_threshold;
+  const Real geweke_threshold;
+  const Real target_ess;
+  const size_t window;
+
+  // number of iterations discarded as burn-in; negative while burning in.
+  int burn_in;
+  Real max_split_rhat = std::numeric_limits<Real>::infinity();
+
+  vector<vector<Real>> traces;
+};
+
+} // namespace convergence
+} // namespace myFM
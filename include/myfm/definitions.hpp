@@ -4,11 +4,14 @@
 #include <memory>
 #include <random>
 #include <unsupported/Eigen/SpecialFunctions>
+#include <utility>
 #include <vector>
 
 #include <Eigen/Core>
 #include <Eigen/Sparse>
 
+#include "block_mapper.hpp"
+
 namespace myFM {
 
 using namespace std;
@@ -27,33 +30,194 @@ template <typename Real> using SparseVector = Eigen::SparseVector<Real>;
 
 namespace relational {
 
+/*
+A block of rows shared by many training cases: case i uses the features in
+row original_to_block[i] of X. The mapping is stored compactly (see
+BlockMapper); sort the cases by block row to get it run-length encoded.
+
+A block may itself have children, whose original_to_block maps the rows of
+this block to rows of the child (e.g. rating -> user -> region). A case then
+also uses the features of its descendants' rows, in depth-first order after
+the block's own features.
+
+The rows may instead be dense (e.g. pretrained embeddings), in which case
+they are kept column-major in X_dense and X is an empty matrix of the same
+shape. A dense block with the identity mapping (see dense_features) is a
+dense extension of the main table. Kernels should go through multiply,
+multiply_squared and for_each_in_row, or RelationWiseCache's column
+accessors, which dispatch on the storage.
+*/
 template <typename Real> struct RelationBlock {
   typedef Eigen::SparseMatrix<Real, Eigen::RowMajor> SparseMatrix;
+  typedef Eigen::Matrix<Real, -1, -1, Eigen::ColMajor> DenseMatrix;
   typedef Eigen::Matrix<Real, -1, 1> Vector;
 
-  inline RelationBlock(vector<size_t> original_to_block, const SparseMatrix &X)
-      : original_to_block(original_to_block),
-        mapper_size(original_to_block.size()), X(X), block_size(X.rows()),
-        feature_size(X.cols()) {
-    for (auto c : original_to_block) {
-      if (c >= block_size)
-        throw runtime_error("index mapping points to non-existing row.");
-    }
+  inline RelationBlock(BlockMapper original_to_block, const SparseMatrix &X)
+      : RelationBlock(std::move(original_to_block), X,
+                      vector<RelationBlock>{}) {}
+
+  inline RelationBlock(BlockMapper original_to_block, const SparseMatrix &X,
+                       vector<RelationBlock> children)
+      : RelationBlock(std::move(original_to_block), X, DenseMatrix(), false,
+                      std::move(children)) {}
+
+  inline RelationBlock(BlockMapper original_to_block,
+                       const DenseMatrix &X_dense)
+      : RelationBlock(std::move(original_to_block), X_dense,
+                      vector<RelationBlock>{}) {}
+
+  inline RelationBlock(BlockMapper original_to_block,
+                       const DenseMatrix &X_dense,
+                       vector<RelationBlock> children)
+      : RelationBlock(std::move(original_to_block),
+                      SparseMatrix(X_dense.rows(), X_dense.cols()), X_dense,
+                      true, std::move(children)) {}
+
+  /* Dense features for every case, i.e. with the identity mapping. */
+  inline static RelationBlock dense_features(const DenseMatrix &X_dense) {
+    return RelationBlock(BlockMapper::identity(X_dense.rows()), X_dense);
   }
 
   inline RelationBlock(const RelationBlock &other)
-      : RelationBlock(other.original_to_block, other.X) {}
+      : RelationBlock(other.original_to_block, other.X, other.X_dense,
+                      other.is_dense, other.children) {}
+
+  /* The same rows (and children) used by other cases. */
+  inline RelationBlock with_original_to_block(BlockMapper mapper) const {
+    return RelationBlock(std::move(mapper), X, X_dense, is_dense, children);
+  }
+
+  /*
+  Replaces the case mapping, e.g. when the training window slides; the
+  rows themselves stay the same.
+  */
+  inline void set_original_to_block(BlockMapper mapper) {
+    if (mapper.block_size() > block_size) {
+      throw runtime_error("index mapping points to non-existing row.");
+    }
+    original_to_block = std::move(mapper);
+    mapper_size = original_to_block.size();
+  }
+
+  /* X * v, for a vector v of length feature_size. */
+  template <typename Derived>
+  inline Vector multiply(const Eigen::MatrixBase<Derived> &v) const {
+    if (is_dense) {
+      return X_dense * v;
+    }
+    return X * v;
+  }
+
+  /* (X .* X) * v. */
+  template <typename Derived>
+  inline Vector multiply_squared(const Eigen::MatrixBase<Derived> &v) const {
+    if (is_dense) {
+      Vector result = Vector::Zero(block_size);
+      for (size_t col = 0; col < feature_size; col++) {
+        result.array() += X_dense.col(col).array().square() * v(col);
+      }
+      return result;
+    }
+    return X.cwiseAbs2() * v;
+  }
+
+  /* Calls f(column, value) for the (stored) entries of a row. */
+  template <typename F> inline void for_each_in_row(size_t row, F &&f) const {
+    if (is_dense) {
+      for (size_t col = 0; col < feature_size; col++) {
+        f(col, X_dense(row, col));
+      }
+    } else {
+      for (typename SparseMatrix::InnerIterator it(X, row); it; ++it) {
+        f(static_cast<size_t>(it.col()), it.value());
+      }
+    }
+  }
+
+  /* Number of features including those of all the descendants. */
+  inline size_t total_feature_size() const {
+    size_t result = feature_size;
+    for (const auto &child : children) {
+      result += child.total_feature_size();
+    }
+    return result;
+  }
 
-  const vector<size_t> original_to_block;
-  const size_t mapper_size;
+  BlockMapper original_to_block;
+  size_t mapper_size;
   const SparseMatrix X;
+  const DenseMatrix X_dense;
+  const bool is_dense;
   const size_t block_size;
   const size_t feature_size;
+  const vector<RelationBlock> children;
+
+private:
+  inline RelationBlock(BlockMapper original_to_block, const SparseMatrix &X,
+                       const DenseMatrix &X_dense, bool is_dense,
+                       vector<RelationBlock> children)
+      : original_to_block(std::move(original_to_block)),
+        mapper_size(this->original_to_block.size()), X(X), X_dense(X_dense),
+        is_dense(is_dense), block_size(X.rows()), feature_size(X.cols()),
+        children(std::move(children)) {
+    if (this->original_to_block.block_size() > block_size) {
+      throw runtime_error("index mapping points to non-existing row.");
+    }
+    for (const auto &child : this->children) {
+      if (child.mapper_size != block_size) {
+        throw runtime_error("child relation has mapper size different from "
+                            "the parent's block size.");
+      }
+    }
+  }
 };
 
+template <typename Real>
+inline bool has_nested_relation(const vector<RelationBlock<Real>> &relations) {
+  for (const auto &rel : relations) {
+    if (!rel.children.empty()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+template <typename Real>
+inline void append_flattened_relation(const RelationBlock<Real> &block,
+                                      const BlockMapper &original_to_block,
+                                      vector<RelationBlock<Real>> &result) {
+  if (block.is_dense) {
+    result.emplace_back(original_to_block, block.X_dense);
+  } else {
+    result.emplace_back(original_to_block, block.X);
+  }
+  for (const auto &child : block.children) {
+    append_flattened_relation(
+        child, original_to_block.compose(child.original_to_block), result);
+  }
+}
+
+/*
+Rewrites nested blocks as sibling blocks, composing the index mappings so
+that a descendant maps cases directly to its own rows. The model is
+unchanged, and the trainers and the predictors then cache and compute every
+block's quantities per row of that block, i.e. at its own (coarsest) level.
+*/
+template <typename Real>
+inline vector<RelationBlock<Real>>
+flatten_relations(const vector<RelationBlock<Real>> &relations) {
+  vector<RelationBlock<Real>> result;
+  for (const auto &rel : relations) {
+    append_flattened_relation(rel, rel.original_to_block, result);
+  }
+  return result;
+}
+
 template <typename Real> struct RelationWiseCache {
   typedef typename RelationBlock<Real>::Vector Vector;
   typedef typename RelationBlock<Real>::SparseMatrix SparseMatrix;
+  typedef Eigen::Matrix<Real, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>
+      SideMatrix;
 
   inline RelationWiseCache(const RelationBlock<Real> &source)
       : target(source), X_t(source.X.transpose()), cardinality(source.X.rows()),
@@ -62,8 +226,60 @@ template <typename Real> struct RelationWiseCache {
         e_q(source.X.rows()) {
     X_t.makeCompressed();
     cardinality.array() = static_cast<Real>(0);
-    for (auto v : source.original_to_block) {
-      cardinality(v)++;
+    source.original_to_block.for_each_run(
+        [this](size_t begin, size_t end, size_t block_index) {
+          cardinality(block_index) += static_cast<Real>(end - begin);
+        });
+  }
+
+  /* Makes cardinality the per-block sum of the given case weights. */
+  inline void set_case_weights(const Vector &case_weight) {
+    cardinality.array() = static_cast<Real>(0);
+    target.original_to_block.for_each_run(
+        [this, &case_weight](size_t begin, size_t end, size_t block_index) {
+          cardinality(block_index) +=
+              case_weight.segment(begin, end - begin).sum();
+        });
+  }
+
+  /* Calls f(block_row, value) for the (stored) entries of a column. */
+  template <typename F>
+  inline void for_each_in_column(size_t col, F &&f) const {
+    if (target.is_dense) {
+      const Real *column = target.X_dense.col(col).data();
+      for (size_t row = 0; row < target.block_size; row++) {
+        f(row, column[row]);
+      }
+    } else {
+      for (typename SparseMatrix::InnerIterator it(X_t, col); it; ++it) {
+        f(static_cast<size_t>(it.col()), it.value());
+      }
+    }
+  }
+
+  /* x_col^T v */
+  inline Real column_dot(size_t col, const Vector &v) const {
+    if (target.is_dense) {
+      return target.X_dense.col(col).dot(v);
+    }
+    return X_t.row(col) * v;
+  }
+
+  /* (x_col .* x_col)^T v */
+  inline Real column_squared_dot(size_t col, const Vector &v) const {
+    if (target.is_dense) {
+      return target.X_dense.col(col).cwiseAbs2().dot(v);
+    }
+    return X_t.row(col).cwiseAbs2() * v;
+  }
+
+  /* result += scale * (x_col .* v) */
+  inline void add_scaled_column_product(size_t col, const Vector &v,
+                                        Real scale, Vector &result) const {
+    if (target.is_dense) {
+      result.array() += scale * target.X_dense.col(col).array() * v.array();
+    } else {
+      result += X_t.row(col).transpose().cwiseProduct(v) * scale;
     }
   }
 
@@ -81,6 +297,21 @@ template <typename Real> struct RelationWiseCache {
 
   Vector e;
   Vector e_q;
+
+  /*
+  Per-side counterparts of q, c, c_S and e_q for the updates under an
+  interaction mask (see GibbsFMTrainer::update_V_masked_relation), one row
+  per block row and one column per side of the mask, side_c_S holding an
+  n_sides x n_sides matrix per row. side_dq and side_dq_S gather the
+  changes of the block's sums of x v and x^2 v^2 until the cases are
+  brought up to date. Empty without a mask.
+  */
+  SideMatrix side_q;
+  SideMatrix side_c;
+  SideMatrix side_c_S;
+  SideMatrix side_e_q;
+  SideMatrix side_dq;
+  SideMatrix side_dq_S;
 };
 } // namespace relational
 
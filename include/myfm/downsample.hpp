@@ -0,0 +1,82 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+#include "util.hpp"
+
+namespace myFM {
+using namespace std;
+
+template <typename Real> struct DownsampleResult {
+  vector<size_t> indices;
+  vector<Real> weights;
+};
+
+/*
+Stratified downsampling without replacement. Of the n_s rows of stratum s
+(those with strata[i] == s), a uniformly chosen subset of
+max(1, round(keep_rate[s] * n_s)) rows is kept, and each of them is weighted
+n_s / (number kept) so that the weighted likelihood over the kept rows is an
+unbiased estimate of the one over all rows (see
+FMLearningConfig::sample_weight).
+
+The kept indices are in increasing order, so that the grouping of the cases
+by relation block row (and hence run-length encoded mappers) survives.
+*/
+template <typename Real>
+inline DownsampleResult<Real>
+stratified_downsample(const vector<size_t> &strata,
+                      const vector<Real> &keep_rate, int random_seed) {
+  for (Real rate : keep_rate) {
+    if (!(rate > 0 && rate <= 1)) {
+      throw invalid_argument("keep rates must be in (0, 1].");
+    }
+  }
+  vector<size_t> stratum_size(keep_rate.size(), 0);
+  for (size_t stratum : strata) {
+    if (stratum >= keep_rate.size()) {
+      throw invalid_argument(StringBuilder{}
+                                 .add("stratum")
+                                 .space_and_add(stratum)
+                                 .space_and_add("has no keep rate.")
+                                 .build());
+    }
+    stratum_size[stratum]++;
+  }
+  vector<size_t> to_keep(keep_rate.size(), 0);
+  vector<Real> weight(keep_rate.size(), 0);
+  for (size_t stratum = 0; stratum < keep_rate.size(); stratum++) {
+    if (stratum_size[stratum] == 0) {
+      continue;
+    }
+    to_keep[stratum] = std::max<size_t>(
+        1, static_cast<size_t>(
+               std::round(keep_rate[stratum] * stratum_size[stratum])));
+    weight[stratum] = static_cast<Real>(stratum_size[stratum]) /
+                      static_cast<Real>(to_keep[stratum]);
+  }
+
+  // selection sampling (Knuth's algorithm S), run for all strata at once.
+  mt19937 gen(random_seed);
+  uniform_real_distribution<Real> uniform(0, 1);
+  vector<size_t> remaining(stratum_size);
+  DownsampleResult<Real> result;
+  for (size_t i = 0; i < strata.size(); i++) {
+    const size_t stratum = strata[i];
+    if (to_keep[stratum] > 0 &&
+        uniform(gen) * remaining[stratum] < to_keep[stratum]) {
+      result.indices.push_back(i);
+      result.weights.push_back(weight[stratum]);
+      to_keep[stratum]--;
+    }
+    remaining[stratum]--;
+  }
+  return result;
+}
+
+} // namespace myFM
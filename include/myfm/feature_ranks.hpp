@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstddef>
+#include <stdexcept>
+#include <vector>
+
+namespace myFM {
+using namespace std;
+
+/*
+The number of leading factors each feature uses (see
+FMLearningConfig::group_ranks) and where each feature's factors start when
+the rows of V are stored one after another, cut to their rank. The layout
+is shared by all the samples of a run, which then only hold the ranked
+entries.
+*/
+class FeatureRanks {
+public:
+  inline explicit FeatureRanks(const vector<int> &ranks)
+      : ranks_(ranks), offsets_(ranks.size() + 1, 0) {
+    for (size_t feature = 0; feature < ranks.size(); feature++) {
+      if (ranks[feature] < 0) {
+        throw invalid_argument("feature ranks must be non-negative.");
+      }
+      offsets_[feature + 1] = offsets_[feature] + ranks[feature];
+    }
+  }
+
+  inline size_t size() const { return ranks_.size(); }
+  inline int operator[](size_t feature) const { return ranks_[feature]; }
+  inline const vector<int> &ranks() const { return ranks_; }
+
+  /* Where the factors of `feature` start among the ranked entries. */
+  inline size_t offset(size_t feature) const { return offsets_[feature]; }
+
+  /* The sum of the ranks, the number of entries of a ranked V. */
+  inline size_t n_entries() const { return offsets_.back(); }
+
+  inline bool operator==(const FeatureRanks &other) const {
+    return ranks_ == other.ranks_;
+  }
+  inline bool operator!=(const FeatureRanks &other) const {
+    return !(*this == other);
+  }
+
+private:
+  vector<int> ranks_;
+  vector<size_t> offsets_;
+};
+
+} // namespace myFM
@@ -0,0 +1,238 @@
+#pragma once
+
+#include <cstddef>
+#include <stdexcept>
+#include <vector>
+
+#include "definitions.hpp"
+#include "util.hpp"
+
+namespace myFM {
+namespace implicit {
+using namespace std;
+
+/*
+Implicit-feedback term for Gibbs sampling: every pair (u, i) of a row u of
+the user block and a row i of the item block counts as an extra case with
+target 0 and likelihood weight `weight`, whether or not it was observed,
+in the manner of implicit ALS. Such a case has only the two blocks'
+features, so that its prediction is
+
+  f(u, i) = t_u + t_i + p_u . p_i,
+
+where p_u is the row's factor sum and t_u its linear terms plus its
+within-block interactions (plus w0 for the user side). A coordinate of w or
+V belonging to one side enters f linearly, and the sums over all pairs of
+its coefficient squared and times f only involve the other side through
+
+  n, A = sum t, SA = sum t^2, Q = sum p, B = sum t p, S = sum p p^T,
+
+so that a sweep costs O((n_users + n_items) k^2) on top of the observed
+cases instead of O(n_users n_items k).
+*/
+template <typename Real> struct ImplicitFeedback {
+  typedef relational::RelationBlock<Real> RelationBlock;
+  typedef relational::RelationWiseCache<Real> RelationWiseCache;
+  typedef types::Vector<Real> Vector;
+  typedef types::DenseMatrix<Real> DenseMatrix;
+
+  struct Side {
+    inline Side(const RelationBlock &block, const RelationWiseCache &cache,
+                size_t offset, size_t rank)
+        : block(block), cache(cache), offset(offset),
+          n(static_cast<Real>(block.block_size)), P(block.block_size, rank),
+          t(block.block_size), Q(rank), B(rank), S(rank, rank),
+          dirty_factor(rank, true) {}
+
+    const RelationBlock &block;
+    const RelationWiseCache &cache;
+    const size_t offset;
+    const Real n;
+
+    // per row of the block
+    DenseMatrix P;
+    Vector t;
+
+    // sums over the rows
+    Real A, SA;
+    Vector Q, B;
+    DenseMatrix S;
+    // columns of P changed since S was last updated.
+    vector<bool> dirty_factor;
+
+    inline void update_sums() {
+      A = t.sum();
+      SA = t.squaredNorm();
+      Q = P.colwise().sum().transpose();
+      B = P.transpose() * t;
+      for (size_t r = 0; r < dirty_factor.size(); r++) {
+        if (dirty_factor[r]) {
+          S.col(r) = P.transpose() * P.col(r);
+          S.row(r) = S.col(r).transpose();
+          dirty_factor[r] = false;
+        }
+      }
+    }
+
+    // sum of f(u, i) over the rows i of the other side.
+    inline Real row_sum(size_t row, const Side &other) const {
+      return other.n * t(row) + other.A + P.row(row).dot(other.Q);
+    }
+  };
+
+  inline ImplicitFeedback(const vector<RelationBlock> &relations,
+                          const vector<RelationWiseCache> &caches,
+                          size_t user_block, size_t item_block,
+                          size_t main_feature_size, size_t rank,
+                          Real weight)
+      : weight(weight), user_block(user_block), item_block(item_block) {
+    if (user_block >= relations.size() || item_block >= relations.size() ||
+        user_block == item_block) {
+      throw invalid_argument(StringBuilder{}
+                                 .add("invalid implicit feedback blocks")
+                                 .space_and_add(user_block)
+                                 .space_and_add("and")
+                                 .space_and_add(item_block)
+                                 .add(".")
+                                 .build());
+    }
+    size_t offset = main_feature_size;
+    vector<size_t> offsets;
+    for (const auto &rel : relations) {
+      offsets.push_back(offset);
+      offset += rel.feature_size;
+    }
+    sides.emplace_back(relations[user_block], caches[user_block],
+                       offsets[user_block], rank);
+    sides.emplace_back(relations[item_block], caches[item_block],
+                       offsets[item_block], rank);
+  }
+
+  /* 0 for the user block, 1 for the item block, -1 otherwise. */
+  inline int side_of(size_t relation_index) const {
+    if (relation_index == user_block) {
+      return 0;
+    }
+    if (relation_index == item_block) {
+      return 1;
+    }
+    return -1;
+  }
+
+  /* Recomputes everything from the current parameters. */
+  template <typename FMType> inline void reset(const FMType &fm) {
+    for (size_t s = 0; s < 2; s++) {
+      Side &side = sides[s];
+      const size_t fs = side.block.feature_size;
+      const auto V_block = fm.V.middleRows(side.offset, fs);
+      for (int r = 0; r < fm.n_factors; r++) {
+        side.P.col(r) = side.block.multiply(V_block.col(r));
+      }
+      Vector V_squared = V_block.array().square().rowwise().sum().matrix();
+      side.t = side.block.multiply(fm.w.segment(side.offset, fs));
+      side.t.array() +=
+          0.5 * (side.P.rowwise().squaredNorm() -
+                 side.block.multiply_squared(V_squared))
+                    .array();
+      if (s == 0) {
+        side.t.array() += fm.w0;
+      }
+      std::fill(side.dirty_factor.begin(), side.dirty_factor.end(), true);
+      side.update_sums();
+    }
+  }
+
+  /* Makes the sums of the other side current before updating `side`. */
+  inline void prepare(int side) { sides[1 - side].update_sums(); }
+
+  /* Weighted sum of f(u, i)^2 over all the pairs. */
+  inline Real sum_of_squares() const {
+    const Side &user = sides[0], &item = sides[1];
+    Real result = 0;
+    for (size_t u = 0; u < user.block.block_size; u++) {
+      const Real t = user.t(u);
+      const auto p = user.P.row(u);
+      result += item.n * t * t + item.SA + p.dot(item.S * p.transpose()) +
+                2 * t * item.A + 2 * t * p.dot(item.Q) + 2 * p.dot(item.B);
+    }
+    return weight * result;
+  }
+
+  inline Real n_pairs() const { return sides[0].n * sides[1].n; }
+
+  /*
+  Adds the pairs' weighted sum of g^2 to `square` and of g * (g * old - f)
+  to `linear`, where g is the coefficient of the coordinate in f.
+  */
+  inline void add_w0_terms(Real w0_old, Real &square, Real &linear) const {
+    Real g_f = 0;
+    for (size_t u = 0; u < sides[0].block.block_size; u++) {
+      g_f += sides[0].row_sum(u, sides[1]);
+    }
+    square += weight * n_pairs();
+    linear += weight * (n_pairs() * w0_old - g_f);
+  }
+
+  inline void add_w_terms(int side, size_t col, Real w_old, Real &square,
+                          Real &linear) const {
+    const Side &own = sides[side], &other = sides[1 - side];
+    Real g2 = 0, g_f = 0;
+    own.cache.for_each_in_column(col, [&](size_t row, Real x) {
+      g2 += x * x;
+      g_f += x * own.row_sum(row, other);
+    });
+    g2 *= other.n;
+    square += weight * g2;
+    linear += weight * (g2 * w_old - g_f);
+  }
+
+  inline void add_V_terms(int side, size_t col, size_t r, Real v_old,
+                          Real &square, Real &linear) const {
+    const Side &own = sides[side], &other = sides[1 - side];
+    Real g2 = 0, g_f = 0;
+    own.cache.for_each_in_column(col, [&](size_t row, Real x) {
+      const Real h = own.P(row, r) - x * v_old;
+      g2 += x * x * (other.n * h * h + 2 * h * other.Q(r) + other.S(r, r));
+      g_f += x * (h * own.row_sum(row, other) + own.t(row) * other.Q(r) +
+                  other.B(r) + other.S.row(r).dot(own.P.row(row)));
+    });
+    square += weight * g2;
+    linear += weight * (g2 * v_old - g_f);
+  }
+
+  inline void apply_w0(Real delta) { sides[0].t.array() += delta; }
+
+  inline void apply_w(int side, size_t col, Real delta) {
+    Side &own = sides[side];
+    own.cache.for_each_in_column(
+        col, [&](size_t row, Real x) { own.t(row) += x * delta; });
+  }
+
+  inline void apply_V(int side, size_t col, size_t r, Real v_old,
+                      Real delta) {
+    Side &own = sides[side];
+    own.cache.for_each_in_column(col, [&](size_t row, Real x) {
+      const Real h = own.P(row, r) - x * v_old;
+      own.t(row) += x * delta * h;
+      own.P(row, r) += x * delta;
+    });
+    own.dirty_factor[r] = true;
+  }
+
+  inline size_t bytes() const {
+    size_t result = 0;
+    for (const auto &side : sides) {
+      result += sizeof(Real) * (side.P.size() + side.t.size() +
+                                side.Q.size() + side.B.size() +
+                                side.S.size());
+    }
+    return result;
+  }
+
+  const Real weight;
+  const size_t user_block, item_block;
+  vector<Side> sides;
+};
+
+} // namespace implicit
+} // namespace myFM
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <cstddef>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "util.hpp"
+
+namespace myFM {
+using namespace std;
+
+/*
+Which pairs of fields the pairwise term of an FM keeps, the fields being the
+groups of group_index. The kept pairs are given as interaction blocks, each
+a pair of field sets: when the second set is empty the features of the
+first one interact with each other, otherwise only features of the first set
+with those of the second, and the two must be disjoint. No pair of fields
+may be kept by two blocks.
+
+Each set of a block is a "side". A row then keeps one sum of x_i v_i per
+side instead of one overall, and its pairwise term is
+    sum over within-blocks of (|S_side|^2 - sum x_i^2 |v_i|^2) / 2
+  + sum over cross blocks of <S_first, S_second>,
+which costs O(nnz * k) per block a feature belongs to, where the unmasked
+term is the special case of one within-block holding all the fields.
+*/
+class InteractionMask {
+public:
+  typedef vector<pair<vector<size_t>, vector<size_t>>> BlockType;
+
+  /*
+  A side that a feature's field belongs to, and the side it interacts with,
+  which is the same side for a within-block.
+  */
+  struct Membership {
+    size_t side;
+    size_t partner;
+  };
+
+  inline InteractionMask(const vector<size_t> &field_of, size_t n_fields,
+                         const BlockType &blocks)
+      : field_of_(field_of), n_fields_(n_fields), blocks_(blocks),
+        field_memberships_(n_fields), allowed_(n_fields * n_fields, 0) {
+    for (size_t field : field_of) {
+      if (field >= n_fields) {
+        throw invalid_argument("field index out of range.");
+      }
+    }
+    size_t n_sides = 0;
+    for (const auto &block : blocks) {
+      if (block.first.empty()) {
+        throw invalid_argument("an interaction block has no fields.");
+      }
+      const bool within = block.second.empty();
+      const size_t first = n_sides++;
+      const size_t second = within ? first : n_sides++;
+      add_side(block.first, first, second);
+      add_side(block.second, second, first);
+      block_sides_.emplace_back(first, second);
+      const vector<size_t> &others = within ? block.first : block.second;
+      for (size_t a = 0; a < block.first.size(); a++) {
+        for (size_t b = within ? a : 0; b < others.size(); b++) {
+          const size_t f = block.first[a], g = others[b];
+          if (!within && f == g) {
+            throw invalid_argument(StringBuilder{}
+                                       .add("field")
+                                       .space_and_add(f)
+                                       .space_and_add("is on both sides of "
+                                                      "an interaction block.")
+                                       .build());
+          }
+          if (allows(f, g)) {
+            throw invalid_argument(StringBuilder{}
+                                       .add("fields")
+                                       .space_and_add(f)
+                                       .space_and_add("and")
+                                       .space_and_add(g)
+                                       .space_and_add("are in more than one "
+                                                      "interaction block.")
+                                       .build());
+          }
+          allowed_[f * n_fields + g] = 1;
+          allowed_[g * n_fields + f] = 1;
+        }
+      }
+    }
+    n_sides_ = n_sides;
+  }
+
+  inline bool allows(size_t field, size_t other_field) const {
+    return allowed_[field * n_fields_ + other_field] != 0;
+  }
+
+  inline const vector<Membership> &memberships(size_t feature) const {
+    return field_memberships_[field_of_[feature]];
+  }
+
+  inline size_t n_sides() const { return n_sides_; }
+  inline size_t n_fields() const { return n_fields_; }
+  inline size_t feature_size() const { return field_of_.size(); }
+  inline const vector<size_t> &field_of() const { return field_of_; }
+  inline const BlockType &blocks() const { return blocks_; }
+
+  /*
+  The pairwise term of a row from its per-side sums of x_i v_i (the rows of
+  `sums`) and of x_i^2 v_i^2 (those of `squares`, read for within-blocks
+  only).
+  */
+  template <typename Matrix>
+  inline typename Matrix::Scalar pair_term(const Matrix &sums,
+                                           const Matrix &squares) const {
+    typename Matrix::Scalar result = 0;
+    for (const auto &sides : block_sides_) {
+      if (sides.first == sides.second) {
+        result += (sums.row(sides.first).squaredNorm() -
+                   squares.row(sides.first).sum()) /
+                  2;
+      } else {
+        result += sums.row(sides.first).dot(sums.row(sides.second));
+      }
+    }
+    return result;
+  }
+
+private:
+  inline void add_side(const vector<size_t> &fields, size_t side,
+                       size_t partner) {
+    for (size_t field : fields) {
+      if (field >= n_fields_) {
+        throw invalid_argument(StringBuilder{}
+                                   .add("interaction block field")
+                                   .space_and_add(field)
+                                   .space_and_add("out of range.")
+                                   .build());
+      }
+      for (const auto &membership : field_memberships_[field]) {
+        if (membership.side == side) {
+          throw invalid_argument(StringBuilder{}
+                                     .add("field")
+                                     .space_and_add(field)
+                                     .space_and_add("repeated in an "
+                                                    "interaction block.")
+                                     .build());
+        }
+      }
+      field_memberships_[field].push_back(Membership{side, partner});
+    }
+  }
+
+  vector<size_t> field_of_;
+  size_t n_fields_;
+  BlockType blocks_;
+  vector<vector<Membership>> field_memberships_;
+  vector<pair<size_t, size_t>> block_sides_;
+  vector<char> allowed_;
+  size_t n_sides_;
+};
+
+} // namespace myFM
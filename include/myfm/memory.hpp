@@ -0,0 +1,266 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "FM.hpp"
+#include "FMLearningConfig.hpp"
+#include "HyperParams.hpp"
+#include "LearningHistory.hpp"
+#include "definitions.hpp"
+#include "util.hpp"
+
+namespace myFM {
+namespace variational {
+template <typename Real> struct VariationalFM;
+template <typename Real> struct VariationalLearningHistory;
+} // namespace variational
+
+namespace memory {
+
+/*
+Bytes held by each named component of a trainer or predictor.
+*/
+struct MemoryReport {
+  vector<pair<string, size_t>> components;
+
+  inline void add(const string &name, size_t bytes) {
+    for (auto &component : components) {
+      if (component.first == name) {
+        component.second += bytes;
+        return;
+      }
+    }
+    components.emplace_back(name, bytes);
+  }
+
+  inline size_t total() const {
+    size_t result = 0;
+    for (const auto &component : components) {
+      result += component.second;
+    }
+    return result;
+  }
+
+  inline string to_string() const {
+    StringBuilder sb;
+    sb("<MemoryReport total=")(total());
+    for (const auto &component : components) {
+      sb(", ")(component.first)("=")(component.second);
+    }
+    return sb(">").build();
+  }
+};
+
+template <typename Real, int Rows, int Cols, int Options>
+inline size_t bytes_of(const Eigen::Matrix<Real, Rows, Cols, Options> &m) {
+  return sizeof(Real) * m.size();
+}
+
+template <typename Real, int Options, typename StorageIndex>
+inline size_t
+bytes_of(const Eigen::SparseMatrix<Real, Options, StorageIndex> &m) {
+  size_t result = (sizeof(Real) + sizeof(StorageIndex)) * m.nonZeros() +
+                  sizeof(StorageIndex) * (m.outerSize() + 1);
+  if (!m.isCompressed()) {
+    result += sizeof(StorageIndex) * m.outerSize();
+  }
+  return result;
+}
+
+/* CSR/CSC storage for a matrix that does not exist yet. */
+template <typename Real, typename StorageIndex = int>
+inline size_t projected_sparse_bytes(size_t nnz, size_t outer_size) {
+  return (sizeof(Real) + sizeof(StorageIndex)) * nnz +
+         sizeof(StorageIndex) * (outer_size + 1);
+}
+
+template <typename T> inline size_t bytes_of(const vector<T> &v) {
+  return sizeof(T) * v.capacity();
+}
+
+template <typename Real>
+inline size_t bytes_of(const relational::RelationBlock<Real> &block) {
+  size_t result = block.original_to_block.bytes() + bytes_of(block.X) +
+                  bytes_of(block.X_dense);
+  for (const auto &child : block.children) {
+    result += bytes_of(child);
+  }
+  return result;
+}
+
+// the feature ranks are shared by the samples of a run and left out.
+template <typename Real> inline size_t bytes_of(const FM<Real> &fm) {
+  size_t result = sizeof(Real) + bytes_of(fm.w) + bytes_of(fm.V) +
+                  bytes_of(fm.ranked_V);
+  for (const auto &cutpoint : fm.cutpoints) {
+    result += bytes_of(cutpoint);
+  }
+  return result;
+}
+
+template <typename Real>
+inline size_t bytes_of(const variational::VariationalFM<Real> &fm) {
+  return bytes_of(static_cast<const FM<Real> &>(fm)) + sizeof(Real) +
+         bytes_of(fm.w_var) + bytes_of(fm.V_var);
+}
+
+template <typename Real>
+inline size_t bytes_of(const relational::RelationWiseCache<Real> &cache) {
+  return bytes_of(cache.X_t) + bytes_of(cache.cardinality) +
+         bytes_of(cache.y) + bytes_of(cache.q) + bytes_of(cache.q_S) +
+         bytes_of(cache.c) + bytes_of(cache.c_S) + bytes_of(cache.e) +
+         bytes_of(cache.e_q) + bytes_of(cache.side_q) +
+         bytes_of(cache.side_c) + bytes_of(cache.side_c_S) +
+         bytes_of(cache.side_e_q) + bytes_of(cache.side_dq) +
+         bytes_of(cache.side_dq_S);
+}
+
+template <typename Real>
+inline size_t bytes_of(const FMHyperParameters<Real> &hyper) {
+  return sizeof(Real) + bytes_of(hyper.mu_w) + bytes_of(hyper.lambda_w) +
+         bytes_of(hyper.mu_V) + bytes_of(hyper.lambda_V);
+}
+
+template <typename Real>
+inline size_t bytes_of(const GibbsLearningHistory<Real> &history) {
+  size_t result = bytes_of(history.n_mh_accept) +
+                  bytes_of(history.train_log_losses) +
+                  sizeof(FMHyperParameters<Real>) * history.hypers.capacity();
+  for (const auto &hyper : history.hypers) {
+    result += bytes_of(hyper) - sizeof(Real);
+  }
+  return result;
+}
+
+template <typename Real>
+inline size_t
+bytes_of(const variational::VariationalLearningHistory<Real> &history) {
+  return bytes_of(history.hyper) + bytes_of(history.elbos);
+}
+
+/* Number of Vector members of relational::RelationWiseCache. */
+static constexpr size_t GIBBS_RELATION_CACHE_VECTORS = 8;
+/* Extra Vector members of variational::VariationalRelationWiseCache. */
+static constexpr size_t VARIATIONAL_RELATION_CACHE_VECTORS = 5;
+
+/*
+The trainers flatten nested blocks, so every descendant gets its own
+case-to-row mapping and cache. A composed mapping has at most as many runs
+as the one it is composed from, so the parent's size bounds the child's.
+*/
+template <typename Real>
+inline void add_projected_relation(MemoryReport &report,
+                                   const relational::RelationBlock<Real> &rel,
+                                   size_t mapper_bytes, size_t cache_vectors) {
+  report.add("relations",
+             mapper_bytes + bytes_of(rel.X) + bytes_of(rel.X_dense));
+  report.add("relation_caches",
+             projected_sparse_bytes<Real>(rel.X.nonZeros(), rel.X.cols()) +
+                 cache_vectors * sizeof(Real) * rel.block_size);
+  for (const auto &child : rel.children) {
+    add_projected_relation(report, child, mapper_bytes, cache_vectors);
+  }
+}
+
+/*
+Estimate the peak memory of a training run from the shape of the inputs
+alone, without building the trainer. `variational` selects between
+the Gibbs sampler (which keeps `n_kept_samples` models and one set of
+hyper-parameters per iteration) and variational inference (which keeps a
+single model with variances).
+*/
+template <typename Real>
+inline MemoryReport projected_training_memory(
+    const types::SparseMatrix<Real> &X,
+    const vector<relational::RelationBlock<Real>> &relations, size_t rank,
+    const FMLearningConfig<Real> &config, bool variational) {
+  MemoryReport report;
+  const size_t n_train = X.rows();
+  const size_t dim_all = check_row_consistency_return_column(X, relations);
+
+  report.add("X", bytes_of(X));
+  report.add("X_t", projected_sparse_bytes<Real>(X.nonZeros(), X.cols()));
+  report.add("y", sizeof(Real) * n_train);
+  report.add("sample_weight", sizeof(Real) * n_train);
+  report.add("residuals", 2 * sizeof(Real) * n_train);
+  if (variational) {
+    report.add("residuals", 2 * sizeof(Real) * n_train);
+  }
+
+  const size_t cache_vectors =
+      GIBBS_RELATION_CACHE_VECTORS +
+      (variational ? VARIATIONAL_RELATION_CACHE_VECTORS : 0);
+  for (const auto &rel : relations) {
+    add_projected_relation(report, rel, rel.original_to_block.bytes(),
+                           cache_vectors);
+  }
+
+  const size_t n_groups = config.get_n_groups();
+  const size_t fm_bytes =
+      sizeof(Real) * (1 + dim_all * (rank + 1)) * (variational ? 2 : 1);
+  const size_t hyper_bytes =
+      sizeof(Real) * (1 + 2 * n_groups * (rank + 1)) * (variational ? 2 : 1);
+  // with group ranks the kept Gibbs samples hold the ranked part of V only
+  // (see FM::compact).
+  size_t ranked_entries = dim_all * rank, ranks_bytes = 0;
+  if (!config.group_ranks().empty()) {
+    ranked_entries = 0;
+    for (size_t feature = 0; feature < dim_all; feature++) {
+      ranked_entries += std::min<size_t>(
+          rank, config.group_rank(config.group_index(feature), rank));
+    }
+    ranks_bytes = (sizeof(int) + sizeof(size_t)) * (dim_all + 1);
+  }
+  const size_t kept_bytes = sizeof(Real) * (1 + dim_all + ranked_entries);
+  report.add("model", fm_bytes + hyper_bytes + ranks_bytes);
+  if (variational) {
+    report.add("samples", fm_bytes);
+    report.add("history", sizeof(Real) * config.n_iter + hyper_bytes);
+  } else if (config.rao_blackwell) {
+    // the conditional means of the current sweep, besides the kept models.
+    report.add("samples", kept_bytes * config.n_kept_samples + fm_bytes);
+    report.add("history", (hyper_bytes + sizeof(FMHyperParameters<Real>)) *
+                              config.n_iter);
+  } else {
+    report.add("samples", kept_bytes * config.n_kept_samples);
+    report.add("history", (hyper_bytes + sizeof(FMHyperParameters<Real>)) *
+                              config.n_iter);
+  }
+  if (!variational && config.implicit_feedback() &&
+      config.implicit_user_block < relations.size() &&
+      config.implicit_item_block < relations.size()) {
+    // factor sums and linear terms per row, plus the sums over each side.
+    const size_t block_rows =
+        relations[config.implicit_user_block].block_size +
+        relations[config.implicit_item_block].block_size;
+    report.add("implicit_feedback",
+               sizeof(Real) * (block_rows * (rank + 1) +
+                               2 * (2 * rank + rank * rank)));
+  }
+  return report;
+}
+
+/*
+Throw if `report` exceeds the budget configured in `config`.
+A budget of zero means no limit.
+*/
+template <typename Real>
+inline void check_memory_budget(const MemoryReport &report,
+                                const FMLearningConfig<Real> &config) {
+  if (config.memory_budget == 0 || report.total() <= config.memory_budget) {
+    return;
+  }
+  throw std::runtime_error(StringBuilder{}("Projected memory usage ")(
+                               report.total())(" bytes exceeds the budget of ")(
+                               config.memory_budget)(" bytes: ")(
+                               report.to_string())
+                               .build());
+}
+
+} // namespace memory
+} // namespace myFM
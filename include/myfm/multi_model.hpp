@@ -0,0 +1,166 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "definitions.hpp"
+#include "predictor.hpp"
+#include "special.hpp"
+#include "trace.hpp"
+#include "util.hpp"
+
+namespace myFM {
+using namespace std;
+
+/*
+Scores one batch with several predictors at once, e.g. per-market models
+or A/B variants over the same requests. Each row is gathered once (X's
+entries and those of its relation blocks) and then scored by every model
+and every sample while its entries are in cache, where predict would
+traverse the batch once per model and sample.
+
+Model m reads the features [offset_m, offset_m + feature_size_m) of the
+batch's feature space (X's columns, then those of each flattened relation
+block), as its own features 0, 1, ...; with no offsets given, every model
+reads the whole space. The predictors must outlive the scorer.
+*/
+template <typename Real, class FMType = FM<Real>> class MultiModelScorer {
+public:
+  typedef Predictor<Real, FMType> PredictorType;
+  typedef typename PredictorType::TASKTYPE TASKTYPE;
+  typedef typename PredictorType::SparseMatrix SparseMatrix;
+  typedef typename PredictorType::RelationBlock RelationBlock;
+  typedef typename PredictorType::SideSums SideSums;
+  typedef typename FMType::DenseMatrix DenseMatrix;
+
+  inline MultiModelScorer(vector<const PredictorType *> predictors,
+                          vector<size_t> feature_offsets = {})
+      : predictors_(std::move(predictors)),
+        offsets_(std::move(feature_offsets)) {
+    if (offsets_.empty()) {
+      offsets_.assign(predictors_.size(), 0);
+    }
+    if (offsets_.size() != predictors_.size()) {
+      throw std::invalid_argument(StringBuilder{}
+                                      .add("Got")
+                                      .space_and_add(offsets_.size())
+                                      .space_and_add("feature offsets for")
+                                      .space_and_add(predictors_.size())
+                                      .space_and_add("models.")
+                                      .build());
+    }
+    for (const PredictorType *predictor : predictors_) {
+      if (predictor == nullptr) {
+        throw std::invalid_argument("A model is null.");
+      }
+      if (predictor->samples.empty()) {
+        throw std::invalid_argument("A model has no sample.");
+      }
+      if (predictor->type == TASKTYPE::ORDERED) {
+        throw std::invalid_argument(
+            "Ordered probit models are not supported by MultiModelScorer.");
+      }
+    }
+  }
+
+  /*
+  One column per model, holding what its predict returns, with the rows
+  split among n_workers threads.
+  */
+  inline DenseMatrix predict(const SparseMatrix &X,
+                             const vector<RelationBlock> &relations,
+                             size_t n_workers = 1) const {
+    const size_t feature_size =
+        check_row_consistency_return_column(X, relations);
+    for (size_t m = 0; m < predictors_.size(); m++) {
+      if (offsets_[m] + predictors_[m]->feature_size > feature_size) {
+        throw std::invalid_argument(
+            StringBuilder{}
+                .add("Model")
+                .space_and_add(m)
+                .space_and_add("reads up to feature")
+                .space_and_add(offsets_[m] + predictors_[m]->feature_size)
+                .space_and_add("but the batch has")
+                .space_and_add(feature_size)
+                .build());
+      }
+    }
+    if (relational::has_nested_relation(relations)) {
+      return predict(X, relational::flatten_relations(relations), n_workers);
+    }
+    const size_t n_rows = X.rows();
+    DenseMatrix result(n_rows, predictors_.size());
+
+    auto score_rows = [this, &result, &X, &relations](size_t begin,
+                                                      size_t end) {
+      trace::TraceScope scope("score_models", "predict", begin);
+      vector<relational::BlockMapper::Cursor> cursors;
+      for (const auto &relation : relations) {
+        cursors.emplace_back(relation.original_to_block);
+      }
+      vector<size_t> features;
+      vector<Real> values;
+      SideSums sums, squares;
+      typename FMType::Vector sample_scores;
+      for (size_t row = begin; row < end; row++) {
+        PredictorType::gather_row(X, relations, row, cursors, features,
+                                  values);
+        for (size_t m = 0; m < predictors_.size(); m++) {
+          const PredictorType &predictor = *predictors_[m];
+          const size_t offset = offsets_[m];
+          const size_t end_feature = offset + predictor.feature_size;
+          sample_scores.resize(predictor.samples.size());
+          for (size_t s = 0; s < predictor.samples.size(); s++) {
+            const FMType &sample = predictor.samples[s];
+            Real score = sample.w0;
+            sums.setZero(sample.n_sides(), predictor.rank);
+            squares.setZero(sample.n_sides(), predictor.rank);
+            for (size_t k = 0; k < features.size(); k++) {
+              if (features[k] < offset || features[k] >= end_feature) {
+                continue;
+              }
+              const size_t feature = features[k] - offset;
+              const Real x = values[k];
+              score += x * sample.w(feature);
+              const int feature_rank = sample.feature_rank(feature);
+              const auto v = sample.V_row(feature);
+              for (const auto &membership : sample.memberships(feature)) {
+                sums.row(membership.side).head(feature_rank) += x * v;
+                squares.row(membership.side).head(feature_rank) +=
+                    (x * v).cwiseAbs2();
+              }
+            }
+            sample_scores(s) = score + sample.pair_term(sums, squares);
+          }
+          if (predictor.type == TASKTYPE::CLASSIFICATION) {
+            special::normal_cdf(sample_scores.array(), sample_scores.array());
+          }
+          result(row, m) = sample_scores.mean();
+        }
+      }
+    };
+    n_workers = std::max<size_t>(1, std::min<size_t>(n_workers, n_rows));
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < n_workers; i++) {
+      workers.emplace_back(score_rows, n_rows * i / n_workers,
+                           n_rows * (i + 1) / n_workers);
+    }
+    score_rows(0, n_rows / n_workers);
+    for (auto &worker : workers) {
+      worker.join();
+    }
+    return result;
+  }
+
+  inline size_t n_models() const { return predictors_.size(); }
+  inline const vector<size_t> &feature_offsets() const { return offsets_; }
+
+private:
+  vector<const PredictorType *> predictors_;
+  vector<size_t> offsets_;
+};
+
+} // namespace myFM
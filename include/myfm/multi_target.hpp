@@ -0,0 +1,753 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <functional>
+#include <random>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "FM.hpp"
+#include "FMLearningConfig.hpp"
+#include "HyperParams.hpp"
+#include "LearningHistory.hpp"
+#include "definitions.hpp"
+#include "memory.hpp"
+#include "predictor.hpp"
+#include "trace.hpp"
+#include "util.hpp"
+
+namespace myFM {
+namespace multi_target {
+using namespace std;
+
+/*
+Gibbs sampling of T factorization machines that share the design matrix X
+and the relation blocks but have their own targets (the columns of Y).
+
+The factor sums and residuals of all the targets are kept in one row-major
+matrix, so that the values of a case are adjacent, and each column of X_t
+is traversed once per update for all the targets instead of once per
+target. The relation blocks' transposes and cardinalities are
+shared as well; only their per-row sums are kept for each target.
+
+Each target draws from its own generator in the order GibbsFMTrainer would,
+so that with `share_V == false` target t reproduces a single-target run
+seeded with random_seeds[t]. With `share_V == true` the targets keep their
+own w0, w and alpha but share V and its hyper-parameters (those of target
+0), which are drawn from the product of the T likelihoods.
+*/
+template <typename Real> struct MultiTargetGibbsTrainer {
+  typedef FM<Real> FMType;
+  typedef FMHyperParameters<Real> HyperType;
+  typedef GibbsLearningHistory<Real> LearningHistory;
+  typedef relational::RelationBlock<Real> RelationBlock;
+  typedef relational::RelationWiseCache<Real> RelationWiseCache;
+  typedef typename FMType::Vector Vector;
+  typedef typename FMType::DenseMatrix DenseMatrix;
+  typedef typename FMType::SparseMatrix SparseMatrix;
+  typedef Eigen::Matrix<Real, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>
+      RowMajorMatrix;
+
+  typedef FMLearningConfig<Real> Config;
+  typedef typename Config::TASKTYPE TASKTYPE;
+  typedef pair<Predictor<Real>, LearningHistory> learn_result_type;
+
+  /* Per-row sums of a relation block that depend on the target. */
+  struct BlockState {
+    inline BlockState(size_t block_size)
+        : q(block_size), q_S(block_size), c(block_size), c_S(block_size),
+          e(block_size), e_q(block_size) {}
+    Vector q, q_S, c, c_S, e, e_q;
+  };
+
+  inline MultiTargetGibbsTrainer(const SparseMatrix &X,
+                                 const vector<RelationBlock> &relations,
+                                 const DenseMatrix &Y,
+                                 const vector<int> &random_seeds,
+                                 Config learning_config, bool share_V = false)
+      : X(X), relations(relational::flatten_relations(relations)),
+        X_t(X.transpose()),
+        dim_all(check_row_consistency_return_column(X, relations)), Y(Y),
+        n_train(X.rows()), n_targets(Y.cols()),
+        sample_weight(Vector::Ones(X.rows())), sample_weight_sum(X.rows()),
+        qe_train(X.rows(), 2 * Y.cols()),
+        learning_config(learning_config), share_V(share_V),
+        square_(Y.cols()), linear_(Y.cols()), old_(Y.cols()),
+        new_(Y.cols()), delta_(Y.cols()), work_(X.rows()) {
+    if (X.rows() != Y.rows()) {
+      throw invalid_argument(StringBuilder{}
+                                 .add("Shape mismatch: X has size")
+                                 .space_and_add(X.rows())
+                                 .space_and_add("and Y has size")
+                                 .space_and_add(Y.rows())
+                                 .build());
+    }
+    if (random_seeds.size() != n_targets || n_targets == 0) {
+      throw invalid_argument(StringBuilder{}
+                                 .add("Expected one random seed for each of")
+                                 .space_and_add(n_targets)
+                                 .space_and_add("targets, got")
+                                 .space_and_add(random_seeds.size())
+                                 .add(".")
+                                 .build());
+    }
+    check_config();
+    this->X.makeCompressed();
+    this->X_t.makeCompressed();
+    for (const auto &rel : this->relations) {
+      relation_caches.emplace_back(rel);
+    }
+    for (size_t t = 0; t < n_targets; t++) {
+      gens_.emplace_back(random_seeds[t]);
+      blocks_.emplace_back();
+      for (const auto &rel : this->relations) {
+        blocks_[t].emplace_back(rel.block_size);
+      }
+    }
+    if (!learning_config.sample_weight().empty()) {
+      const auto &weights = learning_config.sample_weight();
+      if (weights.size() != static_cast<size_t>(n_train)) {
+        throw invalid_argument(StringBuilder{}
+                                   .add("Shape mismatch: X has size")
+                                   .space_and_add(n_train)
+                                   .space_and_add("and sample_weight has size")
+                                   .space_and_add(weights.size())
+                                   .build());
+      }
+      sample_weight = Eigen::Map<const Vector>(weights.data(), weights.size());
+      sample_weight_sum = sample_weight.sum();
+      for (auto &cache : relation_caches) {
+        cache.set_case_weights(sample_weight);
+      }
+    }
+  }
+
+  /* One model per target, initialised from the target's generator. */
+  inline vector<FMType> create_FMs(int rank, Real init_std) {
+    vector<FMType> fms;
+    for (size_t t = 0; t < n_targets; t++) {
+      fms.emplace_back(rank);
+      fms[t].initialize_weight(dim_all, init_std, gens_[t]);
+      if (share_V) {
+        fms[t].V = fms[0].V;
+      }
+    }
+    return fms;
+  }
+
+  inline vector<HyperType> create_Hypers(size_t rank) {
+    return vector<HyperType>(
+        n_targets, HyperType{rank, learning_config.get_n_groups()});
+  }
+
+  /*
+  Runs the sampler; the callback sees every target's model and
+  hyper-parameters after each sweep and stops the run by returning true.
+  */
+  inline vector<learn_result_type> learn_with_callback(
+      vector<FMType> &fms, vector<HyperType> &hypers,
+      std::function<bool(int, vector<FMType> *, vector<HyperType> *)> cb) {
+    if (fms.size() != n_targets || hypers.size() != n_targets) {
+      throw invalid_argument("Expected one model and one set of "
+                             "hyper-parameters for each target.");
+    }
+    vector<learn_result_type> result;
+    for (size_t t = 0; t < n_targets; t++) {
+      result.emplace_back(
+          Predictor<Real>{static_cast<size_t>(fms[t].n_factors), dim_all,
+                          learning_config.task_type},
+          LearningHistory{});
+      result[t].first.samples.reserve(learning_config.n_kept_samples);
+    }
+    for (size_t t = 0; t < n_targets; t++) {
+      initialize_hyper(hypers[t]);
+      initialize_e(t, fms[t]);
+    }
+    for (int mcmc_iteration = 0; mcmc_iteration < learning_config.n_iter;
+         mcmc_iteration++) {
+      update_all(fms, hypers);
+      const bool keep = learning_config.n_iter <=
+                        (mcmc_iteration + learning_config.n_kept_samples);
+      for (size_t t = 0; t < n_targets; t++) {
+        if (keep) {
+          result[t].first.samples.emplace_back(fms[t]);
+        }
+        result[t].second.hypers.emplace_back(hypers[t]);
+      }
+      if (cb(mcmc_iteration, &fms, &hypers)) {
+        break;
+      }
+    }
+    return result;
+  }
+
+  inline void update_all(vector<FMType> &fms, vector<HyperType> &hypers) {
+    trace::TraceScope scope("sweep", "train");
+    for (size_t t = 0; t < n_targets; t++) {
+      update_alpha(t, hypers[t]);
+      update_w0(t, fms[t], hypers[t]);
+      update_lambda_generic(t, hypers[t].mu_w, hypers[t].lambda_w, fms[t].w);
+      update_mu_generic(t, hypers[t].mu_w, hypers[t].lambda_w, fms[t].w);
+    }
+    update_w(fms, hypers);
+    for (size_t t = 0; t < (share_V ? 1 : n_targets); t++) {
+      for (int r = 0; r < fms[t].n_factors; r++) {
+        update_lambda_generic(t, hypers[t].mu_V.col(r),
+                              hypers[t].lambda_V.col(r), fms[t].V.col(r));
+      }
+      for (int r = 0; r < fms[t].n_factors; r++) {
+        update_mu_generic(t, hypers[t].mu_V.col(r), hypers[t].lambda_V.col(r),
+                          fms[t].V.col(r));
+      }
+    }
+    if (share_V) {
+      for (size_t t = 1; t < n_targets; t++) {
+        hypers[t].mu_V = hypers[0].mu_V;
+        hypers[t].lambda_V = hypers[0].lambda_V;
+      }
+    }
+    update_V(fms, hypers);
+    for (size_t t = 0; t < n_targets; t++) {
+      update_e(t, fms[t]);
+    }
+  }
+
+  /* Bytes currently held by the training data and the work matrices. */
+  inline memory::MemoryReport memory_report() const {
+    memory::MemoryReport report;
+    report.add("X", memory::bytes_of(X));
+    report.add("X_t", memory::bytes_of(X_t));
+    report.add("y", memory::bytes_of(Y));
+    report.add("sample_weight", memory::bytes_of(sample_weight));
+    report.add("residuals", memory::bytes_of(qe_train));
+    for (const auto &rel : relations) {
+      report.add("relations", memory::bytes_of(rel));
+    }
+    for (const auto &cache : relation_caches) {
+      report.add("relation_caches", memory::bytes_of(cache));
+    }
+    for (const auto &states : blocks_) {
+      for (const auto &state : states) {
+        report.add("relation_caches", 6 * sizeof(Real) * state.q.rows());
+      }
+    }
+    return report;
+  }
+
+  SparseMatrix X;
+  vector<RelationBlock> relations;
+  SparseMatrix X_t; // transposed
+
+  const size_t dim_all;
+  const DenseMatrix Y;
+  const int n_train;
+  const size_t n_targets;
+
+  Vector sample_weight;
+  Real sample_weight_sum;
+
+  /*
+  For each case, the factor sums q of the T targets followed by their
+  residuals e, so that all that an entry of X_t updates is in one cache line
+  for a few targets.
+  */
+  RowMajorMatrix qe_train;
+
+  inline Real &q_train(size_t row, size_t t) { return qe_train(row, t); }
+  inline Real &e_train(size_t row, size_t t) {
+    return qe_train(row, n_targets + t);
+  }
+  inline typename RowMajorMatrix::ColXpr e_column(size_t t) {
+    return qe_train.col(n_targets + t);
+  }
+  vector<RelationWiseCache> relation_caches;
+
+  const Config learning_config;
+  const bool share_V;
+
+private:
+  inline void check_config() const {
+    const char *unsupported = nullptr;
+    if (learning_config.task_type == TASKTYPE::ORDERED) {
+      unsupported = "ordered probit";
+    } else if (learning_config.task_type == TASKTYPE::CLASSIFICATION &&
+               !learning_config.sample_weight().empty()) {
+      unsupported = "sample weights for classification";
+    } else if (learning_config.implicit_feedback()) {
+      unsupported = "implicit feedback";
+    } else if (learning_config.interaction_mask()) {
+      unsupported = "an interaction mask";
+    } else if (!learning_config.group_ranks().empty()) {
+      unsupported = "per-group factor ranks";
+    } else if (learning_config.auto_burn_in) {
+      unsupported = "automatic burn-in";
+    } else if (learning_config.rao_blackwell) {
+      unsupported = "Rao-Blackwellisation";
+    } else if (learning_config.collapsed_sum_of_squares != 0) {
+      unsupported = "collapsed duplicate rows";
+    }
+    if (unsupported != nullptr) {
+      throw invalid_argument(StringBuilder{}
+                                 .add(unsupported)
+                                 .space_and_add("is not supported with "
+                                                "multiple targets.")
+                                 .build());
+    }
+  }
+
+  inline Real sample_normal(size_t t, const Real &quad, const Real &first) {
+    return (first / quad) +
+           normal_distribution<Real>(0, 1)(gens_[t]) / std::sqrt(quad);
+  }
+
+  inline void initialize_hyper(HyperType &hyper) {
+    hyper.alpha = static_cast<Real>(1);
+    hyper.mu_w.array() = static_cast<Real>(0);
+    hyper.lambda_w.array() = static_cast<Real>(1e-5);
+    hyper.mu_V.array() = static_cast<Real>(0);
+    hyper.lambda_V.array() = static_cast<Real>(1e-5);
+  }
+
+  inline void initialize_e(size_t t, const FMType &fm) {
+    fm.predict_score_write_target(work_, X, relations);
+    work_ -= Y.col(t);
+    e_column(t) = work_;
+  }
+
+  inline void update_alpha(size_t t, HyperType &hyper) {
+    if (learning_config.task_type == TASKTYPE::CLASSIFICATION) {
+      hyper.alpha = static_cast<Real>(1);
+      return;
+    }
+    work_ = e_column(t);
+    Real e_all = (sample_weight.array() * work_.array().square()).sum();
+    Real exponent = (learning_config.alpha_0 + sample_weight_sum) / 2;
+    Real variance = (learning_config.beta_0 + e_all) / 2;
+    hyper.alpha = gamma_distribution<Real>(exponent, 1 / variance)(gens_[t]);
+  }
+
+  inline void update_w0(size_t t, FMType &fm, const HyperType &hyper) {
+    if (!learning_config.fit_w0) {
+      fm.w0 = 0;
+      return;
+    }
+    work_ = e_column(t);
+    Real w0_lin_term =
+        hyper.alpha *
+        (sample_weight.array() * (fm.w0 - work_.array())).sum();
+    Real w0_quad_term =
+        hyper.alpha * sample_weight_sum + learning_config.reg_0;
+    Real w0_new = sample_normal(t, w0_quad_term, w0_lin_term);
+    e_column(t).array() += (w0_new - fm.w0);
+    fm.w0 = w0_new;
+  }
+
+  inline void update_lambda_generic(size_t t, const Vector &mu,
+                                    Eigen::Ref<Vector> lambda,
+                                    const Vector &weight) {
+    size_t group_index = 0;
+    for (const auto &group_feature_indices :
+         learning_config.group_vs_feature_index()) {
+      Real mean = mu(group_index);
+      Real alpha = learning_config.alpha_0 + group_feature_indices.size();
+      Real beta = learning_config.beta_0;
+      for (auto feature_index : group_feature_indices) {
+        auto dev = weight(feature_index) - mean;
+        beta += dev * dev;
+      }
+      lambda(group_index) =
+          gamma_distribution<Real>(alpha / 2, 2 / beta)(gens_[t]);
+      group_index++;
+    }
+  }
+
+  inline void update_mu_generic(size_t t, Eigen::Ref<Vector> mu,
+                                const Vector &lambda, const Vector &weight) {
+    size_t group_index = 0;
+    for (const auto &group_feature_indices :
+         learning_config.group_vs_feature_index()) {
+      Real square = lambda(group_index) *
+                    (learning_config.gamma_0 + group_feature_indices.size());
+      Real linear = learning_config.gamma_0 * learning_config.mu_0;
+      for (auto &f : group_feature_indices) {
+        linear += weight(f);
+      }
+      linear *= lambda(group_index);
+      mu(group_index) = sample_normal(t, square, linear);
+      group_index++;
+    }
+  }
+
+  inline void update_w(vector<FMType> &fms, const vector<HyperType> &hypers) {
+    using itertype = typename SparseMatrix::InnerIterator;
+    if (!learning_config.fit_linear) {
+      for (auto &fm : fms) {
+        fm.w.array() = 0;
+      }
+      return;
+    }
+    // main table, all the targets at once.
+    Real *linear = linear_.data(), *old = old_.data();
+    for (int feature_index = 0; feature_index < X.cols(); feature_index++) {
+      const int group = learning_config.group_index(feature_index);
+      for (size_t t = 0; t < n_targets; t++) {
+        old[t] = fms[t].w(feature_index);
+        linear[t] = 0;
+      }
+      Real x2_sum = 0;
+      for (itertype it(X_t, feature_index); it; ++it) {
+        Real *e = qe_train.row(it.col()).data() + n_targets;
+        const Real weighted_x = sample_weight(it.col()) * it.value();
+        x2_sum += weighted_x * it.value();
+        for (size_t t = 0; t < n_targets; t++) {
+          e[t] -= it.value() * old[t];
+          linear[t] += weighted_x * e[t];
+        }
+      }
+      for (size_t t = 0; t < n_targets; t++) {
+        const Real lambda = hypers[t].lambda_w(group);
+        const Real mu = hypers[t].mu_w(group);
+        Real square_term = lambda + hypers[t].alpha * x2_sum;
+        Real linear_term = -hypers[t].alpha * linear[t] + lambda * mu;
+        fms[t].w(feature_index) = sample_normal(t, square_term, linear_term);
+        old[t] = fms[t].w(feature_index);
+      }
+      for (itertype it(X_t, feature_index); it; ++it) {
+        Real *e = qe_train.row(it.col()).data() + n_targets;
+        for (size_t t = 0; t < n_targets; t++) {
+          e[t] += it.value() * old[t];
+        }
+      }
+    }
+    // relational blocks
+    for (size_t t = 0; t < n_targets; t++) {
+      update_w_relations(t, fms[t], hypers[t]);
+    }
+  }
+
+  inline void update_w_relations(size_t t, FMType &fm,
+                                 const HyperType &hyper) {
+    size_t offset = X.cols();
+    for (size_t relation_index = 0; relation_index < relations.size();
+         relation_index++) {
+      trace::TraceScope block_scope("relation_block", "train",
+                                    relation_index);
+      const RelationBlock &relation_data = relations[relation_index];
+      const RelationWiseCache &cache = relation_caches[relation_index];
+      BlockState &state = blocks_[t][relation_index];
+      state.e.array() = 0;
+      state.q = relation_data.multiply(
+          fm.w.segment(offset, relation_data.feature_size));
+      relation_data.original_to_block.for_each_run(
+          [this, t, &state](size_t begin, size_t end, size_t i) {
+            const Real q = state.q(i);
+            Real e_sum = 0;
+            for (size_t row = begin; row < end; row++) {
+              e_sum += sample_weight(row) * e_train(row, t);
+              e_train(row, t) -= q; // un-synchronize
+            }
+            state.e(i) += e_sum;
+          });
+      for (size_t inner_feature_index = 0;
+           inner_feature_index < relation_data.feature_size;
+           inner_feature_index++) {
+        const int group =
+            learning_config.group_index(offset + inner_feature_index);
+        const Real w_old = fm.w(offset + inner_feature_index);
+        const Real lambda = hyper.lambda_w(group);
+        const Real mu = hyper.mu_w(group);
+
+        Real square_term =
+            cache.column_squared_dot(inner_feature_index, cache.cardinality);
+        Real linear_term = -cache.column_dot(inner_feature_index, state.e);
+        linear_term += square_term * w_old;
+        square_term = lambda + hyper.alpha * square_term;
+        linear_term = hyper.alpha * linear_term + lambda * mu;
+
+        const Real w_new = sample_normal(t, square_term, linear_term);
+        fm.w(offset + inner_feature_index) = w_new;
+        cache.add_scaled_column_product(inner_feature_index, cache.cardinality,
+                                        w_new - w_old, state.e);
+      }
+      state.q = relation_data.multiply(
+          fm.w.segment(offset, relation_data.feature_size));
+      relation_data.original_to_block.for_each_run(
+          [this, t, &state](size_t begin, size_t end, size_t i) {
+            for (size_t row = begin; row < end; row++) {
+              e_train(row, t) += state.q(i); // re-sync
+            }
+          });
+      offset += relation_data.feature_size;
+    }
+  }
+
+  inline void update_V(vector<FMType> &fms, const vector<HyperType> &hypers) {
+    using itertype = typename SparseMatrix::InnerIterator;
+    const int n_factors = fms[0].n_factors;
+    DenseMatrix V_heads(X.cols(), n_targets);
+
+    for (int factor_index = 0; factor_index < n_factors; factor_index++) {
+      for (size_t t = 0; t < n_targets; t++) {
+        V_heads.col(t) = fms[t].V.col(factor_index).head(X.cols());
+      }
+      qe_train.leftCols(n_targets) = X * V_heads;
+      for (size_t t = 0; t < n_targets; t++) {
+        add_relation_q(t, fms[t], factor_index);
+      }
+
+      // main table, all the targets at once. The scratch is accessed
+      // through local pointers so that it stays in registers.
+      Real *square = square_.data(), *linear = linear_.data(),
+           *old = old_.data(), *delta = delta_.data();
+      for (int feature_index = 0; feature_index < X_t.rows();
+           feature_index++) {
+        const auto g = learning_config.group_index(feature_index);
+        for (size_t t = 0; t < n_targets; t++) {
+          old[t] = fms[t].V(feature_index, factor_index);
+          square[t] = 0;
+          linear[t] = 0;
+        }
+        for (itertype it(X_t, feature_index); it; ++it) {
+          const Real *q = qe_train.row(it.col()).data();
+          const Real *e = q + n_targets;
+          const Real weight = sample_weight(it.col());
+          for (size_t t = 0; t < n_targets; t++) {
+            auto h = it.value() * (q[t] - it.value() * old[t]);
+            const Real weighted_h = weight * h;
+            square[t] += weighted_h * h;
+            linear[t] += (-e[t]) * weighted_h;
+          }
+        }
+        draw_V(hypers, g, factor_index);
+        for (size_t t = 0; t < n_targets; t++) {
+          fms[t].V(feature_index, factor_index) = new_[t];
+          delta[t] = new_[t] - old[t];
+        }
+        for (itertype it(X_t, feature_index); it; ++it) {
+          Real *q = qe_train.row(it.col()).data();
+          Real *e = q + n_targets;
+          for (size_t t = 0; t < n_targets; t++) {
+            auto h = it.value() * (q[t] - it.value() * old[t]);
+            q[t] += it.value() * delta[t];
+            e[t] += h * delta[t];
+          }
+        }
+      }
+
+      // relational blocks
+      size_t offset = X.cols();
+      for (size_t relation_index = 0; relation_index < relations.size();
+           relation_index++) {
+        trace::TraceScope block_scope("relation_block", "train",
+                                      relation_index);
+        const RelationBlock &relation_data = relations[relation_index];
+        for (size_t t = 0; t < n_targets; t++) {
+          prepare_V_block(t, fms[t], relation_index, offset, factor_index);
+        }
+        for (size_t inner_feature_index = 0;
+             inner_feature_index < relation_data.feature_size;
+             inner_feature_index++) {
+          const size_t feature_index = offset + inner_feature_index;
+          const auto g = learning_config.group_index(feature_index);
+          for (size_t t = 0; t < n_targets; t++) {
+            old_[t] = fms[t].V(feature_index, factor_index);
+            add_V_block_terms(t, relation_index, inner_feature_index,
+                              old_[t]);
+          }
+          draw_V(hypers, g, factor_index);
+          for (size_t t = 0; t < n_targets; t++) {
+            fms[t].V(feature_index, factor_index) = new_[t];
+            apply_V_block(t, relation_index, inner_feature_index, old_[t],
+                          new_[t]);
+          }
+        }
+        for (size_t t = 0; t < n_targets; t++) {
+          resync_V_block(t, relation_index);
+        }
+        offset += relation_data.feature_size;
+      }
+    }
+  }
+
+  /*
+  Draws the new value of a coordinate of V from square_ and linear_, the
+  targets' sums of h^2 and -e h, into new_.
+  */
+  inline void draw_V(const vector<HyperType> &hypers, size_t g,
+                     int factor_index) {
+    if (!share_V) {
+      for (size_t t = 0; t < n_targets; t++) {
+        Real square_coeff = square_[t];
+        Real linear_coeff = linear_[t] + square_coeff * old_[t];
+        square_coeff *= hypers[t].alpha;
+        linear_coeff *= hypers[t].alpha;
+        square_coeff += hypers[t].lambda_V(g, factor_index);
+        linear_coeff += hypers[t].lambda_V(g, factor_index) *
+                        hypers[t].mu_V(g, factor_index);
+        new_[t] = sample_normal(t, square_coeff, linear_coeff);
+      }
+      return;
+    }
+    Real square_coeff = hypers[0].lambda_V(g, factor_index);
+    Real linear_coeff =
+        hypers[0].lambda_V(g, factor_index) * hypers[0].mu_V(g, factor_index);
+    for (size_t t = 0; t < n_targets; t++) {
+      square_coeff += hypers[t].alpha * square_[t];
+      linear_coeff +=
+          hypers[t].alpha * (linear_[t] + square_[t] * old_[0]);
+    }
+    const Real v_new = sample_normal(0, square_coeff, linear_coeff);
+    for (size_t t = 0; t < n_targets; t++) {
+      new_[t] = v_new;
+    }
+  }
+
+  inline void add_relation_q(size_t t, const FMType &fm, int factor_index) {
+    size_t offset = X.cols();
+    for (size_t relation_index = 0; relation_index < relations.size();
+         relation_index++) {
+      const RelationBlock &relation_data = relations[relation_index];
+      BlockState &state = blocks_[t][relation_index];
+      state.q = relation_data.multiply(
+          fm.V.col(factor_index).segment(offset, relation_data.feature_size));
+      relation_data.original_to_block.for_each_run(
+          [this, t, &state](size_t begin, size_t end, size_t i) {
+            for (size_t row = begin; row < end; row++) {
+              q_train(row, t) += state.q(i);
+            }
+          });
+      offset += relation_data.feature_size;
+    }
+  }
+
+  /* Takes the block's contribution out of the residuals of target t. */
+  inline void prepare_V_block(size_t t, const FMType &fm,
+                              size_t relation_index, size_t offset,
+                              int factor_index) {
+    const RelationBlock &relation_data = relations[relation_index];
+    BlockState &state = blocks_[t][relation_index];
+    state.q_S = relation_data.multiply_squared(
+        fm.V.col(factor_index)
+            .segment(offset, relation_data.feature_size)
+            .array()
+            .square()
+            .matrix());
+    state.c.array() = 0;
+    state.c_S.array() = 0;
+    state.e.array() = 0;
+    state.e_q.array() = 0;
+    relation_data.original_to_block.for_each_run(
+        [this, t, &state](size_t begin, size_t end, size_t i) {
+          const Real q = state.q(i);
+          const Real q_S = state.q_S(i);
+          Real c = 0, c_S = 0, e = 0, e_q = 0;
+          for (size_t row = begin; row < end; row++) {
+            const Real weight = sample_weight(row);
+            Real temp = (q_train(row, t) - q);
+            c += weight * temp;
+            c_S += weight * temp * temp;
+            e += weight * e_train(row, t);
+            e_q += weight * e_train(row, t) * temp;
+            q_train(row, t) = temp;
+            e_train(row, t) -= (temp * q + 0.5 * q * q - 0.5 * q_S);
+          }
+          state.c(i) += c;
+          state.c_S(i) += c_S;
+          state.e(i) += e;
+          state.e_q(i) += e_q;
+        });
+  }
+
+  inline void add_V_block_terms(size_t t, size_t relation_index,
+                                size_t inner_feature_index, Real v_old) {
+    const RelationWiseCache &cache = relation_caches[relation_index];
+    const BlockState &state = blocks_[t][relation_index];
+    Real square_coeff = 0;
+    Real linear_coeff = 0;
+    cache.for_each_in_column(
+        inner_feature_index, [&](size_t block_data_index, Real x_il) {
+          auto h_B = (state.q(block_data_index) - x_il * v_old);
+          auto h_squared = h_B * h_B * cache.cardinality(block_data_index) +
+                           2 * state.c(block_data_index) * h_B +
+                           state.c_S(block_data_index);
+          h_squared = x_il * x_il * h_squared;
+          square_coeff += h_squared;
+          linear_coeff += (-state.e(block_data_index) * h_B -
+                           state.e_q(block_data_index)) *
+                          x_il;
+        });
+    square_[t] = square_coeff;
+    linear_[t] = linear_coeff;
+  }
+
+  inline void apply_V_block(size_t t, size_t relation_index,
+                            size_t inner_feature_index, Real v_old,
+                            Real v_new) {
+    const RelationWiseCache &cache = relation_caches[relation_index];
+    BlockState &state = blocks_[t][relation_index];
+    const Real delta = v_new - v_old;
+    cache.for_each_in_column(
+        inner_feature_index, [&](size_t block_data_index, Real x_il) {
+          auto h_B = state.q(block_data_index) - x_il * v_old;
+          state.q(block_data_index) += delta * x_il;
+          state.q_S(block_data_index) += delta * (v_new + v_old) * x_il * x_il;
+          state.e(block_data_index) +=
+              x_il * delta *
+              (h_B * cache.cardinality(block_data_index) +
+               state.c(block_data_index));
+          state.e_q(block_data_index) +=
+              x_il * delta *
+              (h_B * state.c(block_data_index) + state.c_S(block_data_index));
+        });
+  }
+
+  inline void resync_V_block(size_t t, size_t relation_index) {
+    const RelationBlock &relation_data = relations[relation_index];
+    const BlockState &state = blocks_[t][relation_index];
+    relation_data.original_to_block.for_each_run(
+        [this, t, &state](size_t begin, size_t end, size_t i) {
+          const Real q = state.q(i);
+          const Real q_S = state.q_S(i);
+          for (size_t row = begin; row < end; row++) {
+            e_train(row, t) +=
+                (q_train(row, t) * q + 0.5 * q * q - 0.5 * q_S);
+            q_train(row, t) += q;
+          }
+        });
+  }
+
+  inline void update_e(size_t t, const FMType &fm) {
+    fm.predict_score_write_target(work_, X, relations);
+    if (learning_config.task_type == TASKTYPE::REGRESSION) {
+      work_ -= Y.col(t);
+    } else {
+      const Real zero = static_cast<Real>(0);
+      const Real std = static_cast<Real>(1);
+      for (int train_data_index = 0; train_data_index < n_train;
+           train_data_index++) {
+        const Real pred = work_(train_data_index);
+        if (Y(train_data_index, t) > 0) {
+          work_(train_data_index) -=
+              sample_truncated_normal_left(gens_[t], pred, std, zero);
+        } else {
+          work_(train_data_index) -=
+              sample_truncated_normal_right(gens_[t], pred, std, zero);
+        }
+      }
+    }
+    e_column(t) = work_;
+  }
+
+  vector<mt19937> gens_;
+  // target x relation block
+  vector<vector<BlockState>> blocks_;
+
+  // per-target scratch for a single coordinate.
+  vector<Real> square_, linear_, old_, new_, delta_;
+  Vector work_;
+};
+
+} // namespace multi_target
+} // namespace myFM
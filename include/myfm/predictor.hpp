@@ -1,12 +1,20 @@
 #pragma once
 
+#include <algorithm>
 #include <atomic>
 #include <mutex>
+#include <sstream>
+#include <string>
 #include <thread>
 
 #include "FM.hpp"
 #include "FMLearningConfig.hpp"
+#include "autotune.hpp"
 #include "definitions.hpp"
+#include "memory.hpp"
+#include "special.hpp"
+#include "thompson.hpp"
+#include "trace.hpp"
 #include "util.hpp"
 
 namespace myFM {
@@ -16,6 +24,7 @@ template <typename Real, class FMType = FM<Real>> struct Predictor {
   typedef typename FMType::SparseMatrix SparseMatrix;
   typedef typename FMType::Vector Vector;
   typedef typename FMType::RelationBlock RelationBlock;
+  typedef typename FMType::SideSums SideSums;
 
   inline Predictor(size_t rank, size_t feature_size, TASKTYPE type)
       : rank(rank), feature_size(feature_size), type(type), samples() {}
@@ -31,13 +40,62 @@ template <typename Real, class FMType = FM<Real>> struct Predictor {
     }
   }
 
+  /*
+  predict on n_workers threads, either each scoring whole samples
+  ("sample_parallel") or each scoring all the samples on a range of rows
+  ("row_parallel"). The first is the default; with autotuning on, the
+  faster of the two for the shape class is used.
+  */
   inline Vector predict_parallel(const SparseMatrix &X,
                                  const vector<RelationBlock> &relations,
                                  size_t n_workers) const {
     check_input(X, relations);
+    if (relational::has_nested_relation(relations)) {
+      // flatten once rather than once per sample.
+      return predict_parallel(X, relational::flatten_relations(relations),
+                              n_workers);
+    }
     if (samples.empty()) {
       throw std::runtime_error("Told to predict but no sample available.");
     }
+    autotune::Autotuner &tuner = autotune::Autotuner::instance();
+    if (!tuner.enabled()) {
+      return predict_with_schedule(X, relations, n_workers, "sample_parallel");
+    }
+    std::ostringstream key;
+    key << autotune::shape_key("predict", X, relations, rank) << "/samples"
+        << autotune::log2_bucket(samples.size()) << "/workers" << n_workers
+        << (samples.front().mask ? "/masked" : "");
+    string schedule;
+    if (tuner.lookup(key.str(), schedule)) {
+      return predict_with_schedule(X, relations, n_workers, schedule);
+    }
+    if (!samples.front().mask) {
+      // settle the kernel of the samples first, so that its measurement
+      // does not count against either schedule.
+      samples.front().predict_score(X, relations);
+    }
+    Vector result;
+    tuner.measure(key.str(), {"sample_parallel", "row_parallel"},
+                  [&](const string &candidate) {
+                    result = predict_with_schedule(X, relations, n_workers,
+                                                   candidate);
+                  });
+    return result;
+  }
+
+  /* predict_parallel with a given schedule. */
+  inline Vector predict_with_schedule(const SparseMatrix &X,
+                                      const vector<RelationBlock> &relations,
+                                      size_t n_workers,
+                                      const string &schedule) const {
+    if (schedule == "row_parallel") {
+      return predict_row_parallel(X, relations, n_workers);
+    }
+    if (schedule != "sample_parallel") {
+      throw std::invalid_argument(
+          StringBuilder{}("Unknown prediction schedule ")(schedule).build());
+    }
     Vector result = Vector::Zero(X.rows());
     const size_t n_samples = this->samples.size();
 
@@ -53,12 +111,10 @@ template <typename Real, class FMType = FM<Real>> struct Predictor {
               size_t cd = currently_done++;
               if (cd >= n_samples)
                 break;
+              trace::TraceScope scope("predict_sample", "predict", cd);
               this->samples[cd].predict_score_write_target(cache, X, relations);
               if (this->type == TASKTYPE::CLASSIFICATION) {
-                cache.array() =
-                    ((cache.array() * static_cast<Real>(std::sqrt(0.5))).erf() +
-                     static_cast<Real>(1)) /
-                    static_cast<Real>(2);
+                special::normal_cdf(cache.array(), cache.array());
               }
               {
                 std::lock_guard<std::mutex> lock{mtx};
@@ -74,43 +130,400 @@ template <typename Real, class FMType = FM<Real>> struct Predictor {
     return result;
   }
 
+  /*
+  Each worker scores a range of rows under every sample, a row at a time,
+  which needs no per-sample buffer over all the rows but reads the rows of
+  the relation blocks once per case rather than once per block row.
+  */
+  inline Vector predict_row_parallel(const SparseMatrix &X,
+                                     const vector<RelationBlock> &relations,
+                                     size_t n_workers) const {
+    check_input(X, relations);
+    if (relational::has_nested_relation(relations)) {
+      return predict_row_parallel(X, relational::flatten_relations(relations),
+                                  n_workers);
+    }
+    return predict_rows(X, relations, n_workers);
+  }
+
+  /*
+  predict_row_parallel over views of a batch that the caller owns, e.g.
+  arrays handed over through the C API, copying neither X nor the blocks.
+  The blocks must not be nested.
+  */
+  inline Vector
+  predict_row_parallel(const Eigen::Map<const SparseMatrix> &X,
+                       const vector<const RelationBlock *> &relations,
+                       size_t n_workers) const {
+    size_t given_feature_size = X.cols();
+    for (const RelationBlock *relation : relations) {
+      if (relation == nullptr) {
+        throw std::invalid_argument("NULL relation block.");
+      }
+      if (!relation->children.empty()) {
+        throw std::invalid_argument(
+            "Nested relation blocks are not supported over views.");
+      }
+      if (relation->mapper_size != static_cast<size_t>(X.rows())) {
+        throw std::invalid_argument(
+            StringBuilder{}("Relation block has ")(relation->mapper_size)(
+                " cases but X has ")(X.rows())(" rows.")
+                .build());
+      }
+      given_feature_size += relation->feature_size;
+    }
+    if (feature_size != given_feature_size) {
+      throw std::invalid_argument(
+          StringBuilder{}("Told to predict for ")(given_feature_size)(
+              " but this->feature_size is ")(feature_size)
+              .build());
+    }
+    return predict_rows(X, relations, n_workers);
+  }
+
   inline Vector predict(const SparseMatrix &X,
                         const vector<RelationBlock> &relations) const {
     check_input(X, relations);
+    if (relational::has_nested_relation(relations)) {
+      return predict(X, relational::flatten_relations(relations));
+    }
     if (samples.empty()) {
       throw std::runtime_error("Empty samples!");
     }
     Vector result = Vector::Zero(X.rows());
     Vector cache = Vector(X.rows());
     for (auto iter = samples.cbegin(); iter != samples.cend(); iter++) {
+      trace::TraceScope scope("predict_sample", "predict",
+                              iter - samples.cbegin());
       iter->predict_score_write_target(cache, X, relations);
       if (type == TASKTYPE::REGRESSION) {
         result += cache;
       } else if (type == TASKTYPE::CLASSIFICATION) {
-        result.array() +=
-            ((cache.array() * static_cast<Real>(std::sqrt(0.5))).erf() +
-             static_cast<Real>(1)) /
-            static_cast<Real>(2);
+        special::normal_cdf(cache.array(), cache.array());
+        result += cache;
       }
     }
     result.array() /= static_cast<Real>(samples.size());
     return result;
   }
 
+  /*
+  Thompson sampling: scores with a single draw from the posterior instead of
+  the average over it. Unless `per_row`, all the rows of X (one request)
+  share the draw; otherwise every row has its own. A Gibbs draw is one of
+  the samples, so this costs 1/n_samples of predict; a variational draw is
+  taken from w_var and V_var, for the coordinates that a row uses only.
+  The draws are determined by `seed` alone, not by n_workers.
+  */
+  inline Vector predict_thompson(const SparseMatrix &X,
+                                 const vector<RelationBlock> &relations,
+                                 uint64_t seed, bool per_row,
+                                 size_t n_workers = 1) const {
+    typedef thompson::Draw<FMType> Draw;
+    check_input(X, relations);
+    if (relational::has_nested_relation(relations)) {
+      return predict_thompson(X, relational::flatten_relations(relations),
+                              seed, per_row, n_workers);
+    }
+    if (samples.empty()) {
+      throw std::runtime_error("Told to predict but no sample available.");
+    }
+    const size_t n_rows = X.rows();
+    Vector result(n_rows);
+    if (!per_row && !Draw::draws) {
+      const FMType &sample = samples[thompson::hash(seed, 0) % samples.size()];
+      sample.predict_score_write_target(result, X, relations);
+    } else {
+      auto score_rows = [this, seed, per_row, &result, &X,
+                         &relations](size_t begin, size_t end) {
+        vector<relational::BlockMapper::Cursor> cursors;
+        for (const auto &relation : relations) {
+          cursors.emplace_back(relation.original_to_block);
+        }
+        SideSums sums, squares;
+        for (size_t row = begin; row < end; row++) {
+          const uint64_t key = thompson::hash(seed, per_row ? row + 1 : 0);
+          const Draw draw(samples[key % samples.size()], key);
+          result(row) = score_row(draw, X, relations, row, cursors, sums,
+                                  squares);
+        }
+      };
+      n_workers = std::max<size_t>(1, std::min<size_t>(n_workers, n_rows));
+      std::vector<std::thread> workers;
+      for (size_t i = 1; i < n_workers; i++) {
+        workers.emplace_back(score_rows, n_rows * i / n_workers,
+                             n_rows * (i + 1) / n_workers);
+      }
+      score_rows(0, n_rows / n_workers);
+      for (auto &worker : workers) {
+        worker.join();
+      }
+    }
+    if (type == TASKTYPE::CLASSIFICATION) {
+      special::normal_cdf(result.array(), result.array());
+    }
+    return result;
+  }
+
+  /*
+  Per-feature attributions of the score in closed form, averaged over the
+  samples: the entry of feature j in a row is
+      x_j w_j + x_j <v_j, s - x_j v_j> / 2,  s = sum_k x_k v_k,
+  so that a row sums to its score less w0; under an interaction mask, s is
+  the sum over the features j interacts with. The columns are the feature
+  indices, X's and then those of each (flattened) relation block, and a row
+  stores the entries of the rows it is made of. The first element is what
+  predict returns, computed in the same pass.
+  */
+  inline std::pair<Vector, SparseMatrix>
+  predict_with_attribution(const SparseMatrix &X,
+                           const vector<RelationBlock> &relations,
+                           size_t n_workers = 1) const {
+    check_input(X, relations);
+    if (relational::has_nested_relation(relations)) {
+      return predict_with_attribution(
+          X, relational::flatten_relations(relations), n_workers);
+    }
+    if (samples.empty()) {
+      throw std::runtime_error("Told to predict but no sample available.");
+    }
+    typedef typename SparseMatrix::StorageIndex StorageIndex;
+    const size_t n_rows = X.rows();
+    std::pair<Vector, SparseMatrix> result{
+        Vector(n_rows), SparseMatrix(n_rows, feature_size)};
+    Vector &prediction = result.first;
+    SparseMatrix &attribution = result.second;
+    {
+      vector<relational::BlockMapper::Cursor> cursors;
+      for (const auto &relation : relations) {
+        cursors.emplace_back(relation.original_to_block);
+      }
+      vector<size_t> features;
+      vector<Real> values;
+      StorageIndex *outer = attribution.outerIndexPtr();
+      outer[0] = 0;
+      for (size_t row = 0; row < n_rows; row++) {
+        gather_row(X, relations, row, cursors, features, values);
+        outer[row + 1] = outer[row] + static_cast<StorageIndex>(values.size());
+      }
+      attribution.resizeNonZeros(outer[n_rows]);
+    }
+
+    auto attribute_rows = [this, &X, &relations, &prediction,
+                           &attribution](size_t begin, size_t end) {
+      vector<relational::BlockMapper::Cursor> cursors;
+      for (const auto &relation : relations) {
+        cursors.emplace_back(relation.original_to_block);
+      }
+      vector<size_t> features;
+      vector<Real> values;
+      SideSums s;
+      Vector sample_scores(samples.size());
+      for (size_t row = begin; row < end; row++) {
+        gather_row(X, relations, row, cursors, features, values);
+        const StorageIndex start = attribution.outerIndexPtr()[row];
+        Real *target = attribution.valuePtr() + start;
+        StorageIndex *columns = attribution.innerIndexPtr() + start;
+        for (size_t k = 0; k < features.size(); k++) {
+          columns[k] = static_cast<StorageIndex>(features[k]);
+          target[k] = 0;
+        }
+        for (size_t m = 0; m < samples.size(); m++) {
+          const FMType &sample = samples[m];
+          s.setZero(sample.n_sides(), rank);
+          for (size_t k = 0; k < features.size(); k++) {
+            const int feature_rank = sample.feature_rank(features[k]);
+            for (const auto &membership : sample.memberships(features[k])) {
+              s.row(membership.side).head(feature_rank) +=
+                  values[k] * sample.V_row(features[k]);
+            }
+          }
+          Real score = sample.w0;
+          for (size_t k = 0; k < features.size(); k++) {
+            const Real x = values[k];
+            const int feature_rank = sample.feature_rank(features[k]);
+            const auto v = sample.V_row(features[k]);
+            Real a = 0;
+            for (const auto &membership : sample.memberships(features[k])) {
+              a += v.dot(s.row(membership.partner).head(feature_rank));
+              if (membership.side == membership.partner) {
+                a -= x * v.squaredNorm();
+              }
+            }
+            a = x * sample.w(features[k]) + x * a / 2;
+            target[k] += a;
+            score += a;
+          }
+          sample_scores(m) = score;
+        }
+        for (size_t k = 0; k < features.size(); k++) {
+          target[k] /= static_cast<Real>(samples.size());
+        }
+        if (type == TASKTYPE::CLASSIFICATION) {
+          special::normal_cdf(sample_scores.array(), sample_scores.array());
+        }
+        prediction(row) = sample_scores.mean();
+      }
+    };
+    n_workers = std::max<size_t>(1, std::min<size_t>(n_workers, n_rows));
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < n_workers; i++) {
+      workers.emplace_back(attribute_rows, n_rows * i / n_workers,
+                           n_rows * (i + 1) / n_workers);
+    }
+    attribute_rows(0, n_rows / n_workers);
+    for (auto &worker : workers) {
+      worker.join();
+    }
+    return result;
+  }
+
   inline void set_samples(vector<FMType> &&samples_from) {
     samples = std::forward<vector<FMType>>(samples_from);
   }
 
   inline void add_sample(const FMType &fm) {
-    if (fm.w0.rows() != feature_size) {
+    if (static_cast<size_t>(fm.w.rows()) != feature_size) {
       throw std::invalid_argument("feature size mismatch!");
     }
-    if (fm.V.cols() != rank) {
+    if (static_cast<size_t>(fm.n_factors) != rank) {
       throw std::invalid_argument("rank mismatch!");
     }
+    if (fm.feature_ranks && fm.feature_ranks->size() != feature_size) {
+      throw std::invalid_argument("feature ranks mismatch!");
+    }
     samples.emplace_back(fm);
   }
 
+  inline memory::MemoryReport memory_report() const {
+    memory::MemoryReport report;
+    size_t sample_bytes = memory::bytes_of(samples) -
+                          sizeof(FMType) * samples.size();
+    for (const auto &sample : samples) {
+      sample_bytes += memory::bytes_of(sample);
+    }
+    report.add("samples", sample_bytes);
+    return report;
+  }
+
+  /*
+  The (feature index, value) entries of one row, X's and then those of the
+  (flattened) relation blocks.
+  */
+  inline static void
+  gather_row(const SparseMatrix &X, const vector<RelationBlock> &relations,
+             size_t row, vector<relational::BlockMapper::Cursor> &cursors,
+             vector<size_t> &features, vector<Real> &values) {
+    features.clear();
+    values.clear();
+    for (typename SparseMatrix::InnerIterator it(X, row); it; ++it) {
+      features.push_back(it.col());
+      values.push_back(it.value());
+    }
+    size_t offset = X.cols();
+    for (size_t b = 0; b < relations.size(); b++) {
+      relations[b].for_each_in_row(
+          cursors[b][row], [&features, &values, offset](size_t col, Real x) {
+            features.push_back(offset + col);
+            values.push_back(x);
+          });
+      offset += relations[b].feature_size;
+    }
+  }
+
+private:
+  inline static const RelationBlock &block_of(const RelationBlock &block) {
+    return block;
+  }
+  inline static const RelationBlock &block_of(const RelationBlock *block) {
+    return *block;
+  }
+
+  /*
+  Each worker scores a range of rows under every sample, with checked
+  input and flat relations (blocks or pointers to them).
+  */
+  template <typename XType, typename Relations>
+  inline Vector predict_rows(const XType &X, const Relations &relations,
+                             size_t n_workers) const {
+    // reads the samples as they are, not as draws from them.
+    typedef thompson::Draw<FM<Real>> MeanDraw;
+    if (samples.empty()) {
+      throw std::runtime_error("Told to predict but no sample available.");
+    }
+    const size_t n_rows = X.rows();
+    Vector result(n_rows);
+    auto score_rows = [this, &result, &X, &relations](size_t begin,
+                                                      size_t end) {
+      trace::TraceScope scope("predict_rows", "predict", begin);
+      vector<relational::BlockMapper::Cursor> cursors;
+      for (const auto &relation : relations) {
+        cursors.emplace_back(block_of(relation).original_to_block);
+      }
+      SideSums sums, squares;
+      Vector sample_scores(samples.size());
+      for (size_t row = begin; row < end; row++) {
+        for (size_t m = 0; m < samples.size(); m++) {
+          sample_scores(m) = score_row(MeanDraw(samples[m], 0), X, relations,
+                                       row, cursors, sums, squares);
+        }
+        if (type == TASKTYPE::CLASSIFICATION) {
+          special::normal_cdf(sample_scores.array(), sample_scores.array());
+        }
+        result(row) = sample_scores.mean();
+      }
+    };
+    n_workers = std::max<size_t>(1, std::min<size_t>(n_workers, n_rows));
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < n_workers; i++) {
+      workers.emplace_back(score_rows, n_rows * i / n_workers,
+                           n_rows * (i + 1) / n_workers);
+    }
+    score_rows(0, n_rows / n_workers);
+    for (auto &worker : workers) {
+      worker.join();
+    }
+    return result;
+  }
+
+  /* The score of one row under a draw, with relations already flattened. */
+  template <class Draw, typename XType, typename Relations>
+  inline Real score_row(const Draw &draw, const XType &X,
+                        const Relations &relations, size_t row,
+                        vector<relational::BlockMapper::Cursor> &cursors,
+                        SideSums &sums, SideSums &squares) const {
+    const auto &sample = draw.sample;
+    Real result = draw.w0();
+    sums.setZero(sample.n_sides(), rank);
+    squares.setZero(sample.n_sides(), rank);
+    auto add = [this, &draw, &sample, &result, &sums,
+                &squares](size_t feature, Real x) {
+      result += x * draw.w(feature);
+      const auto &memberships = sample.memberships(feature);
+      const int feature_rank = sample.feature_rank(feature);
+      for (int f = 0; f < feature_rank; f++) {
+        const Real xv = x * draw.V(feature, f);
+        for (const auto &membership : memberships) {
+          sums(membership.side, f) += xv;
+          squares(membership.side, f) += xv * xv;
+        }
+      }
+    };
+    for (typename XType::InnerIterator it(X, row); it; ++it) {
+      add(it.col(), it.value());
+    }
+    size_t offset = X.cols();
+    for (size_t b = 0; b < relations.size(); b++) {
+      const RelationBlock &relation = block_of(relations[b]);
+      relation.for_each_in_row(
+          cursors[b][row],
+          [&add, offset](size_t col, Real x) { add(offset + col, x); });
+      offset += relation.feature_size;
+    }
+    return result + sample.pair_term(sums, squares);
+  }
+
+public:
   const size_t rank;
   const size_t feature_size;
   const TASKTYPE type;
@@ -0,0 +1,308 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <ios>
+#include <istream>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+
+#include "FM.hpp"
+#include "FMLearningConfig.hpp"
+#include "definitions.hpp"
+#include "interaction_mask.hpp"
+#include "predictor.hpp"
+#include "util.hpp"
+
+namespace myFM {
+
+/*
+Plain binary layout for Gibbs predictors, readable without python.
+
+  char[8]   magic "MYFMPRED"
+  uint32    format version
+  uint32    sizeof(Real)
+  int32     task type
+  uint64    rank, feature_size, n_samples
+  [version 3 only: uint32 flags, bit 0 for a mask and bit 1 for ranks]
+  [version 2, or 3 with bit 0: the interaction mask shared by the samples
+    uint64    n_fields
+    uint64[]  field of each feature (feature_size)
+    uint64    n_blocks
+    n_blocks x 2 x { uint64 size, uint64[] fields }
+  ]
+  [version 3 with bit 1: the factor ranks shared by the samples
+    uint32[]  rank of each feature (feature_size)
+  ]
+  n_samples x {
+    Real      w0
+    Real[]    w (feature_size)
+    Real[]    V (feature_size x rank, column major), or with ranks the
+              first rank[i] factors of each feature i in turn
+    uint64    n_cutpoints
+    n_cutpoints x { uint64 size, Real[] values }
+  }
+
+Integers and floats are written in host byte order. Version 1 is written
+for predictors without an interaction mask or ranks, version 2 for those
+with a mask only, and version 3 for those with ranks.
+*/
+namespace serialization {
+
+static constexpr char PREDICTOR_MAGIC[8] = {'M', 'Y', 'F', 'M',
+                                            'P', 'R', 'E', 'D'};
+static constexpr uint32_t PREDICTOR_FORMAT_VERSION = 1;
+static constexpr uint32_t MASKED_PREDICTOR_FORMAT_VERSION = 2;
+static constexpr uint32_t RANKED_PREDICTOR_FORMAT_VERSION = 3;
+static constexpr uint32_t HAS_MASK = 1;
+static constexpr uint32_t HAS_RANKS = 2;
+
+template <typename T> inline void write_pod(std::ostream &os, const T &value) {
+  os.write(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+template <typename T> inline T read_pod(std::istream &is) {
+  T value;
+  is.read(reinterpret_cast<char *>(&value), sizeof(T));
+  if (!is) {
+    throw std::ios_base::failure("Unexpected end of predictor stream.");
+  }
+  return value;
+}
+
+template <typename Real>
+inline void write_array(std::ostream &os, const Real *data, size_t size) {
+  os.write(reinterpret_cast<const char *>(data), sizeof(Real) * size);
+}
+
+template <typename Real>
+inline void read_array(std::istream &is, Real *data, size_t size) {
+  is.read(reinterpret_cast<char *>(data), sizeof(Real) * size);
+  if (!is) {
+    throw std::ios_base::failure("Unexpected end of predictor stream.");
+  }
+}
+
+inline void write_fields(std::ostream &os, const vector<size_t> &fields) {
+  write_pod<uint64_t>(os, fields.size());
+  for (size_t field : fields) {
+    write_pod<uint64_t>(os, field);
+  }
+}
+
+inline vector<size_t> read_fields(std::istream &is) {
+  vector<size_t> fields(read_pod<uint64_t>(is));
+  for (auto &field : fields) {
+    field = read_pod<uint64_t>(is);
+  }
+  return fields;
+}
+
+inline void write_mask(std::ostream &os, const InteractionMask &mask) {
+  write_pod<uint64_t>(os, mask.n_fields());
+  for (size_t field : mask.field_of()) {
+    write_pod<uint64_t>(os, field);
+  }
+  write_pod<uint64_t>(os, mask.blocks().size());
+  for (const auto &block : mask.blocks()) {
+    write_fields(os, block.first);
+    write_fields(os, block.second);
+  }
+}
+
+inline std::shared_ptr<const InteractionMask> read_mask(std::istream &is,
+                                                        size_t feature_size) {
+  size_t n_fields = read_pod<uint64_t>(is);
+  vector<size_t> field_of(feature_size);
+  for (auto &field : field_of) {
+    field = read_pod<uint64_t>(is);
+  }
+  InteractionMask::BlockType blocks(read_pod<uint64_t>(is));
+  for (auto &block : blocks) {
+    block.first = read_fields(is);
+    block.second = read_fields(is);
+  }
+  return std::make_shared<const InteractionMask>(field_of, n_fields, blocks);
+}
+
+template <typename Real>
+inline void save_predictor(const Predictor<Real> &predictor, std::ostream &os) {
+  const std::shared_ptr<const InteractionMask> mask =
+      predictor.samples.empty() ? nullptr : predictor.samples.front().mask;
+  const std::shared_ptr<const FeatureRanks> ranks =
+      predictor.samples.empty() ? nullptr
+                                : predictor.samples.front().feature_ranks;
+  for (const auto &fm : predictor.samples) {
+    if (static_cast<bool>(fm.feature_ranks) != static_cast<bool>(ranks) ||
+        (ranks && *fm.feature_ranks != *ranks)) {
+      throw std::invalid_argument(
+          "The samples of a predictor differ in their feature ranks.");
+    }
+  }
+  os.write(PREDICTOR_MAGIC, sizeof(PREDICTOR_MAGIC));
+  if (ranks) {
+    write_pod<uint32_t>(os, RANKED_PREDICTOR_FORMAT_VERSION);
+  } else {
+    write_pod<uint32_t>(os, mask ? MASKED_PREDICTOR_FORMAT_VERSION
+                                 : PREDICTOR_FORMAT_VERSION);
+  }
+  write_pod<uint32_t>(os, sizeof(Real));
+  write_pod<int32_t>(os, static_cast<int32_t>(predictor.type));
+  write_pod<uint64_t>(os, predictor.rank);
+  write_pod<uint64_t>(os, predictor.feature_size);
+  write_pod<uint64_t>(os, predictor.samples.size());
+  if (ranks) {
+    write_pod<uint32_t>(os, HAS_RANKS | (mask ? HAS_MASK : 0));
+  }
+  if (mask) {
+    write_mask(os, *mask);
+  }
+  if (ranks) {
+    for (int rank : ranks->ranks()) {
+      write_pod<uint32_t>(os, rank);
+    }
+  }
+  vector<Real> ranked_V;
+  for (const auto &fm : predictor.samples) {
+    write_pod<Real>(os, fm.w0);
+    write_array(os, fm.w.data(), fm.w.rows());
+    if (!ranks) {
+      write_array(os, fm.V.data(), fm.V.size());
+    } else if (fm.is_compact()) {
+      write_array(os, fm.ranked_V.data(), fm.ranked_V.size());
+    } else {
+      ranked_V.clear();
+      for (size_t feature = 0; feature < ranks->size(); feature++) {
+        const auto v = fm.V_row(feature);
+        for (int f = 0; f < v.size(); f++) {
+          ranked_V.push_back(v(f));
+        }
+      }
+      write_array(os, ranked_V.data(), ranked_V.size());
+    }
+    write_pod<uint64_t>(os, fm.cutpoints.size());
+    for (const auto &cutpoint : fm.cutpoints) {
+      write_pod<uint64_t>(os, cutpoint.rows());
+      write_array(os, cutpoint.data(), cutpoint.rows());
+    }
+  }
+  if (!os) {
+    throw std::ios_base::failure("Failed to write the predictor.");
+  }
+}
+
+template <typename Real>
+inline Predictor<Real> load_predictor(std::istream &is) {
+  using FMType = FM<Real>;
+  using Vector = typename FMType::Vector;
+  using DenseMatrix = typename FMType::DenseMatrix;
+  using TASKTYPE = typename FMLearningConfig<Real>::TASKTYPE;
+
+  char magic[sizeof(PREDICTOR_MAGIC)];
+  is.read(magic, sizeof(magic));
+  if (!is || std::memcmp(magic, PREDICTOR_MAGIC, sizeof(magic)) != 0) {
+    throw std::invalid_argument("Not a myFM predictor stream.");
+  }
+  uint32_t version = read_pod<uint32_t>(is);
+  if (version != PREDICTOR_FORMAT_VERSION &&
+      version != MASKED_PREDICTOR_FORMAT_VERSION &&
+      version != RANKED_PREDICTOR_FORMAT_VERSION) {
+    throw std::invalid_argument(
+        StringBuilder{}("Unsupported predictor format version ")(version)
+            .build());
+  }
+  uint32_t real_size = read_pod<uint32_t>(is);
+  if (real_size != sizeof(Real)) {
+    throw std::invalid_argument(
+        StringBuilder{}("Predictor stored with ")(real_size)(
+            "-byte floats but ")(sizeof(Real))("-byte floats are requested.")
+            .build());
+  }
+  int32_t task_type = read_pod<int32_t>(is);
+  if (task_type < 0 || task_type > static_cast<int32_t>(TASKTYPE::ORDERED)) {
+    throw std::invalid_argument("Unknown task type in predictor stream.");
+  }
+  size_t rank = read_pod<uint64_t>(is);
+  size_t feature_size = read_pod<uint64_t>(is);
+  size_t n_samples = read_pod<uint64_t>(is);
+
+  uint32_t flags = 0;
+  if (version == MASKED_PREDICTOR_FORMAT_VERSION) {
+    flags = HAS_MASK;
+  } else if (version == RANKED_PREDICTOR_FORMAT_VERSION) {
+    flags = read_pod<uint32_t>(is);
+  }
+  std::shared_ptr<const InteractionMask> mask;
+  if (flags & HAS_MASK) {
+    mask = read_mask(is, feature_size);
+  }
+  std::shared_ptr<const FeatureRanks> ranks;
+  if (flags & HAS_RANKS) {
+    vector<int> feature_ranks(feature_size);
+    for (auto &feature_rank : feature_ranks) {
+      uint32_t value = read_pod<uint32_t>(is);
+      if (value > rank) {
+        throw std::invalid_argument(
+            "A feature rank exceeds the rank in predictor stream.");
+      }
+      feature_rank = static_cast<int>(value);
+    }
+    ranks = std::make_shared<const FeatureRanks>(feature_ranks);
+  }
+
+  Predictor<Real> predictor(rank, feature_size,
+                            static_cast<TASKTYPE>(task_type));
+  vector<FMType> samples;
+  samples.reserve(n_samples);
+  for (size_t i = 0; i < n_samples; i++) {
+    Real w0 = read_pod<Real>(is);
+    Vector w(feature_size);
+    read_array(is, w.data(), feature_size);
+    // with ranks the sample is read compact, V staying empty.
+    DenseMatrix V(ranks ? 0 : feature_size, rank);
+    Vector ranked_V(ranks ? ranks->n_entries() : 0);
+    read_array(is, V.data(), V.size());
+    read_array(is, ranked_V.data(), ranked_V.size());
+    size_t n_cutpoints = read_pod<uint64_t>(is);
+    vector<Vector> cutpoints;
+    for (size_t c = 0; c < n_cutpoints; c++) {
+      size_t size = read_pod<uint64_t>(is);
+      Vector cutpoint(size);
+      read_array(is, cutpoint.data(), size);
+      cutpoints.emplace_back(std::move(cutpoint));
+    }
+    samples.emplace_back(w0, w, V, cutpoints);
+    samples.back().mask = mask;
+    samples.back().feature_ranks = ranks;
+    samples.back().ranked_V = std::move(ranked_V);
+  }
+  predictor.set_samples(std::move(samples));
+  return predictor;
+}
+
+template <typename Real>
+inline void save_predictor(const Predictor<Real> &predictor,
+                           const std::string &path) {
+  std::ofstream ofs(path, std::ios::binary);
+  if (!ofs) {
+    throw std::ios_base::failure(
+        StringBuilder{}("Could not open ")(path)(" for writing.").build());
+  }
+  save_predictor(predictor, ofs);
+}
+
+template <typename Real>
+inline Predictor<Real> load_predictor(const std::string &path) {
+  std::ifstream ifs(path, std::ios::binary);
+  if (!ifs) {
+    throw std::ios_base::failure(
+        StringBuilder{}("Could not open ")(path)(" for reading.").build());
+  }
+  return load_predictor<Real>(ifs);
+}
+
+} // namespace serialization
+} // namespace myFM
@@ -0,0 +1,586 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <ios>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "FM.hpp"
+#include "FMLearningConfig.hpp"
+#include "definitions.hpp"
+#include "predictor.hpp"
+#include "special.hpp"
+#include "trace.hpp"
+#include "util.hpp"
+
+namespace myFM {
+using namespace std;
+
+/*
+A Gibbs predictor whose samples live in memory shared between processes,
+so that pre-forked workers score from one copy of the tensors. The segment
+is either a named POSIX shared-memory object or a file that is mapped
+read-only (and shared through the page cache) and left to its owner.
+
+A named segment is reference counted in its header. The handle that
+create returns holds the first reference and each attach adds one; a
+handle gives its reference back when it is released in the process that
+took it, and the last one removes the name. Workers may therefore attach
+for as long as any handle, the creator's or another worker's, is alive.
+unlink removes the name earlier; handles stay valid after the name is
+gone. A handle inherited through fork holds no reference of its own; each
+worker attaches by name instead.
+
+  SegmentHeader (below), padded to SEGMENT_ALIGNMENT
+  uint64[]    where each feature's factors start in V (feature_size + 1),
+              padded
+  n_samples x {
+    Real      w0, padded
+    Real[]    w (feature_size), padded
+    Real[]    V (n_entries), padded
+  }
+
+in host byte order. V is stored feature by feature, each feature holding
+its leading feature_rank factors (rank of them without feature_ranks), so
+that each stored entry of a row reads one contiguous run. Interaction
+masks and ordered probit predictors are not supported.
+*/
+template <typename Real> class SharedPredictor {
+public:
+  typedef Predictor<Real> PredictorType;
+  typedef typename PredictorType::TASKTYPE TASKTYPE;
+  typedef typename PredictorType::SparseMatrix SparseMatrix;
+  typedef typename PredictorType::Vector Vector;
+  typedef typename PredictorType::RelationBlock RelationBlock;
+  typedef typename FM<Real>::DenseMatrix DenseMatrix;
+  typedef Eigen::Matrix<Real, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>
+      RowMajorMatrix;
+
+  static constexpr size_t SEGMENT_ALIGNMENT = 64;
+  static constexpr uint32_t SEGMENT_FORMAT_VERSION = 3;
+
+  struct SegmentHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t real_size;
+    int32_t task_type;
+    uint32_t padding;
+    uint64_t rank, feature_size, n_samples;
+    uint64_t n_entries;     // factors stored per sample
+    uint64_t sample_stride; // bytes per sample
+    uint64_t total_size;
+    // references held on a shared-memory segment, the name being removed
+    // when it drops to zero; unused for files.
+    std::atomic<uint64_t> attached;
+  };
+
+  SharedPredictor(const SharedPredictor &) = delete;
+  SharedPredictor &operator=(const SharedPredictor &) = delete;
+
+  /*
+  Places the predictor's samples in a new shared-memory object `name`
+  ("/name" on most systems). The handle returned holds the first reference:
+  keep it until a worker has attached.
+  */
+  inline static std::unique_ptr<SharedPredictor>
+  create(const PredictorType &predictor, const string &name) {
+#ifdef _WIN32
+    throw std::runtime_error(NOT_SUPPORTED);
+#else
+    const size_t size = segment_size(predictor);
+    const int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) {
+      throw std::runtime_error(StringBuilder{}(
+                                   "Could not create the shared segment ")(
+                                   name)(".")
+                                   .build());
+    }
+    void *address = MAP_FAILED;
+    if (ftruncate(fd, static_cast<off_t>(size)) == 0) {
+      address = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (address == MAP_FAILED) {
+      shm_unlink(name.c_str());
+      throw std::runtime_error(StringBuilder{}(
+                                   "Could not size or map the shared segment ")(
+                                   name)(".")
+                                   .build());
+    }
+    // the reference of the handle returned is counted before the magic is
+    // written, so that no worker can release the segment in between.
+    fill(predictor, static_cast<char *>(address), 1);
+    munmap(address, size);
+    std::unique_ptr<SharedPredictor> result;
+    try {
+      result = open_named(name);
+    } catch (...) {
+      shm_unlink(name.c_str());
+      throw;
+    }
+    result->attached_pid_ = getpid();
+    result->owner_ = true;
+    return result;
+#endif
+  }
+
+  /*
+  Attaches to a segment made by create, in this or another process, taking
+  a reference on it.
+  */
+  inline static std::unique_ptr<SharedPredictor> attach(const string &name) {
+#ifdef _WIN32
+    throw std::runtime_error(NOT_SUPPORTED);
+#else
+    std::unique_ptr<SharedPredictor> result = open_named(name);
+    std::atomic<uint64_t> &count = result->writable_header().attached;
+    uint64_t seen = count.load();
+    do {
+      // the last reference is gone and the name is being removed.
+      if (seen == 0) {
+        throw std::runtime_error(StringBuilder{}("The shared segment ")(name)(
+                                     " has been released.")
+                                     .build());
+      }
+    } while (!count.compare_exchange_weak(seen, seen + 1));
+    result->attached_pid_ = getpid();
+    return result;
+#endif
+  }
+
+  /* Writes the segment layout to `path`, for map_file. */
+  inline static void write_file(const PredictorType &predictor,
+                                const string &path) {
+    vector<char> buffer(segment_size(predictor));
+    fill(predictor, buffer.data());
+    std::ofstream ofs(path, std::ios::binary);
+    if (!ofs) {
+      throw std::ios_base::failure(
+          StringBuilder{}("Could not open ")(path)(" for writing.").build());
+    }
+    ofs.write(buffer.data(), buffer.size());
+  }
+
+  /* Maps a file written by write_file read-only. */
+  inline static std::unique_ptr<SharedPredictor>
+  map_file(const string &path) {
+#ifdef _WIN32
+    throw std::runtime_error(NOT_SUPPORTED);
+#else
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw std::ios_base::failure(
+          StringBuilder{}("Could not open ")(path)(" for reading.").build());
+    }
+    std::unique_ptr<SharedPredictor> result(new SharedPredictor());
+    try {
+      result->map(fd, false);
+    } catch (...) {
+      close(fd);
+      throw;
+    }
+    close(fd);
+    return result;
+#endif
+  }
+
+  /*
+  Removes the name of a shared-memory object, e.g. one whose handles died
+  without being released or one to be withdrawn while handles remain.
+  Those stay valid.
+  */
+  inline static void unlink(const string &name) {
+#ifndef _WIN32
+    shm_unlink(name.c_str());
+#endif
+  }
+
+  inline ~SharedPredictor() {
+#ifndef _WIN32
+    if (base_ == nullptr) {
+      return;
+    }
+    if (!name_.empty() && attached_pid_ == getpid() &&
+        writable_header().attached.fetch_sub(1) == 1) {
+      unlink_if_current();
+    }
+    if (header_page_ != nullptr) {
+      munmap(header_page_, sizeof(SegmentHeader));
+    }
+    munmap(const_cast<char *>(base_), size_);
+#endif
+  }
+
+  /*
+  What Predictor::predict returns, with the rows split among n_workers
+  threads and every row scored by all the samples in one pass.
+  */
+  inline Vector predict(const SparseMatrix &X,
+                        const vector<RelationBlock> &relations,
+                        size_t n_workers = 1) const {
+    const size_t given = check_row_consistency_return_column(X, relations);
+    if (given != feature_size()) {
+      throw std::invalid_argument(
+          StringBuilder{}("Told to predict for ")(given)(
+              " but this->feature_size is ")(feature_size())
+              .build());
+    }
+    if (relational::has_nested_relation(relations)) {
+      return predict(X, relational::flatten_relations(relations), n_workers);
+    }
+    const size_t n_rows = X.rows();
+    Vector result(n_rows);
+    auto score_rows = [this, &result, &X, &relations](size_t begin,
+                                                      size_t end) {
+      trace::TraceScope scope("predict_rows", "predict", begin);
+      vector<relational::BlockMapper::Cursor> cursors;
+      for (const auto &relation : relations) {
+        cursors.emplace_back(relation.original_to_block);
+      }
+      vector<size_t> features;
+      vector<Real> values;
+      Vector q(rank()), q_S(rank()), sample_scores(n_samples());
+      for (size_t row = begin; row < end; row++) {
+        PredictorType::gather_row(X, relations, row, cursors, features,
+                                  values);
+        for (size_t s = 0; s < n_samples(); s++) {
+          const Real *sample = sample_data(s);
+          const Real *w = sample + w_offset();
+          const Real *V = sample + V_offset();
+          Real score = sample[0];
+          q.setZero();
+          q_S.setZero();
+          for (size_t k = 0; k < features.size(); k++) {
+            const Real x = values[k];
+            score += x * w[features[k]];
+            const Real *v = V + offsets_[features[k]];
+            const size_t feature_rank =
+                offsets_[features[k] + 1] - offsets_[features[k]];
+            for (size_t f = 0; f < feature_rank; f++) {
+              const Real xv = x * v[f];
+              q(f) += xv;
+              q_S(f) += xv * xv;
+            }
+          }
+          sample_scores(s) = score + (q.squaredNorm() - q_S.sum()) / 2;
+        }
+        if (type() == TASKTYPE::CLASSIFICATION) {
+          special::normal_cdf(sample_scores.array(), sample_scores.array());
+        }
+        result(row) = sample_scores.mean();
+      }
+    };
+    n_workers = std::max<size_t>(1, std::min<size_t>(n_workers, n_rows));
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < n_workers; i++) {
+      workers.emplace_back(score_rows, n_rows * i / n_workers,
+                           n_rows * (i + 1) / n_workers);
+    }
+    score_rows(0, n_rows / n_workers);
+    for (auto &worker : workers) {
+      worker.join();
+    }
+    return result;
+  }
+
+  /* A heap copy of sample i, compact when it has feature_ranks. */
+  inline FM<Real> sample(size_t i) const {
+    if (i >= n_samples()) {
+      throw std::out_of_range("sample index out of range.");
+    }
+    const Real *data = sample_data(i);
+    Vector w = Eigen::Map<const Vector>(data + w_offset(), feature_size());
+    if (!feature_ranks_) {
+      DenseMatrix V = Eigen::Map<const RowMajorMatrix>(
+          data + V_offset(), feature_size(), rank());
+      return FM<Real>(data[0], w, V);
+    }
+    FM<Real> result(data[0], w, DenseMatrix(0, rank()));
+    result.feature_ranks = feature_ranks_;
+    result.ranked_V =
+        Eigen::Map<const Vector>(data + V_offset(), header().n_entries);
+    return result;
+  }
+
+  inline size_t rank() const { return header().rank; }
+  inline size_t feature_size() const { return header().feature_size; }
+  inline size_t n_samples() const { return header().n_samples; }
+  inline TASKTYPE type() const {
+    return static_cast<TASKTYPE>(header().task_type);
+  }
+  /* Bytes mapped, shared with the other handles. */
+  inline size_t bytes() const { return size_; }
+  /* References held on the segment, 0 for a mapped file. */
+  inline uint64_t attached() const {
+    return name_.empty() ? 0 : header().attached.load();
+  }
+  /* Whether this handle was returned by create. */
+  inline bool owner() const { return owner_; }
+  inline const string &name() const { return name_; }
+
+private:
+  SharedPredictor() = default;
+
+  static constexpr const char *NOT_SUPPORTED =
+      "Shared predictors need POSIX shared memory and mmap.";
+
+  inline static size_t padded(size_t bytes) {
+    return (bytes + SEGMENT_ALIGNMENT - 1) / SEGMENT_ALIGNMENT *
+           SEGMENT_ALIGNMENT;
+  }
+
+  inline static size_t header_size() { return padded(sizeof(SegmentHeader)); }
+
+  // bytes of the header and the feature offsets, where the samples start.
+  inline static size_t samples_offset(size_t feature_size) {
+    return header_size() + padded(sizeof(uint64_t) * (feature_size + 1));
+  }
+
+  // offsets of w and V in a sample, in Reals.
+  inline size_t w_offset() const { return padded(sizeof(Real)) / sizeof(Real); }
+  inline size_t V_offset() const {
+    return w_offset() + padded(sizeof(Real) * feature_size()) / sizeof(Real);
+  }
+
+  inline static size_t sample_stride(size_t feature_size, size_t n_entries) {
+    return padded(sizeof(Real)) + padded(sizeof(Real) * feature_size) +
+           padded(sizeof(Real) * n_entries);
+  }
+
+  /* The factors stored per sample, all of them without feature_ranks. */
+  inline static size_t n_entries(const PredictorType &predictor) {
+    const auto &ranks = predictor.samples.front().feature_ranks;
+    return ranks ? ranks->n_entries() : predictor.feature_size * predictor.rank;
+  }
+
+  inline static size_t segment_size(const PredictorType &predictor) {
+    if (predictor.type == TASKTYPE::ORDERED) {
+      throw std::invalid_argument(
+          "Ordered probit predictors cannot be shared.");
+    }
+    if (predictor.samples.empty()) {
+      throw std::invalid_argument("Told to share a predictor with no sample.");
+    }
+    const auto &ranks = predictor.samples.front().feature_ranks;
+    for (const auto &sample : predictor.samples) {
+      if (sample.mask) {
+        throw std::invalid_argument(
+            "Interaction masks are not supported in shared predictors.");
+      }
+      if (static_cast<bool>(sample.feature_ranks) != static_cast<bool>(ranks) ||
+          (ranks && *sample.feature_ranks != *ranks)) {
+        throw std::invalid_argument(
+            "The samples of a predictor differ in their feature ranks.");
+      }
+    }
+    return samples_offset(predictor.feature_size) +
+           predictor.samples.size() *
+               sample_stride(predictor.feature_size, n_entries(predictor));
+  }
+
+  /*
+  Lays the predictor out at `base` with `references` counted, the magic
+  being written last.
+  */
+  inline static void fill(const PredictorType &predictor, char *base,
+                          uint64_t references = 0) {
+    static_assert(sizeof(std::atomic<uint64_t>) == sizeof(uint64_t),
+                  "the reference count must be a plain 64-bit word.");
+    const size_t size = segment_size(predictor);
+    std::memset(base, 0, size);
+    SegmentHeader *header = reinterpret_cast<SegmentHeader *>(base);
+    header->version = SEGMENT_FORMAT_VERSION;
+    header->real_size = sizeof(Real);
+    header->task_type = static_cast<int32_t>(predictor.type);
+    header->rank = predictor.rank;
+    header->feature_size = predictor.feature_size;
+    header->n_samples = predictor.samples.size();
+    header->n_entries = n_entries(predictor);
+    header->sample_stride =
+        sample_stride(predictor.feature_size, header->n_entries);
+    header->total_size = size;
+    new (&header->attached) std::atomic<uint64_t>(references);
+    uint64_t *offsets = reinterpret_cast<uint64_t *>(base + header_size());
+    for (size_t feature = 0; feature < predictor.feature_size; feature++) {
+      offsets[feature + 1] =
+          offsets[feature] + predictor.samples.front().feature_rank(feature);
+    }
+    for (size_t i = 0; i < predictor.samples.size(); i++) {
+      const FM<Real> &sample = predictor.samples[i];
+      Real *data = reinterpret_cast<Real *>(
+          base + samples_offset(predictor.feature_size) +
+          i * header->sample_stride);
+      data[0] = sample.w0;
+      const size_t w_at = padded(sizeof(Real)) / sizeof(Real);
+      const size_t V_at =
+          w_at + padded(sizeof(Real) * predictor.feature_size) / sizeof(Real);
+      Eigen::Map<Vector>(data + w_at, predictor.feature_size) = sample.w;
+      for (size_t feature = 0; feature < predictor.feature_size; feature++) {
+        const auto v = sample.V_row(feature);
+        Eigen::Map<Vector>(data + V_at + offsets[feature], v.size()) =
+            v.transpose();
+      }
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+    std::memcpy(header->magic, SEGMENT_MAGIC, sizeof(header->magic));
+  }
+
+#ifndef _WIN32
+  /* Maps the shared-memory object `name` without taking a reference. */
+  inline static std::unique_ptr<SharedPredictor>
+  open_named(const string &name) {
+    const int fd = shm_open(name.c_str(), O_RDWR, 0);
+    if (fd < 0) {
+      throw std::runtime_error(StringBuilder{}("No shared segment ")(name)(
+                                   " to attach to.")
+                                   .build());
+    }
+    std::unique_ptr<SharedPredictor> result(new SharedPredictor());
+    result->name_ = name;
+    try {
+      result->map(fd, true);
+    } catch (...) {
+      close(fd);
+      throw;
+    }
+    close(fd);
+    return result;
+  }
+
+  /*
+  Removes name_ as long as it still names this segment, and not one that
+  was created under the same name after an unlink.
+  */
+  inline void unlink_if_current() const {
+    const int fd = shm_open(name_.c_str(), O_RDONLY, 0);
+    if (fd < 0) {
+      return;
+    }
+    struct stat info;
+    if (fstat(fd, &info) == 0 &&
+        static_cast<uint64_t>(info.st_dev) == device_ &&
+        static_cast<uint64_t>(info.st_ino) == inode_) {
+      shm_unlink(name_.c_str());
+    }
+    close(fd);
+  }
+
+  /*
+  Maps the segment read-only and, for a shared-memory object, its header
+  writable as well, for the reference count.
+  */
+  inline void map(int fd, bool shared) {
+    struct stat info;
+    if (fstat(fd, &info) != 0 ||
+        static_cast<size_t>(info.st_size) < header_size()) {
+      throw std::runtime_error("Not a shared predictor segment.");
+    }
+    size_ = info.st_size;
+    void *address = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+    if (address == MAP_FAILED) {
+      throw std::runtime_error("Could not map the shared predictor.");
+    }
+    base_ = static_cast<const char *>(address);
+    const SegmentHeader &h = header();
+    if (std::memcmp(h.magic, SEGMENT_MAGIC, sizeof(h.magic)) != 0 ||
+        h.version != SEGMENT_FORMAT_VERSION || h.real_size != sizeof(Real) ||
+        h.total_size != size_ ||
+        h.sample_stride != sample_stride(h.feature_size, h.n_entries) ||
+        samples_offset(h.feature_size) + h.n_samples * h.sample_stride !=
+            size_) {
+      throw std::runtime_error(
+          "Not a shared predictor segment for this precision, or one that "
+          "is still being written.");
+    }
+    read_offsets();
+    if (shared) {
+      void *page = mmap(nullptr, sizeof(SegmentHeader), PROT_READ | PROT_WRITE,
+                        MAP_SHARED, fd, 0);
+      if (page == MAP_FAILED) {
+        throw std::runtime_error("Could not map the shared predictor header.");
+      }
+      header_page_ = page;
+      device_ = static_cast<uint64_t>(info.st_dev);
+      inode_ = static_cast<uint64_t>(info.st_ino);
+    }
+  }
+#endif
+
+  inline const SegmentHeader &header() const {
+    return *reinterpret_cast<const SegmentHeader *>(base_);
+  }
+
+  inline SegmentHeader &writable_header() {
+    return *reinterpret_cast<SegmentHeader *>(header_page_);
+  }
+
+  inline const Real *sample_data(size_t i) const {
+    return reinterpret_cast<const Real *>(
+        base_ + samples_offset(feature_size()) + i * header().sample_stride);
+  }
+
+  /*
+  Checks the feature offsets of a mapped segment and, when some feature
+  uses fewer than rank factors, keeps the ranks for sample.
+  */
+  inline void read_offsets() {
+    offsets_ = reinterpret_cast<const uint64_t *>(base_ + header_size());
+    vector<int> ranks(feature_size());
+    bool ranked = false;
+    for (size_t feature = 0; feature < feature_size(); feature++) {
+      if (offsets_[feature + 1] < offsets_[feature] ||
+          offsets_[feature + 1] - offsets_[feature] > rank()) {
+        throw std::runtime_error("Corrupt feature offsets in shared segment.");
+      }
+      ranks[feature] = static_cast<int>(offsets_[feature + 1] -
+                                        offsets_[feature]);
+      ranked = ranked || static_cast<size_t>(ranks[feature]) != rank();
+    }
+    if (offsets_[0] != 0 || offsets_[feature_size()] != header().n_entries) {
+      throw std::runtime_error("Corrupt feature offsets in shared segment.");
+    }
+    if (ranked) {
+      feature_ranks_ = std::make_shared<const FeatureRanks>(ranks);
+    }
+  }
+
+  static constexpr char SEGMENT_MAGIC[8] = {'M', 'Y', 'F', 'M',
+                                            'S', 'H', 'M', '1'};
+
+  string name_;
+  const char *base_ = nullptr;
+  size_t size_ = 0;
+  void *header_page_ = nullptr;
+  const uint64_t *offsets_ = nullptr;
+  std::shared_ptr<const FeatureRanks> feature_ranks_;
+  // the identity of a shared-memory object, see unlink_if_current.
+  uint64_t device_ = 0, inode_ = 0;
+  int64_t attached_pid_ = -1;
+  bool owner_ = false;
+};
+
+template <typename Real>
+constexpr size_t SharedPredictor<Real>::SEGMENT_ALIGNMENT;
+template <typename Real>
+constexpr uint32_t SharedPredictor<Real>::SEGMENT_FORMAT_VERSION;
+template <typename Real>
+constexpr const char *SharedPredictor<Real>::NOT_SUPPORTED;
+template <typename Real> constexpr char SharedPredictor<Real>::SEGMENT_MAGIC[8];
+
+} // namespace myFM
@@ -0,0 +1,480 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+
+#include <Eigen/Core>
+
+#include "Faddeeva/Faddeeva.hh"
+#include "definitions.hpp"
+
+namespace myFM {
+namespace special {
+using namespace std;
+
+/*
+Vectorised special functions of the normal distribution, for the probit
+paths (classification probabilities and the ordered probit cutpoint
+likelihood). The kernels are written on fixed-size Eigen arrays of
+PACKET_SIZE elements, so that they compile to SIMD code with the whole
+evaluation kept in registers, instead of one Faddeeva call per case.
+
+All of them are built on erfcx(z) = exp(z^2) erfc(z) for z >= 0, evaluated
+with the Chebyshev fit of Numerical Recipes (3rd ed., Sec. 6.2.2) in
+t = 2 / (2 + z). Its relative error is below 2e-15 on [0, inf), on par with
+Faddeeva::erfcx, and it needs no range split, hence no branches; where a
+function has several regimes, every lane computes all of them and blends.
+*/
+
+template <typename Real> using Array = Eigen::Array<Real, Eigen::Dynamic, 1>;
+
+constexpr Eigen::Index PACKET_SIZE = 8;
+
+template <typename Real> using Packet = Eigen::Array<Real, PACKET_SIZE, 1>;
+
+namespace detail {
+
+constexpr int N_ERFCX_COEFFICIENTS = 28;
+constexpr double ERFCX_COEFFICIENTS[N_ERFCX_COEFFICIENTS] = {
+    -1.3026537197817094,  6.4196979235649026e-1, 1.9476473204185836e-2,
+    -9.561514786808631e-3, -9.46595344482036e-4, 3.66839497852761e-4,
+    4.2523324806907e-5,   -2.0278578112534e-5,   -1.624290004647e-6,
+    1.303655835580e-6,    1.5626441722e-8,       -8.5238095915e-8,
+    6.529054439e-9,       5.059343495e-9,        -9.91364156e-10,
+    -2.27365122e-10,      9.6467911e-11,         2.394038e-12,
+    -6.886027e-12,        8.94487e-13,           3.13092e-13,
+    -1.12708e-13,         3.81e-16,              7.106e-15,
+    -1.523e-15,           -9.4e-17,              1.21e-16,
+    -2.8e-17};
+
+// 2 / sqrt(pi)
+constexpr double TWO_OVER_SQRTPI = 1.1283791670955126;
+constexpr double SQRT_HALF = 0.7071067811865476;
+// phi(x) / Phi(x) = INVERSE_MILLS_FACTOR / erfcx(-x / sqrt(2))
+constexpr double INVERSE_MILLS_FACTOR = 0.7978845608028654;
+
+// (-1)^n / (n! (2n + 1)), the Taylor coefficients of erf(z) sqrt(pi) / 2z.
+constexpr int N_ERF_SERIES_COEFFICIENTS = 13;
+constexpr double ERF_SERIES_COEFFICIENTS[N_ERF_SERIES_COEFFICIENTS] = {
+    1.0,
+    -1.0 / 3,
+    1.0 / 10,
+    -1.0 / 42,
+    1.0 / 216,
+    -1.0 / 1320,
+    1.0 / 9360,
+    -1.0 / 75600,
+    1.0 / 685440,
+    -1.0 / 6894720,
+    1.0 / 76204800,
+    -1.0 / 918086400,
+    1.0 / 11975040000.0};
+
+/*
+(v > 0) ? a : b lane by lane. Written as a plain loop, which compilers turn
+into a blend, as Eigen's select() is not vectorised.
+*/
+template <typename Real>
+inline Packet<Real> where_positive(const Packet<Real> &v,
+                                   const Packet<Real> &a,
+                                   const Packet<Real> &b) {
+  Packet<Real> result;
+  for (Eigen::Index lane = 0; lane < PACKET_SIZE; lane++) {
+    result(lane) = v(lane) > 0 ? a(lane) : b(lane);
+  }
+  return result;
+}
+
+/* erfcx(z) for z >= 0, by Clenshaw's recurrence. */
+template <typename Real>
+inline Packet<Real> erfcx_nonnegative(const Packet<Real> &z) {
+  const Packet<Real> t = Real(2) / (Real(2) + z);
+  const Packet<Real> ty = Real(4) * t - Real(2);
+  Packet<Real> d = Packet<Real>::Zero(), dd = Packet<Real>::Zero();
+  for (int j = N_ERFCX_COEFFICIENTS - 1; j > 0; j--) {
+    const Packet<Real> previous = d;
+    // grouped so that only one multiply-add is on the critical path.
+    d = ty * d + (static_cast<Real>(ERFCX_COEFFICIENTS[j]) - dd);
+    dd = previous;
+  }
+  return t *
+         (Real(0.5) * (static_cast<Real>(ERFCX_COEFFICIENTS[0]) + ty * d) -
+          dd)
+             .exp();
+}
+
+/*
+erf(z) for z >= 0, given erfc(z). The Taylor series is used below 0.5,
+where 1 - erfc(z) would lose the relative accuracy.
+*/
+template <typename Real>
+inline Packet<Real> erf_nonnegative(const Packet<Real> &z,
+                                    const Packet<Real> &erfc_z) {
+  const Packet<Real> z2 = z.square();
+  Packet<Real> series = Packet<Real>::Zero();
+  for (int n = N_ERF_SERIES_COEFFICIENTS - 1; n >= 0; n--) {
+    series = series * z2 + static_cast<Real>(ERF_SERIES_COEFFICIENTS[n]);
+  }
+  return where_positive<Real>(
+      Real(0.5) - z, static_cast<Real>(TWO_OVER_SQRTPI) * z * series,
+      Real(1) - erfc_z);
+}
+
+template <typename Real> inline Packet<Real> erf(const Packet<Real> &x) {
+  const Packet<Real> z = x.abs();
+  const Packet<Real> e = erf_nonnegative<Real>(
+      z, (-z.square()).exp() * erfcx_nonnegative<Real>(z));
+  return where_positive<Real>(x, e, -e);
+}
+
+template <typename Real> inline Packet<Real> erfc(const Packet<Real> &x) {
+  const Packet<Real> z = x.abs();
+  const Packet<Real> c = (-z.square()).exp() * erfcx_nonnegative<Real>(z);
+  return where_positive<Real>(x, c, Real(2) - c);
+}
+
+template <typename Real> inline Packet<Real> erfcx(const Packet<Real> &x) {
+  const Packet<Real> cx = erfcx_nonnegative<Real>(x.abs());
+  return where_positive<Real>(x, cx, Real(2) * x.square().exp() - cx);
+}
+
+template <typename Real>
+inline Packet<Real> normal_cdf(const Packet<Real> &x) {
+  return Real(0.5) * erfc<Real>(x * static_cast<Real>(-SQRT_HALF));
+}
+
+/*
+log Phi(x) and phi(x) / Phi(x) from a single erfcx. As in
+OprobitSampler::safe_lcdf, log Phi(x) is -x^2 / 2 + log(erfcx(-x / sqrt(2))
+/ 2) in the lower half, so that it does not underflow, and
+log1p(-erfc(x / sqrt(2)) / 2) in the upper half.
+*/
+template <typename Real>
+inline void log_normal_cdf_and_inverse_mills(const Packet<Real> &x,
+                                             Packet<Real> &log_cdf,
+                                             Packet<Real> &ratio) {
+  const Real factor = static_cast<Real>(INVERSE_MILLS_FACTOR);
+  const Packet<Real> half_x2 = Real(0.5) * x.square();
+  const Packet<Real> exp_half_x2 = (-half_x2).exp();
+  const Packet<Real> cx =
+      erfcx_nonnegative<Real>(x.abs() * static_cast<Real>(SQRT_HALF));
+  const Packet<Real> upper_tail = Real(0.5) * exp_half_x2 * cx;
+  log_cdf = where_positive<Real>(x, (-upper_tail).log1p(),
+                                 (Real(0.5) * cx).log() - half_x2);
+  // phi(x) = factor exp(-x^2 / 2) / 2.
+  ratio = where_positive<Real>(x, Real(0.5) * exp_half_x2 /
+                                      (Real(1) - upper_tail),
+                               cx.inverse()) *
+          factor;
+}
+
+/* See log_normal_cdf_diff below. */
+template <typename Real>
+inline void log_normal_cdf_diff(const Packet<Real> &a, const Packet<Real> &b,
+                                Packet<Real> &log_diff, Packet<Real> &ratio_a,
+                                Packet<Real> &ratio_b) {
+  const Real sqrt_half = static_cast<Real>(SQRT_HALF);
+  const Real factor = static_cast<Real>(INVERSE_MILLS_FACTOR);
+  // the ends after mirroring (a < 0), so that upper >= 0.
+  const Packet<Real> upper = where_positive<Real>(-a, -b, a);
+  const Packet<Real> lower = where_positive<Real>(-a, -a, b);
+  const Packet<Real> half_upper2 = Real(0.5) * upper.square();
+  const Packet<Real> half_lower2 = Real(0.5) * lower.square();
+  const Packet<Real> exp_upper = (-half_upper2).exp();
+  const Packet<Real> exp_lower = (-half_lower2).exp();
+  const Packet<Real> z_upper = upper * sqrt_half;
+  const Packet<Real> z_lower = lower.abs() * sqrt_half;
+  const Packet<Real> cx_upper = erfcx_nonnegative<Real>(z_upper);
+  const Packet<Real> cx_lower = erfcx_nonnegative<Real>(z_lower);
+
+  // lower > 0: both ends in the upper tail.
+  const Packet<Real> scale = (half_lower2 - half_upper2).exp();
+  const Packet<Real> tail = cx_lower - scale * cx_upper;
+  // lower <= 0 <= upper: erf(upper) + erf(-lower) does not cancel.
+  const Packet<Real> central =
+      erf_nonnegative<Real>(z_upper, exp_upper * cx_upper) +
+      erf_nonnegative<Real>(z_lower, exp_lower * cx_lower);
+
+  const Packet<Real> denominator = where_positive<Real>(lower, tail, central);
+  const Packet<Real> inverse = factor / denominator;
+  const Packet<Real> ratio_upper =
+      inverse * where_positive<Real>(lower, scale, exp_upper);
+  const Packet<Real> ratio_lower =
+      inverse *
+      where_positive<Real>(lower, Packet<Real>::Ones(), exp_lower);
+
+  log_diff = (Real(0.5) * denominator).log() -
+             where_positive<Real>(lower, half_lower2, Packet<Real>::Zero());
+  ratio_a = where_positive<Real>(-a, ratio_lower, ratio_upper);
+  ratio_b = where_positive<Real>(-a, ratio_upper, ratio_lower);
+}
+
+/*
+Loads and stores packets of arrays of a given size, padding the last one
+with zeros.
+*/
+template <typename Real> struct PacketLoader {
+  inline PacketLoader(Eigen::Index size) : size(size) {}
+
+  inline Eigen::Index packet_size(Eigen::Index begin) const {
+    return std::min(PACKET_SIZE, size - begin);
+  }
+
+  template <typename Derived>
+  inline Packet<Real> load(const Eigen::ArrayBase<Derived> &x,
+                           Eigen::Index begin) const {
+    if (begin + PACKET_SIZE <= size) {
+      return x.template segment<PACKET_SIZE>(begin);
+    }
+    Packet<Real> result = Packet<Real>::Zero();
+    result.head(packet_size(begin)) = x.segment(begin, packet_size(begin));
+    return result;
+  }
+
+  template <typename Derived>
+  inline void store(const Packet<Real> &value,
+                    const Eigen::ArrayBase<Derived> &out_,
+                    Eigen::Index begin) const {
+    // out is taken by const reference so that temporaries like v.array()
+    // bind to it, as in Eigen's "Writing Functions Taking Eigen Types".
+    Eigen::ArrayBase<Derived> &out =
+        const_cast<Eigen::ArrayBase<Derived> &>(out_);
+    if (begin + PACKET_SIZE <= size) {
+      out.template segment<PACKET_SIZE>(begin) = value;
+    } else {
+      out.segment(begin, packet_size(begin)) = value.head(packet_size(begin));
+    }
+  }
+
+  const Eigen::Index size;
+};
+
+template <typename Real, typename Derived, typename OutDerived>
+inline void apply(const Eigen::ArrayBase<Derived> &x,
+                  const Eigen::ArrayBase<OutDerived> &out,
+                  Packet<Real> (*kernel)(const Packet<Real> &)) {
+  const PacketLoader<Real> loader(x.size());
+  for (Eigen::Index begin = 0; begin < x.size(); begin += PACKET_SIZE) {
+    loader.store(kernel(loader.load(x, begin)), out, begin);
+  }
+}
+
+} // namespace detail
+
+/*
+The packet kernels above, over whole arrays. Element-wise functions write to
+`out`, which must have the size of `x` and may be `x` itself.
+*/
+namespace vectorised {
+
+template <typename Derived, typename OutDerived>
+inline void erf(const Eigen::ArrayBase<Derived> &x,
+                const Eigen::ArrayBase<OutDerived> &out) {
+  typedef typename Derived::Scalar Real;
+  detail::apply<Real>(x, out, &detail::erf<Real>);
+}
+
+template <typename Derived, typename OutDerived>
+inline void erfc(const Eigen::ArrayBase<Derived> &x,
+                 const Eigen::ArrayBase<OutDerived> &out) {
+  typedef typename Derived::Scalar Real;
+  detail::apply<Real>(x, out, &detail::erfc<Real>);
+}
+
+template <typename Derived, typename OutDerived>
+inline void erfcx(const Eigen::ArrayBase<Derived> &x,
+                  const Eigen::ArrayBase<OutDerived> &out) {
+  typedef typename Derived::Scalar Real;
+  detail::apply<Real>(x, out, &detail::erfcx<Real>);
+}
+
+template <typename Derived, typename OutDerived>
+inline void normal_cdf(const Eigen::ArrayBase<Derived> &x,
+                       const Eigen::ArrayBase<OutDerived> &out) {
+  typedef typename Derived::Scalar Real;
+  detail::apply<Real>(x, out, &detail::normal_cdf<Real>);
+}
+
+template <typename Real>
+inline void log_normal_cdf(const Array<Real> &x, Array<Real> &log_cdf,
+                           Array<Real> &ratio) {
+  const detail::PacketLoader<Real> loader(x.size());
+  log_cdf.resize(x.size());
+  ratio.resize(x.size());
+  Packet<Real> log_cdf_p, ratio_p;
+  for (Eigen::Index begin = 0; begin < x.size(); begin += PACKET_SIZE) {
+    detail::log_normal_cdf_and_inverse_mills<Real>(loader.load(x, begin),
+                                                   log_cdf_p, ratio_p);
+    loader.store(log_cdf_p, log_cdf, begin);
+    loader.store(ratio_p, ratio, begin);
+  }
+}
+
+template <typename Real>
+inline void log_normal_cdf_diff(const Array<Real> &a, const Array<Real> &b,
+                                Array<Real> &log_diff, Array<Real> &ratio_a,
+                                Array<Real> &ratio_b) {
+  const detail::PacketLoader<Real> loader(a.size());
+  log_diff.resize(a.size());
+  ratio_a.resize(a.size());
+  ratio_b.resize(a.size());
+  Packet<Real> log_diff_p, ratio_a_p, ratio_b_p;
+  for (Eigen::Index begin = 0; begin < a.size(); begin += PACKET_SIZE) {
+    detail::log_normal_cdf_diff<Real>(loader.load(a, begin),
+                                      loader.load(b, begin), log_diff_p,
+                                      ratio_a_p, ratio_b_p);
+    loader.store(log_diff_p, log_diff, begin);
+    loader.store(ratio_a_p, ratio_a, begin);
+    loader.store(ratio_b_p, ratio_b, begin);
+  }
+}
+
+} // namespace vectorised
+
+/*
+The same functions one case at a time with Faddeeva, branching on the
+argument instead of evaluating every branch.
+*/
+namespace scalar {
+
+template <typename Derived, typename OutDerived>
+inline void erf(const Eigen::ArrayBase<Derived> &x,
+                const Eigen::ArrayBase<OutDerived> &out_) {
+  Eigen::ArrayBase<OutDerived> &out =
+      const_cast<Eigen::ArrayBase<OutDerived> &>(out_);
+  for (Eigen::Index i = 0; i < x.size(); i++) {
+    out(i) = Faddeeva::erf(x(i));
+  }
+}
+
+template <typename Derived, typename OutDerived>
+inline void erfc(const Eigen::ArrayBase<Derived> &x,
+                 const Eigen::ArrayBase<OutDerived> &out_) {
+  Eigen::ArrayBase<OutDerived> &out =
+      const_cast<Eigen::ArrayBase<OutDerived> &>(out_);
+  for (Eigen::Index i = 0; i < x.size(); i++) {
+    out(i) = Faddeeva::erfc(x(i));
+  }
+}
+
+template <typename Derived, typename OutDerived>
+inline void erfcx(const Eigen::ArrayBase<Derived> &x,
+                  const Eigen::ArrayBase<OutDerived> &out_) {
+  Eigen::ArrayBase<OutDerived> &out =
+      const_cast<Eigen::ArrayBase<OutDerived> &>(out_);
+  for (Eigen::Index i = 0; i < x.size(); i++) {
+    out(i) = Faddeeva::erfcx(x(i));
+  }
+}
+
+template <typename Derived, typename OutDerived>
+inline void normal_cdf(const Eigen::ArrayBase<Derived> &x,
+                       const Eigen::ArrayBase<OutDerived> &out_) {
+  typedef typename Derived::Scalar Real;
+  const Real sqrt_half = static_cast<Real>(detail::SQRT_HALF);
+  Eigen::ArrayBase<OutDerived> &out =
+      const_cast<Eigen::ArrayBase<OutDerived> &>(out_);
+  for (Eigen::Index i = 0; i < x.size(); i++) {
+    out(i) = Real(0.5) * std::erfc(-x(i) * sqrt_half);
+  }
+}
+
+template <typename Real>
+inline void log_normal_cdf(const Array<Real> &x, Array<Real> &log_cdf,
+                           Array<Real> &ratio) {
+  const Real sqrt_half = static_cast<Real>(detail::SQRT_HALF);
+  const Real factor = static_cast<Real>(detail::INVERSE_MILLS_FACTOR);
+  log_cdf.resize(x.size());
+  ratio.resize(x.size());
+  for (Eigen::Index i = 0; i < x.size(); i++) {
+    const Real half_x2 = x(i) * x(i) / 2;
+    if (x(i) > 0) {
+      const Real upper_tail =
+          std::exp(-half_x2) * Faddeeva::erfcx(x(i) * sqrt_half) / 2;
+      log_cdf(i) = std::log1p(-upper_tail);
+      ratio(i) = factor * std::exp(-half_x2) / 2 / (1 - upper_tail);
+    } else {
+      const Real cx = Faddeeva::erfcx(-x(i) * sqrt_half);
+      log_cdf(i) = std::log(cx / 2) - half_x2;
+      ratio(i) = factor / cx;
+    }
+  }
+}
+
+template <typename Real>
+inline void log_normal_cdf_diff(const Array<Real> &a, const Array<Real> &b,
+                                Array<Real> &log_diff, Array<Real> &ratio_a,
+                                Array<Real> &ratio_b) {
+  const Real sqrt_half = static_cast<Real>(detail::SQRT_HALF);
+  const Real factor = static_cast<Real>(detail::INVERSE_MILLS_FACTOR);
+  log_diff.resize(a.size());
+  ratio_a.resize(a.size());
+  ratio_b.resize(a.size());
+  for (Eigen::Index i = 0; i < a.size(); i++) {
+    const bool flip = a(i) < 0;
+    const Real upper = flip ? -b(i) : a(i), lower = flip ? -a(i) : b(i);
+    Real denominator, ratio_upper, ratio_lower;
+    if (lower > 0) {
+      const Real scale = std::exp((lower * lower - upper * upper) / 2);
+      denominator = Faddeeva::erfcx(lower * sqrt_half) -
+                    scale * Faddeeva::erfcx(upper * sqrt_half);
+      log_diff(i) = std::log(denominator / 2) - lower * lower / 2;
+      ratio_upper = factor * scale / denominator;
+      ratio_lower = factor / denominator;
+    } else {
+      denominator = Faddeeva::erf(upper * sqrt_half) -
+                    Faddeeva::erf(lower * sqrt_half);
+      log_diff(i) = std::log(denominator / 2);
+      ratio_upper = factor * std::exp(-upper * upper / 2) / denominator;
+      ratio_lower = factor * std::exp(-lower * lower / 2) / denominator;
+    }
+    ratio_a(i) = flip ? ratio_lower : ratio_upper;
+    ratio_b(i) = flip ? ratio_upper : ratio_lower;
+  }
+}
+
+} // namespace scalar
+
+/*
+The entry points. Without FMA (e.g. the x86-64 baseline), the 27 dependent
+steps of the Chebyshev recurrence cost more than the table-driven scalar
+Faddeeva, so the packet kernels are only used when the target has FMA
+(-march=native or -mfma), unless MYFM_VECTORISE_SPECIAL says otherwise.
+
+  erf, erfc, erfcx: element-wise.
+  normal_cdf: Phi(x), element-wise.
+  log_normal_cdf(x, log_cdf, ratio): log Phi(x), accurate far into both
+    tails, and the inverse Mills ratio phi(x) / Phi(x) = d log Phi(x) / dx.
+  log_normal_cdf_diff(a, b, log_diff, ratio_a, ratio_b): for a > b,
+    log(Phi(a) - Phi(b)) and phi(a) / (Phi(a) - Phi(b)), phi(b) / (Phi(a) -
+    Phi(b)), with the case analysis of OprobitSampler::safe_ldiff: when both
+    are negative the interval is mirrored to (-b, -a), and when both are
+    then positive, the difference is taken between exp(b^2 / 2)-scaled
+    tails so that it does not cancel.
+*/
+#ifndef MYFM_VECTORISE_SPECIAL
+#ifdef EIGEN_VECTORIZE_FMA
+#define MYFM_VECTORISE_SPECIAL 1
+#else
+#define MYFM_VECTORISE_SPECIAL 0
+#endif
+#endif
+
+#if MYFM_VECTORISE_SPECIAL
+using vectorised::erf;
+using vectorised::erfc;
+using vectorised::erfcx;
+using vectorised::log_normal_cdf;
+using vectorised::log_normal_cdf_diff;
+using vectorised::normal_cdf;
+#else
+using scalar::erf;
+using scalar::erfc;
+using scalar::erfcx;
+using scalar::log_normal_cdf;
+using scalar::log_normal_cdf_diff;
+using scalar::normal_cdf;
+#endif
+
+} // namespace special
+} // namespace myFM
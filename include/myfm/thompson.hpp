@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+namespace myFM {
+namespace thompson {
+using namespace std;
+
+/*
+Counter-based randomness for Thompson sampling: every draw is a hash of the
+request seed and of what is drawn (a row, a coordinate), so workers need no
+generator state, and a request draws the same model whichever worker scores
+a row and however many there are.
+*/
+
+/* The splitmix64 finalizer. */
+inline uint64_t mix(uint64_t x) {
+  x += 0x9E3779B97F4A7C15ULL;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+  return x ^ (x >> 31);
+}
+
+inline uint64_t hash(uint64_t seed, uint64_t a, uint64_t b = 0) {
+  return mix(mix(seed ^ mix(a)) ^ b);
+}
+
+/* A standard normal variate by Box-Muller on the two halves of a key. */
+template <typename Real> inline Real standard_normal(uint64_t key) {
+  const double scale = 1.0 / 4294967296.0; // 2^-32
+  const uint64_t bits = mix(key);
+  // in (0, 1], so that the logarithm stays finite.
+  const double u1 = (static_cast<double>(bits >> 32) + 1) * scale;
+  const double u2 = static_cast<double>(bits & 0xFFFFFFFFULL) * scale;
+  return static_cast<Real>(std::sqrt(-2 * std::log(u1)) *
+                           std::cos(6.283185307179586 * u2));
+}
+
+/*
+The model that a posterior sample stands for. An FM sample is a draw from
+the posterior already and is read as it is; posteriors that are drawn from
+specialise this (see variational.hpp), drawing each coordinate on read from
+`key`. Coordinates are read at most once per row.
+*/
+template <class FMType> struct Draw {
+  typedef typename FMType::Vector::Scalar Real;
+  static constexpr bool draws = false;
+
+  inline Draw(const FMType &sample, uint64_t) : sample(sample) {}
+
+  inline Real w0() const { return sample.w0; }
+  inline Real w(size_t feature) const { return sample.w(feature); }
+  inline Real V(size_t feature, size_t factor) const {
+    return sample.V_at(feature, factor);
+  }
+
+  const FMType &sample;
+};
+
+template <class FMType> constexpr bool Draw<FMType>::draws;
+
+} // namespace thompson
+} // namespace myFM
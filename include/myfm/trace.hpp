@@ -0,0 +1,218 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <ios>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "util.hpp"
+
+namespace myFM {
+
+/*
+Optional timeline of what each thread is doing, written in the Chrome
+trace-event format (load the output in chrome://tracing or Perfetto).
+
+Recording is off by default; while it is off, a TraceScope costs a single
+relaxed atomic load. While it is on, each thread appends to its own
+fixed-size ring buffer, so the recording threads never contend and only the
+most recent events survive a long run. The buffer of a thread that exits
+goes back to the recorder and is taken over, events and all, by the next
+thread that starts recording, so that the short-lived workers of parallel
+prediction need as many buffers as there are threads alive at once, not one
+each.
+*/
+namespace trace {
+
+struct TraceEvent {
+  const char *name;
+  const char *category;
+  int64_t arg; // e.g. relation or sample index; negative if absent.
+  int64_t begin_ns;
+  int64_t end_ns;
+};
+
+struct ThreadBuffer {
+  inline ThreadBuffer(size_t thread_index, size_t capacity)
+      : thread_index(thread_index), events(capacity), n_written(0) {}
+
+  inline void push(const TraceEvent &event) {
+    events[n_written % events.size()] = event;
+    n_written++;
+  }
+
+  const size_t thread_index;
+  vector<TraceEvent> events;
+  size_t n_written;
+};
+
+struct TraceRecorder {
+  static constexpr size_t DEFAULT_CAPACITY = 1 << 16;
+
+  inline static TraceRecorder &instance() {
+    static TraceRecorder recorder;
+    return recorder;
+  }
+
+  /* Start recording, keeping up to `capacity` events per thread. */
+  inline void start(size_t capacity = DEFAULT_CAPACITY) {
+    if (capacity == 0) {
+      throw std::invalid_argument("trace capacity must be positive.");
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    capacity_ = capacity;
+    generation_++;
+    buffers_.clear();
+    free_buffers_.clear();
+    origin_ = std::chrono::steady_clock::now();
+    enabled_.store(true, std::memory_order_release);
+  }
+
+  inline void stop() { enabled_.store(false, std::memory_order_release); }
+
+  inline bool enabled() const {
+    return enabled_.load(std::memory_order_relaxed);
+  }
+
+  inline int64_t now_ns() const {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now() - origin_)
+        .count();
+  }
+
+  inline void record(const TraceEvent &event) {
+    thread_local BufferLease lease;
+    if (!lease.buffer || lease.generation != generation_) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      lease.generation = generation_;
+      if (free_buffers_.empty()) {
+        lease.buffer =
+            std::make_shared<ThreadBuffer>(buffers_.size(), capacity_);
+        buffers_.push_back(lease.buffer);
+      } else {
+        lease.buffer = free_buffers_.back();
+        free_buffers_.pop_back();
+      }
+    }
+    lease.buffer->push(event);
+  }
+
+  /* Buffers made in the current recording, in use or free. */
+  inline size_t n_buffers() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return buffers_.size();
+  }
+
+  /*
+  Write the events recorded so far. Call after the traced work has
+  finished; buffers of threads that are still recording may be torn.
+  */
+  inline void write_json(std::ostream &os) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    os << "{\"traceEvents\":[";
+    bool first = true;
+    for (const auto &buffer : buffers_) {
+      const size_t capacity = buffer->events.size();
+      const size_t n_kept = std::min(buffer->n_written, capacity);
+      for (size_t i = buffer->n_written - n_kept; i < buffer->n_written;
+           i++) {
+        const TraceEvent &event = buffer->events[i % capacity];
+        if (!first) {
+          os << ",";
+        }
+        first = false;
+        os << "{\"name\":\"" << event.name << "\",\"cat\":\""
+           << event.category << "\",\"ph\":\"X\",\"pid\":0,\"tid\":"
+           << buffer->thread_index << ",\"ts\":" << event.begin_ns / 1e3
+           << ",\"dur\":" << (event.end_ns - event.begin_ns) / 1e3;
+        if (event.arg >= 0) {
+          os << ",\"args\":{\"index\":" << event.arg << "}";
+        }
+        os << "}";
+      }
+    }
+    os << "],\"displayTimeUnit\":\"ms\"}";
+  }
+
+  inline void write_json(const std::string &path) {
+    std::ofstream ofs(path);
+    if (!ofs) {
+      throw std::ios_base::failure(
+          StringBuilder{}("Could not open ")(path)(" for writing.").build());
+    }
+    write_json(ofs);
+  }
+
+private:
+  TraceRecorder() = default;
+
+  /* A thread's buffer, handed back when the thread exits. */
+  struct BufferLease {
+    inline ~BufferLease() {
+      if (buffer) {
+        TraceRecorder::instance().release(buffer, generation);
+      }
+    }
+
+    std::shared_ptr<ThreadBuffer> buffer;
+    size_t generation = 0;
+  };
+
+  inline void release(const std::shared_ptr<ThreadBuffer> &buffer,
+                      size_t generation) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (generation == generation_) {
+      free_buffers_.push_back(buffer);
+    }
+  }
+
+  std::atomic<bool> enabled_{false};
+  std::mutex mutex_;
+  size_t capacity_ = DEFAULT_CAPACITY;
+  // bumped by start() so that threads drop buffers of a previous recording.
+  std::atomic<size_t> generation_{0};
+  std::chrono::steady_clock::time_point origin_;
+  vector<std::shared_ptr<ThreadBuffer>> buffers_;
+  // buffers of exited threads, to be reused.
+  vector<std::shared_ptr<ThreadBuffer>> free_buffers_;
+};
+
+/* Records the lifetime of the scope as one event, if recording is on. */
+struct TraceScope {
+  inline TraceScope(const char *name, const char *category, int64_t arg = -1)
+      : recorder_(TraceRecorder::instance()), active_(recorder_.enabled()) {
+    if (active_) {
+      event_.name = name;
+      event_.category = category;
+      event_.arg = arg;
+      event_.begin_ns = recorder_.now_ns();
+    }
+  }
+
+  inline ~TraceScope() {
+    if (active_) {
+      event_.end_ns = recorder_.now_ns();
+      recorder_.record(event_);
+    }
+  }
+
+  TraceScope(const TraceScope &) = delete;
+  TraceScope &operator=(const TraceScope &) = delete;
+
+private:
+  TraceRecorder &recorder_;
+  const bool active_;
+  TraceEvent event_;
+};
+
+} // namespace trace
+} // namespace myFM
@@ -152,13 +152,13 @@ inline size_t check_row_consistency_return_column(
   size_t col = X.cols();
   int i = 0;
   for (const auto &rel : relations) {
-    if (row != rel.original_to_block.size()) {
+    if (row != rel.mapper_size) {
       throw std::runtime_error(
           (StringBuilder{})("main table has size ")(row)(" but the relation[")(
-              i)("] has size ")(rel.original_to_block.size())
+              i)("] has size ")(rel.mapper_size)
               .build());
     }
-    col += rel.feature_size;
+    col += rel.total_feature_size();
     i++;
   }
   return col;
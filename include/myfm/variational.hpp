@@ -6,7 +6,9 @@
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <thread>
 #include <tuple>
+#include <utility>
 
 #include "FM.hpp"
 #include "FMLearningConfig.hpp"
@@ -89,7 +91,9 @@ template <typename Real> struct VariationalFM : public FM<Real> {
 
   inline VariationalFM(const VariationalFM &other)
       : BaseType(other.w0, other.w, other.V), w0_var(other.w0_var),
-        w_var(other.w_var), V_var(other.V_var) {}
+        w_var(other.w_var), V_var(other.V_var) {
+    this->feature_ranks = other.feature_ranks;
+  }
 
   inline VariationalFM(Real w0, Real w0_var, const Vector &w,
                        const Vector &w_var, const DenseMatrix &V,
@@ -111,6 +115,164 @@ template <typename Real> struct VariationalFM : public FM<Real> {
 template <typename Real>
 using VariationalPredictor = Predictor<Real, VariationalFM<Real>>;
 
+/*
+The mean and the variance of each row's score under the mean-field
+posterior, in one pass over the rows split among n_workers threads. With
+a_j = x_j v_jf of mean m_j and variance s_j, the pairwise term of factor f,
+sum_{j<k} a_j a_k, has variance
+    T M^2 + sum_j m_j^2 s_j - 2 M sum_j m_j s_j + (T^2 - sum_j s_j^2) / 2
+for M = sum_j m_j and T = sum_j s_j (as in update_e_and_var), and as the
+factors and the linear terms are independent, their variances add up. The
+first element is what predict returns; the variance is that of the score,
+before the link and without observation noise, and of the mixture when
+there are several samples.
+*/
+template <typename Real>
+inline std::pair<typename VariationalFM<Real>::Vector,
+                 typename VariationalFM<Real>::Vector>
+predict_mean_and_variance(
+    const VariationalPredictor<Real> &predictor,
+    const typename VariationalFM<Real>::SparseMatrix &X,
+    const vector<relational::RelationBlock<Real>> &relations,
+    size_t n_workers = 1) {
+  typedef typename VariationalFM<Real>::Vector Vector;
+  typedef typename VariationalFM<Real>::SparseMatrix SparseMatrix;
+  typedef typename FMLearningConfig<Real>::TASKTYPE TASKTYPE;
+  predictor.check_input(X, relations);
+  if (relational::has_nested_relation(relations)) {
+    return predict_mean_and_variance(
+        predictor, X, relational::flatten_relations(relations), n_workers);
+  }
+  const auto &samples = predictor.samples;
+  if (samples.empty()) {
+    throw std::runtime_error("Told to predict but no sample available.");
+  }
+  for (const auto &sample : samples) {
+    if (sample.mask) {
+      throw std::invalid_argument(
+          "Variational models do not support interaction masks.");
+    }
+  }
+  const size_t n_rows = X.rows();
+  const size_t rank = predictor.rank;
+  std::pair<Vector, Vector> result{Vector(n_rows), Vector(n_rows)};
+  Vector &mean = result.first;
+  Vector &variance = result.second;
+
+  auto score_rows = [&](size_t begin, size_t end) {
+    trace::TraceScope scope("predict_rows", "predict", begin);
+    vector<relational::BlockMapper::Cursor> cursors;
+    for (const auto &relation : relations) {
+      cursors.emplace_back(relation.original_to_block);
+    }
+    // per factor: sum x v, sum x^2 v^2 and the x2s, x3sv, x4s2 and x4sv2
+    // sums of update_e_and_var.
+    Vector q(rank), q_s(rank), x2s(rank), x3sv(rank), x4s2(rank), x4sv2(rank);
+    Vector sample_means(samples.size()), sample_vars(samples.size());
+    for (size_t row = begin; row < end; row++) {
+      for (size_t m = 0; m < samples.size(); m++) {
+        const VariationalFM<Real> &sample = samples[m];
+        Real score = sample.w0, score_var = sample.w0_var;
+        q.setZero();
+        q_s.setZero();
+        x2s.setZero();
+        x3sv.setZero();
+        x4s2.setZero();
+        x4sv2.setZero();
+        auto add = [&](size_t feature, Real x) {
+          const Real x2 = x * x;
+          score += x * sample.w(feature);
+          score_var += x2 * sample.w_var(feature);
+          for (size_t f = 0; f < rank; f++) {
+            const Real v = sample.V(feature, f);
+            const Real s = sample.V_var(feature, f);
+            q(f) += x * v;
+            q_s(f) += x2 * v * v;
+            x2s(f) += x2 * s;
+            x3sv(f) += x2 * x * s * v;
+            x4s2(f) += x2 * x2 * s * s;
+            x4sv2(f) += x2 * x2 * s * v * v;
+          }
+        };
+        for (typename SparseMatrix::InnerIterator it(X, row); it; ++it) {
+          add(it.col(), it.value());
+        }
+        size_t offset = X.cols();
+        for (size_t b = 0; b < relations.size(); b++) {
+          relations[b].for_each_in_row(
+              cursors[b][row],
+              [&add, offset](size_t col, Real x) { add(offset + col, x); });
+          offset += relations[b].feature_size;
+        }
+        score += 0.5 * (q.squaredNorm() - q_s.sum());
+        score_var +=
+            (q.array().square() * x2s.array() + 0.5 * x2s.array().square() -
+             2 * x3sv.array() * q.array() - 0.5 * x4s2.array() +
+             x4sv2.array())
+                .sum();
+        sample_means(m) = score;
+        sample_vars(m) = score_var;
+      }
+      const Real score_mean = sample_means.mean();
+      variance(row) = sample_vars.mean() +
+                      (sample_means.array() - score_mean).square().mean();
+      if (predictor.type == TASKTYPE::CLASSIFICATION) {
+        special::normal_cdf(sample_means.array(), sample_means.array());
+        mean(row) = sample_means.mean();
+      } else {
+        mean(row) = score_mean;
+      }
+    }
+  };
+  n_workers = std::max<size_t>(1, std::min<size_t>(n_workers, n_rows));
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < n_workers; i++) {
+    workers.emplace_back(score_rows, n_rows * i / n_workers,
+                         n_rows * (i + 1) / n_workers);
+  }
+  score_rows(0, n_rows / n_workers);
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  return result;
+}
+
+} // namespace variational
+
+namespace thompson {
+/* Draws from the variational posterior, a normal per coordinate. */
+template <typename Real> struct Draw<variational::VariationalFM<Real>> {
+  static constexpr bool draws = true;
+
+  inline Draw(const variational::VariationalFM<Real> &sample, uint64_t key)
+      : sample(sample), key(key) {}
+
+  inline Real w0() const {
+    return sample.w0 + std::sqrt(sample.w0_var) *
+                           standard_normal<Real>(hash(key, 0));
+  }
+  inline Real w(size_t feature) const {
+    return sample.w(feature) + std::sqrt(sample.w_var(feature)) *
+                                   standard_normal<Real>(hash(key, 1, feature));
+  }
+  inline Real V(size_t feature, size_t factor) const {
+    return sample.V(feature, factor) +
+           std::sqrt(sample.V_var(feature, factor)) *
+               standard_normal<Real>(
+                   hash(key, 2, feature * sample.V.cols() + factor));
+  }
+
+  const variational::VariationalFM<Real> &sample;
+  const uint64_t key;
+};
+
+template <typename Real>
+constexpr bool Draw<variational::VariationalFM<Real>>::draws;
+} // namespace thompson
+
+namespace variational {
+
+
 template <typename Real>
 struct VariationalRelationWiseCache
     : public relational::RelationWiseCache<Real> {
@@ -173,6 +335,8 @@ struct VariationalFMTrainer
   using itertype = typename SparseMatrix::InnerIterator;
 
 public:
+  static constexpr bool is_variational = true;
+
   Vector x2s;
   Vector x3sv;
   Real e_var_sum;
@@ -192,7 +356,16 @@ public:
   learn_with_callback(
       FMType &fm, HyperType &hyper,
       std::function<bool(int, FMType *, HyperType *, LearningHistory *)> cb) {
-    initialize_hyper(fm, hyper);
+    this->check_memory_budget(fm.n_factors);
+    this->apply_group_ranks(fm);
+    // factors outside a rank are zero without uncertainty.
+    for (size_t feature = 0; feature < this->dim_all; feature++) {
+      const int rank = this->feature_ranks_[feature];
+      fm.V_var.row(feature).tail(fm.n_factors - rank).setZero();
+    }
+    if (!this->continuing_) {
+      initialize_hyper(fm, hyper);
+    }
     initialize_e(fm, hyper);
 
     std::pair<VariationalPredictor<Real>, LearningHistory> result{
@@ -215,6 +388,23 @@ public:
     return result;
   }
 
+  inline void slide_trainer_state() {
+    x2s.resize(this->n_train);
+    x3sv.resize(this->n_train);
+  }
+
+  inline void add_trainer_memory(memory::MemoryReport &report) const {
+    report.add("residuals",
+               memory::bytes_of(x2s) + memory::bytes_of(x3sv));
+    for (const auto &cache : this->relation_caches) {
+      report.add("relation_caches",
+                 memory::bytes_of(cache.x2s) + memory::bytes_of(cache.x3sv) +
+                     memory::bytes_of(cache.cache_vector_1) +
+                     memory::bytes_of(cache.cache_vector_2) +
+                     memory::bytes_of(cache.cache_vector_3));
+    }
+  }
+
   inline void initialize_hyper(FMType &fm, HyperType &hyper) {
     hyper.alpha = static_cast<Real>(1);
     hyper.alpha_rate = this->n_train * .5;
@@ -234,6 +424,12 @@ public:
     if (this->learning_config.task_type == TASKTYPE::ORDERED)
       throw std::runtime_error(
           "Ordered Probit Regression  for Variational FM not implemented");
+    if (this->learning_config.implicit_feedback())
+      throw std::runtime_error(
+          "Implicit feedback for Variational FM not implemented");
+    if (this->learning_config.interaction_mask())
+      throw std::runtime_error(
+          "Interaction masks for Variational FM not implemented");
     // fm.predict_score_write_target(this->e_train, this->X, this->relations);
     this->update_e_and_var(fm, hyper);
     this->e_train -= this->y;
@@ -252,10 +448,13 @@ public:
       return;
     }
 
-    Real e_all = this->e_train.array().square().sum();
+    Real e_all =
+        (this->sample_weight.array() * this->e_train.array().square()).sum() +
+        this->learning_config.collapsed_sum_of_squares;
     e_all += this->e_var_sum;
 
-    Real exponent = (this->learning_config.alpha_0 + this->n_train) / 2;
+    Real exponent =
+        (this->learning_config.alpha_0 + this->sample_weight_sum) / 2;
     Real rate = (this->learning_config.beta_0 + e_all) / 2;
     Real new_alpha = exponent / rate;
     hyper.alpha = new_alpha;
@@ -264,16 +463,23 @@ public:
 
   /*
  The sampling method for both $\lambda _g ^{(w)}$ and $\lambda _{g,r} ^{(v)}$.
+ Groups whose rank leaves out factor `factor_index` keep their value.
  */
   inline void update_lambda_generic(const Vector &mu, const Vector &mu_var,
                                     Eigen::Ref<Vector> lambda,
                                     Eigen::Ref<Vector> lambda_rate,
                                     const Vector &weight,
-                                    const Vector &weight_var) {
+                                    const Vector &weight_var,
+                                    int factor_index = -1) {
     const vector<vector<size_t>> &group_vs_feature_index =
         this->learning_config.group_vs_feature_index();
     size_t group_index = 0;
     for (const auto &group_feature_indices : group_vs_feature_index) {
+      if (factor_index >= 0 &&
+          !this->learning_config.group_has_factor(group_index, factor_index)) {
+        group_index++;
+        continue;
+      }
       Real mean = mu(group_index);
       Real alpha = this->learning_config.alpha_0 + group_feature_indices.size();
       Real beta = this->learning_config.beta_0;
@@ -296,11 +502,16 @@ private:
  */
   inline void update_mu_generic(Eigen::Ref<Vector> mu,
                                 Eigen::Ref<Vector> mu_var, const Vector &lambda,
-                                const Vector &weight) {
+                                const Vector &weight, int factor_index = -1) {
     const vector<vector<size_t>> &group_vs_feature_index =
         this->learning_config.group_vs_feature_index();
     size_t group_index = 0;
     for (const auto &group_feature_indices : group_vs_feature_index) {
+      if (factor_index >= 0 &&
+          !this->learning_config.group_has_factor(group_index, factor_index)) {
+        group_index++;
+        continue;
+      }
       size_t n_feature_in_groups = group_feature_indices.size();
       Real square = lambda(group_index) *
                     (this->learning_config.gamma_0 + n_feature_in_groups);
@@ -332,7 +543,7 @@ public:
           hyper.mu_V.col(factor_index), hyper.mu_V_var.col(factor_index),
           hyper.lambda_V.col(factor_index),
           hyper.lambda_V_rate.col(factor_index), fm.V.col(factor_index),
-          fm.V_var.col(factor_index));
+          fm.V_var.col(factor_index), factor_index);
     }
   }
 
@@ -340,7 +551,8 @@ public:
     for (int factor_index = 0; factor_index < fm.n_factors; factor_index++) {
       this->update_mu_generic(
           hyper.mu_V.col(factor_index), hyper.mu_V_var.col(factor_index),
-          hyper.lambda_V.col(factor_index), fm.V.col(factor_index));
+          hyper.lambda_V.col(factor_index), fm.V.col(factor_index),
+          factor_index);
     }
   }
 
@@ -350,9 +562,11 @@ public:
       fm.w0_var = 0;
       return;
     }
-    Real w0_lin_term = hyper.alpha * (fm.w0 - this->e_train.array()).sum();
+    Real w0_lin_term =
+        hyper.alpha *
+        (this->sample_weight.array() * (fm.w0 - this->e_train.array())).sum();
     Real w0_quad_term =
-        hyper.alpha * this->n_train + this->learning_config.reg_0;
+        hyper.alpha * this->sample_weight_sum + this->learning_config.reg_0;
     Real w0_new = w0_lin_term / w0_quad_term;
     this->e_train.array() += (w0_new - fm.w0);
     fm.w0 = w0_new;
@@ -372,11 +586,15 @@ public:
       this->e_train.array() -= this->X_t.row(feature_index) * w_old;
       Real lambda = hyper.lambda_w(group);
       Real mu = hyper.mu_w(group);
-      Real square_term =
-          lambda + hyper.alpha * this->X_t.row(feature_index).cwiseAbs2().sum();
-      Real linear_term =
-          -hyper.alpha * this->X_t.row(feature_index) * this->e_train +
-          lambda * mu;
+      Real x2_sum = 0;
+      Real xe_sum = 0;
+      for (itertype it(this->X_t, feature_index); it; ++it) {
+        const Real weighted_x = this->sample_weight(it.col()) * it.value();
+        x2_sum += weighted_x * it.value();
+        xe_sum += weighted_x * this->e_train(it.col());
+      }
+      Real square_term = lambda + hyper.alpha * x2_sum;
+      Real linear_term = -hyper.alpha * xe_sum + lambda * mu;
 
       Real w_new = normal_mean(square_term, linear_term);
       this->e_train.array() += this->X_t.row(feature_index) * w_new;
@@ -388,22 +606,23 @@ public:
     size_t offset = this->X.cols();
     for (size_t relation_index = 0; relation_index < this->relations.size();
          relation_index++) {
+      trace::TraceScope block_scope("relation_block", "train",
+                                    relation_index);
       RelationBlock &relation_data = this->relations[relation_index];
       RelationWiseCache &relation_cache = this->relation_caches[relation_index];
       relation_cache.e.array() = 0;
       relation_cache.q.array() = 0;
 
-      relation_cache.q =
-          relation_data.X * fm.w.segment(offset, relation_data.feature_size);
+      relation_cache.q = relation_data.multiply(
+          fm.w.segment(offset, relation_data.feature_size));
 
-      {
-        size_t train_data_index = 0;
-        for (auto i : relation_data.original_to_block) {
-          relation_cache.e(i) += this->e_train(train_data_index);
-          this->e_train(train_data_index++) -=
-              relation_cache.q(i); // un-synchronize
-        }
-      }
+      relation_data.original_to_block.for_each(
+          [this, &relation_cache](size_t train_data_index, size_t i) {
+            relation_cache.e(i) += this->sample_weight(train_data_index) *
+                                   this->e_train(train_data_index);
+            this->e_train(train_data_index) -=
+                relation_cache.q(i); // un-synchronize
+          });
       for (size_t inner_feature_index = 0;
            inner_feature_index < relation_data.feature_size;
            inner_feature_index++) {
@@ -413,11 +632,10 @@ public:
         Real lambda = hyper.lambda_w(group);
         Real mu = hyper.mu_w(group);
 
-        Real square_term =
-            relation_cache.X_t.row(inner_feature_index).cwiseAbs2() *
-            relation_cache.cardinality;
+        Real square_term = relation_cache.column_squared_dot(
+            inner_feature_index, relation_cache.cardinality);
         Real linear_term =
-            -relation_cache.X_t.row(inner_feature_index) * relation_cache.e;
+            -relation_cache.column_dot(inner_feature_index, relation_cache.e);
 
         linear_term += square_term * w_old;
 
@@ -428,47 +646,45 @@ public:
         fm.w(offset + inner_feature_index) = w_new;
         fm.w_var(offset + inner_feature_index) = 1 / square_term;
 
-        relation_cache.e += relation_cache.X_t.row(inner_feature_index)
-                                .transpose()
-                                .cwiseProduct(relation_cache.cardinality) *
-                            (w_new - w_old);
+        relation_cache.add_scaled_column_product(
+            inner_feature_index, relation_cache.cardinality, w_new - w_old,
+            relation_cache.e);
       }
 
-      relation_cache.q =
-          relation_data.X * fm.w.segment(offset, relation_data.feature_size);
-      {
-        size_t train_data_index = 0;
-        for (auto i : relation_data.original_to_block) {
-          this->e_train(train_data_index++) += relation_cache.q(i); // un-sync
-        }
-      }
+      relation_cache.q = relation_data.multiply(
+          fm.w.segment(offset, relation_data.feature_size));
+      relation_data.original_to_block.for_each(
+          [this, &relation_cache](size_t train_data_index, size_t i) {
+            this->e_train(train_data_index) += relation_cache.q(i); // re-sync
+          });
       offset += relation_data.feature_size;
     }
   }
 
   inline void update_V(FMType &fm, HyperType &hyper) {
 
-    for (int factor_index = 0; factor_index < fm.n_factors; factor_index++) {
+    // the factors past every rank are zero without uncertainty.
+    for (int factor_index = 0; factor_index < this->n_ranked_factors(fm);
+         factor_index++) {
       this->q_train.array() = 0;
       this->x2s.array() = 0;
       this->x3sv.array() = 0;
       const auto &V_ref = fm.V.col(factor_index);
       const auto &V_var_ref = fm.V_var.col(factor_index);
-      for (int train_index = 0; train_index < this->n_train; train_index++) {
-        for (itertype it(this->X, train_index); it; ++it) {
-          Real x = it.value();
-          int col = it.col();
-          this->q_train(train_index) += x * V_ref(col);
-          this->x2s(train_index) += x * x * V_var_ref(col);
-          this->x3sv(train_index) += x * x * x * V_var_ref(col) * V_ref(col);
-        }
-      }
+      this->for_each_ranked_entry(
+          factor_index, [&](size_t train_index, size_t col, Real x) {
+            this->q_train(train_index) += x * V_ref(col);
+            this->x2s(train_index) += x * x * V_var_ref(col);
+            this->x3sv(train_index) += x * x * x * V_var_ref(col) * V_ref(col);
+          });
       // compute contribution of blocks
       {
         // initialize block q caches
         size_t offset = this->X.cols();
         for (size_t relation_index = 0; relation_index < this->relations.size();
              relation_index++) {
+          trace::TraceScope block_scope("relation_block", "train",
+                                        relation_index);
 
           const RelationBlock &relation_data = this->relations[relation_index];
           RelationWiseCache &relation_cache =
@@ -479,23 +695,22 @@ public:
           // relation_cache.x4sv2().array() = 0;
           for (int inner_data_index = 0;
                inner_data_index < relation_data.X.rows(); inner_data_index++) {
-            for (itertype it(relation_data.X, inner_data_index); it; ++it) {
-              Real x = it.value();
-              Real x2 = x * x;
-              int col = it.col() + offset;
-              relation_cache.q(inner_data_index) += x * V_ref(col);
-              relation_cache.x2s(inner_data_index) += x2 * V_var_ref(col);
-              relation_cache.x3sv(inner_data_index) +=
-                  x2 * x * V_var_ref(col) * V_ref(col);
-            }
-          }
-          size_t train_data_index = 0;
-          for (auto i : relation_data.original_to_block) {
-            this->q_train(train_data_index) += relation_cache.q(i);
-            this->x2s(train_data_index) += relation_cache.x2s(i);
-            this->x3sv(train_data_index) += relation_cache.x3sv(i);
-            train_data_index++;
+            relation_data.for_each_in_row(
+                inner_data_index, [&](size_t inner_col, Real x) {
+                  Real x2 = x * x;
+                  int col = inner_col + offset;
+                  relation_cache.q(inner_data_index) += x * V_ref(col);
+                  relation_cache.x2s(inner_data_index) += x2 * V_var_ref(col);
+                  relation_cache.x3sv(inner_data_index) +=
+                      x2 * x * V_var_ref(col) * V_ref(col);
+                });
           }
+          relation_data.original_to_block.for_each(
+              [this, &relation_cache](size_t train_data_index, size_t i) {
+                this->q_train(train_data_index) += relation_cache.q(i);
+                this->x2s(train_data_index) += relation_cache.x2s(i);
+                this->x3sv(train_data_index) += relation_cache.x3sv(i);
+              });
           offset += relation_data.feature_size;
         }
       }
@@ -503,6 +718,9 @@ public:
       // main table
       for (int feature_index = 0; feature_index < this->X_t.rows();
            feature_index++) {
+        if (factor_index >= this->feature_ranks_[feature_index]) {
+          continue;
+        }
         auto g = this->learning_config.group_index(feature_index);
         Real v_old = fm.V(feature_index, factor_index);
         Real v_var_old = fm.V_var(feature_index, factor_index);
@@ -520,10 +738,11 @@ public:
           Real x3sv = this->x3sv(train_data_index);
           x2s -= x * x * v_var_old;
           x3sv -= x * x * x * v_var_old * v_old;
-          square_coeff += h * h;
-          linear_coeff += (-this->e_train(train_data_index)) * h;
-          square_coeff_var += x2s * x * x;
-          linear_coeff_var += h * x2s - x * x3sv;
+          const Real weight = this->sample_weight(train_data_index);
+          square_coeff += weight * h * h;
+          linear_coeff += weight * (-this->e_train(train_data_index)) * h;
+          square_coeff_var += weight * x2s * x * x;
+          linear_coeff_var += weight * (h * x2s - x * x3sv);
         }
         linear_coeff += square_coeff * v_old;
         linear_coeff -= linear_coeff_var;
@@ -558,19 +777,20 @@ public:
       // initialize caches
       for (size_t relation_index = 0; relation_index < this->relations.size();
            relation_index++) {
+        trace::TraceScope block_scope("relation_block", "train",
+                                      relation_index);
 
         const RelationBlock &relation_data = this->relations[relation_index];
         RelationWiseCache &relation_cache =
             this->relation_caches[relation_index];
 
         // initialize block caches.
-        relation_cache.q_S = relation_data.X.cwiseAbs2() *
-                             (fm.V.col(factor_index)
-                                  .segment(offset, relation_data.feature_size)
-                                  .array()
-                                  .square()
-                                  .matrix());
-        size_t train_data_index = 0;
+        relation_cache.q_S = relation_data.multiply_squared(
+            fm.V.col(factor_index)
+                .segment(offset, relation_data.feature_size)
+                .array()
+                .square()
+                .matrix());
 
         relation_cache.c.array() = 0;
         relation_cache.c_S.array() = 0;
@@ -580,38 +800,44 @@ public:
         relation_cache.c_x3sv().array() = 0;
         relation_cache.c_x2s_q().array() = 0;
 
-        for (auto i : relation_data.original_to_block) {
-          // un-synchronization
-          Real &q_orig = this->q_train(train_data_index);
-          Real &x2s_orig = this->x2s(train_data_index);
-          Real &x3sv_orig = this->x3sv(train_data_index);
-
-          q_orig -= relation_cache.q(i);
-          x2s_orig -= relation_cache.x2s(i);
-          x3sv_orig -= relation_cache.x3sv(i);
-
-          relation_cache.c(i) += q_orig;
-          relation_cache.c_S(i) += q_orig * q_orig;
-          relation_cache.e(i) += this->e_train(train_data_index);
-          relation_cache.e_q(i) += this->e_train(train_data_index) * q_orig;
-          relation_cache.c_x2s()(i) += x2s_orig;
-          relation_cache.c_x3sv()(i) += x3sv_orig;
-          relation_cache.c_x2s_q()(i) += x2s_orig * q_orig;
-          // un-synchronization of q, x2s  x3sv, e, x3sv_sum, x2sv_sum
-
-          // q_B
-          // 1/ 2 ( (q_B + q_other) **2 - (q_B_S + other) )
-          // q_B * q_other + 0.5 q_B **2 - 0.5 * q_B_S
-          this->e_train(train_data_index) -=
-              (this->q_train(train_data_index) * relation_cache.q(i) +
-               0.5 * relation_cache.q(i) * relation_cache.q(i) -
-               0.5 * relation_cache.q_S(i));
-          train_data_index++;
-        }
+        relation_data.original_to_block.for_each(
+            [this, &relation_cache](size_t train_data_index, size_t i) {
+              // un-synchronization
+              Real &q_orig = this->q_train(train_data_index);
+              Real &x2s_orig = this->x2s(train_data_index);
+              Real &x3sv_orig = this->x3sv(train_data_index);
+
+              q_orig -= relation_cache.q(i);
+              x2s_orig -= relation_cache.x2s(i);
+              x3sv_orig -= relation_cache.x3sv(i);
+
+              const Real weight = this->sample_weight(train_data_index);
+              const Real weighted_e = weight * this->e_train(train_data_index);
+              relation_cache.c(i) += weight * q_orig;
+              relation_cache.c_S(i) += weight * q_orig * q_orig;
+              relation_cache.e(i) += weighted_e;
+              relation_cache.e_q(i) += weighted_e * q_orig;
+              relation_cache.c_x2s()(i) += weight * x2s_orig;
+              relation_cache.c_x3sv()(i) += weight * x3sv_orig;
+              relation_cache.c_x2s_q()(i) += weight * x2s_orig * q_orig;
+              // un-synchronization of q, x2s  x3sv, e, x3sv_sum, x2sv_sum
+
+              // q_B
+              // 1/ 2 ( (q_B + q_other) **2 - (q_B_S + other) )
+              // q_B * q_other + 0.5 q_B **2 - 0.5 * q_B_S
+              this->e_train(train_data_index) -=
+                  (this->q_train(train_data_index) * relation_cache.q(i) +
+                   0.5 * relation_cache.q(i) * relation_cache.q(i) -
+                   0.5 * relation_cache.q_S(i));
+            });
         // Initialized block-wise caches.
         for (size_t inner_feature_index = 0;
              inner_feature_index < relation_data.feature_size;
              inner_feature_index++) {
+          if (factor_index >=
+              this->feature_ranks_[offset + inner_feature_index]) {
+            continue;
+          }
           auto g =
               this->learning_config.group_index(offset + inner_feature_index);
           Real v_old = fm.V(offset + inner_feature_index, factor_index);
@@ -622,40 +848,39 @@ public:
           Real square_coeff_var = 0;
           Real linear_coeff_var = 0;
 
-          Real x_il;
-          for (itertype it(relation_cache.X_t, inner_feature_index); it; ++it) {
-            auto block_data_index = it.col();
-
-            auto card = relation_cache.cardinality(block_data_index);
-            x_il = it.value();
-            auto x2 = x_il * x_il;
-
-            relation_cache.x2s(block_data_index) -= x2 * v_var_old;
-            relation_cache.x3sv(block_data_index) -=
-                (x_il * x2 * v_old * v_var_old);
-            auto h_B = (relation_cache.q(block_data_index) - x_il * v_old);
-            auto h_squared = h_B * h_B * card +
-                             2 * relation_cache.c(block_data_index) * h_B +
-                             relation_cache.c_S(block_data_index);
-            h_squared = x_il * x_il * h_squared;
-            square_coeff += h_squared;
-            linear_coeff += (-relation_cache.e(block_data_index) * h_B -
-                             relation_cache.e_q(block_data_index)) *
-                            x_il;
-
-            square_coeff_var += (relation_cache.c_x2s()(block_data_index) +
-                                 relation_cache.x2s(block_data_index) * card) *
-                                x_il * x_il;
-            linear_coeff_var +=
-                (relation_cache.c_x2s_q()(block_data_index) +
-                 relation_cache.x2s(block_data_index) *
-                     relation_cache.c(block_data_index) +
-                 relation_cache.c_x2s()(block_data_index) * h_B +
-                 relation_cache.x2s(block_data_index) * h_B * card -
-                 relation_cache.c_x3sv()(block_data_index) -
-                 relation_cache.x3sv(block_data_index) * card) *
-                x_il;
-          }
+          relation_cache.for_each_in_column(
+              inner_feature_index,
+              [&](size_t block_data_index, Real x_il) {
+                auto card = relation_cache.cardinality(block_data_index);
+                auto x2 = x_il * x_il;
+
+                relation_cache.x2s(block_data_index) -= x2 * v_var_old;
+                relation_cache.x3sv(block_data_index) -=
+                    (x_il * x2 * v_old * v_var_old);
+                auto h_B = (relation_cache.q(block_data_index) - x_il * v_old);
+                auto h_squared = h_B * h_B * card +
+                                 2 * relation_cache.c(block_data_index) * h_B +
+                                 relation_cache.c_S(block_data_index);
+                h_squared = x_il * x_il * h_squared;
+                square_coeff += h_squared;
+                linear_coeff += (-relation_cache.e(block_data_index) * h_B -
+                                 relation_cache.e_q(block_data_index)) *
+                                x_il;
+
+                square_coeff_var +=
+                    (relation_cache.c_x2s()(block_data_index) +
+                     relation_cache.x2s(block_data_index) * card) *
+                    x_il * x_il;
+                linear_coeff_var +=
+                    (relation_cache.c_x2s_q()(block_data_index) +
+                     relation_cache.x2s(block_data_index) *
+                         relation_cache.c(block_data_index) +
+                     relation_cache.c_x2s()(block_data_index) * h_B +
+                     relation_cache.x2s(block_data_index) * h_B * card -
+                     relation_cache.c_x3sv()(block_data_index) -
+                     relation_cache.x3sv(block_data_index) * card) *
+                    x_il;
+              });
           linear_coeff += square_coeff * v_old;
           linear_coeff -= linear_coeff_var;
           square_coeff += square_coeff_var;
@@ -671,39 +896,38 @@ public:
           Real delta = v_new - v_old;
           fm.V(offset + inner_feature_index, factor_index) = v_new;
           fm.V_var(offset + inner_feature_index, factor_index) = v_var_new;
-          for (itertype it(relation_cache.X_t, inner_feature_index); it; ++it) {
-            auto block_data_index = it.col();
-            const Real x_il = it.value();
-            auto h_B = relation_cache.q(block_data_index) - x_il * v_old;
-            relation_cache.q(block_data_index) += delta * x_il;
-            relation_cache.q_S(block_data_index) +=
-                delta * (v_new + v_old) * x_il * x_il;
-
-            relation_cache.e(block_data_index) +=
-                x_il * delta *
-                (h_B * relation_cache.cardinality(block_data_index) +
-                 relation_cache.c(block_data_index));
-            relation_cache.e_q(block_data_index) +=
-                x_il * delta *
-                (h_B * relation_cache.c(block_data_index) +
-                 relation_cache.c_S(block_data_index));
-            relation_cache.x3sv(block_data_index) +=
-                x_il * x_il * x_il * v_new * v_var_new;
-            relation_cache.x2s(block_data_index) += x_il * x_il * v_var_new;
-          }
+          relation_cache.for_each_in_column(
+              inner_feature_index,
+              [&](size_t block_data_index, Real x_il) {
+                auto h_B = relation_cache.q(block_data_index) - x_il * v_old;
+                relation_cache.q(block_data_index) += delta * x_il;
+                relation_cache.q_S(block_data_index) +=
+                    delta * (v_new + v_old) * x_il * x_il;
+
+                relation_cache.e(block_data_index) +=
+                    x_il * delta *
+                    (h_B * relation_cache.cardinality(block_data_index) +
+                     relation_cache.c(block_data_index));
+                relation_cache.e_q(block_data_index) +=
+                    x_il * delta *
+                    (h_B * relation_cache.c(block_data_index) +
+                     relation_cache.c_S(block_data_index));
+                relation_cache.x3sv(block_data_index) +=
+                    x_il * x_il * x_il * v_new * v_var_new;
+                relation_cache.x2s(block_data_index) += x_il * x_il * v_var_new;
+              });
         }
         // re-sync
-        train_data_index = 0;
-        for (auto i : relation_data.original_to_block) {
-          this->e_train(train_data_index) +=
-              (this->q_train(train_data_index) * relation_cache.q(i) +
-               0.5 * relation_cache.q(i) * relation_cache.q(i) -
-               0.5 * relation_cache.q_S(i));
-          this->q_train(train_data_index) += relation_cache.q(i);
-          this->x2s(train_data_index) += relation_cache.x2s(i);
-          this->x3sv(train_data_index) += relation_cache.x3sv(i);
-          train_data_index++;
-        }
+        relation_data.original_to_block.for_each(
+            [this, &relation_cache](size_t train_data_index, size_t i) {
+              this->e_train(train_data_index) +=
+                  (this->q_train(train_data_index) * relation_cache.q(i) +
+                   0.5 * relation_cache.q(i) * relation_cache.q(i) -
+                   0.5 * relation_cache.q_S(i));
+              this->q_train(train_data_index) += relation_cache.q(i);
+              this->x2s(train_data_index) += relation_cache.x2s(i);
+              this->x3sv(train_data_index) += relation_cache.x3sv(i);
+            });
         offset += relation_data.feature_size;
       }
     }
@@ -713,50 +937,53 @@ public:
 
   inline void update_e_and_var(const FMType &fm, const HyperType &hyper) {
     this->e_train.array() = fm.w0;
-    this->e_var_sum = fm.w0_var * this->n_train;
+    this->e_var_sum = fm.w0_var * this->sample_weight_sum;
     for (int train_index = 0; train_index < this->n_train; train_index++) {
       Real &e_ref = this->e_train(train_index);
+      Real var = 0;
       for (itertype it(this->X, train_index); it; ++it) {
         Real x = it.value();
         auto col = it.col();
         e_ref += x * fm.w(col);
-        e_var_sum += x * x * fm.w_var(col);
+        var += x * x * fm.w_var(col);
       }
+      e_var_sum += this->sample_weight(train_index) * var;
     }
 
     { // add contirbution of relations
       size_t offset = this->X.cols();
       for (size_t relation_index = 0; relation_index < this->relations.size();
            relation_index++) {
+        trace::TraceScope block_scope("relation_block", "train",
+                                      relation_index);
         RelationBlock &relation_data = this->relations[relation_index];
         RelationWiseCache &relation_cache =
             this->relation_caches[relation_index];
-        relation_cache.x2s =
-            relation_data.X.cwiseAbs2() *
-            fm.w_var.segment(offset, relation_data.feature_size);
+        relation_cache.x2s = relation_data.multiply_squared(
+            fm.w_var.segment(offset, relation_data.feature_size));
         relation_cache.q.array() = 0;
         relation_cache.x2s.array() = 0;
         for (int inner_index = 0; inner_index < relation_data.X.rows();
              inner_index++) {
           Real &e_ref = relation_cache.q(inner_index);
-          for (itertype it(relation_data.X, inner_index); it; ++it) {
-            Real x = it.value();
-            auto col = offset + it.col();
-            e_ref += x * fm.w(col);
-            this->e_var_sum += x * x * fm.w_var(col);
-          }
+          relation_data.for_each_in_row(
+              inner_index, [&](size_t inner_col, Real x) {
+                auto col = offset + inner_col;
+                e_ref += x * fm.w(col);
+                this->e_var_sum += x * x * fm.w_var(col);
+              });
         }
         offset += relation_data.feature_size;
-        size_t train_index = 0;
-        for (auto i : relation_data.original_to_block) {
-          this->e_train(train_index) += relation_cache.q(i);
-          this->e_var_sum += relation_cache.x2s(i);
-          train_index++;
-        }
+        relation_data.original_to_block.for_each(
+            [this, &relation_cache](size_t train_index, size_t i) {
+              this->e_train(train_index) += relation_cache.q(i);
+              this->e_var_sum +=
+                  this->sample_weight(train_index) * relation_cache.x2s(i);
+            });
       }
     }
 
-    for (int r = 0; r < fm.n_factors; r++) {
+    for (int r = 0; r < this->n_ranked_factors(fm); r++) {
       const Vector &V_ref = fm.V.col(r);
       const Vector &V_var_ref = fm.V_var.col(r);
 
@@ -764,6 +991,8 @@ public:
         size_t offset = this->X.cols();
         for (size_t relation_index = 0; relation_index < this->relations.size();
              relation_index++) {
+          trace::TraceScope block_scope("relation_block", "train",
+                                        relation_index);
           RelationBlock &relation_data = this->relations[relation_index];
           RelationWiseCache &relation_cache =
               this->relation_caches[relation_index];
@@ -775,27 +1004,31 @@ public:
           relation_cache.x4sv2().array() = 0;
           for (int inner_data_index = 0;
                inner_data_index < relation_data.X.rows(); inner_data_index++) {
-            for (itertype it(relation_data.X, inner_data_index); it; ++it) {
-              Real x = it.value();
-              Real x2 = x * x;
-              Real x4 = x2 * x2;
-              int col = it.col() + offset;
-              relation_cache.q(inner_data_index) += x * V_ref(col);
-              relation_cache.q_S(inner_data_index) +=
-                  x2 * V_ref(col) * V_ref(col);
-              relation_cache.x2s(inner_data_index) += x2 * V_var_ref(col);
-              relation_cache.x3sv(inner_data_index) +=
-                  x2 * x * V_var_ref(col) * V_ref(col);
-              relation_cache.x4s2()(inner_data_index) +=
-                  x4 * V_var_ref(col) * V_var_ref(col);
-              relation_cache.x4sv2()(inner_data_index) +=
-                  x4 * V_var_ref(col) * V_ref(col) * V_ref(col);
-            }
+            relation_data.for_each_in_row(
+                inner_data_index, [&](size_t inner_col, Real x) {
+                  Real x2 = x * x;
+                  Real x4 = x2 * x2;
+                  int col = inner_col + offset;
+                  relation_cache.q(inner_data_index) += x * V_ref(col);
+                  relation_cache.q_S(inner_data_index) +=
+                      x2 * V_ref(col) * V_ref(col);
+                  relation_cache.x2s(inner_data_index) += x2 * V_var_ref(col);
+                  relation_cache.x3sv(inner_data_index) +=
+                      x2 * x * V_var_ref(col) * V_ref(col);
+                  relation_cache.x4s2()(inner_data_index) +=
+                      x4 * V_var_ref(col) * V_var_ref(col);
+                  relation_cache.x4sv2()(inner_data_index) +=
+                      x4 * V_var_ref(col) * V_ref(col) * V_ref(col);
+                });
           }
           offset += relation_data.feature_size;
         }
       }
 
+      vector<relational::BlockMapper::Cursor> cursors;
+      for (const auto &relation_data : this->relations) {
+        cursors.push_back(relation_data.original_to_block.cursor());
+      }
       for (int train_index = 0; train_index < this->n_train; train_index++) {
         Real x2s = 0;
         Real x3sv = 0;
@@ -817,8 +1050,7 @@ public:
         }
         for (size_t relation_index = 0; relation_index < this->relations.size();
              relation_index++) {
-          size_t block_index =
-              this->relations[relation_index].original_to_block[train_index];
+          size_t block_index = cursors[relation_index][train_index];
           q_s += this->relation_caches[relation_index].q_S(block_index);
           q += this->relation_caches[relation_index].q(block_index);
           x2s += this->relation_caches[relation_index].x2s(block_index);
@@ -828,6 +1060,7 @@ public:
         }
         this->e_train(train_index) += 0.5 * (q * q - q_s);
         this->e_var_sum +=
+            this->sample_weight(train_index) *
             (q * q * x2s + 0.5 * x2s * x2s - 2 * x3sv * q - 0.5 * x4s2 + x4sv2);
       }
     }
@@ -851,9 +1084,11 @@ public:
         } else {
           n = mean_var_truncated_normal_right(pred);
         }
+        // A row of weight s stands for s copies sharing one latent factor.
         this->e_train(train_data_index) -= std::get<0>(n);
-        elbo += std::get<2>(n) +
-                (std::get<0>(n) - pred) * (std::get<0>(n) - pred) / 2;
+        elbo += this->sample_weight(train_data_index) *
+                (std::get<2>(n) +
+                 (std::get<0>(n) - pred) * (std::get<0>(n) - pred) / 2);
       }
     } else if (this->learning_config.task_type == TASKTYPE::ORDERED) {
       throw std::runtime_error(
@@ -861,7 +1096,10 @@ public:
     }
     elbo += -hyper.alpha *
             (this->learning_config.beta_0 +
-             this->e_train.array().square().sum() + this->e_var_sum) /
+             (this->sample_weight.array() * this->e_train.array().square())
+                 .sum() +
+             this->learning_config.collapsed_sum_of_squares +
+             this->e_var_sum) /
             2;
     // - E[log e^{- alpha * alpha_rate}]
     elbo += hyper.alpha * hyper.alpha_rate * (1 - std::log(hyper.alpha_rate));
@@ -893,7 +1131,9 @@ public:
         auto dev = (hyper.mu_w(group_index) - this->learning_config.mu_0);
         elbo += -(dev * dev) / 2; // variance cancells out?
       }
-      for (int r = 0; r < fm.n_factors; r++) {
+      const int rank =
+          this->learning_config.group_rank(group_index, fm.n_factors);
+      for (int r = 0; r < rank; r++) {
         elbo += 0.5 * std::log(hyper.mu_V_var(group_index, r));
         mean = hyper.mu_V(group_index, r);
         rate = this->learning_config.beta_0;
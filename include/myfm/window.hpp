@@ -0,0 +1,128 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <stdexcept>
+
+#include "definitions.hpp"
+#include "util.hpp"
+
+namespace myFM {
+namespace window {
+using namespace std;
+
+/*
+Helpers to slide a training window over cases: the first `n_evict` cases
+are dropped and new ones are appended after the remaining ones. Each copies
+the kept entries once and in order, where rebuilding would transpose all of
+X again with scattered writes.
+*/
+
+/* For a row-major matrix whose rows are the cases. */
+template <typename Real, typename StorageIndex>
+inline void
+slide_rows(Eigen::SparseMatrix<Real, Eigen::RowMajor, StorageIndex> &X,
+           size_t n_evict, const Eigen::SparseMatrix<Real, Eigen::RowMajor,
+                                                     StorageIndex> &appended) {
+  typedef Eigen::SparseMatrix<Real, Eigen::RowMajor, StorageIndex>
+      SparseMatrix;
+  X.makeCompressed();
+  const StorageIndex *outer = X.outerIndexPtr();
+  const size_t n_kept = X.rows() - n_evict;
+  const StorageIndex start = outer[n_evict];
+  const StorageIndex kept_nnz = outer[X.rows()] - start;
+
+  SparseMatrix result(n_kept + appended.rows(), X.cols());
+  result.resizeNonZeros(kept_nnz + appended.nonZeros());
+  std::copy(X.valuePtr() + start, X.valuePtr() + start + kept_nnz,
+            result.valuePtr());
+  std::copy(X.innerIndexPtr() + start, X.innerIndexPtr() + start + kept_nnz,
+            result.innerIndexPtr());
+  StorageIndex *result_outer = result.outerIndexPtr();
+  for (size_t row = 0; row <= n_kept; row++) {
+    result_outer[row] = outer[row + n_evict] - start;
+  }
+  StorageIndex nnz = kept_nnz;
+  for (Eigen::Index row = 0; row < appended.rows(); row++) {
+    for (typename SparseMatrix::InnerIterator it(appended, row); it; ++it) {
+      result.valuePtr()[nnz] = it.value();
+      result.innerIndexPtr()[nnz] = it.col();
+      nnz++;
+    }
+    result_outer[n_kept + row + 1] = nnz;
+  }
+  X.swap(result);
+}
+
+/*
+For a row-major matrix whose columns are the cases, such as the transpose
+of X; the entries of each row are sorted by case, so the evicted ones are a
+prefix and the appended ones a suffix.
+*/
+template <typename Real, typename StorageIndex>
+inline void
+slide_columns(Eigen::SparseMatrix<Real, Eigen::RowMajor, StorageIndex> &X_t,
+              size_t n_evict,
+              const Eigen::SparseMatrix<Real, Eigen::RowMajor, StorageIndex>
+                  &appended_t) {
+  typedef Eigen::SparseMatrix<Real, Eigen::RowMajor, StorageIndex>
+      SparseMatrix;
+  if (appended_t.rows() != X_t.rows()) {
+    throw invalid_argument(StringBuilder{}
+                               .add("Appended cases have")
+                               .space_and_add(appended_t.rows())
+                               .space_and_add("features, expected")
+                               .space_and_add(X_t.rows())
+                               .add(".")
+                               .build());
+  }
+  X_t.makeCompressed();
+  const size_t n_kept = X_t.cols() - n_evict;
+  const StorageIndex *outer = X_t.outerIndexPtr();
+  const StorageIndex *inner = X_t.innerIndexPtr();
+
+  // the first kept entry of every row.
+  vector<StorageIndex> first_kept(X_t.rows());
+  StorageIndex nnz = 0;
+  for (Eigen::Index row = 0; row < X_t.rows(); row++) {
+    first_kept[row] =
+        std::lower_bound(inner + outer[row], inner + outer[row + 1],
+                         static_cast<StorageIndex>(n_evict)) -
+        inner;
+    nnz += outer[row + 1] - first_kept[row];
+  }
+  SparseMatrix result(X_t.rows(), n_kept + appended_t.cols());
+  result.resizeNonZeros(nnz + appended_t.nonZeros());
+  StorageIndex *result_outer = result.outerIndexPtr();
+  Real *values = result.valuePtr();
+  StorageIndex *indices = result.innerIndexPtr();
+  nnz = 0;
+  for (Eigen::Index row = 0; row < X_t.rows(); row++) {
+    for (StorageIndex k = first_kept[row]; k < outer[row + 1]; k++) {
+      values[nnz] = X_t.valuePtr()[k];
+      indices[nnz] = inner[k] - static_cast<StorageIndex>(n_evict);
+      nnz++;
+    }
+    for (typename SparseMatrix::InnerIterator it(appended_t, row); it; ++it) {
+      values[nnz] = it.value();
+      indices[nnz] = static_cast<StorageIndex>(n_kept + it.col());
+      nnz++;
+    }
+    result_outer[row + 1] = nnz;
+  }
+  X_t.swap(result);
+}
+
+template <typename Real>
+inline void slide_vector(types::Vector<Real> &v, size_t n_evict,
+                         const types::Vector<Real> &appended) {
+  const size_t n_kept = v.rows() - n_evict;
+  if (n_evict > 0) {
+    std::copy(v.data() + n_evict, v.data() + v.rows(), v.data());
+  }
+  v.conservativeResize(n_kept + appended.rows());
+  v.tail(appended.rows()) = appended;
+}
+
+} // namespace window
+} // namespace myFM
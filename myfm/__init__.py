@@ -1,5 +1,5 @@
 from . import _myfm as core
-from ._myfm import RelationBlock
+from ._myfm import RelationBlock, stratified_downsample
 
 # from .wrapper import MyFMRegressor, MyFMClassifier, MyFMOrderedProbit
 from .gibbs import MyFMGibbsClassifier, MyFMGibbsRegressor, MyFMOrderedProbit
@@ -11,6 +11,7 @@ MyFMClassifier = MyFMGibbsClassifier
 __all__ = [
     "core",
     "RelationBlock",
+    "stratified_downsample",
     "MyFMOrderedProbit",
     "MyFMRegressor",
     "MyFMClassifier",
@@ -10,30 +10,102 @@ import numpy
 import scipy.sparse
 
 __all__ = [
+    "AsyncPredictor",
+    "AsyncVariationalPredictor",
     "ConfigBuilder",
     "FM",
     "FMHyperParameters",
     "FMLearningConfig",
     "FMTrainer",
     "LearningHistory",
+    "MemoryReport",
+    "MultiModelScorer",
+    "MultiModelVariationalScorer",
+    "PredictionFuture",
     "Predictor",
     "RelationBlock",
+    "SharedPredictor",
     "TaskType",
     "VariationalFM",
     "VariationalFMHyperParameters",
     "VariationalFMTrainer",
     "VariationalLearningHistory",
     "VariationalPredictor",
+    "autotune_choices",
+    "clear_autotune",
     "create_train_fm",
     "create_train_vfm",
     "mean_var_truncated_normal_left",
     "mean_var_truncated_normal_right",
+    "projected_training_memory",
+    "set_autotune",
+    "start_trace",
+    "stop_trace",
+    "write_trace",
 ]
 
 m: int
 n: int
 
 
+class AsyncPredictor:
+    """Scores batches on a pool of worker threads, each by one worker.
+
+    ``submit`` returns a ``PredictionFuture`` at once and blocks only while
+    ``max_pending`` batches wait for a worker. Keeps ``predictor`` alive.
+    """
+
+    def __init__(
+        self, predictor: Predictor, n_workers: int, max_pending: int
+    ) -> None:
+        ...
+
+    def submit(
+        self, X: scipy.sparse.csr_matrix[float64], relations: List[RelationBlock]
+    ) -> PredictionFuture:
+        ...
+
+    def pending(self) -> int:
+        ...
+
+    @property
+    def n_workers(self) -> int:
+        """
+        :type: int
+        """
+
+    pass
+
+
+class AsyncVariationalPredictor:
+    """Scores batches on a pool of worker threads, each by one worker.
+
+    ``submit`` returns a ``PredictionFuture`` at once and blocks only while
+    ``max_pending`` batches wait for a worker. Keeps ``predictor`` alive.
+    """
+
+    def __init__(
+        self, predictor: VariationalPredictor, n_workers: int, max_pending: int
+    ) -> None:
+        ...
+
+    def submit(
+        self, X: scipy.sparse.csr_matrix[float64], relations: List[RelationBlock]
+    ) -> PredictionFuture:
+        ...
+
+    def pending(self) -> int:
+        ...
+
+    @property
+    def n_workers(self) -> int:
+        """
+        :type: int
+        """
+
+    pass
+
+
 class ConfigBuilder:
     def __init__(self) -> None:
         ...
@@ -58,9 +130,64 @@ class ConfigBuilder:
     def set_gamma_0(self, arg0: float) -> ConfigBuilder:
         ...
 
+    def set_memory_budget(self, arg0: int) -> ConfigBuilder:
+        ...
+
+    def set_auto_burn_in(self, arg0: bool) -> ConfigBuilder:
+        ...
+
+    def set_target_ess(self, arg0: float) -> ConfigBuilder:
+        ...
+
+    def set_rhat_threshold(self, arg0: float) -> ConfigBuilder:
+        ...
+
+    def set_geweke_threshold(self, arg0: float) -> ConfigBuilder:
+        ...
+
+    def set_convergence_check_interval(self, arg0: int) -> ConfigBuilder:
+        ...
+
+    def set_rao_blackwell(self, arg0: bool) -> ConfigBuilder:
+        ...
+
+    def set_sample_weight(self, arg0: List[float]) -> ConfigBuilder:
+        ...
+
+    def set_collapsed_sum_of_squares(self, arg0: float) -> ConfigBuilder:
+        ...
+
+    def set_implicit_feedback(
+        self, user_block: int, item_block: int, weight: float
+    ) -> ConfigBuilder:
+        ...
+
+    def set_interaction_blocks(
+        self, blocks: List[Tuple[List[int], List[int]]]
+    ) -> ConfigBuilder:
+        """Keep only the pairwise interactions of the given field blocks.
+
+        Fields are the groups of ``group_index``. A block ``(A, [])`` lets the
+        fields of ``A`` interact with each other, and ``(A, B)`` lets those of
+        ``A`` interact with those of ``B`` only. Masks are trained by the
+        Gibbs sampler, with or without relation blocks, but not with implicit
+        feedback; variational and multi-target training reject them.
+        """
+        ...
+
     def set_group_index(self, arg0: List[int]) -> ConfigBuilder:
         ...
 
+    def set_group_ranks(self, ranks: List[int]) -> ConfigBuilder:
+        """Give the features of group ``g`` only ``ranks[g]`` factors.
+
+        The remaining factors of those features stay at zero and are not
+        updated, so tail fields cost less per iteration. The learned samples
+        keep the ranks: prediction reads only the ranked factors and saved
+        predictors store only those.
+        """
+        ...
+
     def set_identical_groups(self, arg0: int) -> ConfigBuilder:
         ...
 
@@ -186,6 +313,60 @@ class FMHyperParameters:
 
 
 class FMLearningConfig:
+    @property
+    def memory_budget(self) -> int:
+        """
+        :type: int
+        """
+
+    @property
+    def auto_burn_in(self) -> bool:
+        """
+        :type: bool
+        """
+
+    @property
+    def target_ess(self) -> float:
+        """
+        :type: float
+        """
+
+    @property
+    def rao_blackwell(self) -> bool:
+        """
+        :type: bool
+        """
+
+    @property
+    def sample_weight(self) -> List[float]:
+        """
+        :type: List[float]
+        """
+
+    @property
+    def collapsed_sum_of_squares(self) -> float:
+        """
+        :type: float
+        """
+
+    @property
+    def implicit_user_block(self) -> int:
+        """
+        :type: int
+        """
+
+    @property
+    def implicit_item_block(self) -> int:
+        """
+        :type: int
+        """
+
+    @property
+    def implicit_weight(self) -> float:
+        """
+        :type: float
+        """
+
     pass
 
 
@@ -206,6 +387,46 @@ class FMTrainer:
     def create_Hyper(self, arg0: int) -> FMHyperParameters:
         ...
 
+    def memory_report(self) -> MemoryReport:
+        ...
+
+    def projected_memory_report(self, rank: int) -> MemoryReport:
+        ...
+
+    def learn_with_callback(
+        self,
+        fm: FM,
+        hyper: FMHyperParameters,
+        callback: Callable[[int, FM, FMHyperParameters, LearningHistory], bool],
+    ) -> Tuple[Predictor, LearningHistory]:
+        ...
+
+    def continue_with_callback(
+        self,
+        fm: FM,
+        hyper: FMHyperParameters,
+        callback: Callable[[int, FM, FMHyperParameters, LearningHistory], bool],
+    ) -> Tuple[Predictor, LearningHistory]:
+        """
+        learn_with_callback starting from ``fm`` and ``hyper`` as they are,
+        e.g. to continue training after slide_window.
+        """
+
+    def slide_window(
+        self,
+        fm: FM,
+        n_evict: int,
+        X_new: scipy.sparse.csr_matrix[float64],
+        relations_new: List[RelationBlock],
+        y_new: numpy.ndarray[float64, _Shape[m, 1]],
+    ) -> None:
+        """
+        Drop the ``n_evict`` oldest training cases and append ``X_new``.
+        ``relations_new`` holds the trainer's relation blocks with mappings
+        for the new cases only. ``fm`` must be the model the trainer last
+        left. Neither ordered probit nor sample weights are supported.
+        """
+
     pass
 
 
@@ -216,6 +437,9 @@ class LearningHistory:
     def __setstate__(self, arg0: tuple) -> None:
         ...
 
+    def memory_bytes(self) -> int:
+        ...
+
     @property
     def hypers(self) -> List[FMHyperParameters]:
         """
@@ -228,6 +452,24 @@ class LearningHistory:
         :type: List[int]
         """
 
+    @property
+    def n_burn_in(self) -> int:
+        """
+        :type: int
+        """
+
+    @property
+    def min_effective_sample_size(self) -> float:
+        """
+        :type: float
+        """
+
+    @property
+    def max_split_rhat(self) -> float:
+        """
+        :type: float
+        """
+
     @property
     def train_log_losses(self) -> List[float]:
         """
@@ -237,6 +479,106 @@ class LearningHistory:
     pass
 
 
+class MemoryReport:
+    def total(self) -> int:
+        ...
+
+    @property
+    def components(self) -> List[Tuple[str, int]]:
+        """
+        :type: List[Tuple[str, int]]
+        """
+
+    pass
+
+
+class MultiModelScorer:
+    """Scores one batch with several predictors in one pass over its rows.
+
+    Model ``m`` reads the batch's features from ``feature_offsets[m]`` on
+    (all from 0 when empty). Keeps the list of predictors alive; do not
+    remove predictors from it.
+    """
+
+    def __init__(
+        self, predictors: List[Predictor], feature_offsets: List[int] = []
+    ) -> None:
+        ...
+
+    def predict(
+        self,
+        X: scipy.sparse.csr_matrix[float64],
+        relations: List[RelationBlock],
+        n_workers: int = 1,
+    ) -> numpy.ndarray[float64, _Shape[m, n]]:
+        """One column per model, holding what its ``predict`` returns."""
+        ...
+
+    @property
+    def feature_offsets(self) -> List[int]:
+        """
+        :type: List[int]
+        """
+
+    @property
+    def n_models(self) -> int:
+        """
+        :type: int
+        """
+
+
+class MultiModelVariationalScorer:
+    """Scores one batch with several variational predictors in one pass.
+
+    Model ``m`` reads the batch's features from ``feature_offsets[m]`` on
+    (all from 0 when empty). Keeps the list of predictors alive; do not
+    remove predictors from it.
+    """
+
+    def __init__(
+        self, predictors: List[VariationalPredictor], feature_offsets: List[int] = []
+    ) -> None:
+        ...
+
+    def predict(
+        self,
+        X: scipy.sparse.csr_matrix[float64],
+        relations: List[RelationBlock],
+        n_workers: int = 1,
+    ) -> numpy.ndarray[float64, _Shape[m, n]]:
+        """One column per model, holding what its ``predict`` returns."""
+        ...
+
+    @property
+    def feature_offsets(self) -> List[int]:
+        """
+        :type: List[int]
+        """
+
+    @property
+    def n_models(self) -> int:
+        """
+        :type: int
+        """
+
+
+class PredictionFuture:
+    def done(self) -> bool:
+        ...
+
+    def result(
+        self, timeout: Optional[float] = None
+    ) -> numpy.ndarray[float64, _Shape[m, 1]]:
+        """Wait for the scores; raises ValueError if ``timeout`` passes first."""
+        ...
+
+    def add_done_callback(self, fn: Callable[["PredictionFuture"], None]) -> None:
+        """Call ``fn(self)`` when done, from the scoring worker thread."""
+        ...
+
+    pass
+
+
 class Predictor:
     def __getstate__(self) -> tuple:
         ...
@@ -244,6 +586,9 @@ class Predictor:
     def __setstate__(self, arg0: tuple) -> None:
         ...
 
+    def memory_report(self) -> MemoryReport:
+        ...
+
     def predict(
         self, arg0: scipy.sparse.csr_matrix[float64], arg1: List[RelationBlock]
     ) -> numpy.ndarray[float64, _Shape[m, 1]]:
@@ -257,6 +602,57 @@ class Predictor:
     ) -> numpy.ndarray[float64, _Shape[m, 1]]:
         ...
 
+    def predict_row_parallel(
+        self,
+        X: scipy.sparse.csr_matrix[float64],
+        relations: List[RelationBlock],
+        n_workers: int,
+    ) -> numpy.ndarray[float64, _Shape[m, 1]]:
+        """Score on ``n_workers`` threads, each taking a range of rows."""
+        ...
+
+    def predict_thompson(
+        self,
+        X: scipy.sparse.csr_matrix[float64],
+        relations: List[RelationBlock],
+        seed: int,
+        per_row: bool = False,
+        n_workers: int = 1,
+    ) -> numpy.ndarray[float64, _Shape[m, 1]]:
+        """Score with one posterior draw (Thompson sampling) instead of the mean.
+
+        Unless ``per_row``, all the rows share the draw. The draws depend on
+        ``seed`` only.
+        """
+        ...
+
+    def predict_with_attribution(
+        self,
+        X: scipy.sparse.csr_matrix[float64],
+        relations: List[RelationBlock],
+        n_workers: int = 1,
+    ) -> Tuple[
+        numpy.ndarray[float64, _Shape[m, 1]], scipy.sparse.csr_matrix[float64]
+    ]:
+        """The prediction and per-feature score attributions, in one pass.
+
+        Column ``j`` of the attributions is feature index ``j`` (``X``'s
+        columns, then those of each relation block). A row sums to its mean
+        score less the mean ``w0``.
+        """
+        ...
+
+    def save(self, path: str) -> None:
+        """
+        Write the samples in the binary format read by the C API.
+        """
+
+    @staticmethod
+    def load(path: str) -> Predictor:
+        """
+        Read a predictor written by `save` or the C API.
+        """
+
     @property
     def samples(self) -> List[FM]:
         """
@@ -277,7 +673,10 @@ class RelationBlock:
     def __init__(
         self,
         original_to_block: List[int],
-        data: scipy.sparse.csr_matrix[float64],
+        data: Union[
+            scipy.sparse.csr_matrix[float64], numpy.ndarray[float64, _Shape[m, n]]
+        ],
+        children: List[RelationBlock] = [],
     ) -> None:
         """
         Initializes relation block.
@@ -287,12 +686,19 @@ class RelationBlock:
 
         original_to_block: List[int]
             describes which entry points to to which row of the data (second argument).
-        data: scipy.sparse.csr_matrix[float64]
-            describes repeated pattern.
+        data: Union[scipy.sparse.csr_matrix[float64], np.ndarray[float64]]
+            describes repeated pattern. A dense array (e.g. pretrained
+            embeddings) is stored without index overhead.
+        children: List[RelationBlock]
+            blocks referenced by the rows of this block (e.g. user -> region).
+            Their `original_to_block` maps the rows of `data` to their rows,
+            and their features follow this block's own, depth first.
 
         Note
         -----
         The entries of `original_to_block` must be in the [0, data.shape[0]-1].
+        They are stored as 32-bit indices, or run-length encoded when that is
+        smaller; sorting the cases by block row makes the latter apply.
         """
 
     def __repr__(self) -> str:
@@ -301,6 +707,15 @@ class RelationBlock:
     def __setstate__(self, arg0: tuple) -> None:
         ...
 
+    @staticmethod
+    def dense_features(
+        data: numpy.ndarray[float64, _Shape[m, n]]
+    ) -> RelationBlock:
+        """
+        Dense features for every case, i.e. a dense relation block with the
+        identity mapping. Use this alongside X for dense continuous columns.
+        """
+
     @property
     def block_size(self) -> int:
         """
@@ -308,9 +723,17 @@ class RelationBlock:
         """
 
     @property
-    def data(self) -> scipy.sparse.csr_matrix[float64]:
+    def children(self) -> List[RelationBlock]:
         """
-        :type: scipy.sparse.csr_matrix[float64]
+        :type: List[RelationBlock]
+        """
+
+    @property
+    def data(
+        self,
+    ) -> Union[scipy.sparse.csr_matrix[float64], numpy.ndarray[float64, _Shape[m, n]]]:
+        """
+        :type: Union[scipy.sparse.csr_matrix[float64], numpy.ndarray[float64, _Shape[m, n]]]
         """
 
     @property
@@ -319,6 +742,18 @@ class RelationBlock:
         :type: int
         """
 
+    @property
+    def is_dense(self) -> bool:
+        """
+        :type: bool
+        """
+
+    @property
+    def mapper_encoding(self) -> str:
+        """
+        :type: str
+        """
+
     @property
     def mapper_size(self) -> int:
         """
@@ -331,9 +766,119 @@ class RelationBlock:
         :type: List[int]
         """
 
+    @property
+    def total_feature_size(self) -> int:
+        """
+        :type: int
+        """
+
     pass
 
 
+class SharedPredictor:
+    """A predictor whose samples live in shared memory or a mapped file.
+
+    Pre-forked workers each ``attach`` to the segment by name, scoring from
+    one copy of the samples. A named segment is reference counted: the
+    handle returned by ``create`` and each attached handle hold one
+    reference, and the name is removed when the last of them is released,
+    or earlier by ``unlink``. Handles stay valid after that. A mapped file
+    is left to its owner. Interaction masks and ordered probit predictors are
+    not supported.
+    """
+
+    @staticmethod
+    def create(predictor: Predictor, name: str) -> "SharedPredictor":
+        """Place the samples in the new shared-memory object ``name``.
+
+        The returned handle holds the first reference: keep it until a
+        worker has attached.
+        """
+        ...
+
+    @staticmethod
+    def attach(name: str) -> "SharedPredictor":
+        """Map the segment ``name`` and take a reference on it."""
+        ...
+
+    @staticmethod
+    def write_file(predictor: Predictor, path: str) -> None:
+        ...
+
+    @staticmethod
+    def map_file(path: str) -> "SharedPredictor":
+        """Map a file made by ``write_file`` read-only."""
+        ...
+
+    @staticmethod
+    def unlink(name: str) -> None:
+        """Remove the name of the shared-memory object ``name``."""
+        ...
+
+    def predict(
+        self,
+        X: scipy.sparse.csr_matrix[float64],
+        relations: List[RelationBlock],
+        n_workers: int = 1,
+    ) -> numpy.ndarray[float64, _Shape[m, 1]]:
+        ...
+
+    def sample(self, i: int) -> FM:
+        ...
+
+    @property
+    def attached(self) -> int:
+        """
+        References held on the segment, 0 for a mapped file.
+
+        :type: int
+        """
+
+    @property
+    def bytes(self) -> int:
+        """
+        :type: int
+        """
+
+    @property
+    def feature_size(self) -> int:
+        """
+        :type: int
+        """
+
+    @property
+    def n_samples(self) -> int:
+        """
+        :type: int
+        """
+
+    @property
+    def name(self) -> str:
+        """
+        :type: str
+        """
+
+    @property
+    def owner(self) -> bool:
+        """
+        Whether this handle was returned by ``create``.
+
+        :type: bool
+        """
+
+    @property
+    def rank(self) -> int:
+        """
+        :type: int
+        """
+
+    @property
+    def type(self) -> TaskType:
+        """
+        :type: TaskType
+        """
+
+
 class TaskType:
     """
     Members:
@@ -544,6 +1089,46 @@ class VariationalFMTrainer:
     def create_Hyper(self, arg0: int) -> VariationalFMHyperParameters:
         ...
 
+    def memory_report(self) -> MemoryReport:
+        ...
+
+    def projected_memory_report(self, rank: int) -> MemoryReport:
+        ...
+
+    def learn_with_callback(
+        self,
+        fm: VariationalFM,
+        hyper: VariationalFMHyperParameters,
+        callback: Callable[[int, VariationalFM, VariationalFMHyperParameters, VariationalLearningHistory], bool],
+    ) -> Tuple[VariationalPredictor, VariationalLearningHistory]:
+        ...
+
+    def continue_with_callback(
+        self,
+        fm: VariationalFM,
+        hyper: VariationalFMHyperParameters,
+        callback: Callable[[int, VariationalFM, VariationalFMHyperParameters, VariationalLearningHistory], bool],
+    ) -> Tuple[VariationalPredictor, VariationalLearningHistory]:
+        """
+        learn_with_callback starting from ``fm`` and ``hyper`` as they are,
+        e.g. to continue training after slide_window.
+        """
+
+    def slide_window(
+        self,
+        fm: VariationalFM,
+        n_evict: int,
+        X_new: scipy.sparse.csr_matrix[float64],
+        relations_new: List[RelationBlock],
+        y_new: numpy.ndarray[float64, _Shape[m, 1]],
+    ) -> None:
+        """
+        Drop the ``n_evict`` oldest training cases and append ``X_new``.
+        ``relations_new`` holds the trainer's relation blocks with mappings
+        for the new cases only. ``fm`` must be the model the trainer last
+        left. Neither ordered probit nor sample weights are supported.
+        """
+
     pass
 
 
@@ -554,6 +1139,9 @@ class VariationalLearningHistory:
     def __setstate__(self, arg0: tuple) -> None:
         ...
 
+    def memory_bytes(self) -> int:
+        ...
+
     @property
     def elbos(self) -> List[float]:
         """
@@ -581,6 +1169,65 @@ class VariationalPredictor:
     ) -> numpy.ndarray[float64, _Shape[m, 1]]:
         ...
 
+    def predict_mean_and_variance(
+        self,
+        X: scipy.sparse.csr_matrix[float64],
+        relations: List[RelationBlock],
+        n_workers: int = 1,
+    ) -> Tuple[
+        numpy.ndarray[float64, _Shape[m, 1]], numpy.ndarray[float64, _Shape[m, 1]]
+    ]:
+        """The predictions and the posterior variance of the scores.
+
+        One pass over the rows, on ``n_workers`` threads. The variance is that
+        of the score under the mean-field posterior, before the probit link
+        and without observation noise.
+        """
+        ...
+
+    def predict_row_parallel(
+        self,
+        X: scipy.sparse.csr_matrix[float64],
+        relations: List[RelationBlock],
+        n_workers: int,
+    ) -> numpy.ndarray[float64, _Shape[m, 1]]:
+        """Score on ``n_workers`` threads, each taking a range of rows."""
+        ...
+
+    def predict_thompson(
+        self,
+        X: scipy.sparse.csr_matrix[float64],
+        relations: List[RelationBlock],
+        seed: int,
+        per_row: bool = False,
+        n_workers: int = 1,
+    ) -> numpy.ndarray[float64, _Shape[m, 1]]:
+        """Score with one posterior draw (Thompson sampling) instead of the mean.
+
+        Unless ``per_row``, all the rows share the draw. The draws depend on
+        ``seed`` only.
+        """
+        ...
+
+    def predict_with_attribution(
+        self,
+        X: scipy.sparse.csr_matrix[float64],
+        relations: List[RelationBlock],
+        n_workers: int = 1,
+    ) -> Tuple[
+        numpy.ndarray[float64, _Shape[m, 1]], scipy.sparse.csr_matrix[float64]
+    ]:
+        """The prediction and per-feature score attributions, in one pass.
+
+        Column ``j`` of the attributions is feature index ``j`` (``X``'s
+        columns, then those of each relation block). A row sums to its mean
+        score less the mean ``w0``.
+        """
+        ...
+
+    def memory_report(self) -> MemoryReport:
+        ...
+
     def weights(self) -> VariationalFM:
         ...
 
@@ -625,9 +1272,118 @@ def create_train_vfm(
     """
 
 
+def create_train_multi_target_fm(
+    rank: int,
+    init_std: float,
+    X: scipy.sparse.csr_matrix[float64],
+    relations: List[RelationBlock],
+    Y: numpy.ndarray[float64, _Shape[m, n]],
+    random_seeds: List[int],
+    learning_config: FMLearningConfig,
+    share_V: bool,
+    callback: Callable[[int, List[FM], List[FMHyperParameters]], bool],
+) -> List[Tuple[Predictor, LearningHistory]]:
+    """
+    create and train one fm per column of Y, sharing X.
+    """
+
+
+def stratified_downsample(
+    strata: List[int], keep_rate: List[float], random_seed: int
+) -> Tuple[List[int], List[float]]:
+    """
+    Keep a uniform subset of each stratum's rows.
+
+    Stratum s keeps about ``keep_rate[s]`` of its rows (at least one), in
+    their original order, and returns the kept indices together with the
+    weights (stratum size / number kept) to pass as ``sample_weight``.
+    """
+
+
+def collapse_duplicate_rows(
+    X: scipy.sparse.csr_matrix[float64],
+    relations: List[RelationBlock],
+    y: numpy.ndarray[float64],
+    split_by_label: bool,
+    sample_weight: List[float] = [],
+) -> Tuple[
+    scipy.sparse.csr_matrix[float64],
+    List[RelationBlock],
+    numpy.ndarray[float64],
+    List[float],
+    float,
+    List[int],
+]:
+    """
+    Merge the cases with identical features into weighted rows.
+
+    Returns ``(X, relations, y, sample_weight, within_sum_of_squares,
+    original_to_collapsed)``, where ``y`` holds the mean target of each
+    merged row. Training on them with ``set_sample_weight`` and
+    ``set_collapsed_sum_of_squares`` is equivalent to training on the
+    original rows. With ``split_by_label``, only cases of the same binary
+    label are merged.
+    """
+
+
 def mean_var_truncated_normal_left(arg0: float) -> Tuple[float, float, float]:
     pass
 
 
 def mean_var_truncated_normal_right(arg0: float) -> Tuple[float, float, float]:
     pass
+
+
+def projected_training_memory(
+    X: scipy.sparse.csr_matrix[float64],
+    relations: List[RelationBlock],
+    rank: int,
+    learning_config: FMLearningConfig,
+    variational: bool,
+) -> MemoryReport:
+    """
+    Estimate the peak memory of a training run before starting it.
+    """
+
+
+def start_trace(capacity: int = 65536) -> None:
+    """
+    Start recording per-thread trace events.
+    """
+
+
+def stop_trace() -> None:
+    """
+    Stop recording trace events.
+    """
+
+
+def write_trace(path: str) -> None:
+    """
+    Write the recorded events in Chrome trace-event JSON.
+    """
+
+
+def set_autotune(enabled: bool = True, cache_file: str = "") -> None:
+    """
+    Choose scoring kernels by timing them on first use.
+
+    For each shape class (rank, rows, entries per row, relation blocks and,
+    for ``predict_parallel``, samples and workers), the candidate kernels
+    are warmed up and timed a few times on the actual input, and the one
+    with the fastest run is used from then on. One thread measures at a
+    time; calls made meanwhile use the default kernel. With ``cache_file``,
+    the choices are read from and appended to that file.
+    """
+
+
+def autotune_choices() -> Dict[str, str]:
+    """
+    The kernel chosen for each shape class so far.
+    """
+
+
+def clear_autotune() -> None:
+    """
+    Forget the kernel choices, leaving the cache file as it is.
+    """
@@ -1,3 +1,4 @@
+import warnings
 from abc import ABC, abstractclassmethod, abstractmethod, abstractproperty
 from collections import OrderedDict
 from typing import (
@@ -17,7 +18,13 @@ from tqdm import tqdm
 from scipy import sparse as sps, special
 
 from . import _myfm
-from ._myfm import ConfigBuilder, FMLearningConfig, RelationBlock, TaskType
+from ._myfm import (
+    ConfigBuilder,
+    FMLearningConfig,
+    RelationBlock,
+    TaskType,
+    collapse_duplicate_rows,
+)
 
 REAL = np.float64
 
@@ -71,6 +78,17 @@ class MyFMBase(Generic[FM, Hyper, Predictor, History], ABC):
     ) -> Tuple[Predictor, History]:
         raise NotImplementedError("not implemented")
 
+    @abstractclassmethod
+    def _create_trainer(
+        cls,
+        X: sps.csr_matrix,
+        X_rel: List[RelationBlock],
+        y: np.ndarray,
+        random_seed: int,
+        config: FMLearningConfig,
+    ) -> Any:
+        raise NotImplementedError("not implemented")
+
     @abstractproperty
     def _task_type(self) -> TaskType:
         raise NotImplementedError("must be specified in child")
@@ -150,6 +168,16 @@ class MyFMBase(Generic[FM, Hyper, Predictor, History], ABC):
 
         self.n_groups_: Optional[int] = None
 
+        # (trainer, fm, hyper, n_main_features, n_iter) kept by
+        # fit(keep_trainer=True) for slide.
+        self._trainer_state: Optional[Tuple[Any, FM, Hyper, int, int]] = None
+
+    def __getstate__(self) -> Dict[str, Any]:
+        # the trainer cannot be pickled; a restored estimator cannot slide.
+        state = self.__dict__.copy()
+        state["_trainer_state"] = None
+        return state
+
     def __str__(self) -> str:
         return "{class_name}(init_stdev={init_stdev}, alpha_0={alpha_0}, beta_0={beta_0}, gamma_0={gamma_0}, mu_0={mu_0}, reg_0={reg_0})".format(
             class_name=self.__class__.__name__,
@@ -204,8 +232,17 @@ class MyFMBase(Generic[FM, Hyper, Predictor, History], ABC):
         ] = None,
         config_builder: Optional[ConfigBuilder] = None,
         callback_default_freq: int = 10,
+        sample_weight: Optional[ArrayLike] = None,
+        collapse_duplicates: bool = False,
+        keep_trainer: bool = False,
     ) -> None:
 
+        if keep_trainer and (sample_weight is not None or collapse_duplicates):
+            raise ValueError(
+                "keep_trainer supports neither sample_weight nor collapse_duplicates."
+            )
+        self._trainer_state = None
+
         if config_builder is None:
             config_builder = ConfigBuilder()
 
@@ -216,7 +253,7 @@ class MyFMBase(Generic[FM, Hyper, Predictor, History], ABC):
             X = sps.csr_matrix(X)
 
         assert X.shape[0] == y.shape[0]
-        dim_all = X.shape[1] + sum([rel.feature_size for rel in X_rel])
+        dim_all = X.shape[1] + sum([rel.total_feature_size for rel in X_rel])
 
         if n_kept_samples is None:
             n_kept_samples = n_iter - 10
@@ -264,12 +301,37 @@ class MyFMBase(Generic[FM, Hyper, Predictor, History], ABC):
             do_test = False
 
         config_builder.set_n_iter(n_iter).set_n_kept_samples(n_kept_samples)
+        if sample_weight is not None:
+            sample_weight = np.asarray(sample_weight, dtype=np.float64)
+            if sample_weight.shape != (train_size,):
+                raise ValueError("sample_weight must have one entry per row.")
 
         if X.dtype != np.float64:
             X.data = X.data.astype(np.float64)
         y = self._process_y(y)
         self._set_tasktype(config_builder)
 
+        if collapse_duplicates:
+            if self._task_type == TaskType.ORDERED:
+                raise ValueError("collapse_duplicates does not support ordered probit.")
+            (
+                X,
+                X_rel,
+                y,
+                sample_weight,
+                within_sum_of_squares,
+                _,
+            ) = collapse_duplicate_rows(
+                X,
+                X_rel,
+                y,
+                self._task_type == TaskType.CLASSIFICATION,
+                [] if sample_weight is None else sample_weight,
+            )
+            config_builder.set_collapsed_sum_of_squares(within_sum_of_squares)
+        if sample_weight is not None:
+            config_builder.set_sample_weight(sample_weight)
+
         config = config_builder.build()
 
         if callback is None:
@@ -284,27 +346,103 @@ class MyFMBase(Generic[FM, Hyper, Predictor, History], ABC):
             callback_not_null = callback
 
         with tqdm(total=n_iter) as pbar:
+            wrapped_callback = self._wrap_callback(callback_not_null, pbar)
+            if keep_trainer:
+                trainer = self._create_trainer(X, X_rel, y, self.random_seed, config)
+                fm = trainer.create_FM(self.rank, self.init_stdev)
+                hyper = trainer.create_Hyper(fm.n_factors)
+                self.predictor_, self.history_ = trainer.learn_with_callback(
+                    fm, hyper, wrapped_callback
+                )
+                self._trainer_state = (trainer, fm, hyper, X.shape[1], n_iter)
+            else:
+                self.predictor_, self.history_ = self._train_core(
+                    self.rank,
+                    self.init_stdev,
+                    X,
+                    X_rel,
+                    y,
+                    self.random_seed,
+                    config,
+                    wrapped_callback,
+                )
+        if config.auto_burn_in and getattr(self.history_, "n_burn_in", 0) < 0:
+            warnings.warn(
+                "Burn-in was not detected within n_iter iterations; the last "
+                "n_kept_samples draws are used as they are."
+            )
 
-            def wrapped_callback(
-                i: int, fm: FM, hyper: Hyper, history: History
-            ) -> bool:
-                should_stop, message = callback_not_null(i, fm, hyper, history)
-                if message is not None:
-                    pbar.set_description(message)
-                pbar.update(1)
-                return should_stop
-
-            self.predictor_, self.history_ = self._train_core(
-                self.rank,
-                self.init_stdev,
-                X,
-                X_rel,
-                y,
-                self.random_seed,
-                config,
-                wrapped_callback,
+    def slide(
+        self,
+        X_new: Optional[ArrayLike],
+        y_new: np.ndarray,
+        n_evict: int,
+        X_rel_new: List[RelationBlock] = [],
+        callback: Optional[
+            Callable[[int, FM, Hyper, History], Tuple[bool, Optional[str]]]
+        ] = None,
+        callback_default_freq: int = 10,
+    ) -> None:
+        """Slide the training window of a model fitted with ``keep_trainer=True``
+        and continue training from where the last fit (or slide) stopped.
+
+        Parameters
+        ----------
+        X_new : 2D array-like or None
+            Input variable of the cases to append.
+
+        y_new : 1D array-like
+            Target variable of the cases to append.
+
+        n_evict : int
+            The number of oldest training cases to drop.
+
+        X_rel_new : list of RelationBlock, optional (default=[])
+            The relation blocks given to fit (same rows, same order), with
+            mappings for the new cases only.
+
+        callback: function(int, fm, hyper, history) -> (bool, str), optional(default = None)
+            Called at the every end of each iteration.
+        """
+        trainer_state = getattr(self, "_trainer_state", None)
+        if trainer_state is None:
+            raise RuntimeError("slide requires a model fitted with keep_trainer=True.")
+        trainer, fm, hyper, n_main_features, n_iter = trainer_state
+
+        new_size = check_data_consistency(X_new, X_rel_new)
+        if X_new is None:
+            X_new = sps.csr_matrix((new_size, n_main_features), dtype=REAL)
+        else:
+            X_new = sps.csr_matrix(X_new, dtype=REAL)
+        y_new = self._process_y(np.asarray(y_new))
+        if y_new.shape != (new_size,):
+            raise ValueError("y_new must have one entry per new case.")
+
+        trainer.slide_window(fm, n_evict, X_new, X_rel_new, y_new)
+
+        if callback is None:
+            callback = self._create_default_callback(
+                callback_default_freq=callback_default_freq, do_test=False
+            )
+        with tqdm(total=n_iter) as pbar:
+            self.predictor_, self.history_ = trainer.continue_with_callback(
+                fm, hyper, self._wrap_callback(callback, pbar)
             )
 
+    @staticmethod
+    def _wrap_callback(
+        callback: Callable[[int, FM, Hyper, History], Tuple[bool, Optional[str]]],
+        pbar: tqdm,
+    ) -> Callable[[int, FM, Hyper, History], bool]:
+        def wrapped_callback(i: int, fm: FM, hyper: Hyper, history: History) -> bool:
+            should_stop, message = callback(i, fm, hyper, history)
+            if message is not None:
+                pbar.set_description(message)
+            pbar.update(1)
+            return should_stop
+
+        return wrapped_callback
+
     def _set_tasktype(self, config_builder: ConfigBuilder) -> None:
         config_builder.set_task_type(self._task_type)
 
@@ -330,6 +468,20 @@ class MyFMBase(Generic[FM, Hyper, Predictor, History], ABC):
             raise RuntimeError("Predictor called before fit.")
         return self.predictor_
 
+    def memory_report(self) -> Dict[str, int]:
+        """Bytes held by the fitted samples and the learning history.
+
+        To estimate the memory of a run before fitting, use
+        ``myfm._myfm.projected_training_memory``; to fail fast when it exceeds
+        a limit, pass ``ConfigBuilder().set_memory_budget(n_bytes)`` to ``fit``.
+        """
+        report: Dict[str, int] = OrderedDict(
+            self._fetch_predictor().memory_report().components
+        )
+        if self.history_ is not None:
+            report["history"] = self.history_.memory_bytes()
+        return report
+
 
 class RegressorMixin(Generic[FM, Hyper]):
     _predict_core: Callable
@@ -13,6 +13,7 @@ from ._myfm import (
     Predictor,
     RelationBlock,
     TaskType,
+    FMTrainer,
     create_train_fm,
 )
 from .base import (
@@ -73,6 +74,17 @@ class MyFMGibbsBase(
             rank, init_stdev, X, X_rel, y, random_seed, config, callback
         )
 
+    @classmethod
+    def _create_trainer(
+        cls,
+        X: sps.csr_matrix,
+        X_rel: List[RelationBlock],
+        y: np.ndarray,
+        random_seed: int,
+        config: FMLearningConfig,
+    ) -> FMTrainer:
+        return FMTrainer(X, X_rel, y, random_seed, config)
+
     def get_hyper_trace(self) -> "pd.DataFrame":
         if pd is None:
             raise RuntimeError("Require pandas for get_hyper_trace.")
@@ -136,6 +148,9 @@ class MyFMGibbsRegressor(RegressorMixin[FM, FMHyperParameters], MyFMGibbsBase):
             ]
         ] = None,
         config_builder: Optional[ConfigBuilder] = None,
+        sample_weight: Optional[ArrayLike] = None,
+        collapse_duplicates: bool = False,
+        keep_trainer: bool = False,
     ) -> "MyFMGibbsRegressor":
         """Performs Gibbs sampling to fit the data.
 
@@ -173,6 +188,21 @@ class MyFMGibbsRegressor(RegressorMixin[FM, FMHyperParameters], MyFMGibbsBase):
 
         callback: function(int, fm, hyper, history) -> (bool, str), optional(default = None)
             Called at the every end of each Gibbs iteration.
+
+        sample_weight: 1D array-like, optional (default = None)
+            Likelihood weight of each row; a row of weight ``s`` counts as
+            ``s`` copies of itself. Use the weights returned by
+            :func:`myfm.stratified_downsample` to train on a downsampled set.
+
+        collapse_duplicates: bool, optional (default = False)
+            If ``True``, the cases with identical features (including the
+            relation block rows) are merged into weighted rows before
+            training, which leaves the model unchanged.
+
+        keep_trainer: bool, optional (default = False)
+            If ``True``, the trainer and the last model are kept so that
+            :meth:`slide` can later move the training window and continue.
+            Supports neither ``sample_weight`` nor ``collapse_duplicates``.
         """
         self._fit(
             X,
@@ -187,6 +217,9 @@ class MyFMGibbsRegressor(RegressorMixin[FM, FMHyperParameters], MyFMGibbsBase):
             callback=callback,
             group_shapes=group_shapes,
             config_builder=config_builder,
+            sample_weight=sample_weight,
+            collapse_duplicates=collapse_duplicates,
+            keep_trainer=keep_trainer,
         )
         return self
 
@@ -237,6 +270,9 @@ class MyFMGibbsClassifier(ClassifierMixin[FM, FMHyperParameters], MyFMGibbsBase)
             ]
         ] = None,
         config_builder: Optional[ConfigBuilder] = None,
+        sample_weight: Optional[ArrayLike] = None,
+        collapse_duplicates: bool = False,
+        keep_trainer: bool = False,
     ) -> "MyFMGibbsClassifier":
         """Performs Gibbs sampling to fit the data.
 
@@ -274,6 +310,21 @@ class MyFMGibbsClassifier(ClassifierMixin[FM, FMHyperParameters], MyFMGibbsBase)
 
         callback: function(int, fm, hyper, history) -> (bool, str), optional(default = None)
             Called at the every end of each Gibbs iteration.
+
+        sample_weight: 1D array-like, optional (default = None)
+            Likelihood weight of each row; a row of weight ``s`` counts as
+            ``s`` copies of itself. Use the weights returned by
+            :func:`myfm.stratified_downsample` to train on a downsampled set.
+
+        collapse_duplicates: bool, optional (default = False)
+            If ``True``, the cases with identical features (including the
+            relation block rows) are merged into weighted rows before
+            training, which leaves the model unchanged.
+
+        keep_trainer: bool, optional (default = False)
+            If ``True``, the trainer and the last model are kept so that
+            :meth:`slide` can later move the training window and continue.
+            Supports neither ``sample_weight`` nor ``collapse_duplicates``.
         """
         self._fit(
             X,
@@ -288,6 +339,9 @@ class MyFMGibbsClassifier(ClassifierMixin[FM, FMHyperParameters], MyFMGibbsBase)
             callback=callback,
             group_shapes=group_shapes,
             config_builder=config_builder,
+            sample_weight=sample_weight,
+            collapse_duplicates=collapse_duplicates,
+            keep_trainer=keep_trainer,
         )
         return self
 
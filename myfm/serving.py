@@ -0,0 +1,52 @@
+"""Helpers to score from an asyncio event loop."""
+import asyncio
+from typing import List, Optional, Union
+
+import numpy as np
+import scipy.sparse as sps
+
+from ._myfm import (
+    AsyncPredictor,
+    AsyncVariationalPredictor,
+    PredictionFuture,
+    RelationBlock,
+)
+
+
+def wrap_future(
+    future: PredictionFuture, loop: Optional[asyncio.AbstractEventLoop] = None
+) -> "asyncio.Future[np.ndarray]":
+    """Make a ``PredictionFuture`` awaitable on ``loop``.
+
+    The scoring worker wakes the loop when it is done, so no thread of the
+    loop waits for the scores.
+    """
+    if loop is None:
+        loop = asyncio.get_event_loop()
+    result = loop.create_future()
+
+    def _transfer(done: PredictionFuture) -> None:
+        if result.cancelled():
+            return
+        try:
+            result.set_result(done.result())
+        except Exception as e:
+            result.set_exception(e)
+
+    future.add_done_callback(lambda done: loop.call_soon_threadsafe(_transfer, done))
+    return result
+
+
+async def predict_async(
+    predictor: Union[AsyncPredictor, AsyncVariationalPredictor],
+    X: sps.csr_matrix,
+    X_rel: Optional[List[RelationBlock]] = None,
+) -> np.ndarray:
+    """Submit a batch and await its scores.
+
+    ``submit`` blocks while the predictor's queue is full, which holds up
+    the loop; size ``max_pending`` for the batches expected in flight.
+    """
+    if X_rel is None:
+        X_rel = []
+    return await wrap_future(predictor.submit(sps.csr_matrix(X), X_rel))
@@ -1,9 +1,12 @@
 from .movielens100k_data import MovieLens100kDataManager
 from .movielens1M_data import MovieLens1MDataManager
 from .movielens10M_data import MovieLens10MDataManager
+from .synthetic_data import SYNTHETIC_SCALES, SyntheticMovieLensDataManager
 
 __all__ = [
     "MovieLens100kDataManager",
     "MovieLens1MDataManager",
     "MovieLens10MDataManager",
+    "SyntheticMovieLensDataManager",
+    "SYNTHETIC_SCALES",
 ]
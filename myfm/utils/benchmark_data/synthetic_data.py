@@ -0,0 +1,145 @@
+from typing import Dict, NamedTuple, Optional, Tuple
+
+import numpy as np
+import pandas as pd
+
+from .loader_base import RandomStateType
+
+
+class SyntheticScale(NamedTuple):
+    n_users: int
+    n_items: int
+    n_ratings: int
+
+
+SYNTHETIC_SCALES: Dict[str, SyntheticScale] = {
+    "100k": SyntheticScale(943, 1682, 100_000),
+    "1m": SyntheticScale(6040, 3706, 1_000_209),
+    "10m": SyntheticScale(69878, 10677, 10_000_054),
+    "100m": SyntheticScale(480189, 17770, 100_480_507),
+}
+
+
+class SyntheticMovieLensDataManager:
+    """Generates MovieLens-like ratings without any download.
+
+    Users and items are drawn with power-law (Zipf-like) activity and
+    popularity, each (user, item) pair appears at most once, and ratings in
+    {1, ..., 5} come from a low-rank model with user/item biases and Gaussian
+    noise. User and item ids are contiguous integers starting from 0.
+
+    Parameters
+    ----------
+    scale : str
+        One of "100k", "1m", "10m" and "100m", matching the size of the
+        corresponding MovieLens (or Netflix, for "100m") dataset.
+    random_state : Union[int, np.random.RandomState, None]
+        Seed of the generator.
+    """
+
+    def __init__(
+        self,
+        scale: str = "1m",
+        random_state: Optional[RandomStateType] = 42,
+        latent_rank: int = 8,
+        user_exponent: float = 0.8,
+        item_exponent: float = 1.0,
+        noise_std: float = 0.8,
+    ):
+        if scale not in SYNTHETIC_SCALES:
+            raise ValueError(
+                "scale must be one of {}.".format(list(SYNTHETIC_SCALES.keys()))
+            )
+        self.scale = scale
+        self.n_users, self.n_items, self.n_ratings = SYNTHETIC_SCALES[scale]
+        if isinstance(random_state, np.random.RandomState):
+            self.rns = random_state
+        else:
+            self.rns = np.random.RandomState(random_state)
+        self.latent_rank = latent_rank
+        self.user_exponent = user_exponent
+        self.item_exponent = item_exponent
+        self.noise_std = noise_std
+
+    def _power_law(self, n: int, exponent: float) -> np.ndarray:
+        weight = (np.arange(n) + 1.0) ** (-exponent)
+        # shuffle so that popularity is not correlated with the id.
+        weight = weight[self.rns.permutation(n)]
+        return weight / weight.sum()
+
+    def _sample_pairs(self) -> Tuple[np.ndarray, np.ndarray]:
+        p_user = self._power_law(self.n_users, self.user_exponent)
+        p_item = self._power_law(self.n_items, self.item_exponent)
+        keys = np.zeros(0, dtype=np.int64)
+        while keys.shape[0] < self.n_ratings:
+            n_draw = int((self.n_ratings - keys.shape[0]) * 1.2) + 1
+            users = self.rns.choice(self.n_users, size=n_draw, p=p_user)
+            items = self.rns.choice(self.n_items, size=n_draw, p=p_item)
+            new_keys = users.astype(np.int64) * self.n_items + items
+            keys = np.unique(np.concatenate([keys, new_keys]))
+        keys = keys[self.rns.permutation(keys.shape[0])[: self.n_ratings]]
+        return (keys // self.n_items).astype(np.int64), (keys % self.n_items).astype(
+            np.int64
+        )
+
+    def load_rating_all(self) -> pd.DataFrame:
+        """Generate all the interactions.
+
+        Returns
+        -------
+        pd.DataFrame
+            with columns user_id, movie_id, rating and timestamp.
+        """
+        user_ids, item_ids = self._sample_pairs()
+        k = self.latent_rank
+        user_factor = self.rns.normal(0, 1 / k ** 0.5, size=(self.n_users, k))
+        item_factor = self.rns.normal(0, 1 / k ** 0.5, size=(self.n_items, k))
+        user_bias = self.rns.normal(0, 0.3, size=self.n_users)
+        item_bias = self.rns.normal(0, 0.5, size=self.n_items)
+
+        score = np.empty(user_ids.shape[0], dtype=np.float64)
+        chunk = 1 << 20
+        for start in range(0, user_ids.shape[0], chunk):
+            u = user_ids[start : start + chunk]
+            i = item_ids[start : start + chunk]
+            score[start : start + chunk] = (
+                (user_factor[u] * item_factor[i]).sum(axis=1)
+                + user_bias[u]
+                + item_bias[i]
+            )
+        score += 3.6 + self.rns.normal(0, self.noise_std, size=score.shape[0])
+        rating = np.clip(np.round(score), 1, 5).astype(np.int64)
+
+        timestamp = pd.to_datetime(
+            self.rns.randint(956_703_932, 1_046_454_590, size=rating.shape[0]),
+            unit="s",
+        )
+        return pd.DataFrame(
+            dict(
+                user_id=user_ids,
+                movie_id=item_ids,
+                rating=rating,
+                timestamp=timestamp,
+            )
+        )
+
+    def load_rating_split(
+        self, test_ratio: float = 0.1
+    ) -> Tuple[pd.DataFrame, pd.DataFrame]:
+        """Generate the interactions and split them randomly into train/test.
+
+        Parameters
+        ----------
+        test_ratio : float, optional
+            fraction of the interactions used as the test set, by default 0.1
+
+        Returns
+        -------
+        Tuple[pd.DataFrame, pd.DataFrame]
+            train and test dataframes.
+        """
+        if not (0 < test_ratio < 1):
+            raise ValueError("0 < test_ratio < 1 must hold.")
+        df_all = self.load_rating_all()
+        is_test = self.rns.rand(df_all.shape[0]) < test_ratio
+        return df_all[~is_test], df_all[is_test]
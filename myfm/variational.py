@@ -1,5 +1,4 @@
 from typing import Tuple, List, Callable, Optional
-import warnings
 import numpy as np
 from .base import (
     MyFMBase,
@@ -18,6 +17,7 @@ from ._myfm import (
     VariationalFMHyperParameters,
     VariationalPredictor,
     VariationalLearningHistory,
+    VariationalFMTrainer,
     create_train_vfm,
 )
 
@@ -54,24 +54,65 @@ class MyFMVariationalBase(
             rank, init_stdev, X, X_rel, y, random_seed, config, callback
         )
 
+    @classmethod
+    def _create_trainer(
+        cls,
+        X: sps.csr_matrix,
+        X_rel: List[RelationBlock],
+        y: np.ndarray,
+        random_seed: int,
+        config: FMLearningConfig,
+    ) -> VariationalFMTrainer:
+        return VariationalFMTrainer(X, X_rel, y, random_seed, config)
+
     def _predict_core(
         self,
         X: Optional[ArrayLike],
         X_rel: List[RelationBlock] = [],
         n_workers: Optional[int] = None,
     ) -> np.ndarray:
-        if n_workers is not None:
-            warnings.warn(
-                "Currently variational api does not support multi-thread prediction."
-            )
         predictor = self._fetch_predictor()
         shape = check_data_consistency(X, X_rel)
         if X is None:
             X = sps.csr_matrix((shape, 0), dtype=REAL)
         else:
             X = sps.csr_matrix(X)
+        if n_workers is not None:
+            return predictor.predict_row_parallel(X, X_rel, n_workers)
         return predictor.predict(X, X_rel)
 
+    def predict_with_variance(
+        self,
+        X: Optional[ArrayLike],
+        X_rel: List[RelationBlock] = [],
+        n_workers: int = 1,
+    ) -> Tuple[np.ndarray, np.ndarray]:
+        """Make a prediction together with the posterior variance of the score.
+
+        Parameters
+        ----------
+        X : Optional[ArrayLike]
+            Main Table. When None, treated as a matrix without columns.
+        X_rel : List[RelationBlock], optional
+            Relations, by default []
+        n_workers : int, optional
+            The number of threads the rows are split among, by default 1.
+
+        Returns
+        -------
+        Tuple[np.ndarray, np.ndarray]
+            What ``predict`` (``predict_proba`` for classifiers) returns, and
+            the variance of the score under the variational posterior, before
+            the probit link and without observation noise.
+        """
+        predictor = self._fetch_predictor()
+        shape = check_data_consistency(X, X_rel)
+        if X is None:
+            X = sps.csr_matrix((shape, 0), dtype=REAL)
+        else:
+            X = sps.csr_matrix(X)
+        return predictor.predict_mean_and_variance(X, X_rel, n_workers)
+
 
 class VariationalFMRegressor(
     RegressorMixin[VariationalFM, VariationalFMHyperParameters],
@@ -103,6 +144,9 @@ class VariationalFMRegressor(
             ]
         ] = None,
         config_builder: Optional[ConfigBuilder] = None,
+        sample_weight: Optional[ArrayLike] = None,
+        collapse_duplicates: bool = False,
+        keep_trainer: bool = False,
     ) -> "VariationalFMRegressor":
         """Performs batch variational inference fit the data.
 
@@ -140,6 +184,21 @@ class VariationalFMRegressor(
 
         callback: function(int, fm, hyper, history) -> bool, optional(default = None)
             Called at the every end of each Gibbs iteration.
+
+        sample_weight: 1D array-like, optional (default = None)
+            Likelihood weight of each row; a row of weight ``s`` counts as
+            ``s`` copies of itself. Use the weights returned by
+            :func:`myfm.stratified_downsample` to train on a downsampled set.
+
+        collapse_duplicates: bool, optional (default = False)
+            If ``True``, the cases with identical features (including the
+            relation block rows) are merged into weighted rows before
+            training, which leaves the model unchanged.
+
+        keep_trainer: bool, optional (default = False)
+            If ``True``, the trainer and the last model are kept so that
+            :meth:`slide` can later move the training window and continue.
+            Supports neither ``sample_weight`` nor ``collapse_duplicates``.
         """
         self._fit(
             X,
@@ -154,6 +213,9 @@ class VariationalFMRegressor(
             callback=callback,
             group_shapes=group_shapes,
             config_builder=config_builder,
+            sample_weight=sample_weight,
+            collapse_duplicates=collapse_duplicates,
+            keep_trainer=keep_trainer,
         )
         return self
 
@@ -207,6 +269,9 @@ class VariationalFMClassifier(
             ]
         ] = None,
         config_builder: Optional[ConfigBuilder] = None,
+        sample_weight: Optional[ArrayLike] = None,
+        collapse_duplicates: bool = False,
+        keep_trainer: bool = False,
     ) -> "VariationalFMClassifier":
         """Performs batch variational inference fit the data.
 
@@ -244,6 +309,21 @@ class VariationalFMClassifier(
 
         callback: function(int, fm, hyper) -> bool, optional(default = None)
             Called at the every end of each Gibbs iteration.
+
+        sample_weight: 1D array-like, optional (default = None)
+            Likelihood weight of each row; a row of weight ``s`` counts as
+            ``s`` copies of itself. Use the weights returned by
+            :func:`myfm.stratified_downsample` to train on a downsampled set.
+
+        collapse_duplicates: bool, optional (default = False)
+            If ``True``, the cases with identical features (including the
+            relation block rows) are merged into weighted rows before
+            training, which leaves the model unchanged.
+
+        keep_trainer: bool, optional (default = False)
+            If ``True``, the trainer and the last model are kept so that
+            :meth:`slide` can later move the training window and continue.
+            Supports neither ``sample_weight`` nor ``collapse_duplicates``.
         """
         self._fit(
             X,
@@ -258,6 +338,9 @@ class VariationalFMClassifier(
             callback=callback,
             group_shapes=group_shapes,
             config_builder=config_builder,
+            sample_weight=sample_weight,
+            collapse_duplicates=collapse_duplicates,
+            keep_trainer=keep_trainer,
         )
         return self
 
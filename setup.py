@@ -77,6 +77,25 @@ headers = [
     "include/myfm/FMTrainer.hpp",
     "include/myfm/FMLearningConfig.hpp",
     "include/myfm/OProbitSampler.hpp",
+    "include/myfm/serialization.hpp",
+    "include/myfm/memory.hpp",
+    "include/myfm/trace.hpp",
+    "include/myfm/convergence.hpp",
+    "include/myfm/block_mapper.hpp",
+    "include/myfm/downsample.hpp",
+    "include/myfm/collapse.hpp",
+    "include/myfm/implicit.hpp",
+    "include/myfm/special.hpp",
+    "include/myfm/multi_target.hpp",
+    "include/myfm/window.hpp",
+    "include/myfm/thompson.hpp",
+    "include/myfm/async_predictor.hpp",
+    "include/myfm/interaction_mask.hpp",
+    "include/myfm/feature_ranks.hpp",
+    "include/myfm/autotune.hpp",
+    "include/myfm/multi_model.hpp",
+    "include/myfm/shared_predictor.hpp",
+    "include/myfm/c_api.h",
     "include/Faddeeva/Faddeeva.hh",
     "src/declare_module.hpp",
 ]
@@ -93,6 +112,8 @@ ext_modules = [
             get_eigen_include(),
             "include",
         ],
+        # shm_open and shm_unlink live in librt on older glibc.
+        libraries=["rt"] if sys.platform.startswith("linux") else [],
         language="c++",
     ),
 ]
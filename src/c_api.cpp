@@ -0,0 +1,230 @@
+#include <cstdint>
+#include <exception>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "myfm/c_api.h"
+
+#include "myfm/FM.hpp"
+#include "myfm/definitions.hpp"
+#include "myfm/predictor.hpp"
+#include "myfm/serialization.hpp"
+#include "myfm/util.hpp"
+
+using Real = double;
+using FMType = myFM::FM<Real>;
+using PredictorType = myFM::Predictor<Real>;
+using RelationBlockType = myFM::relational::RelationBlock<Real>;
+using SparseMatrix = typename FMType::SparseMatrix;
+using Vector = typename FMType::Vector;
+using DenseMatrix = typename FMType::DenseMatrix;
+using TASKTYPE = typename myFM::FMLearningConfig<Real>::TASKTYPE;
+
+struct myfm_predictor {
+  PredictorType predictor;
+};
+
+struct myfm_relation_block {
+  RelationBlockType block;
+};
+
+namespace {
+
+thread_local std::string last_error;
+
+// predict_csr returns one value per row, which has no room for the class
+// probabilities of an ordered probit model.
+const char *const ORDERED_NOT_SUPPORTED =
+    "ordered probit predictors are not supported by the C API.";
+
+int fail(int status, const char *message) {
+  last_error = message;
+  return status;
+}
+
+/* Runs `body`, translating exceptions into status codes. */
+template <typename F> int guarded(F body) {
+  try {
+    body();
+    last_error.clear();
+    return MYFM_OK;
+  } catch (const std::invalid_argument &e) {
+    return fail(MYFM_ERROR_INVALID_ARGUMENT, e.what());
+  } catch (const std::ios_base::failure &e) {
+    return fail(MYFM_ERROR_IO, e.what());
+  } catch (const std::runtime_error &e) {
+    return fail(MYFM_ERROR_RUNTIME, e.what());
+  } catch (const std::exception &e) {
+    return fail(MYFM_ERROR_UNKNOWN, e.what());
+  } catch (...) {
+    return fail(MYFM_ERROR_UNKNOWN, "unknown error");
+  }
+}
+
+/*
+A view of the caller's CSR arrays, after checking that indptr starts at 0
+and never decreases and that every column index is within n_cols, so that
+malformed input is an error rather than an out-of-bounds read.
+*/
+Eigen::Map<const SparseMatrix> csr_view(size_t n_rows, size_t n_cols,
+                                        const int32_t *indptr,
+                                        const int32_t *indices,
+                                        const double *data) {
+  if (n_rows > static_cast<size_t>(INT32_MAX) ||
+      n_cols > static_cast<size_t>(INT32_MAX)) {
+    throw std::invalid_argument("CSR dimensions exceed the int32 range.");
+  }
+  if (n_rows > 0 && indptr == nullptr) {
+    throw std::invalid_argument("indptr must not be NULL.");
+  }
+  if (n_rows > 0 && indptr[0] != 0) {
+    throw std::invalid_argument("indptr must start at 0.");
+  }
+  for (size_t row = 0; row < n_rows; row++) {
+    if (indptr[row + 1] < indptr[row]) {
+      throw std::invalid_argument("indptr must be non-decreasing.");
+    }
+  }
+  const size_t nnz = (n_rows > 0) ? static_cast<size_t>(indptr[n_rows]) : 0;
+  if (nnz > 0 && (indices == nullptr || data == nullptr)) {
+    throw std::invalid_argument("indices and data must not be NULL.");
+  }
+  for (size_t k = 0; k < nnz; k++) {
+    if (indices[k] < 0 || static_cast<size_t>(indices[k]) >= n_cols) {
+      throw std::invalid_argument("column index out of range.");
+    }
+  }
+  return Eigen::Map<const SparseMatrix>(n_rows, n_cols, nnz, indptr, indices,
+                                        data);
+}
+
+} // namespace
+
+extern "C" {
+
+int myfm_abi_version(void) { return MYFM_ABI_VERSION; }
+
+const char *myfm_last_error(void) { return last_error.c_str(); }
+
+int myfm_predictor_create(size_t rank, size_t feature_size, int task_type,
+                          myfm_predictor **out) {
+  if (out == nullptr) {
+    return fail(MYFM_ERROR_INVALID_ARGUMENT, "out must not be NULL.");
+  }
+  if (task_type == MYFM_TASK_ORDERED) {
+    return fail(MYFM_ERROR_INVALID_ARGUMENT, ORDERED_NOT_SUPPORTED);
+  }
+  if (task_type < MYFM_TASK_REGRESSION || task_type > MYFM_TASK_ORDERED) {
+    return fail(MYFM_ERROR_INVALID_ARGUMENT, "unknown task type.");
+  }
+  return guarded([&] {
+    *out = new myfm_predictor{
+        PredictorType(rank, feature_size, static_cast<TASKTYPE>(task_type))};
+  });
+}
+
+int myfm_predictor_add_sample(myfm_predictor *predictor, double w0,
+                              const double *w, const double *V) {
+  if (predictor == nullptr || w == nullptr ||
+      (V == nullptr && predictor->predictor.rank > 0)) {
+    return fail(MYFM_ERROR_INVALID_ARGUMENT, "NULL argument.");
+  }
+  return guarded([&] {
+    const PredictorType &p = predictor->predictor;
+    Vector w_(Eigen::Map<const Vector>(w, p.feature_size));
+    DenseMatrix V_ =
+        (p.rank > 0) ? DenseMatrix(Eigen::Map<const DenseMatrix>(
+                           V, p.feature_size, p.rank))
+                     : DenseMatrix(p.feature_size, 0);
+    predictor->predictor.add_sample(FMType(w0, w_, V_));
+  });
+}
+
+int myfm_predictor_load(const char *path, myfm_predictor **out) {
+  if (path == nullptr || out == nullptr) {
+    return fail(MYFM_ERROR_INVALID_ARGUMENT, "NULL argument.");
+  }
+  return guarded([&] {
+    PredictorType predictor =
+        myFM::serialization::load_predictor<Real>(std::string(path));
+    if (predictor.type == TASKTYPE::ORDERED) {
+      throw std::invalid_argument(ORDERED_NOT_SUPPORTED);
+    }
+    *out = new myfm_predictor{std::move(predictor)};
+  });
+}
+
+int myfm_predictor_save(const myfm_predictor *predictor, const char *path) {
+  if (predictor == nullptr || path == nullptr) {
+    return fail(MYFM_ERROR_INVALID_ARGUMENT, "NULL argument.");
+  }
+  return guarded([&] {
+    myFM::serialization::save_predictor(predictor->predictor,
+                                        std::string(path));
+  });
+}
+
+int myfm_predictor_info(const myfm_predictor *predictor, size_t *rank,
+                        size_t *feature_size, size_t *n_samples,
+                        int *task_type) {
+  if (predictor == nullptr) {
+    return fail(MYFM_ERROR_INVALID_ARGUMENT, "NULL argument.");
+  }
+  const PredictorType &p = predictor->predictor;
+  if (rank != nullptr)
+    *rank = p.rank;
+  if (feature_size != nullptr)
+    *feature_size = p.feature_size;
+  if (n_samples != nullptr)
+    *n_samples = p.samples.size();
+  if (task_type != nullptr)
+    *task_type = static_cast<int>(p.type);
+  return MYFM_OK;
+}
+
+void myfm_predictor_free(myfm_predictor *predictor) { delete predictor; }
+
+int myfm_relation_block_create(const uint64_t *original_to_block,
+                               size_t mapper_size, size_t n_rows,
+                               size_t n_cols, const int32_t *indptr,
+                               const int32_t *indices, const double *data,
+                               myfm_relation_block **out) {
+  if (out == nullptr || (mapper_size > 0 && original_to_block == nullptr)) {
+    return fail(MYFM_ERROR_INVALID_ARGUMENT, "NULL argument.");
+  }
+  return guarded([&] {
+    myFM::relational::BlockMapper mapper(original_to_block, mapper_size);
+    *out = new myfm_relation_block{RelationBlockType(
+        mapper,
+        SparseMatrix(csr_view(n_rows, n_cols, indptr, indices, data)))};
+  });
+}
+
+void myfm_relation_block_free(myfm_relation_block *block) { delete block; }
+
+int myfm_predictor_predict_csr(const myfm_predictor *predictor, size_t n_rows,
+                               size_t n_cols, const int32_t *indptr,
+                               const int32_t *indices, const double *data,
+                               const myfm_relation_block *const *relations,
+                               size_t n_relations, size_t n_workers,
+                               double *out) {
+  if (predictor == nullptr || out == nullptr ||
+      (n_relations > 0 && relations == nullptr)) {
+    return fail(MYFM_ERROR_INVALID_ARGUMENT, "NULL argument.");
+  }
+  return guarded([&] {
+    Eigen::Map<const SparseMatrix> X =
+        csr_view(n_rows, n_cols, indptr, indices, data);
+    std::vector<const RelationBlockType *> blocks;
+    blocks.reserve(n_relations);
+    for (size_t i = 0; i < n_relations; i++) {
+      blocks.push_back(relations[i] == nullptr ? nullptr
+                                               : &relations[i]->block);
+    }
+    Eigen::Map<Vector>(out, n_rows) =
+        predictor->predictor.predict_row_parallel(X, blocks, n_workers);
+  });
+}
+
+} // extern "C"
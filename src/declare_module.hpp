@@ -3,6 +3,7 @@
 #include <cstddef>
 #include <functional>
 #include <iostream>
+#include <memory>
 #include <random>
 #include <tuple>
 #include <vector>
@@ -13,11 +14,21 @@
 #include <pybind11/stl.h>
 
 #include "myfm/FM.hpp"
+#include "myfm/collapse.hpp"
 #include "myfm/FMLearningConfig.hpp"
 #include "myfm/FMTrainer.hpp"
 #include "myfm/LearningHistory.hpp"
 #include "myfm/OProbitSampler.hpp"
+#include "myfm/async_predictor.hpp"
+#include "myfm/autotune.hpp"
 #include "myfm/definitions.hpp"
+#include "myfm/downsample.hpp"
+#include "myfm/memory.hpp"
+#include "myfm/multi_model.hpp"
+#include "myfm/multi_target.hpp"
+#include "myfm/serialization.hpp"
+#include "myfm/shared_predictor.hpp"
+#include "myfm/trace.hpp"
 #include "myfm/util.hpp"
 #include "myfm/variational.hpp"
 
@@ -38,6 +49,10 @@ create_train_fm(
     std::function<bool(int, myFM::FM<Real> *, myFM::FMHyperParameters<Real> *,
                        myFM::GibbsLearningHistory<Real> *)>
         cb) {
+  myFM::memory::check_memory_budget(
+      myFM::memory::projected_training_memory(X, relations, n_factor, config,
+                                              false),
+      config);
   FMTrainer<Real> fm_trainer(X, relations, y, random_seed, config);
   auto fm = fm_trainer.create_FM(n_factor, init_std);
   auto hyper_param = fm_trainer.create_Hyper(fm.n_factors);
@@ -57,6 +72,10 @@ create_train_vfm(
                        myFM::variational::VariationalFMHyperParameters<Real> *,
                        myFM::variational::VariationalLearningHistory<Real> *)>
         cb) {
+  myFM::memory::check_memory_budget(
+      myFM::memory::projected_training_memory(X, relations, n_factor, config,
+                                              true),
+      config);
   myFM::variational::VariationalFMTrainer<Real> fm_trainer(X, relations, y,
                                                            random_seed, config);
   auto fm = fm_trainer.create_FM(n_factor, init_std);
@@ -64,6 +83,140 @@ create_train_vfm(
   return fm_trainer.learn_with_callback(fm, hyper_param, cb);
 }
 
+template <typename Real>
+std::vector<
+    std::pair<myFM::Predictor<Real>, myFM::GibbsLearningHistory<Real>>>
+create_train_multi_target_fm(
+    size_t n_factor, Real init_std,
+    const typename myFM::FM<Real>::SparseMatrix &X,
+    const vector<myFM::relational::RelationBlock<Real>> &relations,
+    const typename myFM::FM<Real>::DenseMatrix &Y,
+    const vector<int> &random_seeds, myFM::FMLearningConfig<Real> &config,
+    bool share_V,
+    std::function<bool(int, const vector<myFM::FM<Real>> &,
+                       const vector<myFM::FMHyperParameters<Real>> &)>
+        cb) {
+  using Trainer = myFM::multi_target::MultiTargetGibbsTrainer<Real>;
+  Trainer fm_trainer(X, relations, Y, random_seeds, config, share_V);
+  auto fms = fm_trainer.create_FMs(n_factor, init_std);
+  auto hypers = fm_trainer.create_Hypers(n_factor);
+  return fm_trainer.learn_with_callback(
+      fms, hypers,
+      [&cb](int i, vector<myFM::FM<Real>> *fms,
+            vector<myFM::FMHyperParameters<Real>> *hypers) {
+        return cb(i, *fms, *hypers);
+      });
+}
+
+/*
+Deletes with the GIL released: joining the workers of an AsyncPredictor
+would otherwise deadlock against a callback waiting for the GIL.
+*/
+template <typename T> struct ReleasingGILDeleter {
+  void operator()(T *p) const {
+    py::gil_scoped_release release;
+    delete p;
+  }
+};
+
+template <typename Future>
+void declare_prediction_future(py::module &m, const char *name) {
+  py::class_<Future, std::shared_ptr<Future>>(m, name)
+      .def("done", &Future::done)
+      .def(
+          "result",
+          [](const Future &future, py::object timeout) {
+            py::gil_scoped_release release;
+            if (!future.wait(timeout.is_none() ? -1 : timeout.cast<double>())) {
+              throw py::value_error("Prediction did not finish in time.");
+            }
+            return future.get();
+          },
+          py::arg("timeout") = py::none())
+      .def("add_done_callback", [](std::shared_ptr<Future> future,
+                                   py::function callback) {
+        // the callable is released wherever the future runs its callbacks.
+        std::shared_ptr<py::function> held(
+            new py::function(std::move(callback)), [](py::function *f) {
+              py::gil_scoped_acquire acquire;
+              delete f;
+            });
+        // a weak reference, as the future owns its callbacks.
+        std::weak_ptr<Future> weak(future);
+        future->add_done_callback([held, weak]() {
+          py::gil_scoped_acquire acquire;
+          try {
+            (*held)(weak.lock());
+          } catch (py::error_already_set &e) {
+            // there is no caller to raise to.
+            e.restore();
+            PyErr_WriteUnraisable(held->ptr());
+          }
+        });
+      });
+}
+
+template <typename AsyncPredictor>
+void declare_async_predictor(py::module &m, const char *name) {
+  using PredictorType = typename AsyncPredictor::PredictorType;
+  py::class_<AsyncPredictor,
+             std::unique_ptr<AsyncPredictor,
+                             ReleasingGILDeleter<AsyncPredictor>>>(m, name)
+      .def(py::init<const PredictorType &, size_t, size_t>(),
+           py::arg("predictor"), py::arg("n_workers"), py::arg("max_pending"),
+           py::keep_alive<1, 2>())
+      .def("submit", &AsyncPredictor::submit, py::arg("X"),
+           py::arg("relations"), py::call_guard<py::gil_scoped_release>())
+      .def("pending", &AsyncPredictor::pending)
+      .def_property_readonly("n_workers", &AsyncPredictor::n_workers);
+}
+
+template <typename Scorer>
+void declare_multi_model_scorer(py::module &m, const char *name) {
+  using PredictorType = typename Scorer::PredictorType;
+  py::class_<Scorer>(m, name)
+      .def(py::init<vector<const PredictorType *>, vector<size_t>>(),
+           R"delim(Score one batch with all of ``predictors`` in one pass.
+
+    Model ``m`` reads the batch's features from ``feature_offsets[m]`` on
+    (all from 0 when empty). The list of predictors is kept alive with the
+    scorer; do not remove predictors from it.)delim",
+           py::arg("predictors"),
+           py::arg("feature_offsets") = vector<size_t>{},
+           py::keep_alive<1, 2>())
+      .def("predict", &Scorer::predict, py::arg("X"), py::arg("relations"),
+           py::arg("n_workers") = 1, py::call_guard<py::gil_scoped_release>())
+      .def_property_readonly("n_models", &Scorer::n_models)
+      .def_property_readonly("feature_offsets", &Scorer::feature_offsets);
+}
+
+template <typename Shared>
+void declare_shared_predictor(py::module &m, const char *name) {
+  py::class_<Shared, std::unique_ptr<Shared>>(m, name)
+      .def_static("create", &Shared::create,
+                  R"delim(Place the samples of ``predictor`` in the new
+    shared-memory object ``name``. The handle returned holds the first
+    reference and the name is removed when the last handle is released:
+    keep it until a worker has attached.)delim",
+                  py::arg("predictor"), py::arg("name"))
+      .def_static("attach", &Shared::attach, py::arg("name"))
+      .def_static("write_file", &Shared::write_file, py::arg("predictor"),
+                  py::arg("path"))
+      .def_static("map_file", &Shared::map_file, py::arg("path"))
+      .def_static("unlink", &Shared::unlink, py::arg("name"))
+      .def("predict", &Shared::predict, py::arg("X"), py::arg("relations"),
+           py::arg("n_workers") = 1, py::call_guard<py::gil_scoped_release>())
+      .def("sample", &Shared::sample, py::arg("i"))
+      .def_property_readonly("rank", &Shared::rank)
+      .def_property_readonly("feature_size", &Shared::feature_size)
+      .def_property_readonly("n_samples", &Shared::n_samples)
+      .def_property_readonly("type", &Shared::type)
+      .def_property_readonly("bytes", &Shared::bytes)
+      .def_property_readonly("attached", &Shared::attached)
+      .def_property_readonly("name", &Shared::name)
+      .def_property_readonly("owner", &Shared::owner);
+}
+
 template <typename Real> void declare_functional(py::module &m) {
   using FMTrainer = FMTrainer<Real>;
   using VFMTrainer = myFM::variational::VariationalFMTrainer<Real>;
@@ -82,6 +235,7 @@ template <typename Real> void declare_functional(py::module &m) {
   using Predictor = typename myFM::Predictor<Real>;
   using VPredictor = typename myFM::variational::VariationalPredictor<Real>;
   using TASKTYPE = typename myFM::FMLearningConfig<Real>::TASKTYPE;
+  using MemoryReport = myFM::memory::MemoryReport;
 
   m.doc() = "Backend C++ implementation for myfm.";
 
@@ -90,11 +244,31 @@ template <typename Real> void declare_functional(py::module &m) {
       .value("CLASSIFICATION", TASKTYPE::CLASSIFICATION)
       .value("ORDERED", TASKTYPE::ORDERED);
 
-  py::class_<FMLearningConfig>(m, "FMLearningConfig");
+  py::class_<FMLearningConfig>(m, "FMLearningConfig")
+      .def_readonly("memory_budget", &FMLearningConfig::memory_budget)
+      .def_readonly("auto_burn_in", &FMLearningConfig::auto_burn_in)
+      .def_readonly("target_ess", &FMLearningConfig::target_ess)
+      .def_readonly("rao_blackwell", &FMLearningConfig::rao_blackwell)
+      .def_property_readonly("sample_weight",
+                             &FMLearningConfig::sample_weight)
+      .def_readonly("collapsed_sum_of_squares",
+                    &FMLearningConfig::collapsed_sum_of_squares)
+      .def_readonly("implicit_user_block",
+                    &FMLearningConfig::implicit_user_block)
+      .def_readonly("implicit_item_block",
+                    &FMLearningConfig::implicit_item_block)
+      .def_readonly("implicit_weight", &FMLearningConfig::implicit_weight);
+
+  py::class_<MemoryReport>(m, "MemoryReport")
+      .def_readonly("components", &MemoryReport::components)
+      .def("total", &MemoryReport::total)
+      .def("__repr__", &MemoryReport::to_string);
 
   py::class_<RelationBlock>(m, "RelationBlock",
                             R"delim(The RelationBlock Class.)delim")
-      .def(py::init<vector<size_t>, const SparseMatrix &>(), R"delim(
+      .def(py::init<vector<size_t>, const SparseMatrix &,
+                    vector<RelationBlock>>(),
+           R"delim(
     Initializes relation block.
 
     Parameters
@@ -104,36 +278,93 @@ template <typename Real> void declare_functional(py::module &m) {
         describes which entry points to to which row of the data (second argument).
     data: scipy.sparse.csr_matrix[float64]
         describes repeated pattern. 
+    children: List[RelationBlock]
+        blocks referenced by the rows of this block (e.g. user -> region).
+        Their `original_to_block` maps the rows of `data` to their rows,
+        and their features follow this block's own, depth first.
       
     Note
     -----
-    The entries of `original_to_block` must be in the [0, data.shape[0]-1].)delim",
-           py::arg("original_to_block"), py::arg("data"))
-      .def_readonly("original_to_block", &RelationBlock::original_to_block)
-      .def_readonly("data", &RelationBlock::X)
+    The entries of `original_to_block` must be in the [0, data.shape[0]-1].
+    They are stored as 32-bit indices, or run-length encoded when that is
+    smaller; sorting the cases by block row makes the latter apply.)delim",
+           py::arg("original_to_block"), py::arg("data"),
+           py::arg("children") = vector<RelationBlock>{})
+      .def(py::init<vector<size_t>,
+                    const typename RelationBlock::DenseMatrix &,
+                    vector<RelationBlock>>(),
+           R"delim(
+    Initializes relation block with dense rows.
+
+    Parameters
+    ----------
+
+    original_to_block: List[int]
+        describes which entry points to to which row of the data (second argument).
+    data: np.ndarray[float64]
+        dense rows (e.g. pretrained embeddings), stored without index overhead.
+    children: List[RelationBlock]
+        blocks referenced by the rows of this block.)delim",
+           py::arg("original_to_block"), py::arg("data"),
+           py::arg("children") = vector<RelationBlock>{})
+      .def_static("dense_features", &RelationBlock::dense_features,
+                  R"delim(
+    Dense features for every case, i.e. a dense relation block with the
+    identity mapping. Use this alongside X for dense continuous columns.)delim",
+                  py::arg("data"))
+      .def_property_readonly("original_to_block",
+                             [](const RelationBlock &block) {
+                               return block.original_to_block.to_vector();
+                             })
+      .def_property_readonly("mapper_encoding",
+                             [](const RelationBlock &block) {
+                               return block.original_to_block.encoding_name();
+                             })
+      .def_property_readonly("data",
+                             [](const RelationBlock &block) -> py::object {
+                               if (block.is_dense) {
+                                 return py::cast(block.X_dense);
+                               }
+                               return py::cast(block.X);
+                             })
+      .def_readonly("is_dense", &RelationBlock::is_dense)
       .def_readonly("mapper_size", &RelationBlock::mapper_size)
       .def_readonly("block_size", &RelationBlock::block_size)
       .def_readonly("feature_size", &RelationBlock::feature_size)
+      .def_readonly("children", &RelationBlock::children)
+      .def_property_readonly("total_feature_size",
+                             &RelationBlock::total_feature_size)
       .def("__repr__",
            [](const RelationBlock &block) {
              return (myFM::StringBuilder{})(
                         "<RelationBlock with mapper size = ")(
                         block.mapper_size)(", block data size = ")(
                         block.block_size)(", feature size = ")(
-                        block.feature_size)(">")
+                        block.feature_size)(", children = ")(
+                        block.children.size())(">")
                  .build();
            })
       .def(py::pickle(
           [](const RelationBlock &block) {
-            return py::make_tuple(block.original_to_block, block.X);
+            return py::make_tuple(
+                block.original_to_block.to_vector(), block.X, block.children,
+                block.is_dense ? py::cast(block.X_dense) : py::none());
           },
           [](py::tuple t) {
-            if (t.size() != 2) {
+            if (t.size() < 2 || t.size() > 4) {
               throw std::runtime_error("invalid state for Relationblock.");
             }
+            if (t.size() == 4 && !t[3].is_none()) {
+              return new RelationBlock(
+                  t[0].cast<vector<size_t>>(),
+                  t[3].cast<typename RelationBlock::DenseMatrix>(),
+                  t[2].cast<vector<RelationBlock>>());
+            }
             return new RelationBlock(
                 t[0].cast<vector<size_t>>(),
-                t[1].cast<typename RelationBlock::SparseMatrix>());
+                t[1].cast<typename RelationBlock::SparseMatrix>(),
+                t.size() >= 3 ? t[2].cast<vector<RelationBlock>>()
+                              : vector<RelationBlock>{});
           }));
 
   py::class_<ConfigBuilder>(m, "ConfigBuilder")
@@ -153,12 +384,34 @@ template <typename Real> void declare_functional(py::module &m) {
       .def("set_identical_groups", &ConfigBuilder::set_identical_groups)
       .def("set_cutpoint_scale", &ConfigBuilder::set_cutpoint_scale)
       .def("set_cutpoint_groups", &ConfigBuilder::set_cutpoint_groups)
+      .def("set_memory_budget", &ConfigBuilder::set_memory_budget)
+      .def("set_auto_burn_in", &ConfigBuilder::set_auto_burn_in)
+      .def("set_target_ess", &ConfigBuilder::set_target_ess)
+      .def("set_rhat_threshold", &ConfigBuilder::set_rhat_threshold)
+      .def("set_geweke_threshold", &ConfigBuilder::set_geweke_threshold)
+      .def("set_convergence_check_interval",
+           &ConfigBuilder::set_convergence_check_interval)
+      .def("set_rao_blackwell", &ConfigBuilder::set_rao_blackwell)
+      .def("set_sample_weight", &ConfigBuilder::set_sample_weight)
+      .def("set_collapsed_sum_of_squares",
+           &ConfigBuilder::set_collapsed_sum_of_squares)
+      .def("set_implicit_feedback", &ConfigBuilder::set_implicit_feedback,
+           py::arg("user_block"), py::arg("item_block"), py::arg("weight"))
+      .def("set_interaction_blocks", &ConfigBuilder::set_interaction_blocks,
+           py::arg("blocks"))
+      .def("set_group_ranks", &ConfigBuilder::set_group_ranks,
+           py::arg("ranks"))
       .def("build", &ConfigBuilder::build);
 
   py::class_<FM>(m, "FM")
       .def_readwrite("w0", &FM::w0)
       .def_readwrite("w", &FM::w)
-      .def_readwrite("V", &FM::V)
+      .def_property(
+          "V", [](const FM &fm) { return fm.dense_V(); },
+          [](FM &fm, const DenseMatrix &V) {
+            fm.V = V;
+            fm.ranked_V.resize(0);
+          })
       .def_readwrite("cutpoints", &FM::cutpoints)
       .def("predict_score", &FM::predict_score)
 
@@ -175,17 +428,53 @@ template <typename Real> void declare_functional(py::module &m) {
             Vector w(fm.w);
             DenseMatrix V(fm.V);
             vector<Vector> cutpoints(fm.cutpoints);
-            return py::make_tuple(w0, w, V, cutpoints);
+            py::tuple state =
+                fm.mask ? py::make_tuple(w0, w, V, cutpoints,
+                                         fm.mask->field_of(),
+                                         fm.mask->n_fields(), fm.mask->blocks())
+                        : py::make_tuple(w0, w, V, cutpoints);
+            if (!fm.feature_ranks) {
+              return state;
+            }
+            // the feature ranks go last, after the mask if any, followed by
+            // the ranked V of a compact sample, whose V is then empty.
+            if (fm.is_compact()) {
+              return py::tuple(state +
+                               py::make_tuple(fm.feature_ranks->ranks(),
+                                              Vector(fm.ranked_V)));
+            }
+            return py::tuple(state +
+                             py::make_tuple(fm.feature_ranks->ranks()));
           },
           [](py::tuple t) {
             if (t.size() == 3) {
               /* For the compatibility with earlier versions */
               return new FM(t[0].cast<Real>(), t[1].cast<Vector>(),
                             t[2].cast<DenseMatrix>());
-            } else if (t.size() == 4) {
-              return new FM(t[0].cast<Real>(), t[1].cast<Vector>(),
-                            t[2].cast<DenseMatrix>(),
-                            t[3].cast<vector<Vector>>());
+            } else if (t.size() >= 4 && t.size() <= 9) {
+              std::unique_ptr<FM> fm(new FM(t[0].cast<Real>(),
+                                            t[1].cast<Vector>(),
+                                            t[2].cast<DenseMatrix>(),
+                                            t[3].cast<vector<Vector>>()));
+              const size_t ranks_at = t.size() >= 7 ? 7 : 4;
+              if (t.size() >= 7) {
+                fm->mask = std::make_shared<const myFM::InteractionMask>(
+                    t[4].cast<vector<size_t>>(), t[5].cast<size_t>(),
+                    t[6].cast<myFM::InteractionMask::BlockType>());
+              }
+              if (t.size() > ranks_at) {
+                fm->feature_ranks =
+                    std::make_shared<const myFM::FeatureRanks>(
+                        t[ranks_at].cast<vector<int>>());
+              }
+              if (t.size() > ranks_at + 1) {
+                fm->ranked_V = t[ranks_at + 1].cast<Vector>();
+                if (static_cast<size_t>(fm->ranked_V.rows()) !=
+                    fm->feature_ranks->n_entries()) {
+                  throw std::runtime_error("invalid state for FM.");
+                }
+              }
+              return fm.release();
             } else {
               throw std::runtime_error("invalid state for FM.");
             }
@@ -216,7 +505,14 @@ template <typename Real> void declare_functional(py::module &m) {
             DenseMatrix V(fm.V);
             DenseMatrix V_var(fm.V_var);
             vector<Vector> cutpoints(fm.cutpoints);
-            return py::make_tuple(w0, w0_var, w, w_var, V, V_var, cutpoints);
+            py::tuple state =
+                py::make_tuple(w0, w0_var, w, w_var, V, V_var, cutpoints);
+            if (!fm.feature_ranks) {
+              return state;
+            }
+            // the feature ranks go last, as for FM.
+            return py::tuple(state +
+                             py::make_tuple(fm.feature_ranks->ranks()));
           },
           [](py::tuple t) {
             if (t.size() == 6) {
@@ -225,11 +521,18 @@ template <typename Real> void declare_functional(py::module &m) {
                              t[2].cast<Vector>(), t[3].cast<Vector>(),
                              t[4].cast<DenseMatrix>(),
                              t[5].cast<DenseMatrix>());
-            } else if (t.size() == 7) {
-              return new VFM(t[0].cast<Real>(), t[1].cast<Real>(),
-                             t[2].cast<Vector>(), t[3].cast<Vector>(),
-                             t[4].cast<DenseMatrix>(), t[5].cast<DenseMatrix>(),
-                             t[6].cast<vector<Vector>>());
+            } else if (t.size() == 7 || t.size() == 8) {
+              VFM *fm = new VFM(t[0].cast<Real>(), t[1].cast<Real>(),
+                                t[2].cast<Vector>(), t[3].cast<Vector>(),
+                                t[4].cast<DenseMatrix>(),
+                                t[5].cast<DenseMatrix>(),
+                                t[6].cast<vector<Vector>>());
+              if (t.size() == 8) {
+                fm->feature_ranks =
+                    std::make_shared<const myFM::FeatureRanks>(
+                        t[7].cast<vector<int>>());
+              }
+              return fm;
             } else {
               throw std::runtime_error("invalid state for FM.");
             }
@@ -304,6 +607,28 @@ template <typename Real> void declare_functional(py::module &m) {
       .def_readonly("samples", &Predictor::samples)
       .def("predict", &Predictor::predict)
       .def("predict_parallel", &Predictor::predict_parallel)
+      .def("predict_row_parallel", &Predictor::predict_row_parallel,
+           py::arg("X"), py::arg("relations"), py::arg("n_workers"))
+      .def("predict_thompson", &Predictor::predict_thompson, py::arg("X"),
+           py::arg("relations"), py::arg("seed"), py::arg("per_row") = false,
+           py::arg("n_workers") = 1)
+      .def("predict_with_attribution", &Predictor::predict_with_attribution,
+           py::arg("X"), py::arg("relations"), py::arg("n_workers") = 1)
+      .def("memory_report", &Predictor::memory_report)
+      .def(
+          "save",
+          [](const Predictor &predictor, const std::string &path) {
+            myFM::serialization::save_predictor(predictor, path);
+          },
+          R"delim(Write the samples in the binary format read by the C API.)delim",
+          py::arg("path"))
+      .def_static(
+          "load",
+          [](const std::string &path) {
+            return myFM::serialization::load_predictor<Real>(path);
+          },
+          R"delim(Read a predictor written by `save` or the C API.)delim",
+          py::arg("path"))
       .def(py::pickle(
           [](const Predictor &predictor) {
             return py::make_tuple(predictor.rank, predictor.feature_size,
@@ -323,6 +648,22 @@ template <typename Real> void declare_functional(py::module &m) {
 
   py::class_<VPredictor>(m, "VariationalPredictor")
       .def("predict", &VPredictor::predict)
+      .def("predict_row_parallel", &VPredictor::predict_row_parallel,
+           py::arg("X"), py::arg("relations"), py::arg("n_workers"))
+      .def("predict_mean_and_variance",
+           &myFM::variational::predict_mean_and_variance<Real>,
+           R"delim(The predictions and the posterior variance of the scores.
+
+    One pass over the rows, on ``n_workers`` threads. The variance is that
+    of the score under the mean-field posterior, before the probit link
+    and without observation noise.)delim",
+           py::arg("X"), py::arg("relations"), py::arg("n_workers") = 1)
+      .def("predict_thompson", &VPredictor::predict_thompson, py::arg("X"),
+           py::arg("relations"), py::arg("seed"), py::arg("per_row") = false,
+           py::arg("n_workers") = 1)
+      .def("predict_with_attribution", &VPredictor::predict_with_attribution,
+           py::arg("X"), py::arg("relations"), py::arg("n_workers") = 1)
+      .def("memory_report", &VPredictor::memory_report)
       .def(py::pickle(
           [](const VPredictor &predictor) {
             return py::make_tuple(predictor.rank, predictor.feature_size,
@@ -344,40 +685,98 @@ template <typename Real> void declare_functional(py::module &m) {
         return returned;
       });
 
+  declare_prediction_future<myFM::PredictionFuture<Vector>>(
+      m, "PredictionFuture");
+  declare_async_predictor<myFM::AsyncPredictor<Real>>(m, "AsyncPredictor");
+  declare_async_predictor<myFM::AsyncPredictor<Real, VFM>>(
+      m, "AsyncVariationalPredictor");
+  declare_multi_model_scorer<myFM::MultiModelScorer<Real>>(
+      m, "MultiModelScorer");
+  declare_multi_model_scorer<myFM::MultiModelScorer<Real, VFM>>(
+      m, "MultiModelVariationalScorer");
+  declare_shared_predictor<myFM::SharedPredictor<Real>>(m, "SharedPredictor");
+
+  using Callback = std::function<bool(int, FM *, Hyper *, History *)>;
+  using VCallback = std::function<bool(int, VFM *, VHyper *, VHistory *)>;
+
   py::class_<FMTrainer>(m, "FMTrainer")
       .def(py::init<const SparseMatrix &, const vector<RelationBlock> &,
                     const Vector &, int, FMLearningConfig>())
       .def("create_FM", &FMTrainer::create_FM)
-      .def("create_Hyper", &FMTrainer::create_Hyper);
+      .def("create_Hyper", &FMTrainer::create_Hyper)
+      .def("memory_report", &FMTrainer::memory_report)
+      .def("projected_memory_report", &FMTrainer::projected_memory_report,
+           py::arg("rank"))
+      .def("learn_with_callback", &FMTrainer::learn_with_callback,
+           py::arg("fm"), py::arg("hyper"), py::arg("callback"))
+      .def(
+          "continue_with_callback",
+          [](FMTrainer &trainer, FM &fm, Hyper &hyper, Callback callback) {
+            return trainer.continue_with_callback(fm, hyper, callback);
+          },
+          py::arg("fm"), py::arg("hyper"), py::arg("callback"))
+      .def("slide_window", &FMTrainer::slide_window, py::arg("fm"),
+           py::arg("n_evict"), py::arg("X_new"), py::arg("relations_new"),
+           py::arg("y_new"));
 
   py::class_<VFMTrainer>(m, "VariationalFMTrainer")
       .def(py::init<const SparseMatrix &, const vector<RelationBlock> &,
                     const Vector &, int, FMLearningConfig>())
       .def("create_FM", &VFMTrainer::create_FM)
-      .def("create_Hyper", &VFMTrainer::create_Hyper);
+      .def("create_Hyper", &VFMTrainer::create_Hyper)
+      .def("memory_report", &VFMTrainer::memory_report)
+      .def("projected_memory_report", &VFMTrainer::projected_memory_report,
+           py::arg("rank"))
+      .def("learn_with_callback", &VFMTrainer::learn_with_callback,
+           py::arg("fm"), py::arg("hyper"), py::arg("callback"))
+      .def(
+          "continue_with_callback",
+          [](VFMTrainer &trainer, VFM &fm, VHyper &hyper, VCallback callback) {
+            return trainer.continue_with_callback(fm, hyper, callback);
+          },
+          py::arg("fm"), py::arg("hyper"), py::arg("callback"))
+      .def("slide_window", &VFMTrainer::slide_window, py::arg("fm"),
+           py::arg("n_evict"), py::arg("X_new"), py::arg("relations_new"),
+           py::arg("y_new"));
 
   py::class_<History>(m, "LearningHistory")
       .def_readonly("hypers", &History::hypers)
       .def_readonly("train_log_losses", &History::train_log_losses)
       .def_readonly("n_mh_accept", &History::n_mh_accept)
+      .def_readonly("n_burn_in", &History::n_burn_in)
+      .def_readonly("min_effective_sample_size",
+                    &History::min_effective_sample_size)
+      .def_readonly("max_split_rhat", &History::max_split_rhat)
+      .def("memory_bytes",
+           [](const History &h) { return myFM::memory::bytes_of(h); })
       .def(py::pickle(
           [](const History &h) {
-            return py::make_tuple(h.hypers, h.train_log_losses, h.n_mh_accept);
+            return py::make_tuple(h.hypers, h.train_log_losses, h.n_mh_accept,
+                                  h.n_burn_in, h.min_effective_sample_size,
+                                  h.max_split_rhat);
           },
           [](py::tuple t) {
-            if (t.size() != 3) {
+            // 3-tuples were written before the convergence diagnostics.
+            if (t.size() != 3 && t.size() != 6) {
               throw std::runtime_error("invalid state for LearningHistory.");
             }
             History *result = new History();
             result->hypers = t[0].cast<vector<Hyper>>();
             result->train_log_losses = t[1].cast<vector<Real>>();
             result->n_mh_accept = t[2].cast<vector<size_t>>();
+            if (t.size() == 6) {
+              result->n_burn_in = t[3].cast<int>();
+              result->min_effective_sample_size = t[4].cast<Real>();
+              result->max_split_rhat = t[5].cast<Real>();
+            }
             return result;
           }));
 
   py::class_<VHistory>(m, "VariationalLearningHistory")
       .def_readonly("hypers", &VHistory::hyper)
       .def_readonly("elbos", &VHistory::elbos)
+      .def("memory_bytes",
+           [](const VHistory &h) { return myFM::memory::bytes_of(h); })
       .def(py::pickle(
           [](const VHistory &h) { return py::make_tuple(h.hyper, h.elbos); },
           [](py::tuple t) {
@@ -396,6 +795,96 @@ template <typename Real> void declare_functional(py::module &m) {
         py::arg("X"), py::arg("relations"), py::arg("y"),
         py::arg("random_seed"), py::arg("learning_config"),
         py::arg("callback"));
+  m.def("create_train_multi_target_fm", &create_train_multi_target_fm<Real>,
+        "create and train one fm per column of Y, sharing X.",
+        py::return_value_policy::move, py::arg("rank"), py::arg("init_std"),
+        py::arg("X"), py::arg("relations"), py::arg("Y"),
+        py::arg("random_seeds"), py::arg("learning_config"),
+        py::arg("share_V"), py::arg("callback"));
+  m.def("projected_training_memory",
+        &myFM::memory::projected_training_memory<Real>,
+        "Estimate the peak memory of a training run before starting it.",
+        py::arg("X"), py::arg("relations"), py::arg("rank"),
+        py::arg("learning_config"), py::arg("variational"));
+  m.def(
+      "start_trace",
+      [](size_t capacity) {
+        myFM::trace::TraceRecorder::instance().start(capacity);
+      },
+      "Start recording per-thread trace events.",
+      py::arg("capacity") = static_cast<size_t>(
+          myFM::trace::TraceRecorder::DEFAULT_CAPACITY));
+  m.def(
+      "stop_trace", []() { myFM::trace::TraceRecorder::instance().stop(); },
+      "Stop recording trace events.");
+  m.def(
+      "write_trace",
+      [](const std::string &path) {
+        myFM::trace::TraceRecorder::instance().write_json(path);
+      },
+      "Write the recorded events in Chrome trace-event JSON.",
+      py::arg("path"));
+  m.def(
+      "set_autotune",
+      [](bool enabled, const std::string &cache_file) {
+        auto &tuner = myFM::autotune::Autotuner::instance();
+        tuner.set_cache_file(cache_file);
+        tuner.set_enabled(enabled);
+      },
+      R"delim(Choose scoring kernels by timing them on first use.
+
+    For each shape class (rank, rows, entries per row, relation blocks and,
+    for ``predict_parallel``, samples and workers), the candidate kernels
+    are timed once on the actual input and the fastest is used from then
+    on. With ``cache_file``, the choices are read from and appended to that
+    file.)delim",
+      py::arg("enabled") = true, py::arg("cache_file") = "");
+  m.def(
+      "autotune_choices",
+      []() { return myFM::autotune::Autotuner::instance().choices(); },
+      "The kernel chosen for each shape class so far.");
+  m.def(
+      "clear_autotune",
+      []() { myFM::autotune::Autotuner::instance().clear(); },
+      "Forget the kernel choices, leaving the cache file as it is.");
+  m.def(
+      "stratified_downsample",
+      [](const vector<size_t> &strata, const vector<Real> &keep_rate,
+         int random_seed) {
+        auto result =
+            myFM::stratified_downsample<Real>(strata, keep_rate, random_seed);
+        return std::make_tuple(result.indices, result.weights);
+      },
+      R"delim(Keep a uniform subset of each stratum's rows.
+
+    Stratum s keeps about ``keep_rate[s]`` of its rows (at least one), in
+    their original order, and returns the kept indices together with the
+    weights (stratum size / number kept) to pass as ``sample_weight``.)delim",
+      py::arg("strata"), py::arg("keep_rate"), py::arg("random_seed"));
+  m.def(
+      "collapse_duplicate_rows",
+      [](const typename FM::SparseMatrix &X,
+         const vector<RelationBlock> &relations,
+         const typename FM::Vector &y, bool split_by_label,
+         const vector<Real> &sample_weight) {
+        auto result = myFM::collapse_duplicate_rows<Real>(
+            X, relations, y, split_by_label, sample_weight);
+        return std::make_tuple(result.X, result.relations, result.y,
+                               result.sample_weight,
+                               result.within_sum_of_squares,
+                               result.original_to_collapsed);
+      },
+      R"delim(Merge the cases with identical features into weighted rows.
+
+    Returns ``(X, relations, y, sample_weight, within_sum_of_squares,
+    original_to_collapsed)``, where ``y`` holds the mean target of each
+    merged row. Training on them with ``set_sample_weight`` and
+    ``set_collapsed_sum_of_squares`` is equivalent to training on the
+    original rows. With ``split_by_label``, only cases of the same binary
+    label are merged.)delim",
+      py::arg("X"), py::arg("relations"), py::arg("y"),
+      py::arg("split_by_label"),
+      py::arg("sample_weight") = vector<Real>{});
   m.def("mean_var_truncated_normal_left",
         &myFM::mean_var_truncated_normal_left<Real>);
   m.def("mean_var_truncated_normal_right",
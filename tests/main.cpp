@@ -1,7 +1,29 @@
 #define CATCH_CONFIG_MAIN // This tells Catch to provide a main() - only do this
                           // in one cpp file
 #include "catch.hpp"
+#include "myfm/FM.hpp"
+#include "myfm/FMTrainer.hpp"
 #include "myfm/OProbitSampler.hpp"
+#include "myfm/async_predictor.hpp"
+#include "myfm/autotune.hpp"
+#include "myfm/c_api.h"
+#include "myfm/collapse.hpp"
+#include "myfm/convergence.hpp"
+#include "myfm/downsample.hpp"
+#include "myfm/multi_model.hpp"
+#include "myfm/multi_target.hpp"
+#include "myfm/serialization.hpp"
+#include "myfm/shared_predictor.hpp"
+#include "myfm/special.hpp"
+#include "myfm/trace.hpp"
+#include "myfm/variational.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <sstream>
+#include <thread>
 
 using namespace myFM;
 using OpS = OprobitSampler<double>;
@@ -36,7 +58,7 @@ void ldiff_straightforward(Real x, Real y, Real &loss, Real &dx, Real &dy,
 TEST_CASE("Factorials are computed", "[factorial]") {
   OpS::DenseMatrix H(3, 3);
   OpS::DenseMatrix H_gt(3, 3);
-  double dx, dy, dx_gt, dy_gt, loss, loss_gt;
+  double dx = 0, dy = 0, dx_gt = 0, dy_gt = 0, loss, loss_gt;
 
   /* region 1 */
 
@@ -89,4 +111,2208 @@ TEST_CASE("minimization test.", "[probit-minimization]") {
   OpS sampler(x, y, 3, {0, 1, 2, 3, 4, 5}, rng, 0, 5);
   sampler.start_sample();
   REQUIRE(sampler.gamma_now(0) == Approx(-sampler.gamma_now(1)));
-}
\ No newline at end of file
+}
+
+TEST_CASE("Vectorised probit kernels match the scalar ones.", "[special]") {
+  using Array = special::Array<double>;
+  // not a multiple of the packet size, to cover the padded last packet.
+  const int n = 1003;
+  Array x(n);
+  for (int i = 0; i < n; i++) {
+    x(i) = -30 + 60.0 * i / (n - 1);
+  }
+  Array erf_v(n), erf_s(n), cdf_v(n), cdf_s(n), log_v, ratio_v, log_s,
+      ratio_s;
+  special::vectorised::erf(x, erf_v);
+  special::scalar::erf(x, erf_s);
+  special::vectorised::normal_cdf(x, cdf_v);
+  special::scalar::normal_cdf(x, cdf_s);
+  special::vectorised::log_normal_cdf(x, log_v, ratio_v);
+  special::scalar::log_normal_cdf(x, log_s, ratio_s);
+  for (int i = 0; i < n; i++) {
+    double loss = 0, dx = 0;
+    OpS::safe_lcdf(x(i), loss, dx);
+    REQUIRE(erf_v(i) == Approx(erf_s(i)).epsilon(1e-14));
+    REQUIRE(cdf_v(i) == Approx(cdf_s(i)).epsilon(1e-11));
+    for (const Array *log_p : {&log_v, &log_s}) {
+      REQUIRE((*log_p)(i) == Approx(loss).epsilon(1e-12).margin(1e-15));
+    }
+    for (const Array *ratio : {&ratio_v, &ratio_s}) {
+      REQUIRE((*ratio)(i) == Approx(dx).epsilon(1e-12));
+    }
+  }
+
+  std::mt19937 rng(3);
+  std::normal_distribution<double> normal(0, 3);
+  const int n_pairs = 301;
+  Array a(n_pairs), b(n_pairs);
+  for (int i = 0; i < n_pairs; i++) {
+    a(i) = normal(rng);
+    b(i) = a(i) - 0.01 - std::abs(normal(rng));
+  }
+  Array log_diff[2], ratio_a[2], ratio_b[2];
+  special::vectorised::log_normal_cdf_diff(a, b, log_diff[0], ratio_a[0],
+                                           ratio_b[0]);
+  special::scalar::log_normal_cdf_diff(a, b, log_diff[1], ratio_a[1],
+                                       ratio_b[1]);
+  for (int i = 0; i < n_pairs; i++) {
+    double loss = 0, dx = 0, dy = 0;
+    OpS::DenseMatrix H = OpS::DenseMatrix::Zero(2, 2);
+    OpS::safe_ldiff(a(i), b(i), loss, dx, dy, &H, 1);
+    for (int backend = 0; backend < 2; backend++) {
+      const double r_a = ratio_a[backend](i), r_b = ratio_b[backend](i);
+      REQUIRE(log_diff[backend](i) == Approx(loss).epsilon(1e-9));
+      REQUIRE(r_a == Approx(dx).epsilon(1e-9));
+      REQUIRE(-r_b == Approx(dy).epsilon(1e-9));
+      REQUIRE(-(a(i) * r_a + r_a * r_a) ==
+              Approx(H(1, 1)).epsilon(1e-8).margin(1e-12));
+      REQUIRE(b(i) * r_b - r_b * r_b ==
+              Approx(H(0, 0)).epsilon(1e-8).margin(1e-12));
+      REQUIRE(r_a * r_b == Approx(H(1, 0)).epsilon(1e-8).margin(1e-12));
+    }
+  }
+}
+
+TEST_CASE("Special functions keep their accuracy in the tails.",
+          "[special-tails]") {
+  using Array = special::Array<double>;
+  // erfc far into the upper tail, down to where it underflows, and below.
+  const int n = 401;
+  Array x(n), erfc_v(n), erfc_s(n), erfcx_v(n), erfcx_s(n);
+  for (int i = 0; i < n; i++) {
+    const double magnitude = 5 + 21.0 * i / (n - 1);
+    x(i) = (i % 2 == 0) ? magnitude : -magnitude;
+  }
+  special::vectorised::erfc(x, erfc_v);
+  special::scalar::erfc(x, erfc_s);
+  for (int i = 0; i < n; i++) {
+    const double expected = std::erfc(x(i));
+    REQUIRE(erfc_v(i) == Approx(expected).epsilon(1e-12).margin(0));
+    REQUIRE(erfc_s(i) == Approx(expected).epsilon(1e-12).margin(0));
+  }
+
+  // erfcx from the upper tail to very large arguments, and over the lower
+  // tail up to where exp(x^2) overflows.
+  Array large(n);
+  for (int i = 0; i < n; i++) {
+    large(i) = (i % 2 == 0) ? std::pow(10.0, 0.7 + 9.3 * i / (n - 1))
+                            : -(5 + 21.0 * i / (n - 1));
+  }
+  special::vectorised::erfcx(large, erfcx_v);
+  special::scalar::erfcx(large, erfcx_s);
+  for (int i = 0; i < n; i++) {
+    const double expected = Faddeeva::erfcx(large(i));
+    REQUIRE(erfcx_v(i) == Approx(expected).epsilon(1e-12).margin(0));
+    REQUIRE(erfcx_s(i) == Approx(expected).epsilon(1e-12).margin(0));
+  }
+  // the asymptote 1 / (sqrt(pi) x) for large x.
+  REQUIRE(erfcx_v(n - 1) * std::sqrt(std::acos(-1.0)) * large(n - 1) ==
+          Approx(1).epsilon(1e-12));
+}
+
+TEST_CASE("Cutpoint likelihood by label matches the per-row loop.",
+          "[oprobit-labels]") {
+  const int K = 5, n = 500;
+  std::mt19937 rng(11);
+  std::normal_distribution<double> normal(0, 4);
+  OpS::DenseVector x(n), y(n);
+  std::vector<size_t> indices(n);
+  for (int i = 0; i < n; i++) {
+    x(i) = normal(rng);
+    if (i % 50 == 0) {
+      // far into the tails of every label.
+      x(i) = (i % 100 == 0) ? 40 : -40;
+    }
+    y(i) = i % K;
+    indices[i] = i;
+  }
+  OpS sampler(x, y, K, indices, rng, 1, 5);
+  OpS::DenseVector gamma(K - 1);
+  gamma << -3, -1, 0.5, 2;
+
+  double ll_row = 0;
+  OpS::DenseVector dgamma_row = OpS::DenseVector::Zero(K - 1);
+  OpS::DenseMatrix H_row = OpS::DenseMatrix::Zero(K - 1, K - 1);
+  for (int i = 0; i < n; i++) {
+    const int label = static_cast<int>(y(i));
+    if (label == 0) {
+      OpS::safe_lcdf(gamma(0) - x(i), ll_row, dgamma_row(0), &H_row, label);
+    } else if (label == K - 1) {
+      sampler.safe_lccdf(gamma(K - 2) - x(i), ll_row, dgamma_row(K - 2),
+                         &H_row, label);
+    } else {
+      OpS::safe_ldiff(gamma(label) - x(i), gamma(label - 1) - x(i), ll_row,
+                      dgamma_row(label), dgamma_row(label - 1), &H_row,
+                      label);
+    }
+  }
+
+  OpS::DenseVector dgamma = OpS::DenseVector::Zero(K - 1);
+  OpS::DenseMatrix H(K - 1, K - 1);
+  const double ll = sampler.add_likelihood_terms(gamma, dgamma, &H);
+  REQUIRE(ll == Approx(ll_row).epsilon(1e-12));
+  for (int k = 0; k < K - 1; k++) {
+    REQUIRE(dgamma(k) == Approx(dgamma_row(k)).epsilon(1e-12));
+    for (int l = 0; l < K - 1; l++) {
+      REQUIRE(H(k, l) == Approx(H_row(k, l)).epsilon(1e-10).margin(1e-12));
+    }
+  }
+}
+
+TEST_CASE("C API predicts like the header-only predictor.", "[c-api]") {
+  using FMd = FM<double>;
+  std::mt19937 rng(0);
+  const int n_rows = 5, n_cols = 4, block_rows = 3, block_cols = 2;
+  FMd::SparseMatrix X(n_rows, n_cols);
+  FMd::SparseMatrix X_block(block_rows, block_cols);
+  std::uniform_real_distribution<double> unif(-1, 1);
+  for (int i = 0; i < n_rows; i++) {
+    X.insert(i, i % n_cols) = unif(rng);
+    X.insert(i, (i + 1) % n_cols) = unif(rng);
+  }
+  for (int i = 0; i < block_rows; i++) {
+    X_block.insert(i, i % block_cols) = unif(rng);
+  }
+  X.makeCompressed();
+  X_block.makeCompressed();
+  std::vector<size_t> mapper{0, 2, 1, 1, 0};
+  std::vector<relational::RelationBlock<double>> relations{
+      relational::RelationBlock<double>(mapper, X_block)};
+
+  FMd fm(3);
+  fm.initialize_weight(n_cols + block_cols, 0.5, rng);
+  FMd::Vector expected = fm.predict_score(X, relations);
+
+  myfm_predictor *predictor = nullptr;
+  REQUIRE(myfm_predictor_create(3, n_cols + block_cols,
+                                MYFM_TASK_REGRESSION,
+                                &predictor) == MYFM_OK);
+  REQUIRE(myfm_predictor_add_sample(predictor, fm.w0, fm.w.data(),
+                                    fm.V.data()) == MYFM_OK);
+
+  std::vector<uint64_t> mapper_u64(mapper.begin(), mapper.end());
+  myfm_relation_block *block = nullptr;
+  REQUIRE(myfm_relation_block_create(
+              mapper_u64.data(), mapper_u64.size(), block_rows, block_cols,
+              X_block.outerIndexPtr(), X_block.innerIndexPtr(),
+              X_block.valuePtr(), &block) == MYFM_OK);
+
+  std::vector<double> out(n_rows);
+  const myfm_relation_block *blocks[] = {block};
+  REQUIRE(myfm_predictor_predict_csr(predictor, n_rows, n_cols,
+                                     X.outerIndexPtr(), X.innerIndexPtr(),
+                                     X.valuePtr(), blocks, 1, 1,
+                                     out.data()) == MYFM_OK);
+  for (int i = 0; i < n_rows; i++) {
+    REQUIRE(out[i] == Approx(expected(i)));
+  }
+
+  const char *path = "myfm_c_api_test.bin";
+  REQUIRE(myfm_predictor_save(predictor, path) == MYFM_OK);
+  myfm_predictor *loaded = nullptr;
+  REQUIRE(myfm_predictor_load(path, &loaded) == MYFM_OK);
+  size_t n_samples = 0;
+  REQUIRE(myfm_predictor_info(loaded, nullptr, nullptr, &n_samples,
+                              nullptr) == MYFM_OK);
+  REQUIRE(n_samples == 1);
+  std::vector<double> out_loaded(n_rows);
+  REQUIRE(myfm_predictor_predict_csr(loaded, n_rows, n_cols,
+                                     X.outerIndexPtr(), X.innerIndexPtr(),
+                                     X.valuePtr(), blocks, 1, 2,
+                                     out_loaded.data()) == MYFM_OK);
+  for (int i = 0; i < n_rows; i++) {
+    REQUIRE(out_loaded[i] == Approx(out[i]));
+  }
+  std::remove(path);
+
+  REQUIRE(myfm_predictor_add_sample(loaded, 0, nullptr, nullptr) ==
+          MYFM_ERROR_INVALID_ARGUMENT);
+  REQUIRE(myfm_predictor_load("does/not/exist.bin", &loaded) ==
+          MYFM_ERROR_IO);
+
+  // ordered probit would come out as raw scores, so it is refused.
+  myfm_predictor *ordered = nullptr;
+  REQUIRE(myfm_predictor_create(3, n_cols + block_cols, MYFM_TASK_ORDERED,
+                                &ordered) == MYFM_ERROR_INVALID_ARGUMENT);
+  REQUIRE(ordered == nullptr);
+  Predictor<double> ordered_predictor(
+      3, n_cols + block_cols, FMLearningConfig<double>::TASKTYPE::ORDERED);
+  FMd ordered_sample(fm);
+  ordered_sample.cutpoints.push_back(FMd::Vector::LinSpaced(2, -1, 1));
+  ordered_predictor.add_sample(ordered_sample);
+  serialization::save_predictor(ordered_predictor, std::string(path));
+  REQUIRE(myfm_predictor_load(path, &ordered) ==
+          MYFM_ERROR_INVALID_ARGUMENT);
+  REQUIRE(ordered == nullptr);
+  std::remove(path);
+
+  // malformed CSR input is an error, not an out-of-bounds read.
+  std::vector<int32_t> bad_indices(X.innerIndexPtr(),
+                                   X.innerIndexPtr() + X.nonZeros());
+  bad_indices[3] = n_cols;
+  REQUIRE(myfm_predictor_predict_csr(predictor, n_rows, n_cols,
+                                     X.outerIndexPtr(), bad_indices.data(),
+                                     X.valuePtr(), blocks, 1, 1,
+                                     out.data()) ==
+          MYFM_ERROR_INVALID_ARGUMENT);
+  std::vector<int32_t> bad_indptr(X.outerIndexPtr(),
+                                  X.outerIndexPtr() + n_rows + 1);
+  std::swap(bad_indptr[1], bad_indptr[2]);
+  REQUIRE(myfm_predictor_predict_csr(predictor, n_rows, n_cols,
+                                     bad_indptr.data(), X.innerIndexPtr(),
+                                     X.valuePtr(), blocks, 1, 1,
+                                     out.data()) ==
+          MYFM_ERROR_INVALID_ARGUMENT);
+  REQUIRE(myfm_relation_block_create(
+              mapper_u64.data(), mapper_u64.size(), block_rows, block_cols - 1,
+              X_block.outerIndexPtr(), X_block.innerIndexPtr(),
+              X_block.valuePtr(), &block) == MYFM_ERROR_INVALID_ARGUMENT);
+
+  myfm_relation_block_free(block);
+  myfm_predictor_free(loaded);
+  myfm_predictor_free(predictor);
+}
+
+TEST_CASE("Fixed-rank scoring matches the generic kernel.", "[fixed-rank]") {
+  using FMd = FM<double>;
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<double> unif(-1, 1);
+  FMd::SparseMatrix X(50, 7), X_block(6, 5);
+  for (int i = 0; i < 50; i++) {
+    X.insert(i, i % 7) = unif(rng);
+    X.insert(i, (3 * i + 1) % 7) = unif(rng);
+  }
+  for (int i = 0; i < 6; i++) {
+    X_block.insert(i, i % 5) = unif(rng);
+  }
+  std::vector<size_t> mapper(50);
+  for (size_t i = 0; i < mapper.size(); i++) {
+    mapper[i] = (i * 7) % 6;
+  }
+  std::vector<relational::RelationBlock<double>> relations{
+      relational::RelationBlock<double>(mapper, X_block)};
+
+  for (int rank : {4, 8, 16, 32, 64}) {
+    FMd fm(rank);
+    fm.initialize_weight(12, 0.5, rng);
+    FMd::Vector fixed(50), generic(50);
+    fm.predict_score_write_target(fixed, X, relations);
+    fm.predict_score_generic_rank(generic, X, relations);
+    REQUIRE((fixed - generic).cwiseAbs().maxCoeff() < 1e-10);
+  }
+}
+
+TEST_CASE("Projected memory matches the trainer and enforces the budget.",
+          "[memory]") {
+  using FMd = FM<double>;
+  std::mt19937 rng(2);
+  std::uniform_real_distribution<double> unif(-1, 1);
+  FMd::SparseMatrix X(40, 6), X_block(5, 4);
+  FMd::Vector y(40);
+  for (int i = 0; i < 40; i++) {
+    X.insert(i, i % 6) = 1;
+    y(i) = unif(rng);
+  }
+  for (int i = 0; i < 5; i++) {
+    X_block.insert(i, i % 4) = 1;
+  }
+  X.makeCompressed();
+  X_block.makeCompressed();
+  std::vector<size_t> mapper(40);
+  for (size_t i = 0; i < mapper.size(); i++) {
+    mapper[i] = i % 5;
+  }
+  std::vector<relational::RelationBlock<double>> relations{
+      relational::RelationBlock<double>(mapper, X_block)};
+
+  FMLearningConfig<double>::Builder builder;
+  builder.set_identical_groups(10).set_n_iter(20).set_n_kept_samples(5);
+  GibbsFMTrainer<double> trainer(X, relations, y, 0, builder.build());
+
+  auto actual = trainer.memory_report();
+  auto projected = trainer.projected_memory_report(3);
+  for (const auto &component : actual.components) {
+    bool found = false;
+    for (const auto &p : projected.components) {
+      if (p.first == component.first) {
+        REQUIRE(p.second == component.second);
+        found = true;
+      }
+    }
+    REQUIRE(found);
+  }
+
+  auto fm = trainer.create_FM(3, 0.1);
+  auto hyper = trainer.create_Hyper(fm.n_factors);
+  auto result = trainer.learn_with_callback(
+      fm, hyper,
+      [](int, FMd *, FMHyperParameters<double> *,
+         GibbsLearningHistory<double> *) { return false; });
+  size_t samples_bytes = 0;
+  for (const auto &p : projected.components) {
+    if (p.first == "samples")
+      samples_bytes = p.second;
+  }
+  REQUIRE(result.first.memory_report().total() >= samples_bytes);
+
+  builder.set_memory_budget(projected.total() - 1);
+  GibbsFMTrainer<double> limited(X, relations, y, 0, builder.build());
+  auto fm_limited = limited.create_FM(3, 0.1);
+  auto hyper_limited = limited.create_Hyper(fm_limited.n_factors);
+  REQUIRE_THROWS_AS(
+      limited.learn_with_callback(
+          fm_limited, hyper_limited,
+          [](int, FMd *, FMHyperParameters<double> *,
+             GibbsLearningHistory<double> *) { return false; }),
+      std::runtime_error);
+
+  // a budget that the data alone exceeds is rejected before the trainer
+  // copies X or builds its caches.
+  builder.set_memory_budget(memory::bytes_of(X));
+  REQUIRE_THROWS_AS(GibbsFMTrainer<double>(X, relations, y, 0, builder.build()),
+                    std::runtime_error);
+  REQUIRE_THROWS_AS(variational::VariationalFMTrainer<double>(
+                        X, relations, y, 0, builder.build()),
+                    std::runtime_error);
+}
+
+TEST_CASE("Trace recorder writes per-thread events.", "[trace]") {
+  using FMd = FM<double>;
+  std::mt19937 rng(3);
+  FMd::SparseMatrix X(20, 5);
+  FMd::Vector y(20);
+  for (int i = 0; i < 20; i++) {
+    X.insert(i, i % 5) = 1;
+    y(i) = i % 3;
+  }
+  std::vector<relational::RelationBlock<double>> relations;
+  FMLearningConfig<double>::Builder builder;
+  builder.set_identical_groups(5).set_n_iter(4).set_n_kept_samples(4);
+  GibbsFMTrainer<double> trainer(X, relations, y, 0, builder.build());
+  auto fm = trainer.create_FM(2, 0.1);
+  auto hyper = trainer.create_Hyper(fm.n_factors);
+
+  auto &recorder = trace::TraceRecorder::instance();
+  recorder.start(8);
+  auto result = trainer.learn_with_callback(
+      fm, hyper,
+      [](int, FMd *, FMHyperParameters<double> *,
+         GibbsLearningHistory<double> *) { return false; });
+  result.first.predict_parallel(X, relations, 2);
+  recorder.stop();
+
+  std::stringstream ss;
+  recorder.write_json(ss);
+  const std::string json = ss.str();
+  REQUIRE(json.find("\"traceEvents\"") != std::string::npos);
+  REQUIRE(json.find("\"predict_sample\"") != std::string::npos);
+  // the ring buffer of the training thread only keeps its last 8 events.
+  REQUIRE(json.find("\"update_alpha\"") == std::string::npos);
+  REQUIRE(json.find("\"sweep\"") != std::string::npos);
+
+  // nothing is recorded once stopped.
+  recorder.start(8);
+  recorder.stop();
+  result.first.predict(X, relations);
+  std::stringstream empty;
+  recorder.write_json(empty);
+  REQUIRE(empty.str().find("predict_sample") == std::string::npos);
+
+  // workers started by every call reuse the buffers of exited ones.
+  recorder.start(8);
+  for (int call = 0; call < 10; call++) {
+    result.first.predict_parallel(X, relations, 2);
+  }
+  recorder.stop();
+  REQUIRE(recorder.n_buffers() <= 3);
+}
+
+TEST_CASE("Convergence diagnostics and automatic burn-in.", "[convergence]") {
+  std::mt19937 rng(4);
+  std::normal_distribution<double> normal(0, 1);
+  std::vector<double> iid(2000), trending(2000);
+  for (size_t i = 0; i < iid.size(); i++) {
+    iid[i] = normal(rng);
+    trending[i] = normal(rng) + i * 0.01;
+  }
+  REQUIRE(convergence::split_rhat(iid.data(), iid.size()) < 1.01);
+  REQUIRE(std::abs(convergence::geweke_z(iid.data(), iid.size())) < 4);
+  REQUIRE(convergence::effective_sample_size(iid.data(), iid.size()) > 1000);
+  REQUIRE(convergence::split_rhat(trending.data(), trending.size()) > 1.5);
+  REQUIRE(std::abs(convergence::geweke_z(trending.data(), trending.size())) >
+          4);
+
+  using FMd = FM<double>;
+  FMd::SparseMatrix X(500, 10);
+  FMd::Vector y(500);
+  for (int i = 0; i < 500; i++) {
+    X.insert(i, i % 10) = 1;
+    y(i) = 0.1 * (i % 10) + 0.3 * normal(rng);
+  }
+  std::vector<relational::RelationBlock<double>> relations;
+  FMLearningConfig<double>::Builder builder;
+  builder.set_identical_groups(10)
+      .set_n_iter(3000)
+      .set_n_kept_samples(100)
+      .set_auto_burn_in(true)
+      .set_target_ess(50);
+  GibbsFMTrainer<double> trainer(X, relations, y, 0, builder.build());
+  auto fm = trainer.create_FM(2, 0.1);
+  auto hyper = trainer.create_Hyper(fm.n_factors);
+  auto result = trainer.learn_with_callback(
+      fm, hyper,
+      [](int, FMd *, FMHyperParameters<double> *,
+         GibbsLearningHistory<double> *) { return false; });
+  REQUIRE(result.second.n_burn_in > 0);
+  REQUIRE(result.second.min_effective_sample_size >= 50);
+  REQUIRE(result.second.hypers.size() < 3000);
+  REQUIRE(result.first.samples.size() <= 100);
+  REQUIRE(!result.first.samples.empty());
+
+  // the reported effective sample size is that of the kept samples.
+  REQUIRE(result.second.min_effective_sample_size <=
+          result.first.samples.size());
+
+  // a threshold no chain passes: the last draws are kept all the same.
+  builder.set_n_iter(200).set_target_ess(0).set_rhat_threshold(0);
+  GibbsFMTrainer<double> stuck(X, relations, y, 0, builder.build());
+  auto fm_stuck = stuck.create_FM(2, 0.1);
+  auto hyper_stuck = stuck.create_Hyper(fm_stuck.n_factors);
+  auto unconverged = stuck.learn_with_callback(
+      fm_stuck, hyper_stuck,
+      [](int, FMd *, FMHyperParameters<double> *,
+         GibbsLearningHistory<double> *) { return false; });
+  REQUIRE(unconverged.second.n_burn_in < 0);
+  REQUIRE(unconverged.second.hypers.size() == 200);
+  REQUIRE(unconverged.first.samples.size() == 100);
+  REQUIRE((unconverged.first.samples.back().V - fm_stuck.V).norm() == 0);
+  REQUIRE_NOTHROW(unconverged.first.predict(X, relations));
+
+  FMLearningConfig<double>::Builder invalid;
+  invalid.set_identical_groups(10).set_target_ess(50);
+  REQUIRE_THROWS_AS(invalid.build(), std::invalid_argument);
+  invalid.set_auto_burn_in(true).set_n_kept_samples(20);
+  REQUIRE_THROWS_AS(invalid.build(), std::invalid_argument);
+}
+
+TEST_CASE("Rao-Blackwellised predictor averages conditional means.",
+          "[rao-blackwell]") {
+  using FMd = FM<double>;
+  using TASKTYPE = FMLearningConfig<double>::TASKTYPE;
+  std::mt19937 rng(5);
+  std::normal_distribution<double> normal(0, 1);
+  FMd::SparseMatrix X(400, 20);
+  FMd::Vector y(400), y_interaction(400), y_class(400);
+  // user and item factors, so that the interactions carry the signal.
+  std::vector<double> user_factor(10), item_factor(10);
+  for (int u = 0; u < 10; u++) {
+    user_factor[u] = normal(rng);
+    item_factor[u] = normal(rng);
+  }
+  for (int i = 0; i < 400; i++) {
+    int user = i % 10, item = 10 + (i * 7) % 10;
+    X.insert(i, user) = 1;
+    X.insert(i, item) = 1;
+    y(i) = 0.2 * user - 0.1 * item + 0.1 * normal(rng);
+    y_interaction(i) =
+        1.5 * user_factor[user] * item_factor[item - 10] + 0.1 * normal(rng);
+    y_class(i) = (y_interaction(i) + 0.5 * normal(rng) > 0) ? 1 : 0;
+  }
+  std::vector<relational::RelationBlock<double>> relations;
+  auto fit = [&](const FMd::Vector &target, TASKTYPE type,
+                 bool rao_blackwell) {
+    FMLearningConfig<double>::Builder builder;
+    builder.set_identical_groups(20)
+        .set_task_type(type)
+        .set_n_iter(300)
+        .set_n_kept_samples(200)
+        .set_rao_blackwell(rao_blackwell);
+    GibbsFMTrainer<double> trainer(X, relations, target, 0, builder.build());
+    auto fm = trainer.create_FM(2, 0.1);
+    auto hyper = trainer.create_Hyper(fm.n_factors);
+    return trainer
+        .learn_with_callback(fm, hyper,
+                             [](int, FMd *, FMHyperParameters<double> *,
+                                GibbsLearningHistory<double> *) {
+                               return false;
+                             })
+        .first;
+  };
+  auto rms = [](const FMd::Vector &diff) {
+    return std::sqrt(diff.squaredNorm() / diff.rows());
+  };
+  auto raw = fit(y, TASKTYPE::REGRESSION, false);
+  auto averaged = fit(y, TASKTYPE::REGRESSION, true);
+  REQUIRE(raw.samples.size() == 200);
+  REQUIRE(averaged.samples.size() == 200);
+  REQUIRE(rms(raw.predict(X, relations) - averaged.predict(X, relations)) <
+          0.05);
+
+  // the interactions of one averaged model would shrink as V's sign and
+  // rotation drift; the averaged predictions of the conditional-mean models
+  // follow those of the draws.
+  auto raw_interaction = fit(y_interaction, TASKTYPE::REGRESSION, false);
+  auto averaged_interaction = fit(y_interaction, TASKTYPE::REGRESSION, true);
+  FMd::Vector rb_interaction = averaged_interaction.predict(X, relations);
+  REQUIRE(rms(raw_interaction.predict(X, relations) - rb_interaction) < 0.02);
+  REQUIRE(rms(rb_interaction - y_interaction) < 0.15);
+
+  // classification averages the probabilities, not the scores.
+  auto raw_class = fit(y_class, TASKTYPE::CLASSIFICATION, false);
+  auto averaged_class = fit(y_class, TASKTYPE::CLASSIFICATION, true);
+  FMd::Vector rb_probability = averaged_class.predict(X, relations);
+  REQUIRE(rms(raw_class.predict(X, relations) - rb_probability) < 0.05);
+  FMd::Vector mean_score = FMd::Vector::Zero(400);
+  for (const auto &sample : averaged_class.samples) {
+    mean_score += sample.predict_score(X, relations);
+  }
+  mean_score /= averaged_class.samples.size();
+  FMd::Vector probability_of_mean = mean_score;
+  special::normal_cdf(probability_of_mean.array(), probability_of_mean.array());
+  REQUIRE(rms(rb_probability - probability_of_mean) > 1e-3);
+}
+
+TEST_CASE("Nested relation blocks behave like composed sibling blocks.",
+          "[relation]") {
+  using FMd = FM<double>;
+  using Block = relational::RelationBlock<double>;
+  std::mt19937 rng(3);
+  std::uniform_real_distribution<double> unif(-1, 1);
+  const int n_rows = 60, n_users = 12, n_regions = 3;
+  FMd::SparseMatrix X(n_rows, 2), X_user(n_users, n_users + 1),
+      X_region(n_regions, n_regions);
+  std::vector<size_t> rating_to_user(n_rows), user_to_region(n_users);
+  FMd::Vector y(n_rows);
+  for (int i = 0; i < n_rows; i++) {
+    X.insert(i, i % 2) = 1;
+    rating_to_user[i] = (i * 5) % n_users;
+    y(i) = unif(rng);
+  }
+  for (int u = 0; u < n_users; u++) {
+    X_user.insert(u, u) = 1;
+    X_user.insert(u, n_users) = unif(rng);
+    user_to_region[u] = u % n_regions;
+  }
+  for (int r = 0; r < n_regions; r++) {
+    X_region.insert(r, r) = 1;
+  }
+  std::vector<size_t> rating_to_region(n_rows);
+  for (int i = 0; i < n_rows; i++) {
+    rating_to_region[i] = user_to_region[rating_to_user[i]];
+  }
+
+  std::vector<Block> nested{
+      Block(rating_to_user, X_user, {Block(user_to_region, X_region)})};
+  std::vector<Block> siblings{Block(rating_to_user, X_user),
+                              Block(rating_to_region, X_region)};
+  REQUIRE(nested[0].total_feature_size() == n_users + 1 + n_regions);
+  REQUIRE_THROWS_AS(
+      Block(rating_to_user, X_user, {Block(rating_to_region, X_region)}),
+      std::runtime_error);
+
+  auto fit = [&](const std::vector<Block> &relations) {
+    FMLearningConfig<double>::Builder builder;
+    builder.set_identical_groups(2 + n_users + 1 + n_regions)
+        .set_n_iter(20)
+        .set_n_kept_samples(10);
+    GibbsFMTrainer<double> trainer(X, relations, y, 0, builder.build());
+    auto fm = trainer.create_FM(3, 0.1);
+    auto hyper = trainer.create_Hyper(fm.n_factors);
+    return trainer
+        .learn_with_callback(fm, hyper,
+                             [](int, FMd *, FMHyperParameters<double> *,
+                                GibbsLearningHistory<double> *) {
+                               return false;
+                             })
+        .first;
+  };
+  auto from_nested = fit(nested);
+  auto from_siblings = fit(siblings);
+  FMd::Vector expected = from_siblings.predict(X, siblings);
+  FMd::Vector actual = from_nested.predict(X, nested);
+  for (int i = 0; i < n_rows; i++) {
+    REQUIRE(actual(i) == Approx(expected(i)));
+  }
+}
+
+TEST_CASE("Block mappers pick a compact encoding.", "[relation]") {
+  using relational::BlockMapper;
+  std::vector<size_t> scattered{0, 2, 1, 1, 0, 2, 1, 0};
+  BlockMapper indexed(scattered);
+  REQUIRE(indexed.encoding() == BlockMapper::Encoding::INDEX32);
+  REQUIRE(indexed.to_vector() == scattered);
+
+  std::vector<size_t> sorted;
+  for (size_t block = 0; block < 4; block++) {
+    sorted.insert(sorted.end(), 10 + block, block);
+  }
+  BlockMapper runs(sorted);
+  REQUIRE(runs.encoding() == BlockMapper::Encoding::RUN_LENGTH);
+  REQUIRE(runs.n_runs() == 4);
+  REQUIRE(runs.bytes() < sorted.size() * sizeof(uint32_t));
+  REQUIRE(runs.to_vector() == sorted);
+  auto cursor = runs.cursor();
+  for (size_t i = 0; i < sorted.size(); i++) {
+    REQUIRE(runs[i] == sorted[i]);
+    REQUIRE(cursor[i] == sorted[i]);
+  }
+
+  BlockMapper to_region(std::vector<size_t>{1, 0, 1, 0});
+  auto composed = runs.compose(to_region);
+  REQUIRE(composed.size() == sorted.size());
+  for (size_t i = 0; i < sorted.size(); i++) {
+    REQUIRE(composed[i] == to_region[sorted[i]]);
+  }
+}
+
+TEST_CASE("Run-length encoded blocks train like scattered ones.",
+          "[relation]") {
+  using FMd = FM<double>;
+  using Block = relational::RelationBlock<double>;
+  std::mt19937 rng(11);
+  std::uniform_real_distribution<double> unif(-1, 1);
+  const int n_rows = 200, n_users = 10;
+  FMd::SparseMatrix X(n_rows, 3), X_user(n_users, n_users);
+  std::vector<size_t> rating_to_user(n_rows);
+  FMd::Vector y(n_rows);
+  for (int i = 0; i < n_rows; i++) {
+    X.insert(i, i % 3) = 1;
+    rating_to_user[i] = i / (n_rows / n_users);
+    y(i) = 0.1 * rating_to_user[i] + unif(rng);
+  }
+  for (int u = 0; u < n_users; u++) {
+    X_user.insert(u, u) = 1;
+  }
+  FMd::SparseMatrix X_dense_user(n_rows, 3 + n_users);
+  for (int i = 0; i < n_rows; i++) {
+    X_dense_user.insert(i, i % 3) = 1;
+    X_dense_user.insert(i, 3 + rating_to_user[i]) = 1;
+  }
+  std::vector<Block> relations{Block(rating_to_user, X_user)};
+  REQUIRE(relations[0].original_to_block.encoding() ==
+          relational::BlockMapper::Encoding::RUN_LENGTH);
+
+  FMLearningConfig<double>::Builder builder;
+  builder.set_identical_groups(3 + n_users).set_n_iter(20).set_n_kept_samples(
+      10);
+  GibbsFMTrainer<double> trainer(X, relations, y, 0, builder.build());
+  auto fm = trainer.create_FM(4, 0.1);
+  auto hyper = trainer.create_Hyper(fm.n_factors);
+  auto predictor =
+      trainer
+          .learn_with_callback(fm, hyper,
+                               [](int, FMd *, FMHyperParameters<double> *,
+                                  GibbsLearningHistory<double> *) {
+                                 return false;
+                               })
+          .first;
+  FMd::Vector expected = predictor.predict(X_dense_user, {});
+  FMd::Vector actual = predictor.predict(X, relations);
+  for (int i = 0; i < n_rows; i++) {
+    REQUIRE(actual(i) == Approx(expected(i)));
+  }
+}
+
+TEST_CASE("Dense blocks train and predict like their sparse copies.",
+          "[relation]") {
+  using FMd = FM<double>;
+  using Block = relational::RelationBlock<double>;
+  std::mt19937 rng(17);
+  std::normal_distribution<double> normal(0, 1);
+  const int n_rows = 120, n_items = 6, n_users = 8, dim = 4;
+  Block::DenseMatrix embedding(n_rows, dim), user_embedding(n_users, dim);
+  for (int i = 0; i < n_rows; i++) {
+    for (int j = 0; j < dim; j++) {
+      embedding(i, j) = normal(rng);
+    }
+  }
+  for (int u = 0; u < n_users; u++) {
+    for (int j = 0; j < dim; j++) {
+      user_embedding(u, j) = normal(rng);
+    }
+  }
+  FMd::SparseMatrix X(n_rows, n_items);
+  std::vector<size_t> rating_to_user(n_rows);
+  FMd::Vector y(n_rows);
+  for (int i = 0; i < n_rows; i++) {
+    X.insert(i, i % n_items) = 1;
+    rating_to_user[i] = (i * 3) % n_users;
+    y(i) = embedding(i, 0) * user_embedding(rating_to_user[i], 1) +
+           0.1 * normal(rng);
+  }
+
+  std::vector<Block> dense{Block::dense_features(embedding),
+                           Block(rating_to_user, user_embedding)};
+  FMd::SparseMatrix embedding_sparse = embedding.sparseView(),
+                    user_embedding_sparse = user_embedding.sparseView();
+  std::vector<size_t> identity(n_rows);
+  for (int i = 0; i < n_rows; i++) {
+    identity[i] = i;
+  }
+  std::vector<Block> sparse{Block(identity, embedding_sparse),
+                            Block(rating_to_user, user_embedding_sparse)};
+  REQUIRE(dense[0].is_dense);
+  REQUIRE(dense[0].original_to_block.encoding() ==
+          relational::BlockMapper::Encoding::IDENTITY);
+  REQUIRE(memory::bytes_of(dense[0]) < memory::bytes_of(sparse[0]));
+
+  FMLearningConfig<double>::Builder builder;
+  builder.set_identical_groups(n_items + 2 * dim)
+      .set_n_iter(20)
+      .set_n_kept_samples(10);
+  auto gibbs = [&](const std::vector<Block> &relations) {
+    GibbsFMTrainer<double> trainer(X, relations, y, 0, builder.build());
+    auto fm = trainer.create_FM(3, 0.1);
+    auto hyper = trainer.create_Hyper(fm.n_factors);
+    return trainer
+        .learn_with_callback(fm, hyper,
+                             [](int, FMd *, FMHyperParameters<double> *,
+                                GibbsLearningHistory<double> *) {
+                               return false;
+                             })
+        .first.predict(X, relations);
+  };
+  auto vb = [&](const std::vector<Block> &relations) {
+    using namespace variational;
+    VariationalFMTrainer<double> trainer(X, relations, y, 0, builder.build());
+    auto fm = trainer.create_FM(3, 0.1);
+    auto hyper = trainer.create_Hyper(fm.n_factors);
+    return trainer
+        .learn_with_callback(
+            fm, hyper,
+            [](int, VariationalFM<double> *,
+               VariationalFMHyperParameters<double> *,
+               VariationalLearningHistory<double> *) { return false; })
+        .first.predict(X, relations);
+  };
+  FMd::Vector gibbs_dense = gibbs(dense), gibbs_sparse = gibbs(sparse);
+  FMd::Vector vb_dense = vb(dense), vb_sparse = vb(sparse);
+  for (int i = 0; i < n_rows; i++) {
+    REQUIRE(gibbs_dense(i) == Approx(gibbs_sparse(i)));
+    REQUIRE(vb_dense(i) == Approx(vb_sparse(i)));
+  }
+}
+
+TEST_CASE("Integer row weights act like duplicated rows.", "[weight]") {
+  using FMd = FM<double>;
+  using Block = relational::RelationBlock<double>;
+  using VTrainer = variational::VariationalFMTrainer<double>;
+  std::mt19937 rng(5);
+  std::normal_distribution<double> normal(0, 1);
+  const int n_rows = 50, n_items = 7, n_users = 6;
+  FMd::SparseMatrix X(n_rows, n_items), X_user(n_users, n_users);
+  for (int u = 0; u < n_users; u++) {
+    X_user.insert(u, u) = 1;
+  }
+  std::vector<size_t> rating_to_user(n_rows);
+  std::vector<double> weights(n_rows);
+  FMd::Vector y(n_rows);
+  int n_duplicated = 0;
+  for (int i = 0; i < n_rows; i++) {
+    X.insert(i, (i * 5) % n_items) = 1;
+    rating_to_user[i] = i % n_users;
+    weights[i] = 1 + (i % 3);
+    y(i) = normal(rng);
+    n_duplicated += weights[i];
+  }
+  FMd::SparseMatrix X_dup(n_duplicated, n_items);
+  std::vector<size_t> rating_to_user_dup;
+  FMd::Vector y_dup(n_duplicated);
+  for (int i = 0, row = 0; i < n_rows; i++) {
+    for (int copy = 0; copy < weights[i]; copy++, row++) {
+      X_dup.insert(row, (i * 5) % n_items) = 1;
+      rating_to_user_dup.push_back(rating_to_user[i]);
+      y_dup(row) = y(i);
+    }
+  }
+  std::vector<Block> relations{Block(rating_to_user, X_user)},
+      relations_dup{Block(rating_to_user_dup, X_user)};
+
+  for (auto task : {FMLearningConfig<double>::TASKTYPE::REGRESSION,
+                    FMLearningConfig<double>::TASKTYPE::CLASSIFICATION}) {
+    FMd::Vector target = y, target_dup = y_dup;
+    if (task == FMLearningConfig<double>::TASKTYPE::CLASSIFICATION) {
+      target = (y.array() > 0).cast<double>();
+      target_dup = (y_dup.array() > 0).cast<double>();
+    }
+    FMLearningConfig<double>::Builder builder;
+    builder.set_identical_groups(n_items + n_users)
+        .set_task_type(task)
+        .set_n_iter(10)
+        .set_n_kept_samples(10);
+    auto fit = [&](const FMd::SparseMatrix &X_train,
+                   const std::vector<Block> &relations_train,
+                   const FMd::Vector &y_train,
+                   const FMLearningConfig<double> &config) {
+      VTrainer trainer(X_train, relations_train, y_train, 0, config);
+      auto fm = trainer.create_FM(2, 0.1);
+      auto hyper = trainer.create_Hyper(fm.n_factors);
+      return trainer
+          .learn_with_callback(
+              fm, hyper,
+              [](int, variational::VariationalFM<double> *,
+                 variational::VariationalFMHyperParameters<double> *,
+                 variational::VariationalLearningHistory<double> *) {
+                return false;
+              })
+          .first.predict(X, relations);
+    };
+    FMd::Vector duplicated = fit(X_dup, relations_dup, target_dup,
+                                 builder.build());
+    FMd::Vector weighted =
+        fit(X, relations, target, builder.set_sample_weight(weights).build());
+    for (int i = 0; i < n_rows; i++) {
+      REQUIRE(weighted(i) == Approx(duplicated(i)).margin(1e-8));
+    }
+  }
+
+  FMLearningConfig<double>::Builder builder;
+  builder.set_identical_groups(n_items + n_users)
+      .set_sample_weight(std::vector<double>(n_rows - 1, 1.0));
+  REQUIRE_THROWS_AS(
+      GibbsFMTrainer<double>(X, relations, y, 0, builder.build()),
+      std::invalid_argument);
+  REQUIRE_THROWS_AS(builder.set_sample_weight({-1.0}).build(),
+                    std::invalid_argument);
+}
+
+TEST_CASE("Stratified downsampling keeps unbiased weights.", "[weight]") {
+  const size_t n_rows = 10000;
+  std::vector<size_t> strata(n_rows);
+  for (size_t i = 0; i < n_rows; i++) {
+    strata[i] = (i % 100 == 0) ? 1 : 0;
+  }
+  auto result = stratified_downsample<double>(strata, {0.1, 1.0}, 3);
+  REQUIRE(result.indices.size() == 990 + 100);
+  REQUIRE(std::is_sorted(result.indices.begin(), result.indices.end()));
+  double weight_sum[2] = {0, 0};
+  for (size_t k = 0; k < result.indices.size(); k++) {
+    weight_sum[strata[result.indices[k]]] += result.weights[k];
+  }
+  REQUIRE(weight_sum[0] == Approx(9900));
+  REQUIRE(weight_sum[1] == Approx(100));
+  REQUIRE_THROWS_AS(stratified_downsample<double>(strata, {0.1}, 3),
+                    std::invalid_argument);
+  REQUIRE_THROWS_AS(stratified_downsample<double>(strata, {0.0, 1.0}, 3),
+                    std::invalid_argument);
+}
+
+TEST_CASE("Collapsed duplicate rows give the same posterior.", "[weight]") {
+  using FMd = FM<double>;
+  using Block = relational::RelationBlock<double>;
+  using VTrainer = variational::VariationalFMTrainer<double>;
+  using TASKTYPE = FMLearningConfig<double>::TASKTYPE;
+  std::mt19937 rng(11);
+  std::normal_distribution<double> normal(0, 1);
+  const int n_rows = 300, n_items = 5, n_users = 4;
+  FMd::SparseMatrix X(n_rows, n_items), X_user(n_users, 2);
+  for (int u = 0; u < n_users; u++) {
+    X_user.insert(u, u % 2) = 1;
+  }
+  std::vector<size_t> rating_to_user(n_rows);
+  FMd::Vector y(n_rows);
+  for (int i = 0; i < n_rows; i++) {
+    const int item = rng() % n_items;
+    X.insert(i, item) = 1;
+    rating_to_user[i] = rng() % n_users;
+    y(i) = item - static_cast<double>(rating_to_user[i]) + normal(rng);
+  }
+  std::vector<Block> relations{Block(rating_to_user, X_user)};
+
+  auto collapsed = collapse_duplicate_rows(X, relations, y, false);
+  REQUIRE(collapsed.X.rows() == n_items * n_users);
+  double total_weight = 0;
+  for (double w : collapsed.sample_weight) {
+    total_weight += w;
+  }
+  REQUIRE(total_weight == Approx(n_rows));
+  for (int i = 0; i < n_rows; i++) {
+    const size_t row = collapsed.original_to_collapsed[i];
+    REQUIRE(collapsed.relations[0].original_to_block[row] ==
+            rating_to_user[i]);
+  }
+
+  for (auto task : {TASKTYPE::REGRESSION, TASKTYPE::CLASSIFICATION}) {
+    FMd::Vector target = y;
+    if (task == TASKTYPE::CLASSIFICATION) {
+      target = (y.array() > 1).cast<double>();
+    }
+    auto merged = collapse_duplicate_rows(
+        X, relations, target, task == TASKTYPE::CLASSIFICATION);
+    FMLearningConfig<double>::Builder builder;
+    builder.set_identical_groups(n_items + 2)
+        .set_task_type(task)
+        .set_n_iter(10)
+        .set_n_kept_samples(10);
+    auto fit = [&](const FMd::SparseMatrix &X_train,
+                   const std::vector<Block> &relations_train,
+                   const FMd::Vector &y_train,
+                   const FMLearningConfig<double> &config) {
+      VTrainer trainer(X_train, relations_train, y_train, 0, config);
+      auto fm = trainer.create_FM(2, 0.1);
+      auto hyper = trainer.create_Hyper(fm.n_factors);
+      return trainer
+          .learn_with_callback(
+              fm, hyper,
+              [](int, variational::VariationalFM<double> *,
+                 variational::VariationalFMHyperParameters<double> *,
+                 variational::VariationalLearningHistory<double> *) {
+                return false;
+              })
+          .first.predict(X, relations);
+    };
+    FMd::Vector original = fit(X, relations, target, builder.build());
+    builder.set_sample_weight(merged.sample_weight)
+        .set_collapsed_sum_of_squares(merged.within_sum_of_squares);
+    FMd::Vector collapsed_fit =
+        fit(merged.X, merged.relations, merged.y, builder.build());
+    for (int i = 0; i < n_rows; i++) {
+      REQUIRE(collapsed_fit(i) == Approx(original(i)).margin(1e-8));
+    }
+  }
+}
+
+TEST_CASE("Implicit feedback matches materialised pairs.", "[implicit]") {
+  using FMd = FM<double>;
+  using Block = relational::RelationBlock<double>;
+  std::mt19937 rng(11);
+  std::normal_distribution<double> normal(0, 1);
+  const int n_rows = 30, n_users = 5, n_items = 4;
+  const double implicit_weight = 0.3;
+  FMd::SparseMatrix X_user(n_users, n_users + 1),
+      X_item(n_items, n_items + 1);
+  for (int u = 0; u < n_users; u++) {
+    X_user.insert(u, u) = 1;
+    X_user.insert(u, n_users) = normal(rng);
+  }
+  for (int i = 0; i < n_items; i++) {
+    X_item.insert(i, i) = 1;
+    X_item.insert(i, n_items) = normal(rng);
+  }
+  const int n_pairs = n_users * n_items;
+  FMd::SparseMatrix X(n_rows, 2), X_all(n_rows + n_pairs, 2);
+  std::vector<size_t> to_user, to_item;
+  FMd::Vector y(n_rows), y_all(n_rows + n_pairs);
+  std::vector<double> weights;
+  for (int row = 0; row < n_rows; row++) {
+    X.insert(row, row % 2) = 1;
+    X_all.insert(row, row % 2) = 1;
+    to_user.push_back(row % n_users);
+    to_item.push_back((row * 3) % n_items);
+    y(row) = y_all(row) = 1 + normal(rng);
+    weights.push_back(1);
+  }
+  std::vector<Block> relations{Block(to_user, X_user), Block(to_item, X_item)};
+  for (int u = 0; u < n_users; u++) {
+    for (int i = 0; i < n_items; i++) {
+      to_user.push_back(u);
+      to_item.push_back(i);
+      y_all(weights.size()) = 0;
+      weights.push_back(implicit_weight);
+    }
+  }
+  std::vector<Block> relations_all{Block(to_user, X_user),
+                                   Block(to_item, X_item)};
+
+  FMLearningConfig<double>::Builder builder;
+  builder.set_identical_groups(2 + n_users + 1 + n_items + 1)
+      .set_n_iter(5)
+      .set_n_kept_samples(5);
+  auto fit = [&](const FMd::SparseMatrix &X_train,
+                 const std::vector<Block> &relations_train,
+                 const FMd::Vector &y_train,
+                 const FMLearningConfig<double> &config) {
+    GibbsFMTrainer<double> trainer(X_train, relations_train, y_train, 0,
+                                   config);
+    auto fm = trainer.create_FM(3, 0.1);
+    auto hyper = trainer.create_Hyper(fm.n_factors);
+    auto result = trainer.learn_with_callback(
+        fm, hyper,
+        [](int, FMd *, FMHyperParameters<double> *,
+           GibbsLearningHistory<double> *) { return false; });
+    REQUIRE((trainer.memory_report().to_string().find("implicit_feedback") !=
+             std::string::npos) == config.implicit_feedback());
+    return FMd::Vector(result.first.predict(X, relations));
+  };
+  FMd::Vector materialised = fit(X_all, relations_all, y_all,
+                                 builder.set_sample_weight(weights).build());
+  FMd::Vector implicit =
+      fit(X, relations, y,
+          builder.set_sample_weight({})
+              .set_implicit_feedback(0, 1, implicit_weight)
+              .build());
+  for (int row = 0; row < n_rows; row++) {
+    REQUIRE(implicit(row) == Approx(materialised(row)).margin(1e-8));
+  }
+
+  REQUIRE_THROWS_AS(builder.set_implicit_feedback(0, 1, -1).build(),
+                    std::invalid_argument);
+  REQUIRE_THROWS_AS(builder.set_implicit_feedback(0, 1, 1)
+                        .set_task_type(
+                            FMLearningConfig<double>::TASKTYPE::CLASSIFICATION)
+                        .build(),
+                    std::invalid_argument);
+}
+
+TEST_CASE("Multi-target training matches separate runs.", "[multi-target]") {
+  using FMd = FM<double>;
+  using Block = relational::RelationBlock<double>;
+  using Trainer = multi_target::MultiTargetGibbsTrainer<double>;
+  std::mt19937 rng(13);
+  std::normal_distribution<double> normal(0, 1);
+  const int n_rows = 40, n_features = 6, n_users = 7, n_targets = 3;
+  FMd::SparseMatrix X(n_rows, n_features), X_user(n_users, 3);
+  FMd::DenseMatrix Y(n_rows, n_targets);
+  std::vector<size_t> to_user;
+  for (int row = 0; row < n_rows; row++) {
+    X.insert(row, row % n_features) = 1;
+    X.insert(row, (row * 5 + 1) % n_features) = normal(rng);
+    to_user.push_back(row % n_users);
+    for (int t = 0; t < n_targets; t++) {
+      Y(row, t) = t + normal(rng);
+    }
+  }
+  for (int u = 0; u < n_users; u++) {
+    X_user.insert(u, u % 2) = 1;
+    X_user.insert(u, 2) = normal(rng);
+  }
+  std::vector<Block> relations{Block(to_user, X_user)};
+  const std::vector<int> seeds{3, 5, 7};
+
+  FMLearningConfig<double>::Builder builder;
+  auto config = builder.set_identical_groups(n_features + 3)
+                    .set_n_iter(8)
+                    .set_n_kept_samples(4)
+                    .build();
+  Trainer trainer(X, relations, Y, seeds, config);
+  auto fms = trainer.create_FMs(3, 0.1);
+  auto hypers = trainer.create_Hypers(3);
+  auto results = trainer.learn_with_callback(
+      fms, hypers,
+      [](int, std::vector<FMd> *, std::vector<FMHyperParameters<double>> *) {
+        return false;
+      });
+  REQUIRE(results.size() == static_cast<size_t>(n_targets));
+  for (int t = 0; t < n_targets; t++) {
+    GibbsFMTrainer<double> single(X, relations, FMd::Vector(Y.col(t)),
+                                  seeds[t], config);
+    auto fm = single.create_FM(3, 0.1);
+    auto hyper = single.create_Hyper(fm.n_factors);
+    auto result = single.learn_with_callback(
+        fm, hyper,
+        [](int, FMd *, FMHyperParameters<double> *,
+           GibbsLearningHistory<double> *) { return false; });
+    REQUIRE(results[t].first.samples.size() == result.first.samples.size());
+    FMd::Vector expected = result.first.predict(X, relations);
+    FMd::Vector actual = results[t].first.predict(X, relations);
+    for (int row = 0; row < n_rows; row++) {
+      REQUIRE(actual(row) == Approx(expected(row)).margin(1e-8));
+    }
+  }
+
+  Trainer shared(X, relations, Y, seeds, config, true);
+  fms = shared.create_FMs(3, 0.1);
+  hypers = shared.create_Hypers(3);
+  results = shared.learn_with_callback(
+      fms, hypers,
+      [](int, std::vector<FMd> *, std::vector<FMHyperParameters<double>> *) {
+        return false;
+      });
+  for (int t = 1; t < n_targets; t++) {
+    REQUIRE(fms[t].V == fms[0].V);
+    REQUIRE(fms[t].w != fms[0].w);
+  }
+  REQUIRE(std::isfinite(results[2].first.predict(X, relations).sum()));
+
+  REQUIRE_THROWS_AS(Trainer(X, relations, Y, {1, 2}, config),
+                    std::invalid_argument);
+  REQUIRE_THROWS_AS(Trainer(X, relations, Y, seeds,
+                            builder.set_rao_blackwell(true).build()),
+                    std::invalid_argument);
+}
+
+TEST_CASE("Sliding the window matches building on the new window.",
+          "[window]") {
+  using FMd = FM<double>;
+  using Block = relational::RelationBlock<double>;
+  using Hyper = FMHyperParameters<double>;
+  using History = GibbsLearningHistory<double>;
+  std::mt19937 rng(17);
+  std::normal_distribution<double> normal(0, 1);
+  const int n_rows = 60, n_features = 5, n_users = 6, n_evict = 25,
+            n_new = 15;
+  FMd::SparseMatrix X_all(n_rows + n_new, n_features), X_user(n_users, 3);
+  FMd::Vector y_all(n_rows + n_new);
+  std::vector<size_t> to_user;
+  for (int row = 0; row < n_rows + n_new; row++) {
+    X_all.insert(row, row % n_features) = 1;
+    X_all.insert(row, (row + 1 + row / n_features % (n_features - 1)) %
+                          n_features) = normal(rng);
+    // sorted by user so that the mapping is run-length encoded.
+    to_user.push_back(row * n_users / (n_rows + n_new));
+    y_all(row) = normal(rng);
+  }
+  X_all.makeCompressed();
+  for (int u = 0; u < n_users; u++) {
+    X_user.insert(u, u % 2) = 1;
+    X_user.insert(u, 2) = normal(rng);
+  }
+  auto rows = [&](int begin, int end) {
+    return std::make_tuple(
+        FMd::SparseMatrix(X_all.middleRows(begin, end - begin)),
+        std::vector<Block>{Block(
+            std::vector<size_t>(to_user.begin() + begin,
+                                to_user.begin() + end),
+            X_user)},
+        FMd::Vector(y_all.segment(begin, end - begin)));
+  };
+  auto before = rows(0, n_rows), appended = rows(n_rows, n_rows + n_new),
+       after = rows(n_evict, n_rows + n_new);
+
+  FMLearningConfig<double>::Builder builder;
+  auto config = builder.set_identical_groups(n_features + 3)
+                    .set_n_iter(3)
+                    .set_n_kept_samples(3)
+                    .build();
+  GibbsFMTrainer<double> trainer(std::get<0>(before), std::get<1>(before),
+                                 std::get<2>(before), 0, config);
+  auto fm = trainer.create_FM(2, 0.1);
+  auto hyper = trainer.create_Hyper(fm.n_factors);
+  trainer.learn_with_callback(
+      fm, hyper, [](int, FMd *, Hyper *, History *) { return false; });
+  trainer.slide_window(fm, n_evict, std::get<0>(appended),
+                       std::get<1>(appended), std::get<2>(appended));
+
+  GibbsFMTrainer<double> rebuilt(std::get<0>(after), std::get<1>(after),
+                                 std::get<2>(after), 0, config);
+  REQUIRE(trainer.n_train == rebuilt.n_train);
+  REQUIRE(FMd::DenseMatrix(trainer.X) == FMd::DenseMatrix(rebuilt.X));
+  REQUIRE(FMd::DenseMatrix(trainer.X_t) == FMd::DenseMatrix(rebuilt.X_t));
+  REQUIRE(trainer.y == rebuilt.y);
+  REQUIRE(trainer.relations[0].original_to_block.to_vector() ==
+          rebuilt.relations[0].original_to_block.to_vector());
+  REQUIRE(trainer.relations[0].original_to_block.encoding() ==
+          relational::BlockMapper::Encoding::RUN_LENGTH);
+  REQUIRE(trainer.relation_caches[0].cardinality ==
+          rebuilt.relation_caches[0].cardinality);
+  REQUIRE(trainer.sample_weight_sum == n_rows - n_evict + n_new);
+  FMd::Vector residual =
+      fm.predict_score(std::get<0>(after), std::get<1>(after)) -
+      std::get<2>(after);
+  for (int row = 0; row < trainer.n_train; row++) {
+    REQUIRE(trainer.e_train(row) == Approx(residual(row)).margin(1e-8));
+  }
+
+  auto result = trainer.continue_with_callback(
+      fm, hyper, [](int, FMd *, Hyper *, History *) { return false; });
+  REQUIRE(result.second.hypers.size() == 3);
+  REQUIRE(std::isfinite(result.first.predict(std::get<0>(after),
+                                             std::get<1>(after))
+                            .sum()));
+
+  variational::VariationalFMTrainer<double> vtrainer(
+      std::get<0>(before), std::get<1>(before), std::get<2>(before), 0,
+      config);
+  auto vfm = vtrainer.create_FM(2, 0.1);
+  auto vhyper = vtrainer.create_Hyper(vfm.n_factors);
+  vtrainer.learn_with_callback(
+      vfm, vhyper,
+      [](int, variational::VariationalFM<double> *,
+         variational::VariationalFMHyperParameters<double> *,
+         variational::VariationalLearningHistory<double> *) {
+        return false;
+      });
+  vtrainer.slide_window(vfm, n_evict, std::get<0>(appended),
+                        std::get<1>(appended), std::get<2>(appended));
+  auto vresult = vtrainer.continue_with_callback(
+      vfm, vhyper,
+      [](int, variational::VariationalFM<double> *,
+         variational::VariationalFMHyperParameters<double> *,
+         variational::VariationalLearningHistory<double> *) {
+        return false;
+      });
+  REQUIRE(vresult.second.elbos.size() == 3);
+  REQUIRE(std::isfinite(vresult.second.elbos.back()));
+
+  REQUIRE_THROWS_AS(trainer.slide_window(fm, 1000, std::get<0>(appended),
+                                         std::get<1>(appended),
+                                         std::get<2>(appended)),
+                    std::invalid_argument);
+}
+
+TEST_CASE("Thompson sampling scores with one posterior draw.", "[thompson]") {
+  using FMd = FM<double>;
+  using VFMd = variational::VariationalFM<double>;
+  using Block = relational::RelationBlock<double>;
+  std::mt19937 rng(23);
+  std::normal_distribution<double> normal(0, 1);
+  const int n_rows = 40, n_features = 4, n_users = 5, rank = 3;
+  FMd::SparseMatrix X(n_rows, n_features), X_user(n_users, 2);
+  std::vector<size_t> to_user;
+  for (int row = 0; row < n_rows; row++) {
+    // rows repeat every 10, so the shared draw shows as repeated scores.
+    X.insert(row, row % 10 % n_features) = 1 + row % 10;
+    to_user.push_back(row % 10 % n_users);
+  }
+  X.makeCompressed();
+  for (int u = 0; u < n_users; u++) {
+    X_user.insert(u, u % 2) = normal(rng);
+  }
+  std::vector<Block> relations{Block(to_user, X_user)};
+  const int n_all = n_features + 2;
+  auto random_matrix = [&](int rows, int cols) {
+    return FMd::DenseMatrix(FMd::DenseMatrix::NullaryExpr(
+        rows, cols, [&]() { return normal(rng); }));
+  };
+
+  Predictor<double> predictor(rank, n_all,
+                              FMLearningConfig<double>::TASKTYPE::REGRESSION);
+  std::vector<FMd::Vector> scores;
+  for (int s = 0; s < 3; s++) {
+    predictor.add_sample(FMd(normal(rng), random_matrix(n_all, 1),
+                             random_matrix(n_all, rank)));
+    scores.push_back(predictor.samples.back().predict_score(X, relations));
+  }
+  auto matches = [&](const FMd::Vector &result, int row, int s) {
+    return std::abs(result(row) - scores[s](row)) < 1e-10;
+  };
+  for (uint64_t seed = 0; seed < 5; seed++) {
+    FMd::Vector shared = predictor.predict_thompson(X, relations, seed, false);
+    int n_matching = 0;
+    for (int s = 0; s < 3; s++) {
+      n_matching += (shared - scores[s]).cwiseAbs().maxCoeff() < 1e-10;
+    }
+    REQUIRE(n_matching == 1);
+  }
+  FMd::Vector per_row = predictor.predict_thompson(X, relations, 7, true);
+  std::vector<int> used(3);
+  for (int row = 0; row < n_rows; row++) {
+    int n_matching = 0;
+    for (int s = 0; s < 3; s++) {
+      n_matching += matches(per_row, row, s);
+      used[s] += matches(per_row, row, s);
+    }
+    REQUIRE(n_matching == 1);
+  }
+  REQUIRE(std::count(used.begin(), used.end(), 0) == 0);
+  REQUIRE(predictor.predict_thompson(X, relations, 7, true, 3) == per_row);
+
+  Predictor<double> classifier(
+      rank, n_all, FMLearningConfig<double>::TASKTYPE::CLASSIFICATION);
+  for (const auto &sample : predictor.samples) {
+    classifier.add_sample(sample);
+  }
+  FMd::Vector probability = classifier.predict_thompson(X, relations, 7, true);
+  for (int row = 0; row < n_rows; row++) {
+    REQUIRE(probability(row) ==
+            Approx(0.5 * std::erfc(-per_row(row) / std::sqrt(2.0))));
+  }
+
+  variational::VariationalPredictor<double> vpredictor(
+      rank, n_all, FMLearningConfig<double>::TASKTYPE::REGRESSION);
+  const FMd &mean = predictor.samples[0];
+  vpredictor.add_sample(VFMd(mean.w0, 0, mean.w, FMd::Vector::Zero(n_all),
+                             mean.V, FMd::DenseMatrix::Zero(n_all, rank)));
+  FMd::Vector exact = vpredictor.predict(X, relations);
+  REQUIRE((vpredictor.predict_thompson(X, relations, 1, true) - exact)
+              .cwiseAbs()
+              .maxCoeff() < 1e-10);
+  vpredictor.samples[0].w0_var = 0.1;
+  vpredictor.samples[0].w_var.array() = 0.1;
+  vpredictor.samples[0].V_var.array() = 0.1;
+  FMd::Vector drawn = vpredictor.predict_thompson(X, relations, 1, false);
+  FMd::Vector independent = vpredictor.predict_thompson(X, relations, 1, true);
+  REQUIRE((drawn - exact).cwiseAbs().maxCoeff() > 1e-3);
+  REQUIRE(vpredictor.predict_thompson(X, relations, 1, false, 4) == drawn);
+  for (int row = 10; row < n_rows; row++) {
+    REQUIRE(drawn(row) == drawn(row - 10));
+  }
+  REQUIRE(independent(10) != independent(0));
+}
+
+TEST_CASE("Attributions sum to the score and match the closed form.",
+          "[attribution]") {
+  using FMd = FM<double>;
+  using Block = relational::RelationBlock<double>;
+  std::mt19937 rng(29);
+  std::normal_distribution<double> normal(0, 1);
+  const int n_rows = 30, n_features = 5, n_users = 4, n_user_features = 3,
+            rank = 2;
+  const int n_all = n_features + n_user_features;
+  FMd::SparseMatrix X(n_rows, n_features), X_user(n_users, n_user_features);
+  std::vector<size_t> to_user;
+  for (int row = 0; row < n_rows; row++) {
+    X.insert(row, row % n_features) = normal(rng);
+    X.insert(row, (row + 2) % n_features) = normal(rng);
+    to_user.push_back((row * 7) % n_users);
+  }
+  X.makeCompressed();
+  for (int u = 0; u < n_users; u++) {
+    X_user.insert(u, u % n_user_features) = normal(rng);
+  }
+  std::vector<Block> relations{Block(to_user, X_user)};
+  auto random_matrix = [&](int rows, int cols) {
+    return FMd::DenseMatrix(FMd::DenseMatrix::NullaryExpr(
+        rows, cols, [&]() { return normal(rng); }));
+  };
+  Predictor<double> predictor(rank, n_all,
+                              FMLearningConfig<double>::TASKTYPE::REGRESSION);
+  Predictor<double> classifier(
+      rank, n_all, FMLearningConfig<double>::TASKTYPE::CLASSIFICATION);
+  double mean_w0 = 0;
+  for (int s = 0; s < 3; s++) {
+    FMd fm(normal(rng), random_matrix(n_all, 1), random_matrix(n_all, rank));
+    mean_w0 += fm.w0 / 3;
+    predictor.add_sample(fm);
+    classifier.add_sample(fm);
+  }
+
+  auto result = predictor.predict_with_attribution(X, relations);
+  FMd::Vector expected = predictor.predict(X, relations);
+  FMd::DenseMatrix attribution(result.second);
+  REQUIRE(result.second.nonZeros() == 3 * n_rows);
+  for (int row = 0; row < n_rows; row++) {
+    REQUIRE(result.first(row) == Approx(expected(row)));
+    REQUIRE(attribution.row(row).sum() + mean_w0 == Approx(expected(row)));
+    // the flattened row, against which to check each entry.
+    FMd::Vector x = FMd::Vector::Zero(n_all);
+    x.head(n_features) = FMd::DenseMatrix(X.row(row)).transpose();
+    x.tail(n_user_features) =
+        FMd::DenseMatrix(X_user.row(to_user[row])).transpose();
+    for (int j = 0; j < n_all; j++) {
+      double a = 0;
+      for (const auto &fm : predictor.samples) {
+        for (int k = 0; k < n_all; k++) {
+          if (k != j) {
+            a += x(j) * x(k) * fm.V.row(j).dot(fm.V.row(k)) / 2;
+          }
+        }
+        a += x(j) * fm.w(j);
+      }
+      REQUIRE(attribution(row, j) == Approx(a / 3).margin(1e-12));
+    }
+  }
+  auto parallel = predictor.predict_with_attribution(X, relations, 4);
+  REQUIRE(parallel.first == result.first);
+  REQUIRE(FMd::DenseMatrix(parallel.second) == attribution);
+
+  auto classified = classifier.predict_with_attribution(X, relations);
+  FMd::Vector probability = classifier.predict(X, relations);
+  for (int row = 0; row < n_rows; row++) {
+    REQUIRE(classified.first(row) == Approx(probability(row)));
+  }
+  REQUIRE(FMd::DenseMatrix(classified.second) == attribution);
+}
+
+TEST_CASE("Asynchronous batches match predict.", "[async]") {
+  using FMd = FM<double>;
+  std::mt19937 rng(31);
+  std::normal_distribution<double> normal(0, 1);
+  const int n_features = 6, rank = 2;
+  Predictor<double> predictor(rank, n_features,
+                              FMLearningConfig<double>::TASKTYPE::REGRESSION);
+  for (int s = 0; s < 2; s++) {
+    FMd::DenseMatrix V(n_features, rank);
+    for (int i = 0; i < n_features * rank; i++) {
+      V(i) = normal(rng);
+    }
+    predictor.add_sample(FMd(normal(rng), FMd::Vector::Ones(n_features), V));
+  }
+  std::vector<FMd::SparseMatrix> batches;
+  for (int b = 0; b < 8; b++) {
+    FMd::SparseMatrix X(20 + b, n_features);
+    for (int row = 0; row < X.rows(); row++) {
+      X.insert(row, (row + b) % n_features) = normal(rng);
+    }
+    X.makeCompressed();
+    batches.push_back(X);
+  }
+
+  std::atomic<int> n_called(0);
+  std::vector<std::shared_ptr<PredictionFuture<FMd::Vector>>> futures;
+  {
+    // one slot, so that submit has to wait for the workers.
+    AsyncPredictor<double> pool(predictor, 2, 1);
+    for (const auto &X : batches) {
+      futures.push_back(pool.submit(X, {}));
+      futures.back()->add_done_callback([&n_called] { n_called++; });
+    }
+    REQUIRE(pool.pending() <= 1);
+    REQUIRE_THROWS_AS(pool.submit(FMd::SparseMatrix(3, n_features + 1), {}),
+                      std::invalid_argument);
+  }
+  // the pool scores what was queued before it stops.
+  REQUIRE(n_called == static_cast<int>(batches.size()));
+  for (size_t b = 0; b < batches.size(); b++) {
+    REQUIRE(futures[b]->done());
+    REQUIRE(futures[b]->get() == predictor.predict(batches[b], {}));
+  }
+  int n_late = 0;
+  futures[0]->add_done_callback([&n_late] { n_late++; });
+  REQUIRE(n_late == 1);
+
+  Predictor<double> empty(rank, n_features,
+                          FMLearningConfig<double>::TASKTYPE::REGRESSION);
+  AsyncPredictor<double> failing(empty, 1, 2);
+  auto failed = failing.submit(batches[0], {});
+  REQUIRE(failed->wait(10));
+  REQUIRE_THROWS_AS(failed->get(), std::runtime_error);
+}
+
+TEST_CASE("Interaction masks keep only the allowed field pairs.", "[mask]") {
+  using FMd = FM<double>;
+  using Block = relational::RelationBlock<double>;
+  using Hyper = FMHyperParameters<double>;
+  using History = GibbsLearningHistory<double>;
+  std::mt19937 rng(37);
+  std::normal_distribution<double> normal(0, 1);
+  const int n_rows = 50, n_features = 6, n_users = 4, rank = 3;
+  // fields 0, 1 and 2 own two features of X each; the user block is field 2.
+  const std::vector<size_t> field_of{0, 0, 1, 1, 2, 2, 2, 2};
+  const InteractionMask::BlockType blocks{{{0}, {1}}, {{2}, {}}};
+  FMd::SparseMatrix X(n_rows, n_features), X_user(n_users, 2);
+  std::vector<size_t> to_user;
+  FMd::Vector y(n_rows);
+  for (int row = 0; row < n_rows; row++) {
+    for (int field = 0; field < 3; field++) {
+      X.insert(row, 2 * field + (row + field) % 2) = normal(rng);
+    }
+    to_user.push_back(row % n_users);
+    y(row) = normal(rng);
+  }
+  X.makeCompressed();
+  for (int u = 0; u < n_users; u++) {
+    X_user.insert(u, u % 2) = normal(rng);
+  }
+  std::vector<Block> relations{Block(to_user, X_user)};
+
+  FMd fm(normal(rng), FMd::Vector::Random(8),
+         FMd::DenseMatrix::Random(8, rank));
+  fm.mask = std::make_shared<const InteractionMask>(field_of, 3, blocks);
+  FMd::Vector masked = fm.predict_score(X, relations);
+  for (int row = 0; row < n_rows; row++) {
+    FMd::Vector x = FMd::Vector::Zero(8);
+    x.head(n_features) = FMd::DenseMatrix(X.row(row)).transpose();
+    x.tail(2) = FMd::DenseMatrix(X_user.row(to_user[row])).transpose();
+    double expected = fm.w0 + x.dot(fm.w);
+    for (int i = 0; i < 8; i++) {
+      for (int j = i + 1; j < 8; j++) {
+        if (fm.mask->allows(field_of[i], field_of[j])) {
+          expected += x(i) * x(j) * fm.V.row(i).dot(fm.V.row(j));
+        }
+      }
+    }
+    REQUIRE(masked(row) == Approx(expected));
+  }
+  REQUIRE(fm.mask->allows(0, 1));
+  REQUIRE_FALSE(fm.mask->allows(0, 0));
+  REQUIRE_FALSE(fm.mask->allows(1, 2));
+
+  Predictor<double> predictor(rank, 8,
+                              FMLearningConfig<double>::TASKTYPE::REGRESSION);
+  predictor.add_sample(fm);
+  auto attributed = predictor.predict_with_attribution(X, relations);
+  for (int row = 0; row < n_rows; row++) {
+    REQUIRE(attributed.first(row) == Approx(masked(row)));
+    REQUIRE(FMd::DenseMatrix(attributed.second.row(row)).sum() + fm.w0 ==
+            Approx(masked(row)));
+  }
+  REQUIRE((predictor.predict_thompson(X, relations, 3, true) - masked)
+              .cwiseAbs()
+              .maxCoeff() < 1e-10);
+  std::stringstream stream;
+  serialization::save_predictor(predictor, stream);
+  auto loaded = serialization::load_predictor<double>(stream);
+  REQUIRE(loaded.predict(X, relations) == predictor.predict(X, relations));
+
+  // a single block of all the fields is the unmasked model.
+  fm.mask = std::make_shared<const InteractionMask>(
+      field_of, 3, InteractionMask::BlockType{{{0, 1, 2}, {}}});
+  FMd unmasked(fm.w0, fm.w, fm.V);
+  REQUIRE((fm.predict_score(X, relations) -
+           unmasked.predict_score(X, relations))
+              .cwiseAbs()
+              .maxCoeff() < 1e-10);
+  REQUIRE_THROWS_AS(InteractionMask(field_of, 3, {{{0}, {1}}, {{0, 1}, {}}}),
+                    std::invalid_argument);
+  REQUIRE_THROWS_AS(InteractionMask(field_of, 3, {{{0}, {0}}}),
+                    std::invalid_argument);
+
+  // training on X alone, whose fields are the first six groups' fields.
+  const std::vector<size_t> group_index(field_of.begin(),
+                                        field_of.begin() + n_features);
+  auto train = [&](const InteractionMask::BlockType &mask_blocks) {
+    FMLearningConfig<double>::Builder builder;
+    auto config = builder.set_group_index(group_index)
+                      .set_n_iter(5)
+                      .set_n_kept_samples(5)
+                      .set_interaction_blocks(mask_blocks)
+                      .build();
+    GibbsFMTrainer<double> trainer(X, {}, y, 0, config);
+    auto model = trainer.create_FM(rank, 0.1);
+    auto hyper = trainer.create_Hyper(model.n_factors);
+    auto result = trainer.learn_with_callback(
+        model, hyper, [](int, FMd *, Hyper *, History *) { return false; });
+    FMd::Vector residual = model.predict_score(X, {}) - y;
+    REQUIRE((trainer.e_train - residual).cwiseAbs().maxCoeff() < 1e-8);
+    REQUIRE(result.first.samples.back().mask == config.interaction_mask());
+    return FMd(model);
+  };
+  FMd cross = train({{{0}, {1}}, {{2}, {}}});
+  FMd all = train({{{0, 1, 2}, {}}});
+  FMd plain = train({});
+  REQUIRE((all.V - plain.V).cwiseAbs().maxCoeff() < 1e-8);
+  REQUIRE((cross.V - plain.V).cwiseAbs().maxCoeff() > 1e-3);
+
+  // with the user block, against the same cases with the block spelled out
+  // in X, which draws the same coordinates in the same order.
+  FMd::SparseMatrix X_flat(n_rows, 8);
+  for (int row = 0; row < n_rows; row++) {
+    for (FMd::SparseMatrix::InnerIterator it(X, row); it; ++it) {
+      X_flat.insert(row, it.col()) = it.value();
+    }
+    for (FMd::SparseMatrix::InnerIterator it(X_user, to_user[row]); it;
+         ++it) {
+      X_flat.insert(row, n_features + it.col()) = it.value();
+    }
+  }
+  X_flat.makeCompressed();
+  auto train_all = [&](const FMd::SparseMatrix &X_train,
+                       const std::vector<Block> &train_relations) {
+    FMLearningConfig<double>::Builder builder;
+    auto config = builder.set_group_index(field_of)
+                      .set_n_iter(5)
+                      .set_n_kept_samples(5)
+                      .set_interaction_blocks(blocks)
+                      .build();
+    GibbsFMTrainer<double> trainer(X_train, train_relations, y, 0, config);
+    auto model = trainer.create_FM(rank, 0.1);
+    auto hyper = trainer.create_Hyper(model.n_factors);
+    trainer.learn_with_callback(
+        model, hyper, [](int, FMd *, Hyper *, History *) { return false; });
+    FMd::Vector residual = model.predict_score(X_train, train_relations) - y;
+    REQUIRE((trainer.e_train - residual).cwiseAbs().maxCoeff() < 1e-8);
+    return FMd(model);
+  };
+  FMd with_relations = train_all(X, relations);
+  FMd flat = train_all(X_flat, {});
+  REQUIRE((with_relations.V - flat.V).cwiseAbs().maxCoeff() < 1e-8);
+  REQUIRE((with_relations.predict_score(X, relations) -
+           flat.predict_score(X_flat, {}))
+              .cwiseAbs()
+              .maxCoeff() < 1e-8);
+}
+
+TEST_CASE("Per-group factor ranks keep the factors beyond them at zero.",
+          "[rank]") {
+  using FMd = FM<double>;
+  using Block = relational::RelationBlock<double>;
+  using Hyper = FMHyperParameters<double>;
+  using History = GibbsLearningHistory<double>;
+  using VTrainer = variational::VariationalFMTrainer<double>;
+  using VFM = variational::VariationalFM<double>;
+  std::mt19937 rng(41);
+  std::normal_distribution<double> normal(0, 1);
+  const int n_rows = 60, n_features = 6, n_users = 5, rank = 3;
+  FMd::SparseMatrix X(n_rows, n_features), X_user(n_users, n_users);
+  std::vector<size_t> to_user;
+  FMd::Vector y(n_rows);
+  for (int row = 0; row < n_rows; row++) {
+    X.insert(row, row % 3) = normal(rng);
+    X.insert(row, 3 + (row / 3) % 3) = normal(rng);
+    to_user.push_back(row % n_users);
+    y(row) = normal(rng);
+  }
+  X.makeCompressed();
+  for (int u = 0; u < n_users; u++) {
+    X_user.insert(u, u) = 1;
+  }
+  std::vector<Block> relations{Block(to_user, X_user)};
+  // groups 0 and 1 split X, the users are group 2.
+  std::vector<size_t> group_index{0, 0, 0, 1, 1, 1};
+  group_index.insert(group_index.end(), n_users, 2);
+  const std::vector<size_t> ranks{3, 1, 0};
+  auto config_of = [&](const std::vector<size_t> &group_ranks) {
+    FMLearningConfig<double>::Builder builder;
+    return builder.set_group_index(group_index)
+        .set_n_iter(5)
+        .set_n_kept_samples(5)
+        .set_group_ranks(group_ranks)
+        .build();
+  };
+  auto check_tails = [&](const FMd::DenseMatrix &V) {
+    for (size_t feature = 0; feature < group_index.size(); feature++) {
+      const int kept = ranks[group_index[feature]];
+      REQUIRE(V.row(feature).tail(rank - kept).squaredNorm() == 0);
+    }
+  };
+
+  std::vector<Predictor<double>> ranked_predictors;
+  auto gibbs = [&](const std::vector<size_t> &group_ranks) {
+    GibbsFMTrainer<double> trainer(X, relations, y, 0, config_of(group_ranks));
+    auto model = trainer.create_FM(rank, 0.1);
+    auto hyper = trainer.create_Hyper(model.n_factors);
+    auto result = trainer.learn_with_callback(
+        model, hyper, [](int, FMd *, Hyper *, History *) { return false; });
+    FMd::Vector residual = model.predict_score(X, relations) - y;
+    REQUIRE((trainer.e_train - residual).cwiseAbs().maxCoeff() < 1e-8);
+    if (group_ranks == ranks) {
+      for (const auto &sample : result.first.samples) {
+        REQUIRE(sample.is_compact());
+        check_tails(sample.dense_V());
+      }
+      ranked_predictors.push_back(result.first);
+    }
+    return FMd(model);
+  };
+  FMd ranked = gibbs(ranks);
+  REQUIRE(ranked.V.topRows(3).cwiseAbs().minCoeff() > 0);
+  // the model carries the ranks, and scoring within them is exact.
+  REQUIRE(ranked.feature_ranks->size() == group_index.size());
+  for (size_t feature = 0; feature < group_index.size(); feature++) {
+    REQUIRE((*ranked.feature_ranks)[feature] ==
+            static_cast<int>(ranks[group_index[feature]]));
+  }
+  FMd::Vector dense_score(n_rows);
+  ranked.predict_score_with_kernel(dense_score, X, relations, "per_factor");
+  REQUIRE((ranked.predict_score(X, relations) - dense_score)
+              .cwiseAbs()
+              .maxCoeff() < 1e-10);
+
+  // only the ranked part of V is kept, in memory and on disk.
+  const Predictor<double> &predictor = ranked_predictors.front();
+  auto drop_ranks = [](FMd &sample) {
+    sample.V = sample.dense_V();
+    sample.ranked_V.resize(0);
+    sample.feature_ranks.reset();
+  };
+  Predictor<double> unranked = predictor;
+  for (auto &sample : unranked.samples) {
+    drop_ranks(sample);
+  }
+  // the users' factors are all cut, so 3 + 3 of the 11 x 3 are kept.
+  REQUIRE(predictor.samples.front().ranked_V.size() == 3 * 3 + 3 * 1);
+  REQUIRE(memory::bytes_of(predictor.samples.front()) <
+          memory::bytes_of(unranked.samples.front()));
+  REQUIRE((predictor.predict(X, relations) - unranked.predict(X, relations))
+              .cwiseAbs()
+              .maxCoeff() < 1e-10);
+  GibbsFMTrainer<double> projecting(X, relations, y, 0, config_of(ranks));
+  auto samples_bytes = [](const memory::MemoryReport &report) {
+    for (const auto &component : report.components) {
+      if (component.first == "samples") {
+        return component.second;
+      }
+    }
+    return size_t(0);
+  };
+  REQUIRE(samples_bytes(projecting.projected_memory_report(rank)) ==
+          5 * (sizeof(double) * (1 + group_index.size()) +
+               memory::bytes_of(predictor.samples.front().ranked_V)));
+  std::stringstream ranked_stream, unranked_stream;
+  serialization::save_predictor(predictor, ranked_stream);
+  serialization::save_predictor(unranked, unranked_stream);
+  REQUIRE(ranked_stream.str().size() < unranked_stream.str().size());
+  Predictor<double> loaded =
+      serialization::load_predictor<double>(ranked_stream);
+  REQUIRE(*loaded.samples.front().feature_ranks == *ranked.feature_ranks);
+  REQUIRE(loaded.samples.front().is_compact());
+  REQUIRE((loaded.predict(X, relations) - unranked.predict(X, relations))
+              .cwiseAbs()
+              .maxCoeff() < 1e-10);
+  Predictor<double> mixed = predictor;
+  drop_ranks(mixed.samples.back());
+  REQUIRE_THROWS_AS(serialization::save_predictor(mixed, unranked_stream),
+                    std::invalid_argument);
+#ifndef _WIN32
+  // a shared segment holds the ranked part as well.
+  const std::string path =
+      "myfm_rank_" + std::to_string(static_cast<long>(getpid()));
+  SharedPredictor<double>::write_file(predictor, path + ".ranked");
+  SharedPredictor<double>::write_file(unranked, path + ".unranked");
+  {
+    auto shared = SharedPredictor<double>::map_file(path + ".ranked");
+    auto dense = SharedPredictor<double>::map_file(path + ".unranked");
+    REQUIRE(shared->bytes() < dense->bytes());
+    REQUIRE((shared->predict(X, relations) - unranked.predict(X, relations))
+                .cwiseAbs()
+                .maxCoeff() < 1e-10);
+    REQUIRE(shared->sample(0).is_compact());
+    REQUIRE(shared->sample(0).ranked_V ==
+            predictor.samples.front().ranked_V);
+    REQUIRE(!dense->sample(0).is_compact());
+  }
+  std::remove((path + ".ranked").c_str());
+  std::remove((path + ".unranked").c_str());
+  REQUIRE_THROWS_AS(SharedPredictor<double>::write_file(mixed, path),
+                    std::invalid_argument);
+#endif
+  // ranks of n_factors everywhere are the plain chain.
+  FMd full = gibbs({3, 3, 3});
+  FMd plain = gibbs({});
+  REQUIRE((full.V - plain.V).cwiseAbs().maxCoeff() < 1e-12);
+  REQUIRE_THROWS_AS(gibbs({4, 1, 0}), std::invalid_argument);
+  REQUIRE_THROWS_AS(config_of({3, 1}), std::invalid_argument);
+
+  VTrainer trainer(X, relations, y, 0, config_of(ranks));
+  auto model = trainer.create_FM(rank, 0.1);
+  auto hyper = trainer.create_Hyper(model.n_factors);
+  auto result = trainer.learn_with_callback(
+      model, hyper,
+      [](int, VFM *, variational::VariationalFMHyperParameters<double> *,
+         variational::VariationalLearningHistory<double> *) { return false; });
+  check_tails(model.V);
+  check_tails(model.V_var);
+  for (double elbo : result.second.elbos) {
+    REQUIRE(std::isfinite(elbo));
+  }
+  FMd::Vector prediction = result.first.predict(X, relations);
+  REQUIRE(prediction.allFinite());
+}
+
+TEST_CASE("Autotuned kernels agree and their choices persist.",
+          "[autotune]") {
+  using FMd = FM<double>;
+  using Block = relational::RelationBlock<double>;
+  using TASKTYPE = FMLearningConfig<double>::TASKTYPE;
+  std::mt19937 rng(43);
+  std::normal_distribution<double> normal(0, 1);
+  const int n_rows = 40, n_features = 7, n_users = 5, n_dense = 3;
+  FMd::SparseMatrix X(n_rows, n_features), X_user(n_users, n_users);
+  std::vector<size_t> to_user, to_dense;
+  for (int row = 0; row < n_rows; row++) {
+    X.insert(row, row % n_features) = normal(rng);
+    X.insert(row, (row * 3 + 1) % n_features) = normal(rng);
+    to_user.push_back(row % n_users);
+    to_dense.push_back((row / 2) % 4);
+  }
+  X.makeCompressed();
+  for (int u = 0; u < n_users; u++) {
+    X_user.insert(u, u) = 1;
+  }
+  std::vector<Block> relations{
+      Block(to_user, X_user),
+      Block(to_dense, FMd::DenseMatrix(FMd::DenseMatrix::Random(4, n_dense)))};
+  const int n_all = n_features + n_users + n_dense;
+
+  for (int rank : {5, 8}) {
+    Predictor<double> predictor(rank, n_all, TASKTYPE::CLASSIFICATION);
+    for (int m = 0; m < 3; m++) {
+      predictor.add_sample(FMd(normal(rng), FMd::Vector::Random(n_all),
+                               FMd::DenseMatrix::Random(n_all, rank)));
+    }
+    const FMd &sample = predictor.samples.front();
+    FMd::Vector fused(n_rows), per_factor(n_rows);
+    sample.predict_score_with_kernel(fused, X, relations, "fused");
+    sample.predict_score_with_kernel(per_factor, X, relations, "per_factor");
+    REQUIRE((fused - per_factor).cwiseAbs().maxCoeff() < 1e-10);
+    REQUIRE_THROWS_AS(
+        sample.predict_score_with_kernel(fused, X, relations, "tiled"),
+        std::invalid_argument);
+
+    FMd::Vector expected = predictor.predict(X, relations);
+    REQUIRE((predictor.predict_row_parallel(X, relations, 3) - expected)
+                .cwiseAbs()
+                .maxCoeff() < 1e-10);
+  }
+
+  autotune::Autotuner &tuner = autotune::Autotuner::instance();
+  const std::string cache_file = "myfm_autotune_test_cache.txt";
+  std::remove(cache_file.c_str());
+  tuner.clear();
+  tuner.set_cache_file(cache_file);
+  tuner.set_enabled(true);
+  Predictor<double> predictor(6, n_all, TASKTYPE::REGRESSION);
+  for (int m = 0; m < 4; m++) {
+    predictor.add_sample(FMd(normal(rng), FMd::Vector::Random(n_all),
+                             FMd::DenseMatrix::Random(n_all, 6)));
+  }
+  FMd::Vector expected = predictor.samples.front().predict_score(X, relations);
+  REQUIRE(tuner.choices().size() == 1);
+  FMd::Vector mean = predictor.predict(X, relations);
+  for (int repeat = 0; repeat < 2; repeat++) {
+    REQUIRE((predictor.predict_parallel(X, relations, 2) - mean)
+                .cwiseAbs()
+                .maxCoeff() < 1e-10);
+  }
+  const std::map<std::string, std::string> choices = tuner.choices();
+  REQUIRE(choices.size() == 2);
+  for (const auto &choice : choices) {
+    const bool scoring = choice.first.compare(0, 6, "score/") == 0;
+    if (scoring) {
+      REQUIRE((choice.second == "fused" || choice.second == "per_factor"));
+    } else {
+      REQUIRE(choice.first.compare(0, 8, "predict/") == 0);
+      REQUIRE((choice.second == "sample_parallel" ||
+               choice.second == "row_parallel"));
+    }
+  }
+  // a larger shape class is tuned separately.
+  FMd::SparseMatrix X_twice(2 * n_rows, n_features);
+  std::vector<size_t> to_user_twice(to_user), to_dense_twice(to_dense);
+  to_user_twice.insert(to_user_twice.end(), to_user.begin(), to_user.end());
+  to_dense_twice.insert(to_dense_twice.end(), to_dense.begin(),
+                        to_dense.end());
+  for (int row = 0; row < 2 * n_rows; row++) {
+    for (FMd::SparseMatrix::InnerIterator it(X, row % n_rows); it; ++it) {
+      X_twice.insert(row, it.col()) = it.value();
+    }
+  }
+  X_twice.makeCompressed();
+  std::vector<Block> relations_twice{
+      relations[0].with_original_to_block(to_user_twice),
+      relations[1].with_original_to_block(to_dense_twice)};
+  FMd::Vector twice =
+      predictor.samples.front().predict_score(X_twice, relations_twice);
+  REQUIRE((twice.head(n_rows) - expected).cwiseAbs().maxCoeff() < 1e-10);
+  REQUIRE(tuner.choices().size() == 3);
+
+  // the choices come back from the cache file.
+  tuner.clear();
+  tuner.set_cache_file(cache_file);
+  REQUIRE(tuner.choices().size() == 3);
+  REQUIRE(tuner.choices().at(choices.begin()->first) ==
+          choices.begin()->second);
+  REQUIRE_THROWS_AS(tuner.record("two words", "fused"),
+                    std::invalid_argument);
+
+  // candidates are warmed up and timed several times, the choice runs last.
+  std::map<std::string, int> runs;
+  std::string last;
+  auto count_runs = [&](const std::string &candidate) {
+    runs[candidate]++;
+    last = candidate;
+    if (candidate == "slow") {
+      std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+  };
+  REQUIRE(tuner.measure("runs", {"slow", "fast"}, count_runs) == "fast");
+  REQUIRE(runs["slow"] == 1 + autotune::Autotuner::TIMED_RUNS);
+  REQUIRE(runs["fast"] == 1 + autotune::Autotuner::TIMED_RUNS);
+  REQUIRE(last == "fast");
+  REQUIRE(tuner.measure("runs_again", {"fast", "slow"}, count_runs) ==
+          "fast");
+  REQUIRE(last == "fast");
+
+  // while one thread measures, the others run the first candidate untimed.
+  std::atomic<bool> started(false), release(false);
+  std::thread measuring([&] {
+    tuner.measure("held", {"a", "b"}, [&](const std::string &) {
+      started = true;
+      while (!release) {
+        std::this_thread::yield();
+      }
+    });
+  });
+  while (!started) {
+    std::this_thread::yield();
+  }
+  std::vector<std::string> ran;
+  REQUIRE(tuner.measure("held", {"b", "a"}, [&](const std::string &c) {
+    ran.push_back(c);
+  }) == "b");
+  REQUIRE(ran == std::vector<std::string>{"b"});
+  std::string choice;
+  REQUIRE(!tuner.lookup("held", choice));
+  release = true;
+  measuring.join();
+  REQUIRE(tuner.lookup("held", choice));
+
+  tuner.set_enabled(false);
+  tuner.set_cache_file("");
+  tuner.clear();
+  std::remove(cache_file.c_str());
+}
+
+TEST_CASE("The variational predictive variance matches sampled models.",
+          "[variance]") {
+  using FMd = FM<double>;
+  using VFM = variational::VariationalFM<double>;
+  using Block = relational::RelationBlock<double>;
+  using TASKTYPE = FMLearningConfig<double>::TASKTYPE;
+  std::mt19937 rng(47);
+  std::normal_distribution<double> normal(0, 1);
+  const int n_rows = 6, n_features = 4, n_users = 3, rank = 3;
+  const int n_all = n_features + 2;
+  FMd::SparseMatrix X(n_rows, n_features), X_user(n_users, 2);
+  std::vector<size_t> to_user;
+  for (int row = 0; row < n_rows; row++) {
+    X.insert(row, row % n_features) = normal(rng);
+    X.insert(row, (row + 1) % n_features) = normal(rng);
+    to_user.push_back(row % n_users);
+  }
+  X.makeCompressed();
+  for (int u = 0; u < n_users; u++) {
+    X_user.insert(u, u % 2) = 1 + u;
+  }
+  std::vector<Block> relations{Block(to_user, X_user)};
+  auto random_sample = [&]() {
+    return VFM(normal(rng), 0.1, FMd::Vector::Random(n_all),
+               FMd::Vector::Random(n_all).cwiseAbs() * 0.2,
+               FMd::DenseMatrix::Random(n_all, rank),
+               FMd::DenseMatrix::Random(n_all, rank).cwiseAbs() * 0.2);
+  };
+
+  variational::VariationalPredictor<double> predictor(rank, n_all,
+                                                      TASKTYPE::REGRESSION);
+  predictor.add_sample(random_sample());
+  auto result =
+      variational::predict_mean_and_variance(predictor, X, relations, 2);
+  REQUIRE((result.first - predictor.predict(X, relations))
+              .cwiseAbs()
+              .maxCoeff() < 1e-10);
+  REQUIRE((predictor.predict_row_parallel(X, relations, 2) - result.first)
+              .cwiseAbs()
+              .maxCoeff() < 1e-10);
+
+  // Monte Carlo over models drawn from the posterior.
+  const VFM &posterior = predictor.samples.front();
+  const int n_draws = 40000;
+  FMd::Vector sum = FMd::Vector::Zero(n_rows);
+  FMd::Vector sum_squares = FMd::Vector::Zero(n_rows);
+  FMd::Vector w(n_all);
+  FMd::DenseMatrix V(n_all, rank);
+  for (int draw = 0; draw < n_draws; draw++) {
+    for (int j = 0; j < n_all; j++) {
+      w(j) = posterior.w(j) + std::sqrt(posterior.w_var(j)) * normal(rng);
+      for (int f = 0; f < rank; f++) {
+        V(j, f) = posterior.V(j, f) +
+                  std::sqrt(posterior.V_var(j, f)) * normal(rng);
+      }
+    }
+    const double w0 =
+        posterior.w0 + std::sqrt(posterior.w0_var) * normal(rng);
+    FMd::Vector score = FMd(w0, w, V).predict_score(X, relations);
+    sum += score;
+    sum_squares += score.cwiseAbs2();
+  }
+  FMd::Vector mc_mean = sum / n_draws;
+  FMd::Vector mc_var = sum_squares / n_draws - mc_mean.cwiseAbs2();
+  for (int row = 0; row < n_rows; row++) {
+    REQUIRE(result.first(row) ==
+            Approx(mc_mean(row)).margin(0.05 + 0.02 * result.second(row)));
+    REQUIRE(result.second(row) == Approx(mc_var(row)).epsilon(0.05));
+  }
+
+  // two samples: the variance of the mixture, probabilities for the mean.
+  variational::VariationalPredictor<double> classifier(
+      rank, n_all, TASKTYPE::CLASSIFICATION);
+  classifier.add_sample(posterior);
+  classifier.add_sample(random_sample());
+  auto mixture = variational::predict_mean_and_variance(classifier, X,
+                                                        relations);
+  REQUIRE((mixture.first - classifier.predict(X, relations))
+              .cwiseAbs()
+              .maxCoeff() < 1e-10);
+  variational::VariationalPredictor<double> second(rank, n_all,
+                                                   TASKTYPE::REGRESSION);
+  second.add_sample(classifier.samples.back());
+  auto other = variational::predict_mean_and_variance(second, X, relations);
+  for (int row = 0; row < n_rows; row++) {
+    const double gap = result.first(row) - other.first(row);
+    REQUIRE(mixture.second(row) ==
+            Approx((result.second(row) + other.second(row)) / 2 +
+                   gap * gap / 4));
+  }
+}
+
+TEST_CASE("Scoring several models in one pass matches each predict.",
+          "[multi_model]") {
+  using FMd = FM<double>;
+  using VFM = variational::VariationalFM<double>;
+  using Block = relational::RelationBlock<double>;
+  using TASKTYPE = FMLearningConfig<double>::TASKTYPE;
+  std::mt19937 rng(53);
+  std::normal_distribution<double> normal(0, 1);
+  const int n_rows = 30, n_features = 5, n_users = 4;
+  const int n_all = n_features + n_users;
+  FMd::SparseMatrix X(n_rows, n_features), X_user(n_users, n_users),
+      X_none(n_rows, 0);
+  std::vector<size_t> to_user;
+  for (int row = 0; row < n_rows; row++) {
+    X.insert(row, row % n_features) = normal(rng);
+    X.insert(row, (row + 2) % n_features) = normal(rng);
+    to_user.push_back(row % n_users);
+  }
+  X.makeCompressed();
+  for (int u = 0; u < n_users; u++) {
+    X_user.insert(u, u) = 1;
+  }
+  std::vector<Block> relations{Block(to_user, X_user)};
+  auto make = [&](int rank, int feature_size, TASKTYPE type) {
+    Predictor<double> predictor(rank, feature_size, type);
+    for (int m = 0; m < 3; m++) {
+      predictor.add_sample(FMd(normal(rng), FMd::Vector::Random(feature_size),
+                               FMd::DenseMatrix::Random(feature_size, rank)));
+    }
+    return predictor;
+  };
+  Predictor<double> regression = make(4, n_all, TASKTYPE::REGRESSION),
+                    classification = make(3, n_all, TASKTYPE::CLASSIFICATION),
+                    main_only = make(2, n_features, TASKTYPE::REGRESSION),
+                    users_only = make(5, n_users, TASKTYPE::REGRESSION),
+                    masked = make(3, n_all, TASKTYPE::REGRESSION);
+  // X's first two features against the rest, and the users among themselves.
+  auto mask = std::make_shared<const InteractionMask>(
+      std::vector<size_t>{0, 0, 1, 1, 1, 2, 2, 2, 2}, 3,
+      InteractionMask::BlockType{{{0}, {1}}, {{2}, {}}});
+  for (auto &sample : masked.samples) {
+    sample.mask = mask;
+  }
+  // entries past a feature's rank are never read, so they may hold anything,
+  // and a compact sample is read like a dense one.
+  Predictor<double> ranked = make(4, n_all, TASKTYPE::REGRESSION);
+  auto feature_ranks = std::make_shared<const FeatureRanks>(
+      std::vector<int>{4, 4, 2, 2, 2, 1, 1, 0, 0});
+  for (auto &sample : ranked.samples) {
+    sample.feature_ranks = feature_ranks;
+  }
+  ranked.samples.front().compact();
+
+  MultiModelScorer<double> scorer(
+      {&regression, &classification, &main_only, &users_only, &masked,
+       &ranked},
+      {0, 0, 0, static_cast<size_t>(n_features), 0, 0});
+  REQUIRE(scorer.n_models() == 6);
+  FMd::DenseMatrix scores = scorer.predict(X, relations, 3);
+  std::vector<FMd::Vector> expected{
+      regression.predict(X, relations), classification.predict(X, relations),
+      main_only.predict(X, {}), users_only.predict(X_none, relations),
+      masked.predict(X, relations), ranked.predict(X, relations)};
+  for (size_t m = 0; m < expected.size(); m++) {
+    REQUIRE((scores.col(m) - expected[m]).cwiseAbs().maxCoeff() < 1e-10);
+  }
+  REQUIRE((scorer.predict(X, relations) - scores).cwiseAbs().maxCoeff() ==
+          0);
+
+  variational::VariationalPredictor<double> variational_predictor(
+      3, n_all, TASKTYPE::CLASSIFICATION);
+  variational_predictor.add_sample(
+      VFM(normal(rng), 0.1, FMd::Vector::Random(n_all),
+          FMd::Vector::Constant(n_all, 0.1), FMd::DenseMatrix::Random(n_all, 3),
+          FMd::DenseMatrix::Constant(n_all, 3, 0.1)));
+  MultiModelScorer<double, VFM> variational_scorer({&variational_predictor});
+  REQUIRE((variational_scorer.predict(X, relations).col(0) -
+           variational_predictor.predict(X, relations))
+              .cwiseAbs()
+              .maxCoeff() < 1e-10);
+
+  // features 6 to 9 run past the batch's nine.
+  MultiModelScorer<double> misaligned({&regression, &users_only}, {0, 6});
+  REQUIRE_THROWS_AS(misaligned.predict(X, relations), std::invalid_argument);
+  REQUIRE_THROWS_AS(MultiModelScorer<double>({&regression}, {0, 0}),
+                    std::invalid_argument);
+  Predictor<double> ordered = make(2, n_all, TASKTYPE::ORDERED);
+  REQUIRE_THROWS_AS(MultiModelScorer<double>({&ordered}),
+                    std::invalid_argument);
+}
+
+TEST_CASE("Shared predictors score like the predictor they were made from.",
+          "[shared]") {
+  using FMd = FM<double>;
+  using Block = relational::RelationBlock<double>;
+  using TASKTYPE = FMLearningConfig<double>::TASKTYPE;
+  using Shared = SharedPredictor<double>;
+  std::mt19937 rng(59);
+  std::normal_distribution<double> normal(0, 1);
+  const int n_rows = 25, n_features = 6, n_users = 3, rank = 5;
+  const int n_all = n_features + n_users;
+  FMd::SparseMatrix X(n_rows, n_features), X_user(n_users, n_users);
+  std::vector<size_t> to_user;
+  for (int row = 0; row < n_rows; row++) {
+    X.insert(row, row % n_features) = normal(rng);
+    X.insert(row, (row + 3) % n_features) = normal(rng);
+    to_user.push_back(row % n_users);
+  }
+  X.makeCompressed();
+  for (int u = 0; u < n_users; u++) {
+    X_user.insert(u, u) = 1;
+  }
+  std::vector<Block> relations{Block(to_user, X_user)};
+  auto make = [&](TASKTYPE type) {
+    Predictor<double> predictor(rank, n_all, type);
+    for (int s = 0; s < 4; s++) {
+      predictor.add_sample(FMd(normal(rng), FMd::Vector::Random(n_all),
+                               FMd::DenseMatrix::Random(n_all, rank)));
+    }
+    return predictor;
+  };
+  const std::string name =
+      "/myfm_test_" + std::to_string(static_cast<long>(getpid()));
+  Shared::unlink(name);
+
+  for (TASKTYPE type : {TASKTYPE::REGRESSION, TASKTYPE::CLASSIFICATION}) {
+    Predictor<double> predictor = make(type);
+    FMd::Vector expected = predictor.predict(X, relations);
+    {
+      auto created = Shared::create(predictor, name);
+      REQUIRE(created->owner());
+      REQUIRE(created->attached() == 1);
+      REQUIRE_THROWS_AS(Shared::create(predictor, name), std::runtime_error);
+      auto attached = Shared::attach(name);
+      REQUIRE(!attached->owner());
+      REQUIRE(created->attached() == 2);
+      // a worker that lets go leaves the segment to the other handles.
+      attached.reset();
+      REQUIRE(created->attached() == 1);
+      attached = Shared::attach(name);
+      REQUIRE(attached->n_samples() == 4);
+      REQUIRE(attached->type() == type);
+      REQUIRE((attached->predict(X, relations, 3) - expected)
+                  .cwiseAbs()
+                  .maxCoeff() < 1e-10);
+      REQUIRE((attached->sample(1).V - predictor.samples[1].V)
+                  .cwiseAbs()
+                  .maxCoeff() == 0);
+      // the owner lets go; the worker's reference keeps the name.
+      created.reset();
+      REQUIRE(attached->attached() == 1);
+      auto late = Shared::attach(name);
+      REQUIRE(attached->attached() == 2);
+      REQUIRE((late->predict(X, relations) - expected)
+                  .cwiseAbs()
+                  .maxCoeff() < 1e-10);
+      late.reset();
+      REQUIRE(attached->attached() == 1);
+    }
+    // the last reference removed the name.
+    REQUIRE_THROWS_AS(Shared::attach(name), std::runtime_error);
+  }
+
+  Predictor<double> predictor = make(TASKTYPE::REGRESSION);
+  const std::string path = name.substr(1) + ".seg";
+  Shared::write_file(predictor, path);
+  {
+    auto mapped = Shared::map_file(path);
+    REQUIRE(mapped->attached() == 0);
+    REQUIRE(mapped->bytes() % Shared::SEGMENT_ALIGNMENT == 0);
+    REQUIRE((mapped->predict(X, relations) - predictor.predict(X, relations))
+                .cwiseAbs()
+                .maxCoeff() < 1e-10);
+  }
+  std::remove(path.c_str());
+  REQUIRE_THROWS_AS(SharedPredictor<float>::map_file("/dev/null"),
+                    std::runtime_error);
+  // an explicit unlink withdraws the name while the owner lives.
+  {
+    auto created = Shared::create(predictor, name);
+    Shared::unlink(name);
+    REQUIRE_THROWS_AS(Shared::attach(name), std::runtime_error);
+    REQUIRE((created->sample(2).V - predictor.samples[2].V)
+                .cwiseAbs()
+                .maxCoeff() == 0);
+    // a segment created again under the name outlives the old handle.
+    auto recreated = Shared::create(predictor, name);
+    created.reset();
+    REQUIRE(Shared::attach(name)->n_samples() == 4);
+  }
+  REQUIRE_THROWS_AS(Shared::attach(name), std::runtime_error);
+
+  Predictor<double> ordered = make(TASKTYPE::ORDERED);
+  REQUIRE_THROWS_AS(Shared::create(ordered, name), std::invalid_argument);
+  predictor.samples[0].mask = std::make_shared<const InteractionMask>(
+      std::vector<size_t>(n_all, 0), 1, InteractionMask::BlockType{{{0}, {}}});
+  REQUIRE_THROWS_AS(Shared::write_file(predictor, path),
+                    std::invalid_argument);
+  REQUIRE_THROWS_AS(Shared::attach(name), std::runtime_error);
+}
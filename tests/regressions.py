@@ -4,6 +4,7 @@ import unittest
 from unittest.case import TestCase
 
 import numpy as np
+import scipy.sparse as sps
 from myfm import (
     MyFMGibbsClassifier,
     MyFMGibbsRegressor,
@@ -146,5 +147,51 @@ class TestAll(TestCase):
                 print("log loss={}".format(ll))
 
 
+class TestSlide(TestCase):
+    def setUp(self) -> None:
+        rns = np.random.RandomState(0)
+        n_users, n_items, n_cases = 20, 15, 400
+        users = rns.randint(0, n_users, size=n_cases)
+        items = rns.randint(0, n_items, size=n_cases)
+        rows = np.repeat(np.arange(n_cases), 2)
+        cols = np.ravel([users, n_users + items], "F")
+        self.X = sps.csr_matrix(
+            (np.ones(2 * n_cases), (rows, cols)), shape=(n_cases, n_users + n_items)
+        )
+        u_factor = rns.randn(n_users, 2)
+        i_factor = rns.randn(n_items, 2)
+        self.y = (u_factor[users] * i_factor[items]).sum(axis=1) + 0.1 * rns.randn(
+            n_cases
+        )
+
+    def test_slide(self):
+        for CLS in [MyFMGibbsRegressor, VariationalFMRegressor]:
+            fm = CLS(rank=RANK, random_seed=42).fit(
+                self.X[:300],
+                self.y[:300],
+                n_iter=ITERATION,
+                n_kept_samples=ITERATION,
+                keep_trainer=True,
+            )
+            predictor_before = fm.predictor_
+            fm.slide(self.X[300:], self.y[300:], n_evict=100)
+            self.assertIsNot(fm.predictor_, predictor_before)
+            prediction = fm.predict(self.X[300:])
+            self.assertEqual(prediction.shape, (100,))
+            self.assertTrue(np.all(np.isfinite(prediction)))
+
+            # the trainer is dropped on pickling.
+            fm_recovered = pickle.loads(pickle.dumps(fm))
+            self.assertTrue(np.all(fm_recovered.predict(self.X[300:]) == prediction))
+            with self.assertRaises(RuntimeError):
+                fm_recovered.slide(self.X[300:], self.y[300:], n_evict=100)
+
+            fm_plain = CLS(rank=RANK, random_seed=42).fit(
+                self.X, self.y, n_iter=ITERATION, n_kept_samples=ITERATION
+            )
+            with self.assertRaises(RuntimeError):
+                fm_plain.slide(self.X[300:], self.y[300:], n_evict=100)
+
+
 if __name__ == "__main__":
     unittest.main()